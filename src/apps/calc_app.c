@@ -1,14 +1,27 @@
 #include "apps/calc_app.h"
 
+#include "calc/builtins.h"
+#include "calc/bytecode.h"
 #include "calc/eval.h"
+#include "calc/exact.h"
 #include "calc/format.h"
+#include "calc/integrate.h"
 #include "calc/parser.h"
 #include "calc/lexer.h"
+#include "calc/montecarlo.h"
+#include "calc/optimize.h"
+#include "calc/series.h"
+#include "calc/solve.h"
+#include "calc/table.h"
 #include "util/strutil.h"
 
+#include <ctype.h>
+#include <math.h>
 #include <stdio.h>
 #include <string.h>
 
+#define CALC_DEFAULT_SEED 1
+
 static void write_prompt(Display* d, const CalcApp* app) {
     (void)app;
     d->write(d, "calc-os> ");
@@ -18,15 +31,35 @@ static void write_help(Display* d) {
     d->write_line(d, "Commands:");
     d->write_line(d, "  help");
     d->write_line(d, "  mode deg | mode rad");
+    d->write_line(d, "  format shortest | format g15");
     d->write_line(d, "  mem               (show)");
     d->write_line(d, "  mem set <expr>");
     d->write_line(d, "  mem clear");
+    d->write_line(d, "  stats             (optimizer and formula counters)");
+    d->write_line(d, "  cache | cache clear");
+    d->write_line(d, "  tasks             (kernel tasks, runs and idle time)");
+    d->write_line(d, "  table <var> from <expr> to <expr> step <expr> : <expr>");
+    d->write_line(d, "  timing on | timing off   (summary after each table, series or mc)");
+    d->write_line(d, "  integrate(<expr>, <var>, <a>, <b>)");
+    d->write_line(d, "  solve(<expr>, <var>, <guess>)  (root near guess)");
+    d->write_line(d, "  sum(<i>, <a>, <b>, <expr>) | prod(<i>, <a>, <b>, <expr>)");
+    d->write_line(d, "  mc <n> : <expr>          (mean, variance and 95% interval of n samples)");
+    d->write_line(d, "  seed | seed <n>          (of rand, randn and mc)");
+    d->write_line(d, "  <name> = <expr>          (define a variable; it follows what it reads)");
+    d->write_line(d, "  <name>(a, b) = <expr>    (define a function of up to 4 args)");
+    d->write_line(d, "  vars                     (list definitions)");
     d->write_line(d, "  exit");
     d->write_line(d, "Expressions:");
     d->write_line(d, "  operators: + - * / ^");
     d->write_line(d, "  functions: sin cos tan asin acos atan ln log sqrt abs");
+    d->write_line(d, "  random: rand() uniform on [0, 1), randn() standard normal");
     d->write_line(d, "  constants: pi e");
-    d->write_line(d, "  variables: ans mem");
+    d->write_line(d, "  variables: ans mem, and your own");
+}
+
+static void display_sink(void* ctx, const char* s) {
+    Display* d = ctx;
+    d->write(d, s);
 }
 
 void calc_app_init(CalcApp* app, Kernel* kernel, Display* display, Keypad* keypad) {
@@ -37,61 +70,667 @@ void calc_app_init(CalcApp* app, Kernel* kernel, Display* display, Keypad* keypa
     app->ans = 0.0;
     app->mem = 0.0;
     app->mem_set = 0;
+    app->format_mode = FORMAT_SHORTEST;
+    memset(&app->opt_total, 0, sizeof(app->opt_total));
+    expr_cache_init(&app->cache);
+    symtab_init(&app->symbols);
+    app->seed = CALC_DEFAULT_SEED;
+    rng_seed(&app->rng, app->seed, 0);
+    arena_init(&app->arena, 0);
+    app->pool_ready = 0;
+    app->show_timing = 0;
+    outbuf_init(&app->out, display_sink, display);
     app->initialized = 0;
     app->should_exit = 0;
 }
 
 void calc_app_deinit(CalcApp* app) {
-    (void)app;
+    expr_cache_free(&app->cache);
+    symtab_free(&app->symbols);
+    arena_free(&app->arena);
+    if (app->pool_ready) {
+        thread_pool_free(&app->pool);
+    }
 }
 
-static Status eval_and_print(CalcApp* app, const char* expr) {
-    Token tokens[256];
-    size_t tok_count = 0;
+static void make_context(CalcApp* app, EvalContext* ctx) {
+    eval_context_init(ctx);
+    ctx->angle_mode_deg = app->angle_mode_deg;
+    ctx->ans = app->ans;
+    ctx->mem = app->mem_set ? app->mem : 0.0;
+    ctx->mem_set = app->mem_set;
+    ctx->symbols = &app->symbols;
+    ctx->rng = &app->rng;
+}
 
-    Status st = lexer_tokenize(expr, tokens, sizeof(tokens)/sizeof(tokens[0]), &tok_count);
+static Status optimize_expr(CalcApp* app, const EvalContext* ctx, Ast* ast) {
+    OptimizeStats opt;
+    Status st = optimize_ast(ast, ctx, &opt);
     if (!st.ok) {
         return st;
     }
+    app->opt_total.nodes_before += opt.nodes_before;
+    app->opt_total.nodes_after += opt.nodes_after;
+    app->opt_total.folded += opt.folded;
+    app->opt_total.shared += opt.shared;
+    app->opt_total.reduced += opt.reduced;
+    return status_ok();
+}
 
-    AstNode ast_nodes[256];
-    Ast ast = { .nodes = ast_nodes, .node_cap = sizeof(ast_nodes)/sizeof(ast_nodes[0]), .node_len = 0, .root = AST_NODE_INVALID };
+/* Lexes, parses and optimizes expr into ast, which the caller has set up in
+   the app's arena (with its inputs, if any). ctx NULL skips the optimizer. */
+static Status parse_expr(CalcApp* app, const char* expr, const EvalContext* ctx, Ast* ast) {
+    Token* tokens = NULL;
+    size_t tok_count = 0;
+    Status st = lexer_tokenize_arena(expr, &app->arena, &tokens, &tok_count);
+    if (!st.ok) {
+        return st;
+    }
+    ast->symbols = &app->symbols;
+    st = parser_parse(tokens, tok_count, ast);
+    if (!st.ok || ctx == NULL) {
+        return st;
+    }
+    return optimize_expr(app, ctx, ast);
+}
 
-    st = parser_parse(tokens, tok_count, &ast);
+/* Compiles ast into prog, with the code in the app's arena. */
+static Status compile_ast(CalcApp* app, const Ast* ast, Program* prog) {
+    /* at most one instruction per node */
+    prog->code_cap = ast->node_len;
+    prog->code = arena_alloc(&app->arena, prog->code_cap * sizeof(Instr));
+    if (prog->code == NULL) {
+        return status_err("error: out of memory");
+    }
+    return bytecode_compile(ast, prog);
+}
+
+/* Lexes, parses, optimizes and compiles expr into prog. Everything, including
+   the code, is allocated in the app's arena. */
+static Status compile_expr(CalcApp* app, const char* expr, const EvalContext* ctx, Program* prog) {
+    Ast ast;
+    ast_init(&ast, &app->arena);
+    Status st = parse_expr(app, expr, ctx, &ast);
     if (!st.ok) {
         return st;
     }
+    return compile_ast(app, &ast, prog);
+}
 
+static void print_value(CalcApp* app, const char* text) {
+    char line[160];
+    snprintf(line, sizeof(line), "= %s", text);
+    app->display->write_line(app->display, line);
+}
+
+static Status eval_and_print(CalcApp* app, const char* expr) {
     EvalContext ctx;
-    eval_context_init(&ctx);
-    ctx.angle_mode_deg = app->angle_mode_deg;
-    ctx.ans = app->ans;
-    ctx.mem = app->mem_set ? app->mem : 0.0;
-    ctx.mem_set = app->mem_set;
+    make_context(app, &ctx);
+
+    /* Repeated lines skip lexing, parsing and compiling entirely. The key
+       includes the angle mode because the optimizer folds trig constants,
+       and redefining a function drops every program, which may have shared
+       calls to it that are no longer pure. */
+    expr_cache_sync(&app->cache, app->symbols.func_version);
+    char key[EXPR_CACHE_KEY_MAX];
+    size_t key_len = expr_cache_normalize(expr, key, sizeof(key));
+    const Program* prog = key_len > 0 ? expr_cache_get(&app->cache, key, key_len, app->angle_mode_deg) : NULL;
+
+    char buf[128];
+    Program compiled = { .code = NULL, .code_cap = 0, .code_len = 0, .stack_need = 0 };
+    if (prog == NULL) {
+        Ast ast;
+        ast_init(&ast, &app->arena);
+        Status st = parse_expr(app, expr, NULL, &ast);
+        /* Integer-only lines are computed exactly in int64 and printed in
+           full, past the 2^53 where doubles start rounding. They need no
+           program, so they are not cached. */
+        int64_t exact = 0;
+        if (st.ok && exact_eval(&ast, &exact)) {
+            app->ans = (double)exact;
+            symtab_touch_env(&app->symbols, SYMTAB_DEP_ANS);
+            format_int64(exact, buf, sizeof(buf));
+            print_value(app, buf);
+            return status_ok();
+        }
+        if (st.ok) st = optimize_expr(app, &ctx, &ast);
+        if (st.ok) st = compile_ast(app, &ast, &compiled);
+        if (!st.ok) {
+            return st;
+        }
+        if (key_len > 0) {
+            (void)expr_cache_put(&app->cache, key, key_len, app->angle_mode_deg, &compiled);
+        }
+        prog = &compiled;
+    }
 
     double out = 0.0;
-    st = eval_ast(&ast, ast.root, &ctx, &out);
+    Status st = bytecode_run(prog, &ctx, &out);
     if (!st.ok) {
         return st;
     }
 
     app->ans = out;
+    symtab_touch_env(&app->symbols, SYMTAB_DEP_ANS);
+    format_double(out, app->format_mode, buf, sizeof(buf));
+    print_value(app, buf);
+    return status_ok();
+}
+
+/* Evaluates a table bound without touching ans or the cache. */
+static Status eval_value(CalcApp* app, const char* expr, double* out) {
+    EvalContext ctx;
+    make_context(app, &ctx);
+    Program prog = { .code = NULL, .code_cap = 0, .code_len = 0, .stack_need = 0 };
+    Status st = compile_expr(app, expr, &ctx, &prog);
+    if (!st.ok) {
+        return st;
+    }
+    return bytecode_run(&prog, &ctx, out);
+}
+
+/* Finds kw as a whole word in s and cuts s there, returning the text after
+   it, or NULL. */
+static char* split_keyword(char* s, const char* kw) {
+    size_t n = strlen(kw);
+    for (char* p = s; *p != '\0'; p++) {
+        bool starts = p == s || isspace((unsigned char)p[-1]);
+        if (starts && str_starts_with_ci(p, kw) && (p[n] == '\0' || isspace((unsigned char)p[n]))) {
+            *p = '\0';
+            return p + n;
+        }
+    }
+    return NULL;
+}
+
+static Status start_pool(CalcApp* app) {
+    if (!app->pool_ready) {
+        Status st = thread_pool_init(&app->pool, 0);
+        if (!st.ok) {
+            return st;
+        }
+        app->pool_ready = 1;
+    }
+    return status_ok();
+}
 
+static bool is_name(const char* s) {
+    if (!isalpha((unsigned char)s[0]) && s[0] != '_') {
+        return false;
+    }
+    for (; *s != '\0'; s++) {
+        if (!isalnum((unsigned char)*s) && *s != '_') {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* table <var> from <expr> to <expr> step <expr> : <expr> */
+static Status run_table(CalcApp* app, char* args) {
+    static const char* const usage = "error: usage: table x from <a> to <b> step <s> : <expr>";
+    char* body = strchr(args, ':');
+    if (body == NULL) {
+        return status_err(usage);
+    }
+    *body++ = '\0';
+    char* from = split_keyword(args, "from");
+    char* to = from ? split_keyword(from, "to") : NULL;
+    char* step = to ? split_keyword(to, "step") : NULL;
+    if (step == NULL) {
+        return status_err(usage);
+    }
+    str_trim_inplace(args);
+    const char* var = args;
+    if (!is_name(var)) {
+        return status_err("error: table variable must be a name");
+    }
+
+    TableSpec spec;
+    Status st = eval_value(app, from, &spec.from);
+    if (st.ok) st = eval_value(app, to, &spec.to);
+    if (st.ok) st = eval_value(app, step, &spec.step);
+    if (st.ok) st = table_row_count(spec.from, spec.to, spec.step, &spec.rows);
+    if (!st.ok) {
+        return st;
+    }
+
+    EvalContext ctx;
+    make_context(app, &ctx);
+    ctx.rng = NULL; /* shared by the workers: use mc for random samples */
+    const char* const* names = (const char* const*)&var;
+    Ast ast;
+    ast_init(&ast, &app->arena);
+    ast.inputs = names;
+    ast.input_count = 1;
+    st = parse_expr(app, body, &ctx, &ast);
+    if (!st.ok) {
+        return st;
+    }
+    st = start_pool(app);
+    if (!st.ok) {
+        return st;
+    }
+
+    spec.ast = &ast;
+    spec.isa = BATCH_ISA_AUTO;
+    spec.format = app->format_mode;
+    TableStats stats;
+    st = table_run(&spec, &ctx, &app->pool, &app->out, &stats);
+    if (st.ok && app->show_timing) {
+        char line[160];
+        double secs = stats.seconds > 0.0 ? stats.seconds : 1e-9;
+        snprintf(line, sizeof(line), "table: %zu rows (%zu errors) in %.3f ms, %.0f rows/s, %zu threads", stats.rows,
+                 stats.errors, stats.seconds * 1e3, (double)stats.rows / secs, stats.threads);
+        app->display->write_line(app->display, line);
+    }
+    return st;
+}
+
+/* Splits args at top-level commas (not those inside the expression's own
+   calls) into exactly n trimmed parts. */
+static bool split_args(char* args, char** parts, size_t n) {
+    size_t count = 0;
+    int depth = 0;
+    parts[count++] = args;
+    for (char* p = args; *p != '\0'; p++) {
+        if (*p == '(') depth++;
+        if (*p == ')') depth--;
+        if (*p == ',' && depth == 0) {
+            if (count == n) {
+                return false;
+            }
+            *p = '\0';
+            parts[count++] = p + 1;
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        str_trim_inplace(parts[i]);
+    }
+    return count == n;
+}
+
+/* expr with var as its only input, parsed and optimized for ctx. */
+static Status parse_in(CalcApp* app, const char* expr, const char** var, const EvalContext* ctx, Ast* ast) {
+    if (!is_name(*var)) {
+        return status_err("error: expected a variable name");
+    }
+    ast_init(ast, &app->arena);
+    ast->inputs = var;
+    ast->input_count = 1;
+    return parse_expr(app, expr, ctx, ast);
+}
+
+static void print_result(CalcApp* app, double v) {
+    app->ans = v;
+    symtab_touch_env(&app->symbols, SYMTAB_DEP_ANS);
     char buf[128];
-    format_double(out, buf, sizeof(buf));
+    format_double(v, app->format_mode, buf, sizeof(buf));
+    char line[160];
+    snprintf(line, sizeof(line), "= %s", buf);
+    app->display->write_line(app->display, line);
+}
+
+/* integrate(<expr>, <var>, <a>, <b>), args being the text between the
+   parentheses. */
+static Status run_integrate(CalcApp* app, char* args) {
+    char* parts[4];
+    if (!split_args(args, parts, 4)) {
+        return status_err("error: usage: integrate(<expr>, x, <a>, <b>)");
+    }
+    const char* var = parts[1];
+
+    double a = 0.0, b = 0.0;
+    Status st = eval_value(app, parts[2], &a);
+    if (st.ok) st = eval_value(app, parts[3], &b);
+    if (!st.ok) {
+        return st;
+    }
+    EvalContext ctx;
+    make_context(app, &ctx);
+    ctx.rng = NULL; /* shared by the workers */
+    Ast ast;
+    st = parse_in(app, parts[0], &var, &ctx, &ast);
+    if (st.ok) st = start_pool(app);
+    IntegrateResult r;
+    if (st.ok) st = integrate_run(&ast, &ctx, &app->pool, a, b, &r);
+    if (!st.ok) {
+        return st;
+    }
+
+    print_result(app, r.value);
+    char line[200];
+    snprintf(line, sizeof(line), "integrate: error %.3g, %zu evaluations, %zu intervals, %zu steals, %zu threads%s",
+             r.error, r.evaluations, r.intervals, r.steals, r.threads, r.converged ? "" : " (did not converge)");
+    app->display->write_line(app->display, line);
+    return status_ok();
+}
+
+/* solve(<expr>, <var>, <guess>): a root of expr near guess. The
+   expression is compiled once; Newton's derivatives come from the same
+   program run in dual numbers. */
+static Status run_solve(CalcApp* app, char* args) {
+    char* parts[3];
+    if (!split_args(args, parts, 3)) {
+        return status_err("error: usage: solve(<expr>, x, <guess>)");
+    }
+    const char* var = parts[1];
+    double guess = 0.0;
+    Status st = eval_value(app, parts[2], &guess);
+    if (!st.ok) {
+        return st;
+    }
+    EvalContext ctx;
+    make_context(app, &ctx);
+    ctx.rng = NULL; /* the function must not change between evaluations */
+    Ast ast;
+    st = parse_in(app, parts[0], &var, &ctx, &ast);
+    Program prog = { .code = NULL, .code_cap = ast.node_len, .code_len = 0, .stack_need = 0 };
+    if (st.ok) {
+        prog.code = arena_alloc(&app->arena, (ast.node_len + 1) * sizeof(Instr));
+        st = prog.code ? bytecode_compile(&ast, &prog) : status_err("error: out of memory");
+    }
+    SolveResult r;
+    if (st.ok) st = solve_run(&prog, &ctx, guess, &r);
+    if (!st.ok) {
+        return st;
+    }
+
+    print_result(app, r.root);
+    char line[200];
+    snprintf(line, sizeof(line), "solve: %zu Newton + %zu Brent iterations, %zu evaluations, f = %.3g", r.newton,
+             r.brent, r.evaluations, r.value);
+    app->display->write_line(app->display, line);
+    return status_ok();
+}
+
+/* series(<var>, <a>, <b>, <expr>) for sum and prod. */
+static Status run_series(CalcApp* app, SeriesKind kind, char* args) {
+    char* parts[4];
+    if (!split_args(args, parts, 4)) {
+        return status_err(kind == SERIES_SUM ? "error: usage: sum(i, <a>, <b>, <expr>)"
+                                             : "error: usage: prod(i, <a>, <b>, <expr>)");
+    }
+    const char* var = parts[0];
+    double a = 0.0, b = 0.0;
+    Status st = eval_value(app, parts[1], &a);
+    if (st.ok) st = eval_value(app, parts[2], &b);
+    if (!st.ok) {
+        return st;
+    }
+    EvalContext ctx;
+    make_context(app, &ctx);
+    ctx.rng = NULL; /* shared by the workers */
+    Ast ast;
+    st = parse_in(app, parts[3], &var, &ctx, &ast);
+    if (st.ok) st = start_pool(app);
+    SeriesResult r;
+    if (st.ok) st = series_run(&ast, &ctx, &app->pool, kind, a, b, &r);
+    if (!st.ok) {
+        return st;
+    }
+
+    print_result(app, r.value);
+    if (app->show_timing) {
+        char line[160];
+        snprintf(line, sizeof(line), "%s: %zu terms in %.3f ms, %zu threads", kind == SERIES_SUM ? "sum" : "prod",
+                 r.terms, r.seconds * 1e3, r.threads);
+        app->display->write_line(app->display, line);
+    }
+    return status_ok();
+}
+
+/* mc <n> : <expr>. Every run starts from the streams of the current seed,
+   so repeating it repeats the estimate; change the seed for a fresh one. */
+static Status run_mc(CalcApp* app, char* args) {
+    char* body = strchr(args, ':');
+    if (body == NULL) {
+        return status_err("error: usage: mc <n> : <expr>");
+    }
+    *body++ = '\0';
+    double n = 0.0;
+    Status st = eval_value(app, args, &n);
+    if (!st.ok) {
+        return st;
+    }
+    EvalContext ctx;
+    make_context(app, &ctx);
+    Ast ast;
+    ast_init(&ast, &app->arena);
+    st = parse_expr(app, body, &ctx, &ast);
+    if (st.ok) st = start_pool(app);
+    MonteCarloResult r;
+    if (st.ok) st = montecarlo_run(&ast, &ctx, &app->pool, n, app->seed, &r);
+    if (!st.ok) {
+        return st;
+    }
+
+    print_result(app, r.mean);
+    char line[200];
+    snprintf(line, sizeof(line), "mc: variance %.6g, 95%% interval +- %.3g, %zu samples, %zu threads", r.variance,
+             r.half_width, r.samples, r.threads);
+    app->display->write_line(app->display, line);
+    if (app->show_timing) {
+        double secs = r.seconds > 0.0 ? r.seconds : 1e-9;
+        snprintf(line, sizeof(line), "mc: %.3f ms, %.0f samples/s", r.seconds * 1e3, (double)r.samples / secs);
+        app->display->write_line(app->display, line);
+    }
+    return status_ok();
+}
+
+/* seed or seed <expr>: shows or sets the seed, restarting rand and randn. */
+static Status run_seed(CalcApp* app, char* arg) {
+    str_trim_inplace(arg);
+    if (arg[0] != '\0') {
+        double v = 0.0;
+        Status st = eval_value(app, arg, &v);
+        if (!st.ok) {
+            return st;
+        }
+        if (!(v >= 0.0 && v < 18446744073709551616.0) || floor(v) != v) {
+            return status_err("error: seed must be a whole number from 0 to 2^64 - 1");
+        }
+        app->seed = (uint64_t)v;
+        rng_seed(&app->rng, app->seed, 0);
+    }
+    char line[64];
+    snprintf(line, sizeof(line), "seed: %llu", (unsigned long long)app->seed);
+    app->display->write_line(app->display, line);
+    return status_ok();
+}
 
+static Status check_new_name(const char* name) {
+    if (!is_name(name)) {
+        return status_err("error: expected a name before '='");
+    }
+    if (builtins_find_func(name, strlen(name)) >= 0 || builtins_find_var(name, strlen(name)) >= 0) {
+        return status_err("error: cannot redefine a builtin");
+    }
+    /* lines starting with these are commands */
+    static const char* const commands[] = { "integrate", "solve", "sum", "prod", "mc", "seed" };
+    for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+        if (str_eq_ci(name, commands[i])) {
+            return status_err("error: cannot redefine a command");
+        }
+    }
+    return status_ok();
+}
+
+/* name(params) = body. The body is compiled once, with the parameters as
+   inputs, and not optimized: folding would bake in the current angle mode. */
+static Status define_func(CalcApp* app, char* name, char* params, const char* body, const char* source) {
+    const char* names[4];
+    size_t argc = 0;
+    str_trim_inplace(params);
+    for (char* p = params; *p != '\0';) {
+        char* comma = strchr(p, ',');
+        char* next = comma ? comma + 1 : p + strlen(p);
+        if (comma) *comma = '\0';
+        str_trim_inplace(p);
+        if (!is_name(p)) {
+            return status_err("error: expected parameter names");
+        }
+        if (argc == 4) {
+            return status_err("error: too many function args");
+        }
+        for (size_t i = 0; i < argc; i++) {
+            if (str_eq_ci(names[i], p)) {
+                return status_err("error: repeated parameter name");
+            }
+        }
+        names[argc++] = p;
+        if (comma && *next == '\0') {
+            return status_err("error: expected parameter names");
+        }
+        p = next;
+    }
+
+    /* declared first so the body can call the function itself */
+    int id = -1;
+    bool added = false;
+    int old = symtab_find(&app->symbols, name, strlen(name));
+    size_t old_arity = old >= 0 ? symtab_get(&app->symbols, old)->arity : 0;
+    Status st = symtab_declare_func(&app->symbols, name, strlen(name), argc, &id, &added);
+    if (!st.ok) {
+        return st;
+    }
+
+    Ast ast;
+    ast_init(&ast, &app->arena);
+    ast.inputs = names;
+    ast.input_count = argc;
+    st = parse_expr(app, body, NULL, &ast);
+    Program prog = { .code = NULL, .code_cap = ast.node_len, .code_len = 0, .stack_need = 0 };
+    if (st.ok) {
+        prog.code = arena_alloc(&app->arena, (ast.node_len + 1) * sizeof(Instr));
+        st = prog.code ? bytecode_compile(&ast, &prog) : status_err("error: out of memory");
+    }
+    if (st.ok) {
+        st = symtab_define_func(&app->symbols, id, &prog, source);
+    }
+    if (!st.ok) {
+        if (added) {
+            symtab_forget_last(&app->symbols);
+        } else {
+            (void)symtab_declare_func(&app->symbols, name, strlen(name), old_arity, &id, &added);
+        }
+    }
+    return st;
+}
+
+/* name = expr. The formula is kept, unoptimized for the same reason as a
+   function body, and recomputed when anything it reads changes. */
+static Status define_var(CalcApp* app, const char* name, const char* expr, const char* source) {
+    EvalContext ctx;
+    make_context(app, &ctx);
+    Ast ast;
+    ast_init(&ast, &app->arena);
+    Status st = parse_expr(app, expr, NULL, &ast);
+    Program prog = { .code = NULL, .code_cap = ast.node_len, .code_len = 0, .stack_need = 0 };
+    if (st.ok) {
+        prog.code = arena_alloc(&app->arena, (ast.node_len + 1) * sizeof(Instr));
+        st = prog.code ? bytecode_compile(&ast, &prog) : status_err("error: out of memory");
+    }
+    int id = -1;
+    if (st.ok) st = symtab_define_var(&app->symbols, name, strlen(name), &prog, source, &ctx, &id);
+    if (!st.ok) {
+        return st;
+    }
+
+    app->ans = symtab_get(&app->symbols, id)->value;
+    symtab_touch_env(&app->symbols, SYMTAB_DEP_ANS);
+    char buf[128];
+    format_double(app->ans, app->format_mode, buf, sizeof(buf));
     char line[160];
     snprintf(line, sizeof(line), "= %s", buf);
     app->display->write_line(app->display, line);
     return status_ok();
 }
 
+/* name = expr or name(params) = expr. Returns false when line is not a
+   definition. */
+static bool handle_definition(CalcApp* app, char* line) {
+    char* eq = strchr(line, '=');
+    if (eq == NULL) {
+        return false;
+    }
+    char source[256];
+    snprintf(source, sizeof(source), "%s", line);
+    *eq = '\0';
+    char* rhs = eq + 1;
+    char* params = strchr(line, '(');
+    Status st = status_ok();
+    if (params != NULL) {
+        char* close = strrchr(params, ')');
+        str_trim_inplace(line);
+        if (close == NULL || close[1] != '\0') {
+            st = status_err("error: expected name(params) before '='");
+        } else {
+            *params++ = '\0';
+            *close = '\0';
+            str_trim_inplace(line);
+            st = check_new_name(line);
+            if (st.ok) st = define_func(app, line, params, rhs, source);
+            if (st.ok) {
+                char out[160];
+                snprintf(out, sizeof(out), "%s: defined", line);
+                app->display->write_line(app->display, out);
+            }
+        }
+    } else {
+        str_trim_inplace(line);
+        st = check_new_name(line);
+        int found = st.ok ? symtab_find(&app->symbols, line, strlen(line)) : -1;
+        if (found >= 0 && symtab_get(&app->symbols, found)->kind != SYMBOL_VAR) {
+            st = status_err("error: name is already a function");
+        }
+        if (st.ok) st = define_var(app, line, rhs, source);
+    }
+    if (!st.ok) {
+        app->display->write_line(app->display, st.msg ? st.msg : "error");
+    }
+    return true;
+}
+
+static void write_vars(CalcApp* app) {
+    const SymTab* t = &app->symbols;
+    if (t->count == 0) {
+        app->display->write_line(app->display, "vars: (none)");
+        return;
+    }
+    for (size_t i = 0; i < t->count; i++) {
+        const Symbol* s = symtab_get(t, (int)i);
+        char out[320];
+        if (s->kind == SYMBOL_VAR) {
+            char buf[128];
+            format_double(s->value, app->format_mode, buf, sizeof(buf));
+            if (s->source == NULL) {
+                snprintf(out, sizeof(out), "%s = %s", s->name, buf);
+            } else {
+                snprintf(out, sizeof(out), "%s  (%s%s)", s->source, s->error ? "" : "= ", s->error ? s->error : buf);
+            }
+        } else {
+            snprintf(out, sizeof(out), "%s", s->source ? s->source : s->name);
+        }
+        app->display->write_line(app->display, out);
+    }
+}
+
 static void handle_line(CalcApp* app, char* line) {
     str_trim_inplace(line);
     if (line[0] == '\0') {
         return;
     }
 
+    /* formulas invalidated by the previous line, before anything reads them */
+    EvalContext ctx;
+    make_context(app, &ctx);
+    Status up = symtab_update(&app->symbols, &ctx);
+    if (!up.ok) {
+        app->display->write_line(app->display, up.msg);
+        return;
+    }
+
     if (str_eq_ci(line, "exit") || str_eq_ci(line, "quit")) {
         app->should_exit = 1;
         return;
@@ -107,11 +746,13 @@ static void handle_line(CalcApp* app, char* line) {
         str_trim_inplace(arg);
         if (str_eq_ci(arg, "deg")) {
             app->angle_mode_deg = 1;
+            symtab_touch_env(&app->symbols, SYMTAB_DEP_MODE);
             app->display->write_line(app->display, "mode: degrees");
             return;
         }
         if (str_eq_ci(arg, "rad")) {
             app->angle_mode_deg = 0;
+            symtab_touch_env(&app->symbols, SYMTAB_DEP_MODE);
             app->display->write_line(app->display, "mode: radians");
             return;
         }
@@ -119,13 +760,142 @@ static void handle_line(CalcApp* app, char* line) {
         return;
     }
 
+    if (str_starts_with_ci(line, "format ")) {
+        char* arg = line + 7;
+        str_trim_inplace(arg);
+        if (str_eq_ci(arg, "shortest")) {
+            app->format_mode = FORMAT_SHORTEST;
+            app->display->write_line(app->display, "format: shortest round-trip");
+            return;
+        }
+        if (str_eq_ci(arg, "g15")) {
+            app->format_mode = FORMAT_G15;
+            app->display->write_line(app->display, "format: 15 significant digits");
+            return;
+        }
+        app->display->write_line(app->display, "error: expected 'shortest' or 'g15'");
+        return;
+    }
+
+    if (str_eq_ci(line, "stats")) {
+        const OptimizeStats* o = &app->opt_total;
+        char out[160];
+        snprintf(out, sizeof(out), "optimizer: %zu nodes parsed, %zu evaluated, %zu folded, %zu shared, %zu reduced",
+                 o->nodes_before, o->nodes_after, o->folded, o->shared, o->reduced);
+        app->display->write_line(app->display, out);
+        const SymTabStats* d = &app->symbols.stats;
+        snprintf(out, sizeof(out), "formulas: %zu recomputed in %zu updates, %zu with full re-evaluation",
+                 d->recomputed, d->updates, d->full);
+        app->display->write_line(app->display, out);
+        return;
+    }
+
+    if (str_eq_ci(line, "cache")) {
+        char out[160];
+        snprintf(out, sizeof(out), "cache: %zu/%d entries, %zu hits, %zu misses, %zu evictions",
+                 app->cache.count, EXPR_CACHE_CAP, app->cache.hits, app->cache.misses, app->cache.evictions);
+        app->display->write_line(app->display, out);
+        return;
+    }
+
+    if (str_eq_ci(line, "tasks")) {
+        static const char* const prio[KERNEL_PRIORITIES] = { "high", "normal", "low" };
+        Kernel* k = app->kernel;
+        char out[160];
+        KernelTaskInfo info[CALC_APP_TASKS_SHOWN];
+        size_t n = kernel_tasks(k, info, CALC_APP_TASKS_SHOWN);
+        for (size_t i = 0; i < n && i < CALC_APP_TASKS_SHOWN; i++) {
+            snprintf(out, sizeof(out), "task %llx %s (%s%s): %llu runs, %.3f ms", (unsigned long long)info[i].id,
+                     info[i].name != NULL ? info[i].name : "?", prio[info[i].priority],
+                     info[i].coroutine ? ", coroutine" : "", (unsigned long long)info[i].runs,
+                     (double)info[i].run_ns * 1e-6);
+            app->display->write_line(app->display, out);
+        }
+        if (n > CALC_APP_TASKS_SHOWN) {
+            snprintf(out, sizeof(out), "... %zu more", n - CALC_APP_TASKS_SHOWN);
+            app->display->write_line(app->display, out);
+        }
+        KernelStats ks;
+        kernel_stats(k, &ks);
+        snprintf(out, sizeof(out),
+                 "kernel: %zu tasks, %llu passes, %llu wakeups, %.3f s idle, %zu timers pending, %llu fired, "
+                 "%zu workers",
+                 ks.tasks, (unsigned long long)ks.passes, (unsigned long long)ks.wakeups, (double)ks.idle_ns * 1e-9,
+                 ks.timers_pending, (unsigned long long)ks.timers_fired, ks.workers);
+        app->display->write_line(app->display, out);
+        return;
+    }
+
+    if (str_eq_ci(line, "cache clear")) {
+        expr_cache_clear(&app->cache);
+        app->display->write_line(app->display, "cache: cleared");
+        return;
+    }
+
+    if (str_starts_with_ci(line, "table ")) {
+        Status st = run_table(app, line + 6);
+        if (!st.ok) {
+            app->display->write_line(app->display, st.msg ? st.msg : "error");
+        }
+        return;
+    }
+
+    if (str_starts_with_ci(line, "mc ")) {
+        Status st = run_mc(app, line + 3);
+        if (!st.ok) {
+            app->display->write_line(app->display, st.msg ? st.msg : "error");
+        }
+        return;
+    }
+
+    if (str_eq_ci(line, "seed") || str_starts_with_ci(line, "seed ")) {
+        Status st = run_seed(app, line + 4);
+        if (!st.ok) {
+            app->display->write_line(app->display, st.msg ? st.msg : "error");
+        }
+        return;
+    }
+
+    bool call_form = line[strlen(line) - 1] == ')';
+    if (call_form && (str_starts_with_ci(line, "integrate(") || str_starts_with_ci(line, "solve(") ||
+                      str_starts_with_ci(line, "sum(") || str_starts_with_ci(line, "prod("))) {
+        line[strlen(line) - 1] = '\0';
+        char* args = strchr(line, '(') + 1;
+        Status st;
+        switch (tolower((unsigned char)line[1])) {
+            case 'n': st = run_integrate(app, args); break;
+            case 'o': st = run_solve(app, args); break;
+            case 'u': st = run_series(app, SERIES_SUM, args); break;
+            default: st = run_series(app, SERIES_PROD, args); break;
+        }
+        if (!st.ok) {
+            app->display->write_line(app->display, st.msg ? st.msg : "error");
+        }
+        return;
+    }
+
+    if (str_eq_ci(line, "timing on") || str_eq_ci(line, "timing off")) {
+        app->show_timing = str_eq_ci(line, "timing on");
+        app->display->write_line(app->display, app->show_timing ? "timing: on" : "timing: off");
+        return;
+    }
+
+    if (str_eq_ci(line, "vars")) {
+        write_vars(app);
+        return;
+    }
+
+    if (handle_definition(app, line)) {
+        return;
+    }
+
     if (str_eq_ci(line, "mem")) {
         if (!app->mem_set) {
             app->display->write_line(app->display, "mem: (unset)");
             return;
         }
         char buf[128];
-        format_double(app->mem, buf, sizeof(buf));
+        format_double(app->mem, app->format_mode, buf, sizeof(buf));
         char out[160];
         snprintf(out, sizeof(out), "mem: %s", buf);
         app->display->write_line(app->display, out);
@@ -135,6 +905,7 @@ static void handle_line(CalcApp* app, char* line) {
     if (str_eq_ci(line, "mem clear")) {
         app->mem_set = 0;
         app->mem = 0.0;
+        symtab_touch_env(&app->symbols, SYMTAB_DEP_MEM);
         app->display->write_line(app->display, "mem: cleared");
         return;
     }
@@ -148,6 +919,7 @@ static void handle_line(CalcApp* app, char* line) {
         }
         app->mem = app->ans;
         app->mem_set = 1;
+        symtab_touch_env(&app->symbols, SYMTAB_DEP_MEM);
         app->display->write_line(app->display, "mem: set");
         return;
     }
@@ -161,29 +933,27 @@ static void handle_line(CalcApp* app, char* line) {
 void calc_app_task(void* ctx) {
     CalcApp* app = (CalcApp*)ctx;
 
-    if (!app->initialized) {
-        app->display->write_line(app->display, "Calculator OS (sim) - type 'help' for commands");
-        app->initialized = 1;
-    }
+    app->display->write_line(app->display, "Calculator OS (sim) - type 'help' for commands");
+    app->initialized = 1;
+    while (!app->should_exit) {
+        write_prompt(app->display, app);
 
-    if (app->should_exit) {
-        app->display->write_line(app->display, "bye");
-        kernel_stop(app->kernel);
-        return;
-    }
-
-    char line[256];
-    write_prompt(app->display, app);
-    if (!app->keypad->read_line(app->keypad, line, sizeof(line))) {
-        app->should_exit = 1;
-        app->display->write_line(app->display, "bye");
-        kernel_stop(app->kernel);
-        return;
-    }
-    handle_line(app, line);
+        /* the previous line's tokens, AST and code are dead by now */
+        arena_reset(&app->arena);
 
-    if (app->should_exit) {
-        app->display->write_line(app->display, "bye");
-        kernel_stop(app->kernel);
+        /* other tasks run until a whole line has arrived; each wakeup takes
+           one read, so a line sent in pieces never blocks the kernel */
+        while (app->keypad->fd >= 0 && !app->keypad->pending(app->keypad)) {
+            (void)kernel_wait_fd(app->kernel, app->keypad->fd, 0);
+            (void)app->keypad->poll(app->keypad);
+        }
+        char* line = NULL;
+        if (!app->keypad->read_line(app->keypad, &app->arena, &line)) {
+            break;
+        }
+        handle_line(app, line);
     }
+    app->should_exit = 1;
+    app->display->write_line(app->display, "bye");
+    kernel_stop(app->kernel);
 }
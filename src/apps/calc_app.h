@@ -3,6 +3,14 @@
 #include "kernel/kernel.h"
 #include "drivers/console_display.h"
 #include "drivers/console_keypad.h"
+#include "calc/optimize.h"
+#include "calc/expr_cache.h"
+#include "calc/format.h"
+#include "calc/rng.h"
+#include "calc/symtab.h"
+#include "util/arena.h"
+#include "util/outbuf.h"
+#include "util/thread_pool.h"
 
 typedef struct {
     Kernel* kernel;
@@ -13,6 +21,19 @@ typedef struct {
     double ans;
     double mem;
     int mem_set;
+    FormatMode format_mode;
+
+    OptimizeStats opt_total; /* summed over every compiled line */
+    ExprCache cache;         /* compiled programs keyed by normalized input */
+    SymTab symbols;          /* user variables and functions */
+    uint64_t seed;           /* of rand/randn here and of every mc run */
+    Rng rng;                 /* stream 0 of seed, for lines evaluated here */
+    Arena arena;             /* input line, tokens, AST and code; reset per line */
+
+    ThreadPool pool;         /* started by the first table */
+    int pool_ready;
+    int show_timing;         /* print a summary after each table */
+    Outbuf out;              /* table rows on their way to the display */
 
     int initialized;
     int should_exit;
@@ -20,4 +41,12 @@ typedef struct {
 
 void calc_app_init(CalcApp* app, Kernel* kernel, Display* display, Keypad* keypad);
 void calc_app_deinit(CalcApp* app);
+/* Stack for calc_app_task: user functions may call each other 256 deep. */
+#define CALC_APP_STACK ((size_t)8 << 20)
+
+/* Tasks the tasks command lists one by one. */
+#define CALC_APP_TASKS_SHOWN 64
+
+/* The session, for kernel_add_coroutine: greets, then reads and handles
+   lines until exit or end of input, waiting for input with kernel_wait_fd. */
 void calc_app_task(void* ctx);
@@ -0,0 +1,547 @@
+#include "calc/batch.h"
+
+#include "calc/builtins.h"
+#include "calc/bytecode.h"
+#include "calc/symtab.h"
+#include "calc/vecmath.h"
+#include "util/strutil.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BATCH_X86 1
+#include <immintrin.h>
+#else
+#define BATCH_X86 0
+#endif
+
+/* Column kernels: a[i] = a[i] op b[i] over n elements. The checks only say
+   whether some lane needs attention; marking lanes is left to a scalar pass
+   since errors are rare. */
+typedef struct {
+    void (*add)(double* a, const double* b, size_t n);
+    void (*sub)(double* a, const double* b, size_t n);
+    void (*mul)(double* a, const double* b, size_t n);
+    void (*div)(double* a, const double* b, size_t n);
+    void (*neg)(double* a, size_t n);
+    bool (*any_nonfinite)(const double* a, size_t n);
+    bool (*any_zero)(const double* a, size_t n);
+} Kernels;
+
+static void scalar_add(double* a, const double* b, size_t n) {
+    for (size_t i = 0; i < n; i++) a[i] += b[i];
+}
+
+static void scalar_sub(double* a, const double* b, size_t n) {
+    for (size_t i = 0; i < n; i++) a[i] -= b[i];
+}
+
+static void scalar_mul(double* a, const double* b, size_t n) {
+    for (size_t i = 0; i < n; i++) a[i] *= b[i];
+}
+
+static void scalar_div(double* a, const double* b, size_t n) {
+    for (size_t i = 0; i < n; i++) a[i] /= b[i];
+}
+
+static void scalar_neg(double* a, size_t n) {
+    for (size_t i = 0; i < n; i++) a[i] = -a[i];
+}
+
+static bool scalar_any_nonfinite(const double* a, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (!isfinite(a[i])) return true;
+    }
+    return false;
+}
+
+static bool scalar_any_zero(const double* a, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (a[i] == 0.0) return true;
+    }
+    return false;
+}
+
+static const Kernels k_scalar = {
+    scalar_add, scalar_sub, scalar_mul, scalar_div, scalar_neg, scalar_any_nonfinite, scalar_any_zero,
+};
+
+#if BATCH_X86
+
+/* Defines prefix_name(a, b, n) with a vector body and a scalar tail. */
+#define SIMD_BINARY(attr, prefix, name, width, load, store, vop, sop)          \
+    attr static void prefix##_##name(double* a, const double* b, size_t n) { \
+        size_t i = 0;                                                       \
+        for (; i + (width) <= n; i += (width)) {                            \
+            store(a + i, vop(load(a + i), load(b + i)));                    \
+        }                                                                   \
+        for (; i < n; i++) {                                                \
+            a[i] = a[i] sop b[i];                                           \
+        }                                                                   \
+    }
+
+#define SSE2_FN __attribute__((target("sse2")))
+#define AVX2_FN __attribute__((target("avx2")))
+
+SIMD_BINARY(SSE2_FN, sse2, add, 2, _mm_loadu_pd, _mm_storeu_pd, _mm_add_pd, +)
+SIMD_BINARY(SSE2_FN, sse2, sub, 2, _mm_loadu_pd, _mm_storeu_pd, _mm_sub_pd, -)
+SIMD_BINARY(SSE2_FN, sse2, mul, 2, _mm_loadu_pd, _mm_storeu_pd, _mm_mul_pd, *)
+SIMD_BINARY(SSE2_FN, sse2, div, 2, _mm_loadu_pd, _mm_storeu_pd, _mm_div_pd, /)
+
+SSE2_FN static void sse2_neg(double* a, size_t n) {
+    const __m128d sign = _mm_set1_pd(-0.0);
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        _mm_storeu_pd(a + i, _mm_xor_pd(_mm_loadu_pd(a + i), sign));
+    }
+    for (; i < n; i++) a[i] = -a[i];
+}
+
+/* x - x is NaN exactly when x is infinite or NaN. */
+SSE2_FN static bool sse2_any_nonfinite(const double* a, size_t n) {
+    __m128d acc = _mm_setzero_pd();
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128d x = _mm_loadu_pd(a + i);
+        __m128d d = _mm_sub_pd(x, x);
+        acc = _mm_or_pd(acc, _mm_cmpunord_pd(d, d));
+    }
+    return _mm_movemask_pd(acc) != 0 || scalar_any_nonfinite(a + i, n - i);
+}
+
+SSE2_FN static bool sse2_any_zero(const double* a, size_t n) {
+    const __m128d zero = _mm_setzero_pd();
+    __m128d acc = _mm_setzero_pd();
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        acc = _mm_or_pd(acc, _mm_cmpeq_pd(_mm_loadu_pd(a + i), zero));
+    }
+    return _mm_movemask_pd(acc) != 0 || scalar_any_zero(a + i, n - i);
+}
+
+SIMD_BINARY(AVX2_FN, avx2, add, 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_add_pd, +)
+SIMD_BINARY(AVX2_FN, avx2, sub, 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_sub_pd, -)
+SIMD_BINARY(AVX2_FN, avx2, mul, 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_mul_pd, *)
+SIMD_BINARY(AVX2_FN, avx2, div, 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_div_pd, /)
+
+AVX2_FN static void avx2_neg(double* a, size_t n) {
+    const __m256d sign = _mm256_set1_pd(-0.0);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm256_storeu_pd(a + i, _mm256_xor_pd(_mm256_loadu_pd(a + i), sign));
+    }
+    for (; i < n; i++) a[i] = -a[i];
+}
+
+AVX2_FN static bool avx2_any_nonfinite(const double* a, size_t n) {
+    __m256d acc = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d x = _mm256_loadu_pd(a + i);
+        __m256d d = _mm256_sub_pd(x, x);
+        acc = _mm256_or_pd(acc, _mm256_cmp_pd(d, d, _CMP_UNORD_Q));
+    }
+    return _mm256_movemask_pd(acc) != 0 || scalar_any_nonfinite(a + i, n - i);
+}
+
+AVX2_FN static bool avx2_any_zero(const double* a, size_t n) {
+    const __m256d zero = _mm256_setzero_pd();
+    __m256d acc = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        acc = _mm256_or_pd(acc, _mm256_cmp_pd(_mm256_loadu_pd(a + i), zero, _CMP_EQ_OQ));
+    }
+    return _mm256_movemask_pd(acc) != 0 || scalar_any_zero(a + i, n - i);
+}
+
+static const Kernels k_sse2 = {
+    sse2_add, sse2_sub, sse2_mul, sse2_div, sse2_neg, sse2_any_nonfinite, sse2_any_zero,
+};
+
+static const Kernels k_avx2 = {
+    avx2_add, avx2_sub, avx2_mul, avx2_div, avx2_neg, avx2_any_nonfinite, avx2_any_zero,
+};
+
+#endif
+
+BatchIsa batch_best_isa(void) {
+#if BATCH_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return BATCH_ISA_AVX2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return BATCH_ISA_SSE2;
+    }
+#endif
+    return BATCH_ISA_SCALAR;
+}
+
+const char* batch_isa_name(BatchIsa isa) {
+    switch (isa) {
+        case BATCH_ISA_AUTO: return "auto";
+        case BATCH_ISA_SCALAR: return "scalar";
+        case BATCH_ISA_SSE2: return "sse2";
+        case BATCH_ISA_AVX2: return "avx2";
+    }
+    return "unknown";
+}
+
+/* The vecmath kernel that replaces a builtin under isa, or NULL. The scalar
+   path keeps libm so it stays bit-identical to eval_ast. */
+static VecMathFn vector_fn(BuiltinFn fn, BatchIsa isa) {
+    if (isa == BATCH_ISA_SCALAR) {
+        return NULL;
+    }
+    for (size_t i = 0; i < builtins_func_count(); i++) {
+        const BuiltinFunc* f = builtins_func((int)i);
+        if (f->fn == fn) {
+            const VecMathKernel* vk = vecmath_find(f->name);
+            if (vk == NULL) {
+                return NULL;
+            }
+            return isa == BATCH_ISA_AVX2 ? vk->avx2 : vk->generic;
+        }
+    }
+    return NULL;
+}
+
+static const Kernels* kernels_for(BatchIsa isa) {
+#if BATCH_X86
+    if (isa == BATCH_ISA_AVX2) {
+        return &k_avx2;
+    }
+    if (isa == BATCH_ISA_SSE2) {
+        return &k_sse2;
+    }
+#else
+    (void)isa;
+#endif
+    return &k_scalar;
+}
+
+const char* batch_error_message(const BatchReport* report, uint8_t code) {
+    if (code == 0 || code > report->message_count) {
+        return NULL;
+    }
+    return report->messages[code - 1];
+}
+
+static uint8_t message_code(BatchReport* r, const char* msg) {
+    for (size_t i = 0; i < r->message_count; i++) {
+        if (r->messages[i] == msg || strcmp(r->messages[i], msg) == 0) {
+            return (uint8_t)(i + 1);
+        }
+    }
+    if (r->message_count == BATCH_MAX_MESSAGES) {
+        return BATCH_MAX_MESSAGES;
+    }
+    r->messages[r->message_count++] = msg;
+    return (uint8_t)r->message_count;
+}
+
+/* Records the lane's first error only, like the scalar path stopping there. */
+static void fail_lane(BatchReport* r, uint8_t* err, size_t i, const char* msg) {
+    if (err[i] == 0) {
+        err[i] = message_code(r, msg);
+    }
+}
+
+static void check_finite(const Kernels* k, BatchReport* r, const double* a, uint8_t* err, size_t m) {
+    if (!k->any_nonfinite(a, m)) {
+        return;
+    }
+    for (size_t i = 0; i < m; i++) {
+        if (!isfinite(a[i])) {
+            fail_lane(r, err, i, "error: result is not finite");
+        }
+    }
+}
+
+static void fill(double* col, double v, size_t m) {
+    for (size_t i = 0; i < m; i++) {
+        col[i] = v;
+    }
+}
+
+/* Calls the builtin lane by lane. With vec (a vector kernel's results for the
+   same arguments), finite lanes take vec instead: every argument the builtin
+   rejects, and NaN or infinite input, gives a non-finite kernel result, so the
+   builtin only redoes those and its values and messages still apply. */
+static void call_lanes(const Instr* ip, const EvalContext* ctx, const double* vec, double* first, size_t m,
+                       uint8_t* err, BatchReport* r) {
+    for (size_t i = 0; i < m; i++) {
+        if (err[i] != 0) {
+            first[i] = NAN;
+            continue;
+        }
+        if (vec != NULL && isfinite(vec[i])) {
+            first[i] = vec[i];
+            continue;
+        }
+        double args[4] = { 0.0, 0.0, 0.0, 0.0 };
+        for (size_t j = 0; j < ip->arg; j++) {
+            args[j] = first[j * BATCH_BLOCK + i];
+        }
+        double v = 0.0;
+        Status st = ip->as.fn(args, ctx, &v);
+        if (!st.ok) {
+            fail_lane(r, err, i, st.msg);
+            v = NAN;
+        }
+        first[i] = v;
+    }
+}
+
+/* Runs prog over m lanes. Columns are BATCH_BLOCK doubles apart. vfns[pc] is
+   the vector kernel for a call, if it has one, and fills[pc] the bulk draw
+   of a random builtin. */
+static void run_block(const Program* prog, const Kernels* k, const VecMathFn* vfns, const BuiltinFill* fills,
+                      const EvalContext* ctx,
+                      const double* const* cols, size_t base, size_t m, double* stack, double* slots, uint8_t* err,
+                      BatchReport* r) {
+    double* top = stack; /* next free column */
+    for (size_t pc = 0; pc < prog->code_len; pc++) {
+        const Instr* ip = &prog->code[pc];
+        double* a = top - 2 * BATCH_BLOCK;
+        double* b = top - BATCH_BLOCK;
+        switch (ip->op) {
+            case OP_PUSH:
+                fill(top, ip->as.num, m);
+                top += BATCH_BLOCK;
+                break;
+            case OP_ANS:
+                fill(top, ctx->ans, m);
+                top += BATCH_BLOCK;
+                break;
+            case OP_MEM:
+                if (!ctx->mem_set) {
+                    for (size_t i = 0; i < m; i++) {
+                        fail_lane(r, err, i, "error: mem is unset");
+                    }
+                }
+                fill(top, ctx->mem, m);
+                top += BATCH_BLOCK;
+                break;
+            case OP_INPUT:
+                memcpy(top, cols[ip->arg] + base, m * sizeof(double));
+                top += BATCH_BLOCK;
+                break;
+            case OP_NEG:
+                k->neg(b, m);
+                break;
+            case OP_ADD:
+                k->add(a, b, m);
+                check_finite(k, r, a, err, m);
+                top -= BATCH_BLOCK;
+                break;
+            case OP_SUB:
+                k->sub(a, b, m);
+                check_finite(k, r, a, err, m);
+                top -= BATCH_BLOCK;
+                break;
+            case OP_MUL:
+                k->mul(a, b, m);
+                check_finite(k, r, a, err, m);
+                top -= BATCH_BLOCK;
+                break;
+            case OP_DIV:
+                if (k->any_zero(b, m)) {
+                    for (size_t i = 0; i < m; i++) {
+                        if (b[i] == 0.0) {
+                            fail_lane(r, err, i, "error: division by zero");
+                        }
+                    }
+                }
+                k->div(a, b, m);
+                check_finite(k, r, a, err, m);
+                top -= BATCH_BLOCK;
+                break;
+            case OP_POW:
+                for (size_t i = 0; i < m; i++) {
+                    a[i] = pow(a[i], b[i]);
+                }
+                check_finite(k, r, a, err, m);
+                top -= BATCH_BLOCK;
+                break;
+            case OP_CALL: {
+                if (fills[pc] != NULL) {
+                    /* every lane draws, failed or not, so the numbers do not
+                       depend on which lanes failed */
+                    Status st = fills[pc](ctx, top, m);
+                    if (!st.ok) {
+                        for (size_t i = 0; i < m; i++) {
+                            fail_lane(r, err, i, st.msg);
+                        }
+                    }
+                    top += BATCH_BLOCK;
+                    break;
+                }
+                double* first = top - ip->arg * BATCH_BLOCK;
+                double vec[BATCH_BLOCK];
+                if (vfns[pc] != NULL) {
+                    vfns[pc](first, vec, m, ctx->angle_mode_deg != 0);
+                }
+                call_lanes(ip, ctx, vfns[pc] != NULL ? vec : NULL, first, m, err, r);
+                top = first + BATCH_BLOCK;
+                break;
+            }
+            case OP_STORE:
+                memcpy(slots + ip->arg * BATCH_BLOCK, b, m * sizeof(double));
+                break;
+            case OP_LOAD:
+                memcpy(top, slots + ip->arg * BATCH_BLOCK, m * sizeof(double));
+                top += BATCH_BLOCK;
+                break;
+            case OP_USER_VAR: {
+                double v = 0.0;
+                Status st = symtab_value(ctx->symbols, (int)ip->arg, &v);
+                if (!st.ok) {
+                    for (size_t i = 0; i < m; i++) {
+                        fail_lane(r, err, i, st.msg);
+                    }
+                }
+                fill(top, v, m);
+                top += BATCH_BLOCK;
+                break;
+            }
+            case OP_USER_CALL: {
+                /* bodies are scalar programs; run them lane by lane */
+                double* first = top - ip->arg * BATCH_BLOCK;
+                for (size_t i = 0; i < m; i++) {
+                    double args[4] = { 0.0, 0.0, 0.0, 0.0 };
+                    for (size_t j = 0; j < ip->arg; j++) {
+                        args[j] = first[j * BATCH_BLOCK + i];
+                    }
+                    double v = NAN;
+                    if (err[i] == 0) {
+                        Status st = symtab_call(ctx->symbols, ip->as.sym, args, ip->arg, ctx, &v);
+                        if (!st.ok) {
+                            fail_lane(r, err, i, st.msg);
+                            v = NAN;
+                        }
+                    }
+                    first[i] = v;
+                }
+                top = first + BATCH_BLOCK;
+                break;
+            }
+        }
+    }
+}
+
+static BatchIsa resolve_isa(BatchIsa isa) {
+    BatchIsa best = batch_best_isa();
+    return isa == BATCH_ISA_AUTO || isa > best ? best : isa;
+}
+
+Status batch_plan_init(BatchPlan* plan, const Ast* ast, BatchIsa isa) {
+    memset(plan, 0, sizeof(*plan));
+    plan->ast = ast;
+    plan->isa = resolve_isa(isa);
+    plan->prog.code_cap = ast->node_len;
+    plan->prog.code = malloc((ast->node_len + 1) * sizeof(Instr));
+    if (plan->prog.code == NULL) {
+        return status_err("error: out of memory");
+    }
+    Status st = bytecode_compile(ast, &plan->prog);
+    if (!st.ok) {
+        batch_plan_free(plan);
+        return st;
+    }
+
+    const Program* prog = &plan->prog;
+    for (size_t pc = 0; pc < prog->code_len; pc++) {
+        if (prog->code[pc].op == OP_STORE && prog->code[pc].arg + 1 > plan->slot_count) {
+            plan->slot_count = prog->code[pc].arg + 1;
+        }
+    }
+    plan->vfns = calloc(prog->code_len + 1, sizeof(*plan->vfns));
+    plan->fills = calloc(prog->code_len + 1, sizeof(*plan->fills));
+    if (plan->vfns == NULL || plan->fills == NULL) {
+        batch_plan_free(plan);
+        return status_err("error: out of memory");
+    }
+    for (size_t pc = 0; pc < prog->code_len; pc++) {
+        if (prog->code[pc].op == OP_CALL) {
+            plan->vfns[pc] = vector_fn(prog->code[pc].as.fn, plan->isa);
+            plan->fills[pc] = builtins_func(builtins_func_id(prog->code[pc].as.fn))->fill;
+        }
+    }
+    return status_ok();
+}
+
+void batch_plan_free(BatchPlan* plan) {
+    free(plan->prog.code);
+    free(plan->vfns);
+    free(plan->fills);
+    plan->prog.code = NULL;
+    plan->vfns = NULL;
+    plan->fills = NULL;
+}
+
+Status batch_plan_run(const BatchPlan* plan, const EvalContext* ctx, const BatchInput* inputs, size_t input_count,
+                      size_t len, double* out, uint8_t* err, BatchReport* report) {
+    BatchReport local;
+    BatchReport* r = report ? report : &local;
+    memset(r, 0, sizeof(*r));
+    r->isa = plan->isa;
+    const Kernels* k = kernels_for(plan->isa);
+    const Ast* ast = plan->ast;
+    const Program* prog = &plan->prog;
+
+    const double** cols = calloc(ast->input_count + 1, sizeof(*cols));
+    double* stack = malloc((prog->stack_need + plan->slot_count) * BATCH_BLOCK * sizeof(double));
+    Status st = cols != NULL && stack != NULL ? status_ok() : status_err("error: out of memory");
+    for (size_t i = 0; i < ast->input_count && st.ok; i++) {
+        for (size_t j = 0; j < input_count; j++) {
+            if (str_eq_ci(ast->inputs[i], inputs[j].name)) {
+                cols[i] = inputs[j].values;
+                break;
+            }
+        }
+        if (cols[i] == NULL) {
+            st = status_err("error: unbound input");
+        }
+    }
+
+    for (size_t base = 0; st.ok && base < len; base += BATCH_BLOCK) {
+        size_t m = len - base < BATCH_BLOCK ? len - base : BATCH_BLOCK;
+        uint8_t* e = err + base;
+        memset(e, 0, m);
+        run_block(prog, k, plan->vfns, plan->fills, ctx, cols, base, m, stack, stack + prog->stack_need * BATCH_BLOCK, e, r);
+        for (size_t i = 0; i < m; i++) {
+            if (e[i] == 0 && !isfinite(stack[i])) {
+                fail_lane(r, e, i, "error: non-finite result");
+            }
+            if (e[i] != 0) {
+                r->errors++;
+            }
+            out[base + i] = e[i] ? NAN : stack[i];
+        }
+    }
+
+    free(stack);
+    free(cols);
+    return st;
+}
+
+Status batch_eval_isa(const Ast* ast, const EvalContext* ctx, const BatchInput* inputs, size_t input_count,
+                      size_t len, BatchIsa isa, double* out, uint8_t* err, BatchReport* report) {
+    BatchPlan plan;
+    Status st = batch_plan_init(&plan, ast, isa);
+    if (!st.ok) {
+        return st;
+    }
+    st = batch_plan_run(&plan, ctx, inputs, input_count, len, out, err, report);
+    batch_plan_free(&plan);
+    return st;
+}
+
+Status batch_eval(const Ast* ast, const EvalContext* ctx, const BatchInput* inputs, size_t input_count, size_t len,
+                  double* out, uint8_t* err, BatchReport* report) {
+    return batch_eval_isa(ast, ctx, inputs, input_count, len, BATCH_ISA_AUTO, out, err, report);
+}
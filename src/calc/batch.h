@@ -0,0 +1,80 @@
+#pragma once
+
+#include "util/status.h"
+#include "calc/parser.h"
+#include "calc/eval.h"
+#include "calc/builtins.h"
+#include "calc/bytecode.h"
+#include "calc/vecmath.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Elements evaluated together; every instruction runs over one block. */
+#define BATCH_BLOCK 256
+
+/* Distinct error messages one batch can report. Errors come from a small set
+   of fixed strings, so this is never reached in practice. */
+#define BATCH_MAX_MESSAGES 32
+
+typedef enum {
+    BATCH_ISA_AUTO,     /* best the CPU supports */
+    BATCH_ISA_SCALAR,
+    BATCH_ISA_SSE2,
+    BATCH_ISA_AVX2,
+} BatchIsa;
+
+/* One column of values for the Ast input of the same name. */
+typedef struct {
+    const char* name;
+    const double* values;
+} BatchInput;
+
+typedef struct {
+    BatchIsa isa;                                /* kernels actually used */
+    size_t errors;                               /* elements that failed */
+    size_t message_count;
+    const char* messages[BATCH_MAX_MESSAGES];    /* error code k is messages[k - 1] */
+} BatchReport;
+
+/* Evaluates ast once per element: element i binds every input to
+   inputs[j].values[i] and writes out[i]. err[i] is 0 on success, otherwise a
+   code for batch_error_message and out[i] is NaN; a failing element does not
+   stop the others. Messages match eval_ast on the same bindings, and so do
+   values on the scalar path; the SSE2/AVX2 paths call the vecmath kernels, so
+   their function results are within that kernel's max_ulp. A random builtin
+   takes its draws from ctx->rng for a block of elements at once, in element
+   order, so they depend on ctx->rng and len but not on the ISA.
+   Fails as a whole only when an Ast input has no column or memory runs out. */
+Status batch_eval(const Ast* ast, const EvalContext* ctx, const BatchInput* inputs, size_t input_count, size_t len,
+                  double* out, uint8_t* err, BatchReport* report);
+
+/* As batch_eval, with the kernels chosen explicitly. An ISA the CPU lacks
+   falls back to the best one it has. */
+Status batch_eval_isa(const Ast* ast, const EvalContext* ctx, const BatchInput* inputs, size_t input_count,
+                      size_t len, BatchIsa isa, double* out, uint8_t* err, BatchReport* report);
+
+/* An Ast compiled once for batch_plan_run. It refers to the Ast (for the
+   input names), which must outlive it. Running does not modify the plan, so
+   several threads can run one plan at once, each with its own report. */
+typedef struct {
+    const Ast* ast;
+    Program prog;
+    VecMathFn* vfns;      /* vecmath kernel per call instruction, or NULL */
+    BuiltinFill* fills;   /* bulk draw per random call instruction, or NULL */
+    size_t slot_count;
+    BatchIsa isa;         /* resolved, never BATCH_ISA_AUTO */
+} BatchPlan;
+
+Status batch_plan_init(BatchPlan* plan, const Ast* ast, BatchIsa isa);
+void batch_plan_free(BatchPlan* plan);
+
+/* batch_eval_isa with the compilation already done. */
+Status batch_plan_run(const BatchPlan* plan, const EvalContext* ctx, const BatchInput* inputs, size_t input_count,
+                      size_t len, double* out, uint8_t* err, BatchReport* report);
+
+/* The message for an err code, or NULL for 0. */
+const char* batch_error_message(const BatchReport* report, uint8_t code);
+
+BatchIsa batch_best_isa(void);
+const char* batch_isa_name(BatchIsa isa);
@@ -0,0 +1,134 @@
+#include "calc/bigint.h"
+
+#include <string.h>
+
+void bigint_set_u64(BigInt* b, uint64_t v) {
+    b->limb[0] = (uint32_t)v;
+    b->limb[1] = (uint32_t)(v >> 32);
+    b->len = b->limb[1] != 0 ? 2 : b->limb[0] != 0;
+}
+
+void bigint_mul_add(BigInt* b, uint32_t mul, uint32_t add) {
+    uint64_t carry = add;
+    for (size_t i = 0; i < b->len; i++) {
+        uint64_t t = (uint64_t)b->limb[i] * mul + carry;
+        b->limb[i] = (uint32_t)t;
+        carry = t >> 32;
+    }
+    if (carry != 0) {
+        b->limb[b->len++] = (uint32_t)carry;
+    }
+}
+
+void bigint_mul_pow5(BigInt* b, unsigned k) {
+    static const uint32_t pow5[] = {
+        1u, 5u, 25u, 125u, 625u, 3125u, 15625u, 78125u, 390625u,
+        1953125u, 9765625u, 48828125u, 244140625u, 1220703125u,
+    };
+    while (k >= 13) {
+        bigint_mul_add(b, pow5[13], 0);
+        k -= 13;
+    }
+    if (k > 0) {
+        bigint_mul_add(b, pow5[k], 0);
+    }
+}
+
+void bigint_shl(BigInt* b, unsigned bits) {
+    size_t words = bits / 32;
+    unsigned rem = bits % 32;
+    if (b->len == 0) {
+        return;
+    }
+    uint32_t top = rem ? b->limb[b->len - 1] >> (32 - rem) : 0;
+    for (size_t i = b->len; i-- > 0;) {
+        uint32_t lo = (rem && i > 0) ? b->limb[i - 1] >> (32 - rem) : 0;
+        b->limb[i + words] = (b->limb[i] << rem) | lo;
+    }
+    memset(b->limb, 0, words * sizeof(uint32_t));
+    b->len += words;
+    if (top != 0) {
+        b->limb[b->len++] = top;
+    }
+}
+
+static void bigint_shr1(BigInt* b) {
+    for (size_t i = 0; i < b->len; i++) {
+        uint32_t hi = (i + 1 < b->len) ? b->limb[i + 1] << 31 : 0;
+        b->limb[i] = (b->limb[i] >> 1) | hi;
+    }
+    if (b->len > 0 && b->limb[b->len - 1] == 0) {
+        b->len--;
+    }
+}
+
+/* a -= b, requires a >= b */
+static void bigint_sub(BigInt* a, const BigInt* b) {
+    uint64_t borrow = 0;
+    for (size_t i = 0; i < a->len; i++) {
+        uint64_t sub = (i < b->len ? b->limb[i] : 0) + borrow;
+        uint64_t cur = a->limb[i];
+        borrow = cur < sub;
+        a->limb[i] = (uint32_t)(cur - sub);
+    }
+    while (a->len > 0 && a->limb[a->len - 1] == 0) {
+        a->len--;
+    }
+}
+
+size_t bigint_bitlen(const BigInt* b) {
+    if (b->len == 0) {
+        return 0;
+    }
+    size_t n = (b->len - 1) * 32;
+    for (uint32_t top = b->limb[b->len - 1]; top != 0; top >>= 1) {
+        n++;
+    }
+    return n;
+}
+
+int bigint_cmp(const BigInt* a, const BigInt* b) {
+    if (a->len != b->len) {
+        return a->len < b->len ? -1 : 1;
+    }
+    for (size_t i = a->len; i-- > 0;) {
+        if (a->limb[i] != b->limb[i]) {
+            return a->limb[i] < b->limb[i] ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+uint64_t bigint_top64(const BigInt* b, int* shift, bool* sticky) {
+    size_t bits = bigint_bitlen(b);
+    size_t drop = bits > 64 ? bits - 64 : 0;
+    uint64_t v = 0;
+    for (size_t i = 0; i < 64 && i < bits; i++) {
+        size_t bit = drop + i;
+        v |= (uint64_t)((b->limb[bit / 32] >> (bit % 32)) & 1u) << i;
+    }
+    bool s = false;
+    for (size_t i = 0; i < drop / 32 && !s; i++) {
+        s = b->limb[i] != 0;
+    }
+    if (!s && drop % 32 != 0) {
+        s = (b->limb[drop / 32] & ((1u << (drop % 32)) - 1)) != 0;
+    }
+    *shift = (int)drop;
+    *sticky = s;
+    return v;
+}
+
+uint64_t bigint_divmod(BigInt* num, const BigInt* den) {
+    BigInt d = *den;
+    bigint_shl(&d, 63);
+    uint64_t q = 0;
+    for (int bit = 63; bit >= 0; bit--) {
+        if (bigint_cmp(num, &d) >= 0) {
+            bigint_sub(num, &d);
+            q |= UINT64_C(1) << bit;
+        }
+        bigint_shr1(&d);
+    }
+    return q;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Fixed-size unsigned big integers for exact decimal <-> binary conversion.
+   4096 bits covers every operand number_parse and format_double build; callers
+   keep within that bound, nothing here checks it. */
+#define BIGINT_LIMBS 128
+
+typedef struct {
+    uint32_t limb[BIGINT_LIMBS];   /* little endian */
+    size_t len;                    /* no leading zero limbs; 0 means zero */
+} BigInt;
+
+void bigint_set_u64(BigInt* b, uint64_t v);
+
+/* b = b * mul + add */
+void bigint_mul_add(BigInt* b, uint32_t mul, uint32_t add);
+void bigint_mul_pow5(BigInt* b, unsigned k);
+void bigint_shl(BigInt* b, unsigned bits);
+
+size_t bigint_bitlen(const BigInt* b);
+int bigint_cmp(const BigInt* a, const BigInt* b);
+
+/* Top 64 bits of a nonzero b. *shift receives how far b was shifted right and
+   *sticky whether any discarded bit was set. */
+uint64_t bigint_top64(const BigInt* b, int* shift, bool* sticky);
+
+/* Returns num / den and leaves the remainder in num. The quotient must fit in
+   64 bits. */
+uint64_t bigint_divmod(BigInt* num, const BigInt* den);
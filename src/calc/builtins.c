@@ -0,0 +1,253 @@
+#include "calc/builtins.h"
+
+#include "calc/rng.h"
+
+#include <ctype.h>
+#include <math.h>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+static double to_radians(const EvalContext* ctx, double x) {
+    if (ctx->angle_mode_deg) {
+        return x * (M_PI / 180.0);
+    }
+    return x;
+}
+
+static double from_radians(const EvalContext* ctx, double x) {
+    if (ctx->angle_mode_deg) {
+        return x * (180.0 / M_PI);
+    }
+    return x;
+}
+
+static Status fn_abs(const double* a, const EvalContext* ctx, double* out) {
+    (void)ctx;
+    *out = fabs(a[0]);
+    return status_ok();
+}
+
+static Status fn_acos(const double* a, const EvalContext* ctx, double* out) {
+    *out = from_radians(ctx, acos(a[0]));
+    return status_ok();
+}
+
+static Status fn_asin(const double* a, const EvalContext* ctx, double* out) {
+    *out = from_radians(ctx, asin(a[0]));
+    return status_ok();
+}
+
+static Status fn_atan(const double* a, const EvalContext* ctx, double* out) {
+    *out = from_radians(ctx, atan(a[0]));
+    return status_ok();
+}
+
+static Status fn_cos(const double* a, const EvalContext* ctx, double* out) {
+    *out = cos(to_radians(ctx, a[0]));
+    return status_ok();
+}
+
+static Status fn_ln(const double* a, const EvalContext* ctx, double* out) {
+    (void)ctx;
+    if (a[0] <= 0.0) return status_err("error: ln domain");
+    *out = log(a[0]);
+    return status_ok();
+}
+
+static Status fn_log(const double* a, const EvalContext* ctx, double* out) {
+    (void)ctx;
+    if (a[0] <= 0.0) return status_err("error: log domain");
+    *out = log10(a[0]);
+    return status_ok();
+}
+
+static Status fn_rand(const double* a, const EvalContext* ctx, double* out) {
+    (void)a;
+    if (ctx->rng == NULL) return status_err("error: random numbers are unavailable here");
+    *out = rng_uniform(ctx->rng);
+    return status_ok();
+}
+
+static Status fn_randn(const double* a, const EvalContext* ctx, double* out) {
+    (void)a;
+    if (ctx->rng == NULL) return status_err("error: random numbers are unavailable here");
+    *out = rng_normal(ctx->rng);
+    return status_ok();
+}
+
+static Status fn_sin(const double* a, const EvalContext* ctx, double* out) {
+    *out = sin(to_radians(ctx, a[0]));
+    return status_ok();
+}
+
+static Status fn_sqrt(const double* a, const EvalContext* ctx, double* out) {
+    (void)ctx;
+    if (a[0] < 0.0) return status_err("error: sqrt domain");
+    *out = sqrt(a[0]);
+    return status_ok();
+}
+
+static Status fn_tan(const double* a, const EvalContext* ctx, double* out) {
+    *out = tan(to_radians(ctx, a[0]));
+    return status_ok();
+}
+
+static Status fill_rand(const EvalContext* ctx, double* out, size_t n) {
+    if (ctx->rng == NULL) return status_err("error: random numbers are unavailable here");
+    rng_fill_uniform(ctx->rng, out, n);
+    return status_ok();
+}
+
+static Status fill_randn(const EvalContext* ctx, double* out, size_t n) {
+    if (ctx->rng == NULL) return status_err("error: random numbers are unavailable here");
+    rng_fill_normal(ctx->rng, out, n);
+    return status_ok();
+}
+
+/* Derivatives. In degree mode sin/cos/tan take x * pi/180, so their
+   derivatives carry that factor (to_radians); asin/acos/atan return
+   radians * 180/pi, and so do theirs (from_radians). */
+
+static Status d_abs(const double* a, const EvalContext* ctx, double* out) {
+    (void)ctx;
+    *out = a[0] > 0.0 ? 1.0 : a[0] < 0.0 ? -1.0 : 0.0;
+    return status_ok();
+}
+
+static Status d_acos(const double* a, const EvalContext* ctx, double* out) {
+    *out = from_radians(ctx, -1.0 / sqrt(1.0 - a[0] * a[0]));
+    return status_ok();
+}
+
+static Status d_asin(const double* a, const EvalContext* ctx, double* out) {
+    *out = from_radians(ctx, 1.0 / sqrt(1.0 - a[0] * a[0]));
+    return status_ok();
+}
+
+static Status d_atan(const double* a, const EvalContext* ctx, double* out) {
+    *out = from_radians(ctx, 1.0 / (1.0 + a[0] * a[0]));
+    return status_ok();
+}
+
+static Status d_cos(const double* a, const EvalContext* ctx, double* out) {
+    *out = to_radians(ctx, -sin(to_radians(ctx, a[0])));
+    return status_ok();
+}
+
+static Status d_ln(const double* a, const EvalContext* ctx, double* out) {
+    (void)ctx;
+    *out = 1.0 / a[0];
+    return status_ok();
+}
+
+static Status d_log(const double* a, const EvalContext* ctx, double* out) {
+    (void)ctx;
+    *out = 1.0 / (a[0] * log(10.0));
+    return status_ok();
+}
+
+/* A draw does not depend on any input. */
+static Status d_zero(const double* a, const EvalContext* ctx, double* out) {
+    (void)a;
+    (void)ctx;
+    *out = 0.0;
+    return status_ok();
+}
+
+static Status d_sin(const double* a, const EvalContext* ctx, double* out) {
+    *out = to_radians(ctx, cos(to_radians(ctx, a[0])));
+    return status_ok();
+}
+
+static Status d_sqrt(const double* a, const EvalContext* ctx, double* out) {
+    (void)ctx;
+    *out = 0.5 / sqrt(a[0]);
+    return status_ok();
+}
+
+static Status d_tan(const double* a, const EvalContext* ctx, double* out) {
+    double c = cos(to_radians(ctx, a[0]));
+    *out = to_radians(ctx, 1.0 / (c * c));
+    return status_ok();
+}
+
+/* Sorted by name: lookups are a binary search and the index is the symbol id
+   stored in AST_CALL nodes. Register new functions here. */
+static const BuiltinFunc k_funcs[] = {
+    { "abs", 1, fn_abs, "error: abs(x) expects 1 arg", d_abs, NULL },
+    { "acos", 1, fn_acos, "error: acos(x) expects 1 arg", d_acos, NULL },
+    { "asin", 1, fn_asin, "error: asin(x) expects 1 arg", d_asin, NULL },
+    { "atan", 1, fn_atan, "error: atan(x) expects 1 arg", d_atan, NULL },
+    { "cos", 1, fn_cos, "error: cos(x) expects 1 arg", d_cos, NULL },
+    { "ln", 1, fn_ln, "error: ln(x) expects 1 arg", d_ln, NULL },
+    { "log", 1, fn_log, "error: log(x) expects 1 arg", d_log, NULL },
+    { "rand", 0, fn_rand, "error: rand() expects no args", d_zero, fill_rand },
+    { "randn", 0, fn_randn, "error: randn() expects no args", d_zero, fill_randn },
+    { "sin", 1, fn_sin, "error: sin(x) expects 1 arg", d_sin, NULL },
+    { "sqrt", 1, fn_sqrt, "error: sqrt(x) expects 1 arg", d_sqrt, NULL },
+    { "tan", 1, fn_tan, "error: tan(x) expects 1 arg", d_tan, NULL },
+};
+
+/* Sorted by name; the index is the BuiltinVar id. */
+static const char* const k_vars[] = { "ans", "e", "mem", "pi" };
+
+/* Compares a length-delimited identifier against a lowercase table name. */
+static int name_cmp(const char* name, size_t len, const char* entry) {
+    for (size_t i = 0; i < len; i++) {
+        int c = tolower((unsigned char)name[i]);
+        int e = (unsigned char)entry[i];
+        if (e == 0 || c != e) {
+            return c - e;
+        }
+    }
+    return entry[len] == '\0' ? 0 : -1;
+}
+
+static int find_sorted(const char* name, size_t len, const void* table, size_t count, size_t stride) {
+    size_t lo = 0;
+    size_t hi = count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const char* entry = *(const char* const*)((const char*)table + mid * stride);
+        int c = name_cmp(name, len, entry);
+        if (c == 0) {
+            return (int)mid;
+        }
+        if (c < 0) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return -1;
+}
+
+int builtins_find_func(const char* name, size_t len) {
+    return find_sorted(name, len, k_funcs, sizeof(k_funcs) / sizeof(k_funcs[0]), sizeof(k_funcs[0]));
+}
+
+int builtins_find_var(const char* name, size_t len) {
+    return find_sorted(name, len, k_vars, sizeof(k_vars) / sizeof(k_vars[0]), sizeof(k_vars[0]));
+}
+
+const BuiltinFunc* builtins_func(int id) {
+    if (id < 0 || (size_t)id >= sizeof(k_funcs) / sizeof(k_funcs[0])) {
+        return NULL;
+    }
+    return &k_funcs[id];
+}
+
+size_t builtins_func_count(void) {
+    return sizeof(k_funcs) / sizeof(k_funcs[0]);
+}
+
+int builtins_func_id(BuiltinFn fn) {
+    for (size_t i = 0; i < sizeof(k_funcs) / sizeof(k_funcs[0]); i++) {
+        if (k_funcs[i].fn == fn) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include "util/status.h"
+#include "calc/eval.h"
+
+#include <stddef.h>
+
+/* Builtin functions receive their already-evaluated arguments. The arity is
+   checked by the parser, so a function never sees the wrong argument count. */
+typedef Status (*BuiltinFn)(const double* args, const EvalContext* ctx, double* out);
+
+/* n draws of a random builtin at once, the same numbers n calls to its fn
+   would give. */
+typedef Status (*BuiltinFill)(const EvalContext* ctx, double* out, size_t n);
+
+/* Every builtin takes one argument except the random ones, which take none;
+   deriv gives d fn / d x at args[0], including the degree-mode chain rule.
+   It is only called where fn succeeded, and may return an infinite
+   derivative (sqrt at 0). fill is set for exactly the random builtins,
+   which draw from ctx->rng and so must never be folded or shared. */
+typedef struct {
+    const char* name;
+    size_t arity;
+    BuiltinFn fn;
+    const char* arity_msg;
+    BuiltinFn deriv;
+    BuiltinFill fill;
+} BuiltinFunc;
+
+typedef enum {
+    SYM_ANS,
+    SYM_E,
+    SYM_MEM,
+    SYM_PI,
+    SYM_INPUT,   /* SYM_INPUT + i names Ast.inputs[i] */
+} BuiltinVar;
+
+/* Lookups are case-insensitive and take the identifier as it appears in the
+   input (not NUL-terminated). They return -1 when the name is unknown. */
+int builtins_find_func(const char* name, size_t len);
+int builtins_find_var(const char* name, size_t len);
+
+const BuiltinFunc* builtins_func(int id);
+
+/* The id of the builtin implemented by fn, or -1. */
+int builtins_func_id(BuiltinFn fn);
+size_t builtins_func_count(void);
@@ -0,0 +1,373 @@
+#include "calc/bytecode.h"
+
+#include "calc/symtab.h"
+
+#include <math.h>
+#include <string.h>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+#ifndef M_E
+#define M_E 2.71828182845904523536
+#endif
+
+static Status emit(Program* p, Instr in) {
+    if (p->code_len >= p->code_cap) {
+        return status_err("error: program too large");
+    }
+    p->code[p->code_len++] = in;
+    return status_ok();
+}
+
+static Status emit_op(Program* p, OpCode op) {
+    Instr in;
+    memset(&in, 0, sizeof(in));
+    in.op = op;
+    return emit(p, in);
+}
+
+static Status emit_num(Program* p, double v) {
+    Instr in;
+    memset(&in, 0, sizeof(in));
+    in.op = OP_PUSH;
+    in.as.num = v;
+    return emit(p, in);
+}
+
+static Status compile_var(int sym, Program* p) {
+    switch (sym) {
+        case SYM_PI: return emit_num(p, M_PI);
+        case SYM_E: return emit_num(p, M_E);
+        case SYM_ANS: return emit_op(p, OP_ANS);
+        case SYM_MEM: return emit_op(p, OP_MEM);
+        default: {
+            if (sym < SYM_INPUT) {
+                return status_err("error: unknown variable");
+            }
+            Instr in;
+            memset(&in, 0, sizeof(in));
+            in.op = OP_INPUT;
+            in.arg = (unsigned)(sym - SYM_INPUT);
+            return emit(p, in);
+        }
+    }
+}
+
+static Status emit_slot(Program* p, OpCode op, int slot) {
+    if (slot < 0 || slot >= AST_MAX_SLOTS) {
+        return status_err("error: invalid AST node");
+    }
+    Instr in;
+    memset(&in, 0, sizeof(in));
+    in.op = op;
+    in.arg = (unsigned)slot;
+    return emit(p, in);
+}
+
+static Status compile_call(const AstNode* n, Program* p) {
+    const BuiltinFunc* fn = builtins_func(n->as.call.fn);
+    if (fn == NULL) {
+        return status_err("error: unknown function");
+    }
+    if (fn->arity != n->as.call.argc) {
+        return status_err(fn->arity_msg);
+    }
+    Instr in;
+    memset(&in, 0, sizeof(in));
+    in.op = OP_CALL;
+    in.arg = (unsigned)fn->arity;
+    in.as.fn = fn->fn;
+    return emit(p, in);
+}
+
+Status bytecode_compile(const Ast* ast, Program* out) {
+    out->code_len = 0;
+    out->stack_need = 0;
+
+    if (ast->root < 0 || (size_t)ast->root + 1 != ast->node_len) {
+        return status_err("error: invalid AST node");
+    }
+
+    /* Compile-time mirror of the run-time stack: the node that produced each
+       slot, so every operand can be checked against the node consuming it. */
+    int stack[BYTECODE_STACK_MAX];
+    size_t sp = 0;
+
+    for (size_t i = 0; i < ast->node_len; i++) {
+        AstNode node = ast_node(ast, (int)i);
+        const AstNode* n = &node;
+        Status st = status_ok();
+
+        switch (n->kind) {
+            case AST_NUM:
+                st = emit_num(out, n->as.num);
+                break;
+            case AST_VAR:
+                st = compile_var(n->as.var.sym, out);
+                break;
+            case AST_UNARY:
+                if (sp < 1 || stack[sp - 1] != n->as.unary.child) {
+                    return status_err("error: AST not in evaluation order");
+                }
+                sp--;
+                if (n->as.unary.op == UN_NEG) {
+                    st = emit_op(out, OP_NEG);
+                }
+                break;
+            case AST_BINARY: {
+                if (sp < 2 || stack[sp - 2] != n->as.binary.lhs || stack[sp - 1] != n->as.binary.rhs) {
+                    return status_err("error: AST not in evaluation order");
+                }
+                sp -= 2;
+                OpCode op = OP_ADD;
+                switch (n->as.binary.op) {
+                    case BIN_ADD: op = OP_ADD; break;
+                    case BIN_SUB: op = OP_SUB; break;
+                    case BIN_MUL: op = OP_MUL; break;
+                    case BIN_DIV: op = OP_DIV; break;
+                    case BIN_POW: op = OP_POW; break;
+                }
+                st = emit_op(out, op);
+                break;
+            }
+            case AST_USER_VAR: {
+                Instr in;
+                memset(&in, 0, sizeof(in));
+                in.op = OP_USER_VAR;
+                in.arg = (unsigned)n->as.var.sym;
+                st = emit(out, in);
+                break;
+            }
+            case AST_CALL:
+            case AST_USER_CALL: {
+                size_t argc = n->as.call.argc;
+                if (argc > 4 || sp < argc) {
+                    return status_err("error: AST not in evaluation order");
+                }
+                for (size_t a = 0; a < argc; a++) {
+                    if (stack[sp - argc + a] != n->as.call.args[a]) {
+                        return status_err("error: AST not in evaluation order");
+                    }
+                }
+                if (n->kind == AST_CALL) {
+                    st = compile_call(n, out);
+                } else {
+                    Instr in;
+                    memset(&in, 0, sizeof(in));
+                    in.op = OP_USER_CALL;
+                    in.arg = (unsigned)argc;
+                    in.as.sym = n->as.call.fn;
+                    st = emit(out, in);
+                }
+                sp -= argc;
+                break;
+            }
+            case AST_STORE:
+                if (sp < 1 || stack[sp - 1] != n->as.store.child) {
+                    return status_err("error: AST not in evaluation order");
+                }
+                sp--;
+                st = emit_slot(out, OP_STORE, n->as.store.slot);
+                break;
+            case AST_LOAD:
+                st = emit_slot(out, OP_LOAD, n->as.load.slot);
+                break;
+            default:
+                return status_err("error: unknown AST kind");
+        }
+        if (!st.ok) {
+            return st;
+        }
+
+        if (sp >= BYTECODE_STACK_MAX) {
+            return status_err("error: expression too deep");
+        }
+        stack[sp++] = (int)i;
+        if (sp > out->stack_need) {
+            out->stack_need = sp;
+        }
+    }
+
+    if (sp != 1) {
+        return status_err("error: AST not in evaluation order");
+    }
+    return status_ok();
+}
+
+Status bytecode_run(const Program* prog, const EvalContext* ctx, double* out) {
+    if (prog->stack_need > BYTECODE_STACK_MAX) {
+        return status_err("error: expression too deep");
+    }
+
+    double stack[BYTECODE_STACK_MAX];
+    double* sp = stack; /* next free slot */
+    double slots[AST_MAX_SLOTS];
+
+    const Instr* ip = prog->code;
+    const Instr* end = prog->code + prog->code_len;
+    for (; ip < end; ip++) {
+        switch (ip->op) {
+            case OP_PUSH:
+                *sp++ = ip->as.num;
+                break;
+            case OP_ANS:
+                *sp++ = ctx->ans;
+                break;
+            case OP_MEM:
+                if (!ctx->mem_set) return status_err("error: mem is unset");
+                *sp++ = ctx->mem;
+                break;
+            case OP_INPUT:
+                if (ip->arg >= ctx->input_count) return status_err("error: unknown variable");
+                *sp++ = ctx->inputs[ip->arg];
+                break;
+            case OP_NEG:
+                sp[-1] = -sp[-1];
+                break;
+            case OP_ADD:
+                sp--;
+                sp[-1] += sp[0];
+                if (!isfinite(sp[-1])) return status_err("error: result is not finite");
+                break;
+            case OP_SUB:
+                sp--;
+                sp[-1] -= sp[0];
+                if (!isfinite(sp[-1])) return status_err("error: result is not finite");
+                break;
+            case OP_MUL:
+                sp--;
+                sp[-1] *= sp[0];
+                if (!isfinite(sp[-1])) return status_err("error: result is not finite");
+                break;
+            case OP_DIV:
+                sp--;
+                if (sp[0] == 0.0) return status_err("error: division by zero");
+                sp[-1] /= sp[0];
+                if (!isfinite(sp[-1])) return status_err("error: result is not finite");
+                break;
+            case OP_POW:
+                sp--;
+                sp[-1] = pow(sp[-1], sp[0]);
+                if (!isfinite(sp[-1])) return status_err("error: result is not finite");
+                break;
+            case OP_CALL: {
+                double r = 0.0;
+                sp -= ip->arg;
+                Status st = ip->as.fn(sp, ctx, &r);
+                if (!st.ok) return st;
+                *sp++ = r;
+                break;
+            }
+            case OP_STORE:
+                slots[ip->arg] = sp[-1];
+                break;
+            case OP_LOAD:
+                *sp++ = slots[ip->arg];
+                break;
+            case OP_USER_VAR: {
+                Status st = symtab_value(ctx->symbols, (int)ip->arg, sp);
+                if (!st.ok) return st;
+                sp++;
+                break;
+            }
+            case OP_USER_CALL: {
+                double r = 0.0;
+                sp -= ip->arg;
+                Status st = symtab_call(ctx->symbols, ip->as.sym, sp, ip->arg, ctx, &r);
+                if (!st.ok) return st;
+                *sp++ = r;
+                break;
+            }
+        }
+    }
+
+    if (sp != stack + 1) {
+        return status_err("error: invalid program");
+    }
+    *out = stack[0];
+    if (!isfinite(*out)) {
+        return status_err("error: non-finite result");
+    }
+    return status_ok();
+}
+
+Status bytecode_run_dual(const Program* prog, const EvalContext* ctx, const Dual* inputs, Dual* out) {
+    if (prog->stack_need > BYTECODE_STACK_MAX) {
+        return status_err("error: expression too deep");
+    }
+
+    Dual stack[BYTECODE_STACK_MAX];
+    Dual* sp = stack;
+    Dual slots[AST_MAX_SLOTS];
+    Status st = status_ok();
+
+    const Instr* ip = prog->code;
+    const Instr* end = prog->code + prog->code_len;
+    for (; ip < end && st.ok; ip++) {
+        switch (ip->op) {
+            case OP_PUSH:
+                *sp++ = (Dual){ ip->as.num, 0.0 };
+                break;
+            case OP_ANS:
+                *sp++ = (Dual){ ctx->ans, 0.0 };
+                break;
+            case OP_MEM:
+                if (!ctx->mem_set) return status_err("error: mem is unset");
+                *sp++ = (Dual){ ctx->mem, 0.0 };
+                break;
+            case OP_INPUT:
+                if (ip->arg >= ctx->input_count) return status_err("error: unknown variable");
+                *sp++ = inputs[ip->arg];
+                break;
+            case OP_NEG:
+                sp[-1] = (Dual){ -sp[-1].v, -sp[-1].d };
+                break;
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+            case OP_DIV:
+            case OP_POW: {
+                static const BinaryOp ops[] = { BIN_ADD, BIN_SUB, BIN_MUL, BIN_DIV, BIN_POW };
+                sp--;
+                st = eval_dual_binary(ops[ip->op - OP_ADD], sp[-1], sp[0], &sp[-1]);
+                break;
+            }
+            case OP_CALL:
+                sp -= ip->arg;
+                st = eval_dual_call(builtins_func_id(ip->as.fn), sp, ctx, sp);
+                sp++;
+                break;
+            case OP_STORE:
+                slots[ip->arg] = sp[-1];
+                break;
+            case OP_LOAD:
+                *sp++ = slots[ip->arg];
+                break;
+            case OP_USER_VAR:
+                sp->d = 0.0;
+                st = symtab_value(ctx->symbols, (int)ip->arg, &sp->v);
+                sp++;
+                break;
+            case OP_USER_CALL: {
+                Dual r = { 0.0, 0.0 };
+                sp -= ip->arg;
+                st = symtab_call_dual(ctx->symbols, ip->as.sym, sp, ip->arg, ctx, &r);
+                *sp++ = r;
+                break;
+            }
+        }
+    }
+    if (!st.ok) {
+        return st;
+    }
+
+    if (sp != stack + 1) {
+        return status_err("error: invalid program");
+    }
+    *out = stack[0];
+    if (!isfinite(out->v)) {
+        return status_err("error: non-finite result");
+    }
+    return status_ok();
+}
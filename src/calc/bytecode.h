@@ -0,0 +1,64 @@
+#pragma once
+
+#include "util/status.h"
+#include "calc/parser.h"
+#include "calc/eval.h"
+#include "calc/builtins.h"
+
+#include <stddef.h>
+
+/* Maximum operand stack depth of a compiled program. */
+#define BYTECODE_STACK_MAX 256
+
+typedef enum {
+    OP_PUSH,
+    OP_ANS,
+    OP_MEM,
+    OP_INPUT,
+    OP_NEG,
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_POW,
+    OP_CALL,
+    OP_STORE,
+    OP_LOAD,
+    OP_USER_VAR,
+    OP_USER_CALL,
+} OpCode;
+
+typedef struct {
+    OpCode op;
+    unsigned arg;      /* OP_CALL/OP_USER_CALL: argc, OP_STORE/OP_LOAD: slot, OP_INPUT: index,
+                          OP_USER_VAR: symbol id */
+    union {
+        double num;
+        BuiltinFn fn;
+        int sym;       /* OP_USER_CALL: symbol id */
+    } as;
+} Instr;
+
+typedef struct {
+    Instr* code;
+    size_t code_cap;
+    size_t code_len;
+    size_t stack_need;
+} Program;
+
+/* Compiles ast->root into a linear stack program. The parser stores nodes in
+   post-order (operands before the node that consumes them, root last), which is
+   exactly the order a stack machine executes them in, so compilation is a single
+   pass over the node array. Constants become immediates and calls bind directly
+   to the builtin's function pointer. User symbols stay ids, looked up in
+   ctx->symbols at run time, so redefining one affects compiled callers. */
+Status bytecode_compile(const Ast* ast, Program* out);
+
+/* Runs a compiled program. Produces the same value or error as eval_ast. */
+Status bytecode_run(const Program* prog, const EvalContext* ctx, double* out);
+
+/* bytecode_run in dual numbers: the same value or error, plus the
+   derivative seeded by the d parts of inputs, which stand in for
+   ctx->inputs (ctx->input_count of them). User variables are constants;
+   user functions are differentiated through their bodies. */
+Status bytecode_run_dual(const Program* prog, const EvalContext* ctx, const Dual* inputs, Dual* out);
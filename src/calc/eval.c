@@ -1,6 +1,10 @@
 #include "calc/eval.h"
 
+#include "calc/builtins.h"
+#include "calc/symtab.h"
+
 #include <math.h>
+#include <stdlib.h>
 #include <string.h>
 
 #ifndef M_PI
@@ -15,152 +19,112 @@ void eval_context_init(EvalContext* ctx) {
     ctx->ans = 0.0;
     ctx->mem = 0.0;
     ctx->mem_set = 0;
+    ctx->max_depth = EVAL_MAX_DEPTH;
+    ctx->inputs = NULL;
+    ctx->input_count = 0;
+    ctx->symbols = NULL;
+    ctx->call_depth = 0;
+    ctx->max_call_depth = SYMTAB_MAX_CALL_DEPTH;
+    ctx->rng = NULL;
 }
 
-static double to_radians(const EvalContext* ctx, double x) {
-    if (ctx->angle_mode_deg) {
-        return x * (M_PI / 180.0);
-    }
-    return x;
+static bool isfinite_safe(double x) {
+    return isfinite(x) != 0;
 }
 
-static double from_radians(const EvalContext* ctx, double x) {
-    if (ctx->angle_mode_deg) {
-        return x * (180.0 / M_PI);
+static Status eval_var(int sym, const EvalContext* ctx, double* out) {
+    switch (sym) {
+        case SYM_PI:
+            *out = M_PI;
+            return status_ok();
+        case SYM_E:
+            *out = M_E;
+            return status_ok();
+        case SYM_ANS:
+            *out = ctx->ans;
+            return status_ok();
+        case SYM_MEM:
+            if (!ctx->mem_set) {
+                return status_err("error: mem is unset");
+            }
+            *out = ctx->mem;
+            return status_ok();
+        default:
+            if (sym >= SYM_INPUT && (size_t)(sym - SYM_INPUT) < ctx->input_count) {
+                *out = ctx->inputs[sym - SYM_INPUT];
+                return status_ok();
+            }
+            return status_err("error: unknown variable");
     }
-    return x;
 }
 
-static bool isfinite_safe(double x) {
-    return isfinite(x) != 0;
-}
+/* A node whose operands are being evaluated; their values are on the value
+   stack. A node has at most 4 operands, so the value stack never holds more
+   than 4 entries per frame. */
+typedef struct {
+    int id;
+    int done;
+} EvalFrame;
 
-static Status eval_node(const Ast* ast, int id, const EvalContext* ctx, double* out);
+#define EVAL_INLINE_FRAMES 64
 
-static Status eval_var(const char* name, const EvalContext* ctx, double* out) {
-    if (strcmp(name, "pi") == 0) {
-        *out = M_PI;
-        return status_ok();
-    }
-    if (strcmp(name, "e") == 0) {
-        *out = M_E;
-        return status_ok();
-    }
-    if (strcmp(name, "ans") == 0) {
-        *out = ctx->ans;
-        return status_ok();
-    }
-    if (strcmp(name, "mem") == 0) {
-        if (!ctx->mem_set) {
-            return status_err("error: mem is unset");
-        }
-        *out = ctx->mem;
-        return status_ok();
+static size_t operand_count(const Ast* ast, int id) {
+    switch ((AstKind)ast->kind[id]) {
+        case AST_UNARY:
+        case AST_STORE:
+            return 1;
+        case AST_BINARY:
+            return 2;
+        case AST_CALL:
+        case AST_USER_CALL:
+            return (size_t)ast->rhs[id];
+        default:
+            return 0;
     }
-    return status_err("error: unknown variable");
 }
 
-static Status eval_call(const AstNode* n, const Ast* ast, const EvalContext* ctx, double* out) {
-    const char* fn = n->as.call.name;
-
-    double a0 = 0.0;
-    if (n->as.call.argc >= 1) {
-        Status st = eval_node(ast, n->as.call.args[0], ctx, &a0);
-        if (!st.ok) {
-            return st;
-        }
+static int operand(const Ast* ast, int id, size_t i) {
+    if (ast->kind[id] == AST_CALL || ast->kind[id] == AST_USER_CALL) {
+        return ast->args[(size_t)ast->lhs[id] + i];
     }
-
-    if (strcmp(fn, "sin") == 0) {
-        if (n->as.call.argc != 1) return status_err("error: sin(x) expects 1 arg");
-        *out = sin(to_radians(ctx, a0));
-        return status_ok();
-    }
-    if (strcmp(fn, "cos") == 0) {
-        if (n->as.call.argc != 1) return status_err("error: cos(x) expects 1 arg");
-        *out = cos(to_radians(ctx, a0));
-        return status_ok();
-    }
-    if (strcmp(fn, "tan") == 0) {
-        if (n->as.call.argc != 1) return status_err("error: tan(x) expects 1 arg");
-        *out = tan(to_radians(ctx, a0));
-        return status_ok();
-    }
-    if (strcmp(fn, "asin") == 0) {
-        if (n->as.call.argc != 1) return status_err("error: asin(x) expects 1 arg");
-        *out = from_radians(ctx, asin(a0));
-        return status_ok();
-    }
-    if (strcmp(fn, "acos") == 0) {
-        if (n->as.call.argc != 1) return status_err("error: acos(x) expects 1 arg");
-        *out = from_radians(ctx, acos(a0));
-        return status_ok();
-    }
-    if (strcmp(fn, "atan") == 0) {
-        if (n->as.call.argc != 1) return status_err("error: atan(x) expects 1 arg");
-        *out = from_radians(ctx, atan(a0));
-        return status_ok();
-    }
-    if (strcmp(fn, "sqrt") == 0) {
-        if (n->as.call.argc != 1) return status_err("error: sqrt(x) expects 1 arg");
-        if (a0 < 0.0) return status_err("error: sqrt domain");
-        *out = sqrt(a0);
-        return status_ok();
-    }
-    if (strcmp(fn, "abs") == 0) {
-        if (n->as.call.argc != 1) return status_err("error: abs(x) expects 1 arg");
-        *out = fabs(a0);
-        return status_ok();
-    }
-    if (strcmp(fn, "ln") == 0) {
-        if (n->as.call.argc != 1) return status_err("error: ln(x) expects 1 arg");
-        if (a0 <= 0.0) return status_err("error: ln domain");
-        *out = log(a0);
-        return status_ok();
-    }
-    if (strcmp(fn, "log") == 0) {
-        if (n->as.call.argc != 1) return status_err("error: log(x) expects 1 arg");
-        if (a0 <= 0.0) return status_err("error: log domain");
-        *out = log10(a0);
-        return status_ok();
-    }
-
-    return status_err("error: unknown function");
+    return i == 0 ? ast->lhs[id] : ast->rhs[id];
 }
 
-static Status eval_node(const Ast* ast, int id, const EvalContext* ctx, double* out) {
+/* Checks that can fail before any operand is evaluated. */
+static Status eval_enter(const Ast* ast, int id) {
     if (id < 0 || (size_t)id >= ast->node_len) {
         return status_err("error: invalid AST node");
     }
-    const AstNode* n = &ast->nodes[id];
+    switch ((AstKind)ast->kind[id]) {
+        case AST_CALL:
+            if (builtins_func(ast->op[id]) == NULL) {
+                return status_err("error: unknown function");
+            }
+            return status_ok();
+        case AST_STORE:
+            if (ast->op[id] >= AST_MAX_SLOTS) {
+                return status_err("error: invalid AST node");
+            }
+            return status_ok();
+        default:
+            return status_ok();
+    }
+}
 
-    switch (n->kind) {
+/* Computes a node from its operand values v. */
+static Status eval_leave(const Ast* ast, int id, const double* v, const EvalContext* ctx, double* slots, double* out) {
+    switch ((AstKind)ast->kind[id]) {
         case AST_NUM:
-            *out = n->as.num;
+            *out = ast->nums[ast->lhs[id]];
             return status_ok();
         case AST_VAR:
-            return eval_var(n->as.var.name, ctx, out);
-        case AST_UNARY: {
-            double v = 0.0;
-            Status st = eval_node(ast, n->as.unary.child, ctx, &v);
-            if (!st.ok) {
-                return st;
-            }
-            if (n->as.unary.op == UN_NEG) {
-                *out = -v;
-            } else {
-                *out = v;
-            }
+            return eval_var(ast->op[id], ctx, out);
+        case AST_UNARY:
+            *out = ast->op[id] == UN_NEG ? -v[0] : v[0];
             return status_ok();
-        }
         case AST_BINARY: {
-            double a = 0.0, b = 0.0;
-            Status st = eval_node(ast, n->as.binary.lhs, ctx, &a);
-            if (!st.ok) return st;
-            st = eval_node(ast, n->as.binary.rhs, ctx, &b);
-            if (!st.ok) return st;
-
-            switch (n->as.binary.op) {
+            double a = v[0], b = v[1];
+            switch ((BinaryOp)ast->op[id]) {
                 case BIN_ADD: *out = a + b; break;
                 case BIN_SUB: *out = a - b; break;
                 case BIN_MUL: *out = a * b; break;
@@ -178,14 +142,117 @@ static Status eval_node(const Ast* ast, int id, const EvalContext* ctx, double*
             return status_ok();
         }
         case AST_CALL:
-            return eval_call(n, ast, ctx, out);
+            return builtins_func(ast->op[id])->fn(v, ctx, out);
+        case AST_USER_VAR:
+            return symtab_value(ctx->symbols, ast->op[id], out);
+        case AST_USER_CALL:
+            return symtab_call(ctx->symbols, ast->op[id], v, (size_t)ast->rhs[id], ctx, out);
+        case AST_STORE:
+            *out = v[0];
+            slots[ast->op[id]] = *out;
+            return status_ok();
+        case AST_LOAD:
+            if (ast->op[id] >= AST_MAX_SLOTS) {
+                return status_err("error: invalid AST node");
+            }
+            *out = slots[ast->op[id]];
+            return status_ok();
         default:
             return status_err("error: unknown AST kind");
     }
 }
 
+/* Depth-first walk with an explicit frame stack: operands are evaluated left
+   to right, so values and errors match a recursive evaluator, but nesting
+   only costs heap memory up to ctx->max_depth frames. */
+static Status eval_tree(const Ast* ast, int root, const EvalContext* ctx, double* slots, double* out) {
+    EvalFrame inline_frames[EVAL_INLINE_FRAMES];
+    double inline_vals[4 * EVAL_INLINE_FRAMES];
+    EvalFrame* frames = inline_frames;
+    double* vals = inline_vals;
+    size_t cap = EVAL_INLINE_FRAMES;
+    size_t len = 0;
+    size_t vlen = 0;
+
+    Status st = eval_enter(ast, root);
+    if (!st.ok) {
+        return st;
+    }
+    frames[len++] = (EvalFrame){ root, 0 };
+    while (len > 0) {
+        EvalFrame* f = &frames[len - 1];
+        size_t n = operand_count(ast, f->id);
+        if ((size_t)f->done < n) {
+            int child = operand(ast, f->id, (size_t)f->done);
+            f->done++;
+            st = eval_enter(ast, child);
+            if (!st.ok) {
+                break;
+            }
+            if (operand_count(ast, child) == 0) {
+                /* leaves need no frame */
+                st = eval_leave(ast, child, NULL, ctx, slots, &vals[vlen]);
+                if (!st.ok) {
+                    break;
+                }
+                vlen++;
+                continue;
+            }
+            if (len == cap) {
+                size_t new_cap = cap * 2 < ctx->max_depth ? cap * 2 : ctx->max_depth;
+                if (len >= new_cap) {
+                    st = status_err("error: expression too deep");
+                    break;
+                }
+                bool first = frames == inline_frames;
+                EvalFrame* grown = realloc(first ? NULL : frames, new_cap * sizeof(EvalFrame));
+                if (grown != NULL) {
+                    frames = grown;
+                }
+                double* grown_vals = grown ? realloc(first ? NULL : vals, 4 * new_cap * sizeof(double)) : NULL;
+                if (grown_vals != NULL) {
+                    vals = grown_vals;
+                }
+                if (grown == NULL || grown_vals == NULL) {
+                    if (first && grown != NULL) {
+                        free(grown);
+                        frames = inline_frames;
+                    }
+                    st = status_err("error: out of memory");
+                    break;
+                }
+                if (first) {
+                    memcpy(frames, inline_frames, sizeof(inline_frames));
+                    memcpy(vals, inline_vals, sizeof(inline_vals));
+                }
+                cap = new_cap;
+            }
+            frames[len++] = (EvalFrame){ child, 0 };
+            continue;
+        }
+
+        vlen -= n;
+        st = eval_leave(ast, f->id, &vals[vlen], ctx, slots, &vals[vlen]);
+        if (!st.ok) {
+            break;
+        }
+        vlen++;
+        len--;
+    }
+    if (st.ok) {
+        *out = vals[0];
+    }
+
+    if (frames != inline_frames) {
+        free(frames);
+        free(vals);
+    }
+    return st;
+}
+
 Status eval_ast(const Ast* ast, int node_id, const EvalContext* ctx, double* out) {
-    Status st = eval_node(ast, node_id, ctx, out);
+    double slots[AST_MAX_SLOTS];
+    Status st = eval_tree(ast, node_id, ctx, slots, out);
     if (!st.ok) {
         return st;
     }
@@ -194,3 +261,56 @@ Status eval_ast(const Ast* ast, int node_id, const EvalContext* ctx, double* out
     }
     return status_ok();
 }
+
+Status eval_dual_binary(BinaryOp op, Dual a, Dual b, Dual* out) {
+    Dual r = { 0.0, 0.0 };
+    switch (op) {
+        case BIN_ADD:
+            r = (Dual){ a.v + b.v, a.d + b.d };
+            break;
+        case BIN_SUB:
+            r = (Dual){ a.v - b.v, a.d - b.d };
+            break;
+        case BIN_MUL:
+            r = (Dual){ a.v * b.v, a.d * b.v + a.v * b.d };
+            break;
+        case BIN_DIV:
+            if (b.v == 0.0) return status_err("error: division by zero");
+            r.v = a.v / b.v;
+            r.d = (a.d - r.v * b.d) / b.v;
+            break;
+        case BIN_POW:
+            r.v = pow(a.v, b.v);
+            /* terms with a zero factor are skipped: ln(a) is NaN for a <= 0,
+               which is fine when the exponent is constant */
+            if (a.d != 0.0) r.d += b.v * pow(a.v, b.v - 1.0) * a.d;
+            if (b.d != 0.0) r.d += r.v * log(a.v) * b.d;
+            break;
+    }
+    if (!isfinite_safe(r.v)) {
+        return status_err("error: result is not finite");
+    }
+    *out = r;
+    return status_ok();
+}
+
+Status eval_dual_call(int fn, const Dual* args, const EvalContext* ctx, Dual* out) {
+    const BuiltinFunc* f = builtins_func(fn);
+    if (f == NULL) {
+        return status_err("error: unknown function");
+    }
+    /* out may alias args */
+    double x[1] = { f->arity > 0 ? args[0].v : 0.0 };
+    double dx = f->arity > 0 ? args[0].d : 0.0;
+    Dual r = { 0.0, 0.0 };
+    Status st = f->fn(x, ctx, &r.v);
+    if (st.ok && dx != 0.0) {
+        double slope = 0.0;
+        st = f->deriv(x, ctx, &slope);
+        r.d = slope * dx;
+    }
+    if (st.ok) {
+        *out = r;
+    }
+    return st;
+}
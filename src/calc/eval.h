@@ -3,12 +3,40 @@
 #include "util/status.h"
 #include "calc/parser.h"
 
+#include <stddef.h>
+
+typedef struct Rng Rng;   /* calc/rng.h */
+
+/* Default limit on how deeply eval_ast nests; deeper trees fail with
+   "error: expression too deep". */
+#define EVAL_MAX_DEPTH 1024
+
 typedef struct {
     int angle_mode_deg;
     double ans;
     double mem;
     int mem_set;
+    size_t max_depth;   /* eval_ast nesting limit */
+    const double* inputs;   /* values of Ast.inputs */
+    size_t input_count;
+    const SymTab* symbols;  /* user variables and functions; NULL for none */
+    size_t call_depth;      /* user function calls in progress */
+    size_t max_call_depth;
+    Rng* rng;               /* rand and randn draw from it; NULL where threads share ctx */
 } EvalContext;
 
 void eval_context_init(EvalContext* ctx);
 Status eval_ast(const Ast* ast, int node_id, const EvalContext* ctx, double* out);
+
+/* A value and its derivative with respect to one chosen input, for
+   forward-mode differentiation: f(x) and f'(x) in one pass. */
+typedef struct {
+    double v;
+    double d;
+} Dual;
+
+/* The double operation on the values, with the same result or error as
+   eval_ast, and the derivative by the chain rule. The derivative can come
+   out infinite or NaN where f has none (sqrt at 0); abs at 0 gets 0. */
+Status eval_dual_binary(BinaryOp op, Dual a, Dual b, Dual* out);
+Status eval_dual_call(int fn, const Dual* args, const EvalContext* ctx, Dual* out);
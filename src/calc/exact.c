@@ -0,0 +1,93 @@
+#include "calc/exact.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+/* b^e for e >= 0 by squaring. b is squared only while bits of e remain, so
+   an overflow there means the result overflows too (|b| >= 2). */
+static bool ipow(int64_t b, int64_t e, int64_t* out) {
+    int64_t r = 1;
+    while (e > 0) {
+        if ((e & 1) && __builtin_mul_overflow(r, b, &r)) {
+            return false;
+        }
+        e >>= 1;
+        if (e > 0 && __builtin_mul_overflow(b, b, &b)) {
+            return false;
+        }
+    }
+    *out = r;
+    return true;
+}
+
+static ExactState binary(BinaryOp op, int64_t a, int64_t b, int64_t* out) {
+    bool overflow = false;
+    switch (op) {
+        case BIN_ADD: overflow = __builtin_add_overflow(a, b, out); break;
+        case BIN_SUB: overflow = __builtin_sub_overflow(a, b, out); break;
+        case BIN_MUL: overflow = __builtin_mul_overflow(a, b, out); break;
+        case BIN_POW: overflow = b < 0 || !ipow(a, b, out); break;
+        case BIN_DIV: return EXACT_NO;
+    }
+    return overflow ? EXACT_OVERFLOW : EXACT_OK;
+}
+
+void exact_eval_nodes(const Ast* ast, int64_t* values, uint8_t* state) {
+    /* post-order: operands are always done before the node using them */
+    for (size_t i = 0; i < ast->node_len; i++) {
+        ExactState s = EXACT_NO;
+        int64_t v = 0;
+        switch ((AstKind)ast->kind[i]) {
+            case AST_NUM: {
+                double x = ast->nums[ast->lhs[i]];
+                if (floor(x) == x && fabs(x) < EXACT_LITERAL_MAX) {
+                    v = (int64_t)x;
+                    s = EXACT_OK;
+                }
+                break;
+            }
+            case AST_UNARY: {
+                int c = ast->lhs[i];
+                s = (ExactState)state[c];
+                if (s == EXACT_OK && ast->op[i] == UN_NEG) {
+                    s = __builtin_sub_overflow((int64_t)0, values[c], &v) ? EXACT_OVERFLOW : EXACT_OK;
+                } else {
+                    v = values[c];
+                }
+                break;
+            }
+            case AST_BINARY: {
+                int l = ast->lhs[i], r = ast->rhs[i];
+                if (ast->op[i] == BIN_DIV || state[l] == EXACT_NO || state[r] == EXACT_NO) {
+                    s = EXACT_NO;
+                } else if (state[l] == EXACT_OVERFLOW || state[r] == EXACT_OVERFLOW) {
+                    s = EXACT_OVERFLOW;
+                } else {
+                    s = binary((BinaryOp)ast->op[i], values[l], values[r], &v);
+                }
+                break;
+            }
+            default:
+                break;
+        }
+        values[i] = s == EXACT_OK ? v : 0;
+        state[i] = (uint8_t)s;
+    }
+}
+
+bool exact_eval(const Ast* ast, int64_t* out) {
+    if (ast->root < 0 || ast->node_len == 0) {
+        return false;
+    }
+    int64_t* values = malloc(ast->node_len * sizeof(int64_t));
+    uint8_t* state = malloc(ast->node_len);
+    bool ok = values != NULL && state != NULL;
+    if (ok) {
+        exact_eval_nodes(ast, values, state);
+        ok = state[ast->root] == EXACT_OK;
+        *out = ok ? values[ast->root] : 0;
+    }
+    free(values);
+    free(state);
+    return ok;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "calc/parser.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Literals below this in magnitude are exact integers: every integer up to
+   2^53 is a double, so they were read without rounding. */
+#define EXACT_LITERAL_MAX 9007199254740992.0   /* 2^53 */
+
+typedef enum {
+    EXACT_NO,         /* the subtree is not integer-only */
+    EXACT_OK,         /* values[i] holds its exact value */
+    EXACT_OVERFLOW,   /* integer-only, but outside int64 or a negative power */
+} ExactState;
+
+/* Type inference over a parsed Ast: a node is integer-only when every
+   literal below it is an integer of magnitude below EXACT_LITERAL_MAX and
+   every operator is unary +/-, +, -, * or ^. Those subtrees are evaluated
+   in int64, with overflow checks and ^ by squaring, into values[i] with
+   state[i] set for every node; both arrays hold ast->node_len entries.
+   Anything else (/, names, calls) is EXACT_NO, and the caller keeps its
+   double evaluation, as it does for EXACT_OVERFLOW. */
+void exact_eval_nodes(const Ast* ast, int64_t* values, uint8_t* state);
+
+/* The exact value of the whole Ast, when it is integer-only and fits. */
+bool exact_eval(const Ast* ast, int64_t* out);
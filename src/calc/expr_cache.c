@@ -0,0 +1,209 @@
+#include "calc/expr_cache.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+static unsigned key_hash(const char* key, size_t len, int angle_mode_deg) {
+    unsigned h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)key[i];
+        h *= 16777619u;
+    }
+    h ^= (unsigned)(angle_mode_deg != 0);
+    h *= 16777619u;
+    return h;
+}
+
+static bool is_word_char(char c) {
+    return isalnum((unsigned char)c) || c == '_' || c == '.';
+}
+
+/* True if dropping the whitespace between a and b could change the tokens:
+   it joins two words, or lets a number take a sign as its exponent's
+   ("1e -5" is 1, e, -, 5 but "1e-5" one number). */
+static bool space_matters(char a, char b) {
+    if (is_word_char(a) && is_word_char(b)) {
+        return true;
+    }
+    return (a == 'e' || a == 'p') && (b == '+' || b == '-');
+}
+
+void expr_cache_sync(ExprCache* c, uint64_t version) {
+    if (c->version != version) {
+        expr_cache_clear(c);
+        c->version = version;
+    }
+}
+
+size_t expr_cache_normalize(const char* expr, char* out, size_t out_cap) {
+    size_t n = 0;
+    bool space = false;
+    for (const char* p = expr; *p; p++) {
+        if (isspace((unsigned char)*p)) {
+            space = true;
+            continue;
+        }
+        if (space && n > 0 && space_matters(out[n - 1], (char)tolower((unsigned char)*p))) {
+            if (n + 1 >= out_cap) {
+                return 0;
+            }
+            out[n++] = ' ';
+        }
+        space = false;
+        if (n + 1 >= out_cap) {
+            return 0;
+        }
+        out[n++] = (char)tolower((unsigned char)*p);
+    }
+    if (n < out_cap) {
+        out[n] = '\0';
+    }
+    return n;
+}
+
+void expr_cache_init(ExprCache* c) {
+    memset(c, 0, sizeof(*c));
+    for (size_t i = 0; i < EXPR_CACHE_BUCKETS; i++) {
+        c->buckets[i] = -1;
+    }
+    for (size_t i = 0; i < EXPR_CACHE_CAP; i++) {
+        c->entries[i].chain = -1;
+        c->entries[i].prev = -1;
+        c->entries[i].next = -1;
+    }
+    c->head = -1;
+    c->tail = -1;
+}
+
+void expr_cache_free(ExprCache* c) {
+    for (size_t i = 0; i < EXPR_CACHE_CAP; i++) {
+        free(c->entries[i].code);
+        c->entries[i].code = NULL;
+        c->entries[i].code_cap = 0;
+    }
+    expr_cache_clear(c);
+}
+
+void expr_cache_clear(ExprCache* c) {
+    for (size_t i = 0; i < EXPR_CACHE_BUCKETS; i++) {
+        c->buckets[i] = -1;
+    }
+    for (size_t i = 0; i < EXPR_CACHE_CAP; i++) {
+        c->entries[i].used = false;
+        c->entries[i].chain = -1;
+        c->entries[i].prev = -1;
+        c->entries[i].next = -1;
+    }
+    c->head = -1;
+    c->tail = -1;
+    c->count = 0;
+}
+
+static void lru_unlink(ExprCache* c, int i) {
+    ExprCacheEntry* e = &c->entries[i];
+    if (e->prev >= 0) c->entries[e->prev].next = e->next; else c->head = e->next;
+    if (e->next >= 0) c->entries[e->next].prev = e->prev; else c->tail = e->prev;
+    e->prev = -1;
+    e->next = -1;
+}
+
+static void lru_push_front(ExprCache* c, int i) {
+    ExprCacheEntry* e = &c->entries[i];
+    e->prev = -1;
+    e->next = c->head;
+    if (c->head >= 0) c->entries[c->head].prev = i; else c->tail = i;
+    c->head = i;
+}
+
+static void bucket_remove(ExprCache* c, int i) {
+    int* link = &c->buckets[c->entries[i].hash % EXPR_CACHE_BUCKETS];
+    while (*link >= 0) {
+        if (*link == i) {
+            *link = c->entries[i].chain;
+            break;
+        }
+        link = &c->entries[*link].chain;
+    }
+    c->entries[i].chain = -1;
+}
+
+static int find(const ExprCache* c, const char* key, size_t key_len, int angle_mode_deg, unsigned h) {
+    for (int i = c->buckets[h % EXPR_CACHE_BUCKETS]; i >= 0; i = c->entries[i].chain) {
+        const ExprCacheEntry* e = &c->entries[i];
+        if (e->hash == h && e->key_len == key_len && e->angle_mode_deg == angle_mode_deg &&
+            memcmp(e->key, key, key_len) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+const Program* expr_cache_get(ExprCache* c, const char* key, size_t key_len, int angle_mode_deg) {
+    angle_mode_deg = angle_mode_deg != 0;
+    int i = find(c, key, key_len, angle_mode_deg, key_hash(key, key_len, angle_mode_deg));
+    if (i < 0) {
+        c->misses++;
+        return NULL;
+    }
+    c->hits++;
+    if (c->head != i) {
+        lru_unlink(c, i);
+        lru_push_front(c, i);
+    }
+    return &c->entries[i].prog;
+}
+
+Status expr_cache_put(ExprCache* c, const char* key, size_t key_len, int angle_mode_deg, const Program* prog) {
+    if (key_len == 0 || key_len >= EXPR_CACHE_KEY_MAX) {
+        return status_err("error: cache key too long");
+    }
+    angle_mode_deg = angle_mode_deg != 0;
+    unsigned h = key_hash(key, key_len, angle_mode_deg);
+
+    int i = find(c, key, key_len, angle_mode_deg, h);
+    if (i >= 0) {
+        lru_unlink(c, i);
+        bucket_remove(c, i);
+    } else if (c->count < EXPR_CACHE_CAP) {
+        i = 0;
+        while (c->entries[i].used) {
+            i++;
+        }
+        c->count++;
+    } else {
+        i = c->tail;
+        lru_unlink(c, i);
+        bucket_remove(c, i);
+        c->evictions++;
+    }
+
+    ExprCacheEntry* e = &c->entries[i];
+    if (e->code_cap < prog->code_len) {
+        Instr* code = realloc(e->code, prog->code_len * sizeof(Instr));
+        if (code == NULL) {
+            e->used = false;
+            c->count--;
+            return status_err("error: out of memory");
+        }
+        e->code = code;
+        e->code_cap = prog->code_len;
+    }
+    if (prog->code_len > 0) {
+        memcpy(e->code, prog->code, prog->code_len * sizeof(Instr));
+    }
+    e->prog = *prog;
+    e->prog.code = e->code;
+    e->prog.code_cap = e->code_cap;
+
+    memcpy(e->key, key, key_len);
+    e->key[key_len] = '\0';
+    e->key_len = key_len;
+    e->angle_mode_deg = angle_mode_deg;
+    e->hash = h;
+    e->used = true;
+    e->chain = c->buckets[h % EXPR_CACHE_BUCKETS];
+    c->buckets[h % EXPR_CACHE_BUCKETS] = i;
+    lru_push_front(c, i);
+    return status_ok();
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "util/status.h"
+#include "calc/bytecode.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define EXPR_CACHE_CAP 64
+#define EXPR_CACHE_BUCKETS 128
+#define EXPR_CACHE_KEY_MAX 256
+
+typedef struct {
+    char key[EXPR_CACHE_KEY_MAX];
+    size_t key_len;
+    int angle_mode_deg;   /* folded constants depend on the angle mode */
+    unsigned hash;
+    bool used;
+    int chain;            /* next entry in the same bucket */
+    int prev;             /* LRU list, head = most recently used */
+    int next;
+    Instr* code;          /* owned; kept across evictions and reused */
+    size_t code_cap;
+    Program prog;
+} ExprCacheEntry;
+
+typedef struct {
+    ExprCacheEntry entries[EXPR_CACHE_CAP];
+    int buckets[EXPR_CACHE_BUCKETS];
+    int head;
+    int tail;
+    size_t count;
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+    uint64_t version;     /* of the symbol table the programs were compiled for */
+} ExprCache;
+
+void expr_cache_init(ExprCache* c);
+void expr_cache_free(ExprCache* c);
+
+/* Drops every entry but keeps the counters and the code buffers. */
+void expr_cache_clear(ExprCache* c);
+
+/* Clears the cache if version, the symbol table's func_version, is not the
+   one its programs were compiled for. */
+void expr_cache_sync(ExprCache* c, uint64_t version);
+
+/* Writes the cache key for an expression: lowercase, with whitespace removed
+   except where it separates two word characters or an e/p from a sign, so
+   inputs that lex differently never share a key. Returns the key length, or 0
+   when the expression is empty or too long to be cached. */
+size_t expr_cache_normalize(const char* expr, char* out, size_t out_cap);
+
+/* Returns the cached program for key, or NULL. Counts a hit or a miss. */
+const Program* expr_cache_get(ExprCache* c, const char* key, size_t key_len, int angle_mode_deg);
+
+/* Stores a copy of prog under key, evicting the least recently used entry when
+   the cache is full. */
+Status expr_cache_put(ExprCache* c, const char* key, size_t key_len, int angle_mode_deg, const Program* prog);
@@ -1,28 +1,396 @@
 #include "calc/format.h"
+#include "calc/bigint.h"
+#include "calc/format_tables.h"
 
-#include <math.h>
-#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 
-void format_double(double v, char* out, size_t out_cap) {
-    if (out_cap == 0) {
-        return;
+/* Longest output: "-1.2345678901234567e-308" */
+#define FORMAT_MAX_LEN 32
+
+/* Shortest mode switches to scientific notation from 10^17 on, where fixed
+   notation would need padding zeros beyond the 17 significant digits. */
+#define SHORTEST_FIXED_MAX 17
+#define G15_DIGITS 15
+
+typedef struct {
+    uint64_t digits;
+    int exp;   /* value = digits * 10^exp */
+} Decimal;
+
+/* ---- Ryu shortest digits (Adams, "Ryu: fast float-to-string conversion") ---- */
+
+#if defined(__SIZEOF_INT128__)
+/* (m * mul) >> j for a 125-bit table entry, with 64 < j < 128 */
+static uint64_t mul_shift64(uint64_t m, const uint64_t* mul, int j) {
+    __extension__ typedef unsigned __int128 u128;
+    u128 b0 = (u128)m * mul[0];
+    u128 b2 = (u128)m * mul[1];
+    return (uint64_t)(((b0 >> 64) + b2) >> (j - 64));
+}
+#else
+static uint64_t umul128(uint64_t a, uint64_t b, uint64_t* hi) {
+    uint64_t a_lo = (uint32_t)a;
+    uint64_t a_hi = a >> 32;
+    uint64_t b_lo = (uint32_t)b;
+    uint64_t b_hi = b >> 32;
+    uint64_t b00 = a_lo * b_lo;
+    uint64_t b01 = a_lo * b_hi;
+    uint64_t b10 = a_hi * b_lo;
+    uint64_t b11 = a_hi * b_hi;
+    uint64_t mid1 = b10 + (b00 >> 32);
+    uint64_t mid2 = b01 + (uint32_t)mid1;
+    *hi = b11 + (mid1 >> 32) + (mid2 >> 32);
+    return (mid2 << 32) | (uint32_t)b00;
+}
+
+static uint64_t mul_shift64(uint64_t m, const uint64_t* mul, int j) {
+    uint64_t high1;
+    uint64_t low1 = umul128(m, mul[1], &high1);
+    uint64_t high0;
+    (void)umul128(m, mul[0], &high0);
+    uint64_t sum = high0 + low1;
+    if (sum < high0) {
+        high1++;
     }
+    unsigned dist = (unsigned)(j - 64);
+    return (high1 << (64 - dist)) | (sum >> dist);
+}
+#endif
 
-    if (isnan(v)) {
-        snprintf(out, out_cap, "nan");
-        return;
+static int pow5bits(int e) {
+    return (int)(((uint32_t)e * 1217359u) >> 19) + 1;
+}
+
+static int log10_pow2(int e) {
+    return (int)(((uint32_t)e * 78913u) >> 18);
+}
+
+static int log10_pow5(int e) {
+    return (int)(((uint32_t)e * 732923u) >> 20);
+}
+
+static bool multiple_of_pow5(uint64_t v, int p) {
+    int n = 0;
+    while (v % 5 == 0) {
+        v /= 5;
+        n++;
     }
-    if (isinf(v)) {
-        snprintf(out, out_cap, (v > 0) ? "inf" : "-inf");
-        return;
+    return n >= p;
+}
+
+static bool multiple_of_pow2(uint64_t v, int p) {
+    return (v & ((UINT64_C(1) << p) - 1)) == 0;
+}
+
+static Decimal shortest(uint64_t ieee_mant, unsigned ieee_exp) {
+    int e2;
+    uint64_t m2;
+    if (ieee_exp == 0) {
+        e2 = 1 - 1023 - 52 - 2;
+        m2 = ieee_mant;
+    } else {
+        e2 = (int)ieee_exp - 1023 - 52 - 2;
+        m2 = (UINT64_C(1) << 52) | ieee_mant;
+    }
+    bool accept_bounds = (m2 & 1) == 0;
+
+    /* the interval of values that round to v is [mm, mp] around mv, all
+       scaled by 4 so the bounds are integers */
+    uint64_t mv = 4 * m2;
+    unsigned mm_shift = ieee_mant != 0 || ieee_exp <= 1;
+
+    uint64_t vr, vp, vm;
+    int e10;
+    bool vm_trailing_zeros = false;
+    bool vr_trailing_zeros = false;
+    if (e2 >= 0) {
+        int q = log10_pow2(e2) - (e2 > 3);
+        e10 = q;
+        int k = FORMAT_POW5_INV_BITCOUNT + pow5bits(q) - 1;
+        int i = -e2 + q + k;
+        vr = mul_shift64(4 * m2, k_format_pow5_inv[q], i);
+        vp = mul_shift64(4 * m2 + 2, k_format_pow5_inv[q], i);
+        vm = mul_shift64(4 * m2 - 1 - mm_shift, k_format_pow5_inv[q], i);
+        if (q <= 21) {
+            if (mv % 5 == 0) {
+                vr_trailing_zeros = multiple_of_pow5(mv, q);
+            } else if (accept_bounds) {
+                vm_trailing_zeros = multiple_of_pow5(mv - 1 - mm_shift, q);
+            } else {
+                vp -= multiple_of_pow5(mv + 2, q);
+            }
+        }
+    } else {
+        int q = log10_pow5(-e2) - (-e2 > 1);
+        e10 = q + e2;
+        int i = -e2 - q;
+        int k = pow5bits(i) - FORMAT_POW5_BITCOUNT;
+        int j = q - k;
+        vr = mul_shift64(4 * m2, k_format_pow5[i], j);
+        vp = mul_shift64(4 * m2 + 2, k_format_pow5[i], j);
+        vm = mul_shift64(4 * m2 - 1 - mm_shift, k_format_pow5[i], j);
+        if (q <= 1) {
+            vr_trailing_zeros = true;
+            if (accept_bounds) {
+                vm_trailing_zeros = mm_shift == 1;
+            } else {
+                vp--;
+            }
+        } else if (q < 63) {
+            vr_trailing_zeros = multiple_of_pow2(mv, q);
+        }
+    }
+
+    /* drop digits while the interval still contains a shorter number */
+    int removed = 0;
+    unsigned last = 0;
+    uint64_t output;
+    if (vm_trailing_zeros || vr_trailing_zeros) {
+        while (vp / 10 > vm / 10) {
+            vm_trailing_zeros &= vm % 10 == 0;
+            vr_trailing_zeros &= last == 0;
+            last = (unsigned)(vr % 10);
+            vr /= 10;
+            vp /= 10;
+            vm /= 10;
+            removed++;
+        }
+        if (vm_trailing_zeros) {
+            while (vm % 10 == 0) {
+                vr_trailing_zeros &= last == 0;
+                last = (unsigned)(vr % 10);
+                vr /= 10;
+                vp /= 10;
+                vm /= 10;
+                removed++;
+            }
+        }
+        if (vr_trailing_zeros && last == 5 && vr % 2 == 0) {
+            last = 4;   /* exact tie, round to even */
+        }
+        output = vr + ((vr == vm && (!accept_bounds || !vm_trailing_zeros)) || last >= 5);
+    } else {
+        bool round_up = false;
+        while (vp / 10 > vm / 10) {
+            round_up = vr % 10 >= 5;
+            vr /= 10;
+            vp /= 10;
+            vm /= 10;
+            removed++;
+        }
+        output = vr + (vr == vm || round_up);
+    }
+
+    Decimal d = { .digits = output, .exp = e10 + removed };
+    return d;
+}
+
+/* ---- %.15g digits ---- */
+
+static int digit_count(uint64_t v) {
+    int n = 1;
+    while (v >= 10) {
+        v /= 10;
+        n++;
     }
+    return n;
+}
 
-    /* 15 sig digits ~= double precision without noisy tails */
-    snprintf(out, out_cap, "%.15g", v);
+static uint64_t pow10_u64(int n) {
+    uint64_t p = 1;
+    while (n-- > 0) {
+        p *= 10;
+    }
+    return p;
+}
 
-    /* normalize -0 */
-    if (strcmp(out, "-0") == 0 || strcmp(out, "-0.0") == 0) {
-        snprintf(out, out_cap, "0");
+/* m * 2^e2 * 10^k rounded to the nearest integer, ties to even */
+static uint64_t scaled_round(uint64_t m, int e2, int k) {
+    BigInt num;
+    BigInt den;
+    bigint_set_u64(&num, m);
+    bigint_set_u64(&den, 1);
+    if (k >= 0) {
+        bigint_mul_pow5(&num, (unsigned)k);
+    } else {
+        bigint_mul_pow5(&den, (unsigned)-k);
+    }
+    if (e2 + k >= 0) {
+        bigint_shl(&num, (unsigned)(e2 + k));
+    } else {
+        bigint_shl(&den, (unsigned)-(e2 + k));
+    }
+    uint64_t q = bigint_divmod(&num, &den);
+    bigint_shl(&num, 1);
+    int c = bigint_cmp(&num, &den);
+    if (c > 0 || (c == 0 && (q & 1))) {
+        q++;
+    }
+    return q;
+}
+
+/* Rounds v to G15_DIGITS significant digits the way printf does: from the
+   exact binary value, not from the shortest digits. For normal numbers, up to
+   15 shortest digits are already the answer (DBL_DIG is 15), and 16 or 17 are
+   within half an ulp (under 11.1 units of the 17th digit) of v, so rounding
+   them is right unless the discarded tail is that close to a half. Subnormals
+   have less precision and always take the exact path. */
+static Decimal round_g15(Decimal d, uint64_t ieee_mant, unsigned ieee_exp) {
+    int n = digit_count(d.digits);
+    if (ieee_exp != 0) {
+        if (n <= G15_DIGITS) {
+            return d;
+        }
+        uint64_t div = pow10_u64(n - G15_DIGITS);
+        uint64_t tail = (d.digits % div) * pow10_u64(17 - n);
+        uint64_t half = 50;
+        if (tail > half + 11 || tail + 11 < half) {
+            Decimal r = { .digits = d.digits / div + (tail > half), .exp = d.exp + n - G15_DIGITS };
+            return r;
+        }
+    }
+
+    uint64_t m = ieee_exp == 0 ? ieee_mant : ieee_mant | (UINT64_C(1) << 52);
+    int e2 = ieee_exp == 0 ? -1074 : (int)ieee_exp - 1075;
+    int x = d.exp + n - 1;   /* decimal exponent of the leading digit */
+    const uint64_t lo = pow10_u64(G15_DIGITS - 1);
+    for (;;) {
+        uint64_t q = scaled_round(m, e2, G15_DIGITS - 1 - x);
+        if (q < lo) {
+            x--;
+        } else if (q > lo * 10) {
+            x++;
+        } else {
+            Decimal r = { .digits = q, .exp = x - (G15_DIGITS - 1) };
+            return r;
+        }
+    }
+}
+
+/* ---- layout ---- */
+
+/* Writes digits in fixed notation when -4 <= exponent < fixed_max, like %g,
+   and as d.ddde+XX otherwise. */
+static size_t write_decimal(char* out, Decimal d, int fixed_max) {
+    char buf[20];
+    int n = 0;
+    while (d.digits % 10 == 0 && d.digits != 0) {
+        d.digits /= 10;
+        d.exp++;
+    }
+    for (uint64_t v = d.digits; n == 0 || v != 0; v /= 10) {
+        buf[n++] = (char)('0' + v % 10);
+    }
+    char digits[20];
+    for (int i = 0; i < n; i++) {
+        digits[i] = buf[n - 1 - i];
+    }
+
+    int x = d.exp + n - 1;
+    char* p = out;
+    if (x >= -4 && x < fixed_max) {
+        if (x < 0) {
+            *p++ = '0';
+            *p++ = '.';
+            for (int i = 0; i < -x - 1; i++) {
+                *p++ = '0';
+            }
+            memcpy(p, digits, (size_t)n);
+            p += n;
+        } else if (n <= x + 1) {
+            memcpy(p, digits, (size_t)n);
+            p += n;
+            for (int i = n; i <= x; i++) {
+                *p++ = '0';
+            }
+        } else {
+            memcpy(p, digits, (size_t)x + 1);
+            p += x + 1;
+            *p++ = '.';
+            memcpy(p, digits + x + 1, (size_t)(n - x - 1));
+            p += n - x - 1;
+        }
+        return (size_t)(p - out);
+    }
+
+    *p++ = digits[0];
+    if (n > 1) {
+        *p++ = '.';
+        memcpy(p, digits + 1, (size_t)n - 1);
+        p += n - 1;
+    }
+    *p++ = 'e';
+    *p++ = x < 0 ? '-' : '+';
+    int ax = x < 0 ? -x : x;
+    if (ax >= 100) {
+        *p++ = (char)('0' + ax / 100);
+    }
+    *p++ = (char)('0' + ax / 10 % 10);
+    *p++ = (char)('0' + ax % 10);
+    return (size_t)(p - out);
+}
+
+size_t format_double(double v, FormatMode mode, char* out, size_t out_cap) {
+    if (out_cap == 0) {
+        return 0;
+    }
+
+    uint64_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    bool neg = (bits >> 63) != 0;
+    unsigned ieee_exp = (unsigned)(bits >> 52) & 0x7ff;
+    uint64_t ieee_mant = bits & ((UINT64_C(1) << 52) - 1);
+
+    char buf[FORMAT_MAX_LEN];
+    size_t len = 0;
+    if (ieee_exp == 0x7ff) {
+        const char* s = ieee_mant != 0 ? "nan" : neg ? "-inf" : "inf";
+        len = strlen(s);
+        memcpy(buf, s, len);
+    } else if (ieee_exp == 0 && ieee_mant == 0) {
+        buf[len++] = '0';   /* -0 prints as 0 */
+    } else {
+        if (neg) {
+            buf[len++] = '-';
+        }
+        Decimal d = shortest(ieee_mant, ieee_exp);
+        if (mode == FORMAT_G15) {
+            len += write_decimal(buf + len, round_g15(d, ieee_mant, ieee_exp), G15_DIGITS);
+        } else {
+            len += write_decimal(buf + len, d, SHORTEST_FIXED_MAX);
+        }
+    }
+
+    if (len >= out_cap) {
+        len = out_cap - 1;
+    }
+    memcpy(out, buf, len);
+    out[len] = '\0';
+    return len;
+}
+
+size_t format_int64(int64_t v, char* out, size_t out_cap) {
+    if (out_cap == 0) {
+        return 0;
+    }
+    char buf[FORMAT_MAX_LEN];
+    size_t len = sizeof(buf);
+    /* digits from the right, on the magnitude as uint64_t so INT64_MIN works */
+    uint64_t m = v < 0 ? 0 - (uint64_t)v : (uint64_t)v;
+    do {
+        buf[--len] = (char)('0' + m % 10);
+        m /= 10;
+    } while (m != 0);
+    if (v < 0) {
+        buf[--len] = '-';
+    }
+    size_t n = sizeof(buf) - len;
+    if (n >= out_cap) {
+        n = out_cap - 1;
     }
+    memcpy(out, buf + len, n);
+    out[n] = '\0';
+    return n;
 }
@@ -1,5 +1,17 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdint.h>
 
-void format_double(double v, char* out, size_t out_cap);
+typedef enum {
+    FORMAT_SHORTEST,   /* fewest digits that read back as the same double */
+    FORMAT_G15,        /* same text as printf("%.15g") */
+} FormatMode;
+
+/* Writes v into out without going through stdio, truncating to out_cap - 1
+   characters. Both modes print fixed notation for moderate exponents and
+   d.ddde+XX otherwise; -0 prints as "0". Returns the length written. */
+size_t format_double(double v, FormatMode mode, char* out, size_t out_cap);
+
+/* Writes every digit of v, whatever the mode: for exact integer results. */
+size_t format_int64(int64_t v, char* out, size_t out_cap);
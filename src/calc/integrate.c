@@ -0,0 +1,296 @@
+#include "calc/integrate.h"
+
+#include "calc/batch.h"
+
+#include <math.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Kronrod nodes on [0, 1] from the outside in; the odd ones are the 7-point
+   Gauss nodes. Values from QUADPACK's qk15. */
+static const double gk_x[8] = {
+    0.991455371120812639206854697526329, 0.949107912342758524526189684047851,
+    0.864864423359769072789712788640926, 0.741531185599394439863864773280788,
+    0.586087235467691130294144845693013, 0.405845151377397166906606412076961,
+    0.207784955007898467600689403773245, 0.000000000000000000000000000000000,
+};
+static const double gk_w[8] = {
+    0.022935322010529224963732008058970, 0.063092092629978553290700663189204,
+    0.104790010322250183839876322541518, 0.140653259715525918745189590510238,
+    0.169004726639267902826583426598550, 0.190350578064785409913256402421014,
+    0.204432940075298892414161999234649, 0.209482141084727828012999174891714,
+};
+static const double g_w[4] = {
+    0.129484966168869693270611432679082, 0.279705391489276667901467771423780,
+    0.381830050505118944950369775488975, 0.417959183673469387755102040816327,
+};
+
+typedef struct {
+    double a;
+    double b;
+    unsigned depth;
+} IntegrateTask;
+
+typedef struct {
+    double a;
+    double value;
+    double error;
+} IntegratePiece;
+
+/* Written only by its own worker. */
+typedef struct {
+    IntegratePiece* pieces;
+    size_t len;
+    size_t cap;
+    size_t evaluations;
+    bool truncated;
+    Status failure;
+    double failure_at;
+} IntegrateWorker;
+
+typedef struct {
+    const EvalContext* ctx;
+    BatchPlan plan;
+    const char* var;
+    double width;            /* of the whole range */
+    double tol;
+    IntegrateWorker* workers;
+    size_t worker_count;
+    atomic_size_t splits;
+    _Atomic double fail_at;  /* leftmost failure so far; INFINITY for none */
+} IntegrateJob;
+
+/* The 15-point Kronrod estimate over [a, b], and its distance to the 7-point
+   Gauss estimate as the error. */
+static Status gauss_kronrod(IntegrateJob* job, IntegrateWorker* w, double a, double b, double* value, double* error) {
+    double c = 0.5 * (a + b);
+    double h = 0.5 * (b - a);
+    double x[15], f[15];
+    uint8_t err[15];
+    for (size_t i = 0; i < 7; i++) {
+        x[2 * i] = c - h * gk_x[i];
+        x[2 * i + 1] = c + h * gk_x[i];
+    }
+    x[14] = c;
+    BatchInput input = { job->var, x };
+    BatchReport report;
+    Status st = batch_plan_run(&job->plan, job->ctx, &input, 1, 15, f, err, &report);
+    w->evaluations += 15;
+    if (!st.ok) {
+        return st;
+    }
+    for (size_t i = 0; i < 15; i++) {
+        if (err[i] != 0) {
+            return status_err(batch_error_message(&report, err[i]));
+        }
+    }
+
+    double k = gk_w[7] * f[14];
+    double g = g_w[3] * f[14];
+    for (size_t i = 0; i < 7; i++) {
+        double pair = f[2 * i] + f[2 * i + 1];
+        k += gk_w[i] * pair;
+        if (i % 2 == 1) {
+            g += g_w[i / 2] * pair;
+        }
+    }
+    *value = k * h;
+    *error = fabs((k - g) * h);
+    return status_ok();
+}
+
+/* Intervals right of a failure are skipped: they cannot fail further left.
+   Every interval left of it is still visited, so the leftmost failure does
+   not depend on timing. */
+static void fail(IntegrateJob* job, IntegrateWorker* w, Status st, double at) {
+    if (w->failure.ok || at < w->failure_at) {
+        w->failure = st;
+        w->failure_at = at;
+    }
+    double seen = atomic_load(&job->fail_at);
+    while (at < seen && !atomic_compare_exchange_weak(&job->fail_at, &seen, at)) {
+    }
+}
+
+static void keep(IntegrateJob* job, IntegrateWorker* w, double a, double value, double error) {
+    if (w->len == w->cap) {
+        size_t cap = w->cap ? w->cap * 2 : 64;
+        IntegratePiece* grown = realloc(w->pieces, cap * sizeof(IntegratePiece));
+        if (grown == NULL) {
+            fail(job, w, status_err("error: out of memory"), a);
+            return;
+        }
+        w->pieces = grown;
+        w->cap = cap;
+    }
+    w->pieces[w->len++] = (IntegratePiece){ a, value, error };
+}
+
+static void integrate_task(void* p, ThreadPoolTasks* tasks, size_t worker, const void* item) {
+    IntegrateJob* job = p;
+    IntegrateWorker* w = &job->workers[worker];
+    IntegrateTask t;
+    memcpy(&t, item, sizeof(t));
+    if (t.a > atomic_load(&job->fail_at)) {
+        return;
+    }
+    double value = 0.0, error = 0.0;
+    Status st = gauss_kronrod(job, w, t.a, t.b, &value, &error);
+    if (!st.ok) {
+        fail(job, w, st, t.a);
+        return;
+    }
+    if (error <= job->tol * ((t.b - t.a) / job->width)) {
+        keep(job, w, t.a, value, error);
+        return;
+    }
+    double mid = 0.5 * (t.a + t.b);
+    bool splittable = t.a < mid && mid < t.b && t.depth < INTEGRATE_MAX_DEPTH &&
+                      atomic_fetch_add(&job->splits, 1) < INTEGRATE_MAX_SPLITS;
+    if (!splittable) {
+        w->truncated = true;
+        keep(job, w, t.a, value, error);
+        return;
+    }
+    IntegrateTask left = { t.a, mid, t.depth + 1 };
+    IntegrateTask right = { mid, t.b, t.depth + 1 };
+    thread_pool_push_task(tasks, worker, &right);
+    thread_pool_push_task(tasks, worker, &left);
+}
+
+/* Bisects [a, b] from its halves on pool, with every worker's pieces and
+   counts cleared. */
+static Status run_halves(IntegrateJob* job, ThreadPool* pool, double a, double b, ThreadPoolTaskStats* ts) {
+    for (size_t i = 0; i < job->worker_count; i++) {
+        IntegrateWorker* w = &job->workers[i];
+        w->len = 0;
+        w->evaluations = 0;
+        w->truncated = false;
+        w->failure = status_ok();
+    }
+    atomic_store(&job->splits, 0);
+    atomic_store(&job->fail_at, INFINITY);
+    double mid = 0.5 * (a + b);
+    IntegrateTask halves[2] = { { a, mid, 1 }, { mid, b, 1 } };
+    return thread_pool_run_tasks(pool, integrate_task, job, halves, 2, sizeof(IntegrateTask), ts);
+}
+
+static int piece_cmp(const void* pa, const void* pb) {
+    double a = ((const IntegratePiece*)pa)->a;
+    double b = ((const IntegratePiece*)pb)->a;
+    return (a > b) - (a < b);
+}
+
+Status integrate_run(const Ast* ast, const EvalContext* ctx, ThreadPool* pool, double a, double b,
+                     IntegrateResult* out) {
+    memset(out, 0, sizeof(*out));
+    out->converged = true;
+    if (ast->input_count != 1) {
+        return status_err("error: integrate needs exactly one variable");
+    }
+    if (!isfinite(a) || !isfinite(b) || !isfinite(b - a)) {
+        return status_err("error: integration bounds must be finite");
+    }
+    if (a == b) {
+        return status_ok();
+    }
+    double sign = 1.0;
+    if (a > b) {
+        double tmp = a;
+        a = b;
+        b = tmp;
+        sign = -1.0;
+    }
+
+    IntegrateJob job;
+    job.ctx = ctx;
+    job.var = ast->inputs[0];
+    job.width = b - a;
+    atomic_init(&job.splits, 0);
+    atomic_init(&job.fail_at, INFINITY);
+    size_t nworkers = pool != NULL ? pool->count : 1;
+    job.worker_count = nworkers;
+    job.workers = calloc(nworkers, sizeof(IntegrateWorker));
+    if (job.workers == NULL) {
+        return status_err("error: out of memory");
+    }
+    for (size_t i = 0; i < nworkers; i++) {
+        job.workers[i].failure = status_ok();
+    }
+    Status st = batch_plan_init(&job.plan, ast, BATCH_ISA_AUTO);
+    if (!st.ok) {
+        free(job.workers);
+        return st;
+    }
+
+    /* the whole range first: it sets the tolerance, and is often enough */
+    double value = 0.0, error = 0.0;
+    st = gauss_kronrod(&job, &job.workers[0], a, b, &value, &error);
+    job.tol = fmax(INTEGRATE_ABS_TOL, INTEGRATE_REL_TOL * fabs(value));
+    size_t root_evaluations = job.workers[0].evaluations;
+    ThreadPoolTaskStats ts = { 0, 0, 1 };
+    if (st.ok && error <= job.tol) {
+        keep(&job, &job.workers[0], a, value, error);
+        root_evaluations = 0;
+    } else if (st.ok) {
+        st = run_halves(&job, pool, a, b, &ts);
+        /* which intervals got the last of the split budget depended on
+           timing; the calling thread spends it in a fixed order */
+        if (st.ok && pool != NULL && atomic_load(&job.splits) >= INTEGRATE_MAX_SPLITS) {
+            st = run_halves(&job, NULL, a, b, &ts);
+        }
+    }
+
+    out->evaluations = root_evaluations;
+    size_t total = 0;
+    const IntegrateWorker* first = NULL;   /* the leftmost failure, whichever worker found it */
+    for (size_t i = 0; i < nworkers; i++) {
+        const IntegrateWorker* w = &job.workers[i];
+        if (!w->failure.ok && (first == NULL || w->failure_at < first->failure_at)) {
+            first = w;
+        }
+        total += w->len;
+        out->evaluations += w->evaluations;
+        out->converged = out->converged && !w->truncated;
+    }
+    if (st.ok && first != NULL) {
+        st = first->failure;
+    }
+
+    IntegratePiece* all = st.ok ? malloc((total ? total : 1) * sizeof(IntegratePiece)) : NULL;
+    if (st.ok && all == NULL) {
+        st = status_err("error: out of memory");
+    }
+    if (st.ok) {
+        size_t n = 0;
+        for (size_t i = 0; i < nworkers; i++) {
+            if (job.workers[i].len > 0) {
+                memcpy(all + n, job.workers[i].pieces, job.workers[i].len * sizeof(IntegratePiece));
+                n += job.workers[i].len;
+            }
+        }
+        qsort(all, n, sizeof(IntegratePiece), piece_cmp);
+        for (size_t i = 0; i < n; i++) {
+            out->value += all[i].value;
+            out->error += all[i].error;
+        }
+        out->value *= sign;
+        /* intervals cut short still count when their errors fit the budget */
+        out->converged = out->converged || out->error <= job.tol;
+        out->intervals = n;
+        out->steals = ts.steals;
+        out->threads = ts.threads;
+        if (!isfinite(out->value)) {
+            st = status_err("error: non-finite result");
+        }
+    }
+
+    free(all);
+    for (size_t i = 0; i < nworkers; i++) {
+        free(job.workers[i].pieces);
+    }
+    free(job.workers);
+    batch_plan_free(&job.plan);
+    return st;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "util/status.h"
+#include "util/thread_pool.h"
+#include "calc/parser.h"
+#include "calc/eval.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* An interval is accepted once its error estimate is within its share
+   (by width) of max(INTEGRATE_ABS_TOL, INTEGRATE_REL_TOL * |estimate over
+   the whole range|). */
+#define INTEGRATE_ABS_TOL 1e-12
+#define INTEGRATE_REL_TOL 1e-10
+
+/* Limits on bisection; past them intervals are accepted as they are, and
+   the result is reported as not converged unless the summed error still
+   meets the tolerance. A run on a pool that uses up the split budget is
+   redone on the calling thread, where the budget goes to intervals in a
+   fixed order. */
+#define INTEGRATE_MAX_DEPTH 40
+#define INTEGRATE_MAX_SPLITS 100000
+
+typedef struct {
+    double value;
+    double error;          /* estimated absolute error, summed over intervals */
+    size_t evaluations;    /* of the integrand */
+    size_t intervals;      /* accepted */
+    size_t steals;         /* intervals a worker took from another */
+    size_t threads;
+    bool converged;        /* error within tolerance */
+} IntegrateResult;
+
+/* Integrates ast, whose only input is the variable, from a to b with
+   adaptive 7/15-point Gauss-Kronrod quadrature. An interval whose estimate
+   is not good enough is bisected and the halves are queued on the pool's
+   work-stealing deques, so busy regions spread over every worker. The
+   integrand is compiled once to a batch plan that evaluates all 15 nodes of
+   an interval together. Pieces are summed in order of position, so the
+   result (value, error, counts, or the failure) is the same as with pool
+   NULL, which integrates on the calling thread. Fails with the integrand's
+   error at the leftmost interval where it failed. */
+Status integrate_run(const Ast* ast, const EvalContext* ctx, ThreadPool* pool, double a, double b,
+                     IntegrateResult* out);
@@ -1,8 +1,7 @@
 #include "calc/lexer.h"
+#include "calc/number.h"
 
 #include <ctype.h>
-#include <errno.h>
-#include <stdlib.h>
 #include <string.h>
 
 static bool is_ident_start(char c) {
@@ -13,17 +12,31 @@ static bool is_ident_char(char c) {
     return isalnum((unsigned char)c) || c == '_';
 }
 
-static Status push_token(Token* out, size_t out_cap, size_t* out_len, Token t) {
-    if (*out_len >= out_cap) {
-        return status_err("error: token buffer overflow");
+typedef struct {
+    Token* data;
+    size_t cap;
+    size_t len;
+    Arena* arena;   /* NULL: fixed caller buffer */
+} TokenBuf;
+
+static Status push_token(TokenBuf* b, Token t) {
+    if (b->len >= b->cap) {
+        if (b->arena == NULL) {
+            return status_err("error: token buffer overflow");
+        }
+        size_t cap = b->cap ? b->cap * 2 : 64;
+        Token* data = arena_grow(b->arena, b->data, b->cap * sizeof(Token), cap * sizeof(Token));
+        if (data == NULL) {
+            return status_err("error: out of memory");
+        }
+        b->data = data;
+        b->cap = cap;
     }
-    out[*out_len] = t;
-    (*out_len)++;
+    b->data[b->len++] = t;
     return status_ok();
 }
 
-Status lexer_tokenize(const char* input, Token* out, size_t out_cap, size_t* out_len) {
-    *out_len = 0;
+static Status tokenize(const char* input, TokenBuf* out) {
     const char* p = input;
 
     while (*p) {
@@ -49,19 +62,12 @@ Status lexer_tokenize(const char* input, Token* out, size_t out_cap, size_t* out
             case ',': t.kind = TOK_COMMA; t.len = 1; p++; break;
             default: {
                 if (isdigit((unsigned char)*p) || *p == '.') {
-                    errno = 0;
-                    char* endptr = NULL;
-                    double v = strtod(p, &endptr);
-                    if (endptr == p) {
-                        return status_err("error: invalid number");
-                    }
-                    if (errno == ERANGE) {
-                        return status_err("error: number out of range");
+                    Status st = number_parse(p, &t.len, &t.number);
+                    if (!st.ok) {
+                        return st;
                     }
                     t.kind = TOK_NUMBER;
-                    t.number = v;
-                    t.len = (size_t)(endptr - p);
-                    p = endptr;
+                    p += t.len;
                     break;
                 }
                 if (is_ident_start(*p)) {
@@ -79,7 +85,7 @@ Status lexer_tokenize(const char* input, Token* out, size_t out_cap, size_t* out
             }
         }
 
-        Status st = push_token(out, out_cap, out_len, t);
+        Status st = push_token(out, t);
         if (!st.ok) {
             return st;
         }
@@ -90,5 +96,20 @@ Status lexer_tokenize(const char* input, Token* out, size_t out_cap, size_t* out
     end.kind = TOK_END;
     end.start = p;
     end.len = 0;
-    return push_token(out, out_cap, out_len, end);
+    return push_token(out, end);
+}
+
+Status lexer_tokenize(const char* input, Token* out, size_t out_cap, size_t* out_len) {
+    TokenBuf b = { .data = out, .cap = out_cap, .len = 0, .arena = NULL };
+    Status st = tokenize(input, &b);
+    *out_len = b.len;
+    return st;
+}
+
+Status lexer_tokenize_arena(const char* input, Arena* arena, Token** out, size_t* out_len) {
+    TokenBuf b = { .data = NULL, .cap = 0, .len = 0, .arena = arena };
+    Status st = tokenize(input, &b);
+    *out = b.data;
+    *out_len = b.len;
+    return st;
 }
@@ -2,7 +2,12 @@
 
 #include "util/status.h"
 #include "calc/tokens.h"
+#include "util/arena.h"
 
 #include <stddef.h>
 
 Status lexer_tokenize(const char* input, Token* out, size_t out_cap, size_t* out_len);
+
+/* Like lexer_tokenize, but the token array is allocated in arena and grows as
+   needed, so input length is not limited. */
+Status lexer_tokenize_arena(const char* input, Arena* arena, Token** out, size_t* out_len);
@@ -0,0 +1,181 @@
+#define _POSIX_C_SOURCE 199309L
+
+#include "calc/montecarlo.h"
+
+#include "calc/batch.h"
+#include "calc/rng.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Samples evaluated by one batch run. */
+#define MONTECARLO_BLOCK 2048
+
+/* Count, mean and sum of squared deviations from the mean. */
+typedef struct {
+    size_t n;
+    double mean;
+    double m2;
+} Moments;
+
+typedef struct {
+    Moments moments;
+    Status failure;          /* at the lowest failing sample of the part */
+} McPart;
+
+typedef struct {
+    const EvalContext* ctx;
+    BatchPlan plan;
+    uint64_t seed;
+    size_t samples;
+    size_t part_count;
+    McPart* parts;
+} McJob;
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+/* Chan, Golub and LeVeque's pairwise update: exact in the mean and m2 of the
+   union, without the cancellation of a running sum of squares. */
+static void merge(Moments* a, const Moments* b) {
+    if (b->n == 0) {
+        return;
+    }
+    double na = (double)a->n, nb = (double)b->n, n = na + nb;
+    double delta = b->mean - a->mean;
+    a->mean += delta * (nb / n);
+    a->m2 += b->m2 + delta * delta * (na * nb / n);
+    a->n += b->n;
+}
+
+/* Two passes over one block: the mean first, then deviations from it. */
+static Moments block_moments(const double* ys, size_t n) {
+    double s[4] = { 0.0, 0.0, 0.0, 0.0 };
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        s[0] += ys[i];
+        s[1] += ys[i + 1];
+        s[2] += ys[i + 2];
+        s[3] += ys[i + 3];
+    }
+    for (; i < n; i++) s[0] += ys[i];
+    double mean = ((s[0] + s[1]) + (s[2] + s[3])) / (double)n;
+    double q[4] = { 0.0, 0.0, 0.0, 0.0 };
+    for (i = 0; i + 4 <= n; i += 4) {
+        for (size_t k = 0; k < 4; k++) {
+            double d = ys[i + k] - mean;
+            q[k] += d * d;
+        }
+    }
+    for (; i < n; i++) q[0] += (ys[i] - mean) * (ys[i] - mean);
+    return (Moments){ n, mean, (q[0] + q[1]) + (q[2] + q[3]) };
+}
+
+static void mc_worker(void* p, size_t worker) {
+    McJob* job = p;
+    McPart* part = &job->parts[worker];
+    size_t lo = job->samples * worker / job->part_count;
+    size_t hi = job->samples * (worker + 1) / job->part_count;
+
+    Rng rng;
+    rng_seed(&rng, job->seed, worker);
+    EvalContext ctx = *job->ctx;
+    ctx.rng = &rng;
+    double* ys = malloc(MONTECARLO_BLOCK * sizeof(double));
+    uint8_t* err = malloc(MONTECARLO_BLOCK);
+    if (ys == NULL || err == NULL) {
+        part->failure = status_err("error: out of memory");
+    }
+    for (size_t base = lo; part->failure.ok && base < hi; base += MONTECARLO_BLOCK) {
+        size_t n = hi - base < MONTECARLO_BLOCK ? hi - base : MONTECARLO_BLOCK;
+        BatchReport rep;
+        Status st = batch_plan_run(&job->plan, &ctx, NULL, 0, n, ys, err, &rep);
+        if (!st.ok) {
+            part->failure = st;
+            break;
+        }
+        if (rep.errors > 0) {
+            for (size_t i = 0; i < n; i++) {
+                if (err[i] != 0) {
+                    part->failure = status_err(batch_error_message(&rep, err[i]));
+                    break;
+                }
+            }
+            break;
+        }
+        Moments m = block_moments(ys, n);
+        merge(&part->moments, &m);
+    }
+    free(ys);
+    free(err);
+}
+
+Status montecarlo_run(const Ast* ast, const EvalContext* ctx, ThreadPool* pool, double samples, uint64_t seed,
+                      MonteCarloResult* out) {
+    double t0 = now_sec();
+    memset(out, 0, sizeof(*out));
+    out->threads = 1;
+    if (ast->input_count != 0) {
+        return status_err("error: mc expression cannot have variables");
+    }
+    if (!isfinite(samples) || floor(samples) != samples || samples < 2.0) {
+        return status_err("error: mc needs a whole number of at least 2 samples");
+    }
+    if (samples > MONTECARLO_MAX_SAMPLES) {
+        return status_err("error: mc has too many samples");
+    }
+
+    McJob job;
+    job.ctx = ctx;
+    job.seed = seed;
+    job.samples = (size_t)samples;
+    job.part_count = pool != NULL ? pool->count : 1;
+    job.parts = malloc(job.part_count * sizeof(McPart));
+    if (job.parts == NULL) {
+        return status_err("error: out of memory");
+    }
+    for (size_t w = 0; w < job.part_count; w++) {
+        job.parts[w].moments = (Moments){ 0, 0.0, 0.0 };
+        job.parts[w].failure = status_ok();
+    }
+    Status st = batch_plan_init(&job.plan, ast, BATCH_ISA_AUTO);
+    if (!st.ok) {
+        free(job.parts);
+        return st;
+    }
+
+    if (pool != NULL) {
+        thread_pool_start(pool, mc_worker, &job);
+        thread_pool_wait(pool);
+    } else {
+        mc_worker(&job, 0);
+    }
+    out->threads = job.part_count;
+
+    /* parts cover increasing sample ranges, so the first failure is the
+       lowest failing sample */
+    Moments total = { 0, 0.0, 0.0 };
+    for (size_t w = 0; w < job.part_count && st.ok; w++) {
+        st = job.parts[w].failure;
+        merge(&total, &job.parts[w].moments);
+    }
+    if (st.ok) {
+        out->mean = total.mean;
+        out->variance = total.m2 / (double)(total.n - 1);
+        out->half_width = MONTECARLO_Z95 * sqrt(out->variance / (double)total.n);
+        out->samples = total.n;
+        if (!isfinite(out->mean) || !isfinite(out->variance)) {
+            st = status_err("error: non-finite result");
+        }
+    }
+    out->seconds = now_sec() - t0;
+
+    batch_plan_free(&job.plan);
+    free(job.parts);
+    return st;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "util/status.h"
+#include "util/thread_pool.h"
+#include "calc/parser.h"
+#include "calc/eval.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MONTECARLO_MAX_SAMPLES 1e10
+
+/* Two-sided 95% quantile of the standard normal. */
+#define MONTECARLO_Z95 1.959963984540054
+
+typedef struct {
+    double mean;
+    double variance;       /* unbiased sample variance */
+    double half_width;     /* 95% confidence interval is mean +- half_width */
+    size_t samples;
+    size_t threads;
+    double seconds;
+} MonteCarloResult;
+
+/* Evaluates ast, which has no inputs, samples times and summarizes the
+   values. The expression is compiled once to a batch plan, so rand and randn
+   come from the bulk generator. Worker w of n takes samples w * N / n up to
+   (w + 1) * N / n with random stream w of seed and its own EvalContext; the
+   partial means and sums of squared deviations are merged in worker order
+   (Chan et al.), so the result depends only on the seed and the thread
+   count. pool NULL runs one stream on the calling thread.
+   Fails with the expression's error at the lowest failing sample. */
+Status montecarlo_run(const Ast* ast, const EvalContext* ctx, ThreadPool* pool, double samples, uint64_t seed,
+                      MonteCarloResult* out);
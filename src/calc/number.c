@@ -0,0 +1,360 @@
+#include "calc/number.h"
+#include "calc/bigint.h"
+
+#include <float.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/* Significant decimal digits kept before the rest collapses into a sticky
+   digit. The exact decimal expansion of a halfway point between two doubles
+   has at most 767 significant digits, so 800 plus a sticky '1' never changes
+   which side of a halfway point the value falls on. */
+#define NUMBER_MAX_DIGITS 800
+
+/* Exponents are clamped here; anything beyond is far out of range anyway. */
+#define NUMBER_EXP_CLAMP 100000
+
+static const double k_pow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static bool is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+/* ---- rounding ---- */
+
+static unsigned leading_zeros64(uint64_t v) {
+    unsigned n = 0;
+    while (!(v & (UINT64_C(1) << 63))) {
+        v <<= 1;
+        n++;
+    }
+    return n;
+}
+
+static double from_bits(uint64_t bits) {
+    double d;
+    memcpy(&d, &bits, sizeof(d));
+    return d;
+}
+
+/* Rounds (m + f) * 2^e2 to nearest-even, where 0 <= f < 1 and f != 0 iff
+   sticky. Flags overflow, and underflow when the result is inexact and tiny
+   after rounding, the way glibc's strtod reports ERANGE. With hex, a
+   subnormal result is rounded the way glibc rounds hex literals: from the
+   leading 53 bits and whether any bit past the 54th is set, dropping the
+   54th itself (only tininess still sees it). */
+static double round_to_double(uint64_t m, bool sticky, int e2, bool hex, bool* range) {
+    unsigned lz = leading_zeros64(m);
+    m <<= lz;
+    int e = e2 - (int)lz + 63;   /* value is in [2^e, 2^(e+1)) */
+    if (e > DBL_MAX_EXP - 1) {
+        *range = true;
+        return from_bits(UINT64_C(0x7ff0000000000000));
+    }
+
+    unsigned shift = 11;
+    if (e < DBL_MIN_EXP - 1) {
+        int extra = (DBL_MIN_EXP - 1) - e;
+        if (extra > 53) {
+            *range = true;   /* below half the smallest subnormal */
+            return 0.0;
+        }
+        shift += (unsigned)extra;
+    }
+    uint64_t full = m;
+    if (hex && shift > 11) {
+        m &= ~(UINT64_C(1) << 10);
+    }
+
+    uint64_t mant;
+    uint64_t rem;
+    uint64_t half;
+    if (shift < 64) {
+        mant = m >> shift;
+        rem = m & ((UINT64_C(1) << shift) - 1);
+        half = UINT64_C(1) << (shift - 1);
+    } else {
+        mant = 0;
+        rem = m;
+        half = UINT64_C(1) << 63;
+    }
+    bool inexact = rem != 0 || sticky;
+    if (rem > half || (rem == half && (sticky || (mant & 1)))) {
+        mant++;
+    }
+
+    if (e < DBL_MIN_EXP - 1) {
+        /* tiny unless rounding to 53 bits with an unbounded exponent already
+           reaches DBL_MIN */
+        bool reaches_min = e == DBL_MIN_EXP - 2 && (full >> 11) == (UINT64_C(1) << 53) - 1 &&
+                           (full & 0x7ff) >= 0x400;
+        if (inexact && !reaches_min) {
+            *range = true;
+        }
+        return from_bits(mant);   /* 2^52 lands on DBL_MIN's encoding */
+    }
+
+    if (mant == UINT64_C(1) << 53) {
+        mant >>= 1;
+        e++;
+        if (e > DBL_MAX_EXP - 1) {
+            *range = true;
+            return from_bits(UINT64_C(0x7ff0000000000000));
+        }
+    }
+    uint64_t bits = ((uint64_t)(e + 1023) << 52) | (mant & ((UINT64_C(1) << 52) - 1));
+    return from_bits(bits);
+}
+
+/* ---- literals ---- */
+
+static int64_t clamp_exp(int64_t e) {
+    if (e > NUMBER_EXP_CLAMP) return NUMBER_EXP_CLAMP;
+    if (e < -NUMBER_EXP_CLAMP) return -NUMBER_EXP_CLAMP;
+    return e;
+}
+
+/* Parses [eE|pP][+-]digits at p. Returns the number of characters consumed,
+   0 when there are no exponent digits. */
+static size_t parse_exponent(const char* p, char marker, int64_t* exp) {
+    if ((*p | 0x20) != marker) {
+        return 0;
+    }
+    size_t i = 1;
+    bool neg = false;
+    if (p[i] == '+' || p[i] == '-') {
+        neg = p[i] == '-';
+        i++;
+    }
+    if (!is_digit(p[i])) {
+        return 0;
+    }
+    int64_t v = 0;
+    while (is_digit(p[i])) {
+        if (v < NUMBER_EXP_CLAMP) {
+            v = v * 10 + (p[i] - '0');
+        }
+        i++;
+    }
+    *exp = neg ? -v : v;
+    return i;
+}
+
+/* value = D * 10^e10 with D given as n significant digits. The operands stay
+   below 10^801 * 2^63 and 5^1125 * 2^63, well inside a BigInt. */
+static double decimal_slow(const char* digits, size_t n, int e10, bool* range) {
+    BigInt d;
+    bigint_set_u64(&d, 0);
+    size_t i = 0;
+    while (i < n) {
+        uint32_t chunk = 0;
+        uint32_t mul = 1;
+        for (size_t k = 0; k < 9 && i < n; k++, i++) {
+            chunk = chunk * 10 + (uint32_t)(digits[i] - '0');
+            mul *= 10;
+        }
+        if (d.len == 0) {
+            bigint_set_u64(&d, chunk);
+        } else {
+            bigint_mul_add(&d, mul, chunk);
+        }
+    }
+
+    int shift;
+    bool sticky;
+    if (e10 >= 0) {
+        bigint_mul_pow5(&d, (unsigned)e10);
+        uint64_t top = bigint_top64(&d, &shift, &sticky);
+        return round_to_double(top, sticky, shift + e10, false, range);
+    }
+
+    /* q = floor(D * 2^s / 5^k) with q in [2^62, 2^64) */
+    BigInt p;
+    bigint_set_u64(&p, 1);
+    bigint_mul_pow5(&p, (unsigned)-e10);
+    int s = (int)bigint_bitlen(&p) - (int)bigint_bitlen(&d) + 63;
+    if (s > 0) {
+        bigint_shl(&d, (unsigned)s);
+    } else if (s < 0) {
+        bigint_shl(&p, (unsigned)-s);
+    }
+    uint64_t q = bigint_divmod(&d, &p);
+    return round_to_double(q, d.len != 0, -s + e10, false, range);
+}
+
+static size_t parse_decimal(const char* s, double* out, bool* range) {
+    char digits[NUMBER_MAX_DIGITS + 1];
+    size_t n = 0;
+    bool sticky = false;
+    bool any = false;
+    int64_t e10 = 0;
+    const char* p = s;
+
+    for (; is_digit(*p); p++) {
+        any = true;
+        if (n == 0 && *p == '0') {
+            continue;
+        }
+        if (n < NUMBER_MAX_DIGITS) {
+            digits[n++] = *p;
+        } else {
+            e10++;
+            sticky |= *p != '0';
+        }
+    }
+    if (*p == '.') {
+        p++;
+        for (; is_digit(*p); p++) {
+            any = true;
+            if (n == 0 && *p == '0') {
+                e10--;
+                continue;
+            }
+            if (n < NUMBER_MAX_DIGITS) {
+                digits[n++] = *p;
+                e10--;
+            } else {
+                sticky |= *p != '0';
+            }
+        }
+    }
+    if (!any) {
+        return 0;
+    }
+    int64_t exp = 0;
+    p += parse_exponent(p, 'e', &exp);
+    size_t len = (size_t)(p - s);
+
+    if (sticky) {
+        digits[n++] = '1';
+        e10--;
+    } else {
+        while (n > 0 && digits[n - 1] == '0') {
+            n--;
+            e10++;
+        }
+    }
+    if (n == 0) {
+        *out = 0.0;
+        return len;
+    }
+    e10 = clamp_exp(e10 + exp);
+
+    /* value lies in [10^(mag-1), 10^mag) */
+    int64_t mag = (int64_t)n + e10;
+    if (mag > DBL_MAX_10_EXP + 2) {
+        *range = true;
+        *out = from_bits(UINT64_C(0x7ff0000000000000));
+        return len;
+    }
+    if (mag < -324) {
+        *range = true;
+        *out = 0.0;
+        return len;
+    }
+
+#if FLT_EVAL_METHOD == 0
+    /* Clinger's fast path: an exact mantissa times an exact power of ten is
+       rounded once by the FPU. */
+    if (n <= 19) {
+        uint64_t w = 0;
+        for (size_t i = 0; i < n; i++) {
+            w = w * 10 + (uint64_t)(digits[i] - '0');
+        }
+        if (w <= (UINT64_C(1) << 53)) {
+            if (e10 >= -22 && e10 <= 22) {
+                *out = e10 < 0 ? (double)w / k_pow10[-e10] : (double)w * k_pow10[e10];
+                return len;
+            }
+            if (e10 > 22 && e10 <= 22 + 15) {
+                uint64_t scale = (uint64_t)k_pow10[e10 - 22];
+                if (w <= (UINT64_C(1) << 53) / scale) {
+                    *out = (double)(w * scale) * k_pow10[22];
+                    return len;
+                }
+            }
+        }
+    }
+#endif
+
+    *out = decimal_slow(digits, n, (int)e10, range);
+    return len;
+}
+
+static size_t parse_hex(const char* s, double* out, bool* range) {
+    const char* p = s + 2;
+    uint64_t m = 0;
+    int nd = 0;
+    bool sticky = false;
+    bool any = false;
+    int64_t e2 = 0;
+
+    for (int v; (v = hex_value(*p)) >= 0; p++) {
+        any = true;
+        if (m == 0 && v == 0) {
+            continue;
+        }
+        if (nd < 16) {
+            m = (m << 4) | (uint64_t)v;
+            nd++;
+        } else {
+            e2 += 4;
+            sticky |= v != 0;
+        }
+    }
+    if (*p == '.') {
+        p++;
+        for (int v; (v = hex_value(*p)) >= 0; p++) {
+            any = true;
+            if (m == 0 && v == 0) {
+                e2 -= 4;
+                continue;
+            }
+            if (nd < 16) {
+                m = (m << 4) | (uint64_t)v;
+                nd++;
+                e2 -= 4;
+            } else {
+                sticky |= v != 0;
+            }
+        }
+    }
+    if (!any) {
+        return 0;
+    }
+    int64_t exp = 0;
+    p += parse_exponent(p, 'p', &exp);
+
+    *out = m == 0 ? 0.0 : round_to_double(m, sticky, (int)clamp_exp(e2 + exp), true, range);
+    return (size_t)(p - s);
+}
+
+Status number_parse(const char* s, size_t* len, double* out) {
+    bool range = false;
+    size_t n = 0;
+    if (s[0] == '0' && (s[1] | 0x20) == 'x') {
+        n = parse_hex(s, out, &range);
+    }
+    if (n == 0) {
+        n = parse_decimal(s, out, &range);
+    }
+    *len = n;
+    if (n == 0) {
+        return status_err("error: invalid number");
+    }
+    if (range) {
+        return status_err("error: number out of range");
+    }
+    return status_ok();
+}
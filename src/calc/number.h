@@ -0,0 +1,16 @@
+#pragma once
+
+#include "util/status.h"
+
+#include <stddef.h>
+
+/* Parses the numeric literal at the start of s: decimal digits with an
+   optional fraction and exponent ("12", ".5", "1.e3", "2.5E-7") or a hex float
+   ("0x1.8p3"). The grammar and the result are bit-identical to strtod in the C
+   locale, but never depend on the current locale.
+
+   *len receives the number of characters consumed; like strtod, a trailing
+   'e' or 'p' without exponent digits is not part of the literal. Values that
+   overflow, or underflow to a subnormal or zero inexactly, are reported as
+   "error: number out of range". */
+Status number_parse(const char* s, size_t* len, double* out);
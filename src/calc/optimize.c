@@ -0,0 +1,658 @@
+#include "calc/optimize.h"
+
+#include "calc/builtins.h"
+#include "calc/exact.h"
+#include "calc/symtab.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+#ifndef M_E
+#define M_E 2.71828182845904523536
+#endif
+
+/* Hash-consed node pool: structurally identical nodes share one id. */
+typedef struct {
+    AstNode* nodes;
+    size_t len;
+    size_t cap;
+    int* table;        /* open addressing, -1 = empty */
+    size_t table_mask;
+    const SymTab* symbols;
+} Dag;
+
+typedef struct {
+    int id;
+    size_t next;
+} Frame;
+
+static uint64_t mix(uint64_t h, uint64_t v) {
+    h ^= v + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+    return h;
+}
+
+static uint64_t node_hash(const AstNode* n) {
+    uint64_t h = mix(0, (uint64_t)n->kind);
+    switch (n->kind) {
+        case AST_NUM: {
+            uint64_t bits;
+            memcpy(&bits, &n->as.num, sizeof(bits));
+            h = mix(h, bits);
+            break;
+        }
+        case AST_VAR:
+        case AST_USER_VAR:
+            h = mix(h, (uint64_t)n->as.var.sym);
+            break;
+        case AST_UNARY:
+            h = mix(mix(h, (uint64_t)n->as.unary.op), (uint64_t)n->as.unary.child);
+            break;
+        case AST_BINARY:
+            h = mix(mix(mix(h, (uint64_t)n->as.binary.op), (uint64_t)n->as.binary.lhs), (uint64_t)n->as.binary.rhs);
+            break;
+        case AST_CALL:
+        case AST_USER_CALL:
+            h = mix(h, (uint64_t)n->as.call.fn);
+            for (size_t i = 0; i < n->as.call.argc; i++) {
+                h = mix(h, (uint64_t)n->as.call.args[i]);
+            }
+            break;
+        default:
+            break;
+    }
+    return h;
+}
+
+static bool node_equal(const AstNode* a, const AstNode* b) {
+    if (a->kind != b->kind) {
+        return false;
+    }
+    switch (a->kind) {
+        case AST_NUM:
+            return memcmp(&a->as.num, &b->as.num, sizeof(double)) == 0;
+        case AST_VAR:
+        case AST_USER_VAR:
+            return a->as.var.sym == b->as.var.sym;
+        case AST_UNARY:
+            return a->as.unary.op == b->as.unary.op && a->as.unary.child == b->as.unary.child;
+        case AST_BINARY:
+            return a->as.binary.op == b->as.binary.op && a->as.binary.lhs == b->as.binary.lhs &&
+                   a->as.binary.rhs == b->as.binary.rhs;
+        case AST_CALL:
+        case AST_USER_CALL:
+            if (a->as.call.fn != b->as.call.fn || a->as.call.argc != b->as.call.argc) {
+                return false;
+            }
+            for (size_t i = 0; i < a->as.call.argc; i++) {
+                if (a->as.call.args[i] != b->as.call.args[i]) {
+                    return false;
+                }
+            }
+            return true;
+        default:
+            return false;
+    }
+}
+
+/* A call that draws random numbers: every occurrence is a new value. */
+static bool draws(const Dag* d, const AstNode* n) {
+    if (n->kind == AST_CALL) {
+        const BuiltinFunc* fn = builtins_func(n->as.call.fn);
+        return fn != NULL && fn->fill != NULL;
+    }
+    return n->kind == AST_USER_CALL && d->symbols != NULL && symtab_random(d->symbols, n->as.call.fn);
+}
+
+/* Returns the id of the node equal to n, adding it if needed; -1 when full. */
+static int dag_intern(Dag* d, const AstNode* n) {
+    if (draws(d, n)) {
+        if (d->len >= d->cap) {
+            return -1;
+        }
+        d->nodes[d->len] = *n;
+        return (int)d->len++;
+    }
+    size_t i = (size_t)node_hash(n) & d->table_mask;
+    while (d->table[i] >= 0) {
+        if (node_equal(&d->nodes[d->table[i]], n)) {
+            return d->table[i];
+        }
+        i = (i + 1) & d->table_mask;
+    }
+    if (d->len >= d->cap) {
+        return -1;
+    }
+    d->nodes[d->len] = *n;
+    d->table[i] = (int)d->len;
+    return (int)d->len++;
+}
+
+static size_t child_count(const AstNode* n) {
+    switch (n->kind) {
+        case AST_UNARY: return 1;
+        case AST_BINARY: return 2;
+        case AST_CALL:
+        case AST_USER_CALL: return n->as.call.argc;
+        default: return 0;
+    }
+}
+
+static int* child_ref(AstNode* n, size_t i) {
+    switch (n->kind) {
+        case AST_UNARY: return &n->as.unary.child;
+        case AST_BINARY: return i == 0 ? &n->as.binary.lhs : &n->as.binary.rhs;
+        case AST_CALL:
+        case AST_USER_CALL: return &n->as.call.args[i];
+        default: return NULL;
+    }
+}
+
+/* Evaluates n when all its operands are constants, with eval_ast's semantics.
+   Returns false when n is not constant or its evaluation would fail. */
+static bool try_fold(const Dag* d, const AstNode* n, const EvalContext* ctx, double* out) {
+    switch (n->kind) {
+        case AST_VAR:
+            if (n->as.var.sym == SYM_PI) {
+                *out = M_PI;
+                return true;
+            }
+            if (n->as.var.sym == SYM_E) {
+                *out = M_E;
+                return true;
+            }
+            return false;
+        case AST_UNARY: {
+            const AstNode* c = &d->nodes[n->as.unary.child];
+            if (c->kind != AST_NUM) {
+                return false;
+            }
+            *out = n->as.unary.op == UN_NEG ? -c->as.num : c->as.num;
+            return true;
+        }
+        case AST_BINARY: {
+            const AstNode* l = &d->nodes[n->as.binary.lhs];
+            const AstNode* r = &d->nodes[n->as.binary.rhs];
+            if (l->kind != AST_NUM || r->kind != AST_NUM) {
+                return false;
+            }
+            double a = l->as.num, b = r->as.num;
+            switch (n->as.binary.op) {
+                case BIN_ADD: *out = a + b; break;
+                case BIN_SUB: *out = a - b; break;
+                case BIN_MUL: *out = a * b; break;
+                case BIN_DIV:
+                    if (b == 0.0) return false;
+                    *out = a / b;
+                    break;
+                case BIN_POW: *out = pow(a, b); break;
+            }
+            return isfinite(*out) != 0;
+        }
+        case AST_CALL: {
+            double args[4] = { 0.0, 0.0, 0.0, 0.0 };
+            for (size_t i = 0; i < n->as.call.argc; i++) {
+                const AstNode* c = &d->nodes[n->as.call.args[i]];
+                if (c->kind != AST_NUM) {
+                    return false;
+                }
+                args[i] = c->as.num;
+            }
+            const BuiltinFunc* fn = builtins_func(n->as.call.fn);
+            return fn != NULL && fn->fill == NULL && fn->fn(args, ctx, out).ok;
+        }
+        default:
+            return false;
+    }
+}
+
+/* Strength reduction limits: x^k for integer 2 <= k <= POW_CHAIN_MAX becomes a
+   multiply chain (at most four multiplies, so the result stays within a few
+   ulp of pow), and sums of at most POLY_MAX_TERMS monomials of degree at most
+   POLY_MAX_DEGREE in one common subexpression are rewritten in Horner form. */
+#define POW_CHAIN_MAX 8
+#define POLY_MAX_TERMS 32
+#define POLY_MAX_DEGREE 32
+
+static int make_num(Dag* d, double v) {
+    AstNode n;
+    memset(&n, 0, sizeof(n));
+    n.kind = AST_NUM;
+    n.as.num = v;
+    return dag_intern(d, &n);
+}
+
+static int make_binary(Dag* d, BinaryOp op, int lhs, int rhs) {
+    if (lhs < 0 || rhs < 0) {
+        return -1;
+    }
+    AstNode n;
+    memset(&n, 0, sizeof(n));
+    n.kind = AST_BINARY;
+    n.as.binary.op = op;
+    n.as.binary.lhs = lhs;
+    n.as.binary.rhs = rhs;
+    return dag_intern(d, &n);
+}
+
+static bool small_int(double v, int lo, int hi, int* out) {
+    if (!(v >= lo && v <= hi) || v != floor(v)) {
+        return false;
+    }
+    *out = (int)v;
+    return true;
+}
+
+/* Builds base^k by repeated squaring; the squares are shared DAG nodes. */
+static int pow_chain(Dag* d, int base, int k) {
+    int result = -1;
+    int sq = base;
+    bool first = true;
+    while (k > 0) {
+        if (k & 1) {
+            result = first ? sq : make_binary(d, BIN_MUL, result, sq);
+            first = false;
+        }
+        k >>= 1;
+        if (k > 0) {
+            sq = make_binary(d, BIN_MUL, sq, sq);
+        }
+        if (sq < 0 || (!first && result < 0)) {
+            return -1;
+        }
+    }
+    return result;
+}
+
+/* x / c -> x * (1/c) when c is a power of two, so the product rounds exactly
+   like the quotient. */
+static bool exact_reciprocal(double c, double* inv) {
+    if (c == 0.0 || !isfinite(c)) {
+        return false;
+    }
+    int e = 0;
+    if (fabs(frexp(c, &e)) != 0.5) {
+        return false;
+    }
+    double r = 1.0 / c;
+    if (!isfinite(r) || fabs(frexp(r, &e)) != 0.5) {
+        return false;
+    }
+    *inv = r;
+    return true;
+}
+
+/* Rewrites a binary node whose operands are already final. Returns the id of
+   the replacement, or -1 to keep n as is. */
+static int strength_reduce(Dag* d, const AstNode* n) {
+    if (n->kind != AST_BINARY) {
+        return -1;
+    }
+    const AstNode* r = &d->nodes[n->as.binary.rhs];
+    if (r->kind != AST_NUM || d->nodes[n->as.binary.lhs].kind == AST_NUM) {
+        return -1;
+    }
+    if (n->as.binary.op == BIN_POW) {
+        int k = 0;
+        if (!small_int(r->as.num, 2, POW_CHAIN_MAX, &k)) {
+            return -1;
+        }
+        return pow_chain(d, n->as.binary.lhs, k);
+    }
+    if (n->as.binary.op == BIN_DIV) {
+        double inv = 0.0;
+        if (!exact_reciprocal(r->as.num, &inv)) {
+            return -1;
+        }
+        return make_binary(d, BIN_MUL, n->as.binary.lhs, make_num(d, inv));
+    }
+    return -1;
+}
+
+/* Reads id as coef * base^deg. base is shared across calls so every term of a
+   polynomial must use the same subexpression. */
+static bool monomial(const Dag* d, int id, int* base, double* coef, int* deg, int depth) {
+    if (depth > POLY_MAX_DEGREE || *deg > POLY_MAX_DEGREE) {
+        return false;
+    }
+    const AstNode* n = &d->nodes[id];
+    if (n->kind == AST_NUM) {
+        *coef *= n->as.num;
+        return true;
+    }
+    if (n->kind == AST_UNARY && n->as.unary.op == UN_NEG) {
+        *coef = -*coef;
+        return monomial(d, n->as.unary.child, base, coef, deg, depth + 1);
+    }
+    if (n->kind == AST_BINARY && n->as.binary.op == BIN_MUL) {
+        return monomial(d, n->as.binary.lhs, base, coef, deg, depth + 1) &&
+               monomial(d, n->as.binary.rhs, base, coef, deg, depth + 1);
+    }
+    if (n->kind == AST_BINARY && n->as.binary.op == BIN_POW) {
+        const AstNode* r = &d->nodes[n->as.binary.rhs];
+        int k = 0;
+        if (r->kind == AST_NUM && small_int(r->as.num, 2, POLY_MAX_DEGREE, &k)) {
+            double c = 1.0;
+            int dg = 0;
+            if (!monomial(d, n->as.binary.lhs, base, &c, &dg, depth + 1) || c != 1.0) {
+                return false;
+            }
+            *deg += dg * k;
+            return *deg <= POLY_MAX_DEGREE;
+        }
+    }
+    if (*base >= 0 && *base != id) {
+        return false;
+    }
+    *base = id;
+    (*deg)++;
+    return true;
+}
+
+/* Rewrites a maximal +/- chain that is a polynomial of degree >= 2 in a
+   single subexpression into Horner form. Returns -1 to keep the original. */
+static int horner(Dag* d, int id) {
+    int stack[POLY_MAX_TERMS * 2];
+    double sign[POLY_MAX_TERMS * 2];
+    double coefs[POLY_MAX_DEGREE + 1];
+    size_t sp = 0;
+    int base = -1;
+    int max_deg = 0;
+    size_t var_terms = 0;
+    size_t terms = 0;
+
+    memset(coefs, 0, sizeof(coefs));
+    stack[sp] = id;
+    sign[sp] = 1.0;
+    sp++;
+    while (sp > 0) {
+        sp--;
+        int cur = stack[sp];
+        double sg = sign[sp];
+        const AstNode* n = &d->nodes[cur];
+        if (n->kind == AST_BINARY && (n->as.binary.op == BIN_ADD || n->as.binary.op == BIN_SUB)) {
+            if (sp + 2 > sizeof(stack) / sizeof(stack[0])) {
+                return -1;
+            }
+            stack[sp] = n->as.binary.lhs;
+            sign[sp] = sg;
+            sp++;
+            stack[sp] = n->as.binary.rhs;
+            sign[sp] = n->as.binary.op == BIN_SUB ? -sg : sg;
+            sp++;
+            continue;
+        }
+        double c = sg;
+        int dg = 0;
+        if (++terms > POLY_MAX_TERMS || !monomial(d, cur, &base, &c, &dg, 0)) {
+            return -1;
+        }
+        coefs[dg] += c;
+        if (dg > 0) {
+            var_terms++;
+        }
+        if (dg > max_deg) {
+            max_deg = dg;
+        }
+    }
+    if (base < 0 || max_deg < 2 || var_terms < 2 || coefs[max_deg] == 0.0) {
+        return -1;
+    }
+
+    int p = -1;
+    if (coefs[max_deg] == 1.0) {
+        p = base;
+    } else {
+        p = make_binary(d, BIN_MUL, make_num(d, coefs[max_deg]), base);
+    }
+    for (int k = max_deg - 1; k >= 0; k--) {
+        if (k > 0 || coefs[0] != 0.0) {
+            p = make_binary(d, BIN_ADD, p, make_num(d, coefs[k]));
+        }
+        if (k > 0) {
+            p = make_binary(d, BIN_MUL, p, base);
+        }
+    }
+    return p;
+}
+
+static bool is_leaf(const AstNode* n) {
+    return n->kind == AST_NUM || n->kind == AST_VAR || n->kind == AST_USER_VAR;
+}
+
+typedef struct {
+    Dag dag;
+    int* canon;      /* input node -> dag id */
+    int64_t* exact;  /* input node -> exact value, see exact_eval_nodes */
+    uint8_t* exact_state;
+    bool* in_sum;    /* input node is an operand of + or - */
+    int* uses;       /* dag id -> references in the reduced tree */
+    int* slot;       /* dag id -> slot holding its value, -1 if none */
+    int* ids;        /* traversal value stack */
+    Frame* frames;
+    AstNode* out;
+} OptScratch;
+
+static bool scratch_alloc(OptScratch* s, Arena* arena, size_t node_len, size_t out_cap) {
+    memset(s, 0, sizeof(*s));
+    size_t dag_cap = node_len * 2 + 64; /* room for strength-reduction rewrites */
+    size_t table_cap = 16;
+    while (table_cap < dag_cap * 2) {
+        table_cap *= 2;
+    }
+    s->dag.cap = dag_cap;
+    s->dag.table_mask = table_cap - 1;
+    s->dag.nodes = arena_alloc(arena, dag_cap * sizeof(AstNode));
+    s->dag.table = arena_alloc(arena, table_cap * sizeof(int));
+    s->canon = arena_alloc(arena, node_len * sizeof(int));
+    s->exact = arena_alloc(arena, node_len * sizeof(int64_t));
+    s->exact_state = arena_alloc(arena, node_len);
+    s->in_sum = arena_alloc(arena, node_len * sizeof(bool));
+    s->uses = arena_alloc(arena, dag_cap * sizeof(int));
+    s->slot = arena_alloc(arena, dag_cap * sizeof(int));
+    s->ids = arena_alloc(arena, (4 * dag_cap + 1) * sizeof(int));
+    s->frames = arena_alloc(arena, (dag_cap + 1) * sizeof(Frame));
+    s->out = arena_alloc(arena, out_cap * sizeof(AstNode));
+    if (!s->dag.nodes || !s->dag.table || !s->canon || !s->exact || !s->exact_state || !s->in_sum || !s->uses || !s->slot || !s->ids || !s->frames || !s->out) {
+        return false;
+    }
+    memset(s->dag.table, 0xff, table_cap * sizeof(int));
+    memset(s->in_sum, 0, node_len * sizeof(bool));
+    memset(s->uses, 0, dag_cap * sizeof(int));
+    memset(s->slot, 0xff, dag_cap * sizeof(int));
+    return true;
+}
+
+/* Counts how often each node is referenced once repeated subtrees are cut off
+   at their second occurrence. */
+static void count_uses(OptScratch* s, int root) {
+    size_t sp = 0;
+    s->ids[sp++] = root;
+    while (sp > 0) {
+        int id = s->ids[--sp];
+        if (s->uses[id]++ > 0) {
+            continue;
+        }
+        AstNode* n = &s->dag.nodes[id];
+        for (size_t i = child_count(n); i > 0; i--) {
+            s->ids[sp++] = *child_ref(n, i - 1);
+        }
+    }
+}
+
+static bool out_push(AstNode* out, size_t cap, size_t* len, const AstNode* n, int* id) {
+    if (*len >= cap) {
+        return false;
+    }
+    out[*len] = *n;
+    *id = (int)(*len)++;
+    return true;
+}
+
+/* Writes the reduced tree back in post-order. Returns false if it does not fit. */
+static bool emit_tree(OptScratch* s, int root, size_t cap, size_t* out_len, size_t* slot_count, size_t* shared) {
+    size_t fp = 0;
+    size_t vp = 0;
+    s->frames[fp].id = root;
+    s->frames[fp].next = 0;
+    fp++;
+
+    while (fp > 0) {
+        Frame* f = &s->frames[fp - 1];
+        const AstNode* n = &s->dag.nodes[f->id];
+
+        if (f->next == 0 && s->slot[f->id] >= 0) {
+            AstNode load;
+            memset(&load, 0, sizeof(load));
+            load.kind = AST_LOAD;
+            load.as.load.slot = s->slot[f->id];
+            if (!out_push(s->out, cap, out_len, &load, &s->ids[vp])) {
+                return false;
+            }
+            vp++;
+            (*shared)++;
+            fp--;
+            continue;
+        }
+
+        size_t argc = child_count(n);
+        if (f->next < argc) {
+            AstNode tmp = *n;
+            int child = *child_ref(&tmp, f->next);
+            f->next++;
+            s->frames[fp].id = child;
+            s->frames[fp].next = 0;
+            fp++;
+            continue;
+        }
+
+        AstNode copy = *n;
+        vp -= argc;
+        for (size_t i = 0; i < argc; i++) {
+            *child_ref(&copy, i) = s->ids[vp + i];
+        }
+        int id = AST_NODE_INVALID;
+        if (!out_push(s->out, cap, out_len, &copy, &id)) {
+            return false;
+        }
+        if (s->uses[f->id] > 1 && !is_leaf(n) && *slot_count < AST_MAX_SLOTS) {
+            AstNode store;
+            memset(&store, 0, sizeof(store));
+            store.kind = AST_STORE;
+            store.as.store.child = id;
+            store.as.store.slot = (int)*slot_count;
+            if (!out_push(s->out, cap, out_len, &store, &id)) {
+                return false;
+            }
+            s->slot[f->id] = (int)(*slot_count)++;
+        }
+        s->ids[vp++] = id;
+        fp--;
+    }
+    return true;
+}
+
+Status optimize_ast(Ast* ast, const EvalContext* ctx, OptimizeStats* stats) {
+    OptimizeStats local;
+    if (stats == NULL) {
+        stats = &local;
+    }
+    memset(stats, 0, sizeof(*stats));
+    stats->nodes_before = ast->node_len;
+    stats->nodes_after = ast->node_len;
+
+    if (ast->node_len == 0 || ast->root != (int)ast->node_len - 1 || ast->slot_count != 0) {
+        return status_ok();
+    }
+
+    /* scratch lives in the Ast's arena until its owner resets it */
+    size_t out_cap = ast->node_len * 2 + 64;
+    OptScratch s;
+    if (!scratch_alloc(&s, ast->arena, ast->node_len, out_cap)) {
+        return status_err("error: out of memory");
+    }
+    s.dag.symbols = ast->symbols;
+    exact_eval_nodes(ast, s.exact, s.exact_state);
+
+    for (size_t i = 0; i < ast->node_len; i++) {
+        if (ast->kind[i] == AST_BINARY && (ast->op[i] == BIN_ADD || ast->op[i] == BIN_SUB)) {
+            s.in_sum[ast->lhs[i]] = true;
+            s.in_sum[ast->rhs[i]] = true;
+        }
+    }
+
+    size_t folded = 0;
+    size_t reduced = 0;
+    for (size_t i = 0; i < ast->node_len; i++) {
+        AstNode n = ast_node(ast, (int)i);
+        for (size_t c = 0; c < child_count(&n); c++) {
+            int* ref = child_ref(&n, c);
+            *ref = s.canon[*ref];
+        }
+        if (n.kind == AST_UNARY && n.as.unary.op == UN_POS) {
+            s.canon[i] = n.as.unary.child;
+            continue;
+        }
+        double v = 0.0;
+        if (n.kind != AST_NUM && s.exact_state[i] == EXACT_OK) {
+            /* integer-only: exact in int64, then rounded once */
+            memset(&n, 0, sizeof(n));
+            n.kind = AST_NUM;
+            n.as.num = (double)s.exact[i];
+            folded++;
+        } else if (n.kind != AST_NUM && try_fold(&s.dag, &n, ctx, &v)) {
+            memset(&n, 0, sizeof(n));
+            n.kind = AST_NUM;
+            n.as.num = v;
+            folded++;
+        } else {
+            int r = strength_reduce(&s.dag, &n);
+            if (r >= 0) {
+                s.canon[i] = r;
+                reduced++;
+                continue;
+            }
+        }
+        s.canon[i] = dag_intern(&s.dag, &n);
+        if (s.canon[i] < 0) {
+            return status_ok();   /* the DAG is full: leave the Ast as it was */
+        }
+
+        /* rewrite each maximal +/- chain once, at its top */
+        if (n.kind == AST_BINARY && (n.as.binary.op == BIN_ADD || n.as.binary.op == BIN_SUB) && !s.in_sum[i]) {
+            int h = horner(&s.dag, s.canon[i]);
+            if (h >= 0) {
+                s.canon[i] = h;
+                reduced++;
+            }
+        }
+    }
+
+    int root = s.canon[ast->root];
+    count_uses(&s, root);
+
+    size_t out_len = 0;
+    size_t slot_count = 0;
+    size_t shared = 0;
+    if (emit_tree(&s, root, out_cap, &out_len, &slot_count, &shared)) {
+        ast_clear(ast);
+        for (size_t i = 0; i < out_len; i++) {
+            int id;
+            Status st = ast_push(ast, &s.out[i], &id);
+            if (!st.ok) {
+                return st;
+            }
+        }
+        ast->root = (int)out_len - 1;
+        ast->slot_count = slot_count;
+        stats->nodes_after = out_len;
+        stats->folded = folded;
+        stats->shared = shared;
+        stats->reduced = reduced;
+    }
+
+    return status_ok();
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "util/status.h"
+#include "calc/parser.h"
+#include "calc/eval.h"
+
+#include <stddef.h>
+
+typedef struct {
+    size_t nodes_before;
+    size_t nodes_after;
+    size_t folded;   /* operations replaced by their constant value */
+    size_t shared;   /* repeated subtrees replaced by an AST_LOAD */
+    size_t reduced;  /* strength reductions (pow chains, reciprocals, Horner) */
+} OptimizeStats;
+
+/* Rewrites a parsed Ast in place: constant subtrees are folded (integer-only
+   ones exactly, by exact_eval_nodes, and rounded once) and identical
+   subtrees are hash-consed so each is computed once (the first occurrence in
+   evaluation order becomes an AST_STORE, later ones AST_LOADs).
+
+   Strength reduction then turns x^k for small integer k into multiply chains,
+   division by a power of two into multiplication by its reciprocal, and
+   polynomials in one subexpression into Horner form. These may change the
+   last bits of a result compared to evaluating the original tree.
+
+   Folding uses ctx->angle_mode_deg, so the result is only valid for that angle
+   mode; ans, mem and user variables and functions are never folded. Calls
+   that draw random numbers (rand, randn and functions using them) are
+   neither folded nor shared: each occurrence is a separate draw. Subtrees
+   whose evaluation fails (division by zero, domain errors, non-finite
+   results) are left in place so evaluation still reports them. If the rewrite does not fit, the Ast is left untouched.
+   Scratch memory comes from ast->arena. stats may be NULL. */
+Status optimize_ast(Ast* ast, const EvalContext* ctx, OptimizeStats* stats);
@@ -1,5 +1,8 @@
 #include "calc/parser.h"
 
+#include "calc/builtins.h"
+#include "calc/symtab.h"
+
 #include <ctype.h>
 #include <string.h>
 
@@ -32,29 +35,188 @@ static bool ts_match(TokenStream* ts, TokenKind kind) {
     return false;
 }
 
-static Status ast_push(Ast* ast, AstNode node, int* out_id) {
+void ast_init(Ast* ast, Arena* arena) {
+    memset(ast, 0, sizeof(*ast));
+    ast->root = AST_NODE_INVALID;
+    ast->arena = arena;
+}
+
+void ast_clear(Ast* ast) {
+    ast->node_len = 0;
+    ast->num_len = 0;
+    ast->arg_len = 0;
+    ast->root = AST_NODE_INVALID;
+    ast->slot_count = 0;
+}
+
+static void* grow(Arena* arena, void* p, size_t elem, size_t old_cap, size_t new_cap) {
+    return arena_grow(arena, p, old_cap * elem, new_cap * elem);
+}
+
+static bool grow_nodes(Ast* ast, size_t cap) {
+    uint8_t* kind = grow(ast->arena, ast->kind, sizeof(uint8_t), ast->node_cap, cap);
+    uint16_t* op = kind ? grow(ast->arena, ast->op, sizeof(uint16_t), ast->node_cap, cap) : NULL;
+    int32_t* lhs = op ? grow(ast->arena, ast->lhs, sizeof(int32_t), ast->node_cap, cap) : NULL;
+    int32_t* rhs = lhs ? grow(ast->arena, ast->rhs, sizeof(int32_t), ast->node_cap, cap) : NULL;
+    if (rhs == NULL) {
+        return false;
+    }
+    ast->kind = kind;
+    ast->op = op;
+    ast->lhs = lhs;
+    ast->rhs = rhs;
+    ast->node_cap = cap;
+    return true;
+}
+
+static size_t next_cap(size_t cap, size_t need) {
+    size_t n = cap ? cap * 2 : 64;
+    while (n < need) {
+        n *= 2;
+    }
+    return n;
+}
+
+/* Every node consumes at least one token, so sizing all columns to the token
+   count up front means the parser never copies a column while growing it. */
+static Status reserve(Ast* ast, size_t n) {
+    if (n > ast->node_cap && !grow_nodes(ast, n)) {
+        return status_err("error: out of memory");
+    }
+    if (n > ast->num_cap) {
+        double* nums = grow(ast->arena, ast->nums, sizeof(double), ast->num_cap, n);
+        if (nums == NULL) {
+            return status_err("error: out of memory");
+        }
+        ast->nums = nums;
+        ast->num_cap = n;
+    }
+    if (n > ast->arg_cap) {
+        int32_t* args = grow(ast->arena, ast->args, sizeof(int32_t), ast->arg_cap, n);
+        if (args == NULL) {
+            return status_err("error: out of memory");
+        }
+        ast->args = args;
+        ast->arg_cap = n;
+    }
+    return status_ok();
+}
+
+Status ast_push(Ast* ast, const AstNode* node, int* out_id) {
     if (ast->node_len >= ast->node_cap) {
-        return status_err("error: AST too large");
+        if (!grow_nodes(ast, next_cap(ast->node_cap, ast->node_len + 1))) {
+            return status_err("error: out of memory");
+        }
+    }
+
+    size_t i = ast->node_len;
+    uint16_t op = 0;
+    int32_t lhs = 0;
+    int32_t rhs = 0;
+    switch (node->kind) {
+        case AST_NUM:
+            if (ast->num_len >= ast->num_cap) {
+                size_t cap = next_cap(ast->num_cap, ast->num_len + 1);
+                double* nums = grow(ast->arena, ast->nums, sizeof(double), ast->num_cap, cap);
+                if (nums == NULL) {
+                    return status_err("error: out of memory");
+                }
+                ast->nums = nums;
+                ast->num_cap = cap;
+            }
+            lhs = (int32_t)ast->num_len;
+            ast->nums[ast->num_len++] = node->as.num;
+            break;
+        case AST_VAR:
+        case AST_USER_VAR:
+            op = (uint16_t)node->as.var.sym;
+            break;
+        case AST_UNARY:
+            op = (uint16_t)node->as.unary.op;
+            lhs = node->as.unary.child;
+            break;
+        case AST_BINARY:
+            op = (uint16_t)node->as.binary.op;
+            lhs = node->as.binary.lhs;
+            rhs = node->as.binary.rhs;
+            break;
+        case AST_CALL:
+        case AST_USER_CALL:
+            if (ast->arg_len + node->as.call.argc > ast->arg_cap) {
+                size_t cap = next_cap(ast->arg_cap, ast->arg_len + node->as.call.argc);
+                int32_t* args = grow(ast->arena, ast->args, sizeof(int32_t), ast->arg_cap, cap);
+                if (args == NULL) {
+                    return status_err("error: out of memory");
+                }
+                ast->args = args;
+                ast->arg_cap = cap;
+            }
+            op = (uint16_t)node->as.call.fn;
+            lhs = (int32_t)ast->arg_len;
+            rhs = (int32_t)node->as.call.argc;
+            for (size_t a = 0; a < node->as.call.argc; a++) {
+                ast->args[ast->arg_len++] = node->as.call.args[a];
+            }
+            break;
+        case AST_STORE:
+            op = (uint16_t)node->as.store.slot;
+            lhs = node->as.store.child;
+            break;
+        case AST_LOAD:
+            op = (uint16_t)node->as.load.slot;
+            break;
     }
-    ast->nodes[ast->node_len] = node;
-    *out_id = (int)ast->node_len;
+    ast->kind[i] = (uint8_t)node->kind;
+    ast->op[i] = op;
+    ast->lhs[i] = lhs;
+    ast->rhs[i] = rhs;
+    *out_id = (int)i;
     ast->node_len++;
     return status_ok();
 }
 
-static void token_to_ident16(const Token* t, char out[16]) {
-    size_t n = t->len;
-    if (n > 15) {
-        n = 15;
-    }
-    for (size_t i = 0; i < n; i++) {
-        char c = t->start[i];
-        out[i] = (char)tolower((unsigned char)c);
+AstNode ast_node(const Ast* ast, int id) {
+    AstNode n;
+    memset(&n, 0, sizeof(n));
+    n.kind = (AstKind)ast->kind[id];
+    int op = ast->op[id];
+    int32_t lhs = ast->lhs[id];
+    switch (n.kind) {
+        case AST_NUM: n.as.num = ast->nums[lhs]; break;
+        case AST_VAR:
+        case AST_USER_VAR: n.as.var.sym = op; break;
+        case AST_UNARY:
+            n.as.unary.op = (UnaryOp)op;
+            n.as.unary.child = lhs;
+            break;
+        case AST_BINARY:
+            n.as.binary.op = (BinaryOp)op;
+            n.as.binary.lhs = lhs;
+            n.as.binary.rhs = ast->rhs[id];
+            break;
+        case AST_CALL:
+        case AST_USER_CALL:
+            n.as.call.fn = op;
+            n.as.call.argc = (size_t)ast->rhs[id];
+            for (size_t a = 0; a < n.as.call.argc && a < 4; a++) {
+                n.as.call.args[a] = ast->args[(size_t)lhs + a];
+            }
+            break;
+        case AST_STORE:
+            n.as.store.slot = op;
+            n.as.store.child = lhs;
+            break;
+        case AST_LOAD: n.as.load.slot = op; break;
     }
-    out[n] = '\0';
+    return n;
 }
 
-/* Grammar (Pratt-ish precedence):
+size_t ast_bytes(const Ast* ast) {
+    return ast->node_len * (sizeof(uint8_t) + sizeof(uint16_t) + 2 * sizeof(int32_t)) +
+           ast->num_len * sizeof(double) + ast->arg_len * sizeof(int32_t);
+}
+
+/* Grammar (precedence climbing, no recursion):
    expr        := add
    add         := mul (('+'|'-') mul)*
    mul         := pow (('*'|'/') pow)*
@@ -62,256 +224,303 @@ static void token_to_ident16(const Token* t, char out[16]) {
    unary       := ('+'|'-') unary | primary
    primary     := number | ident | call | '(' expr ')'
    call        := ident '(' [expr (',' expr)*] ')'
-*/
 
-static Status parse_expr(TokenStream* ts, Ast* ast, int* out);
+   Pending operators and open groups live on an explicit stack in the Ast's
+   arena, so nesting costs heap memory bounded by max_depth instead of C stack.
+   Nodes are emitted in the same post-order a recursive descent would use. */
+
+typedef enum {
+    PEND_UNARY,
+    PEND_BINARY,
+    PEND_PAREN,
+    PEND_CALL,
+} PendKind;
+
+typedef struct {
+    PendKind kind;
+    int op;                 /* UnaryOp, BinaryOp, builtins_func id or symbol id */
+    bool user;              /* PEND_CALL: op is a user function */
+    int prec;               /* PEND_BINARY: binding strength */
+    size_t argc;            /* PEND_CALL: arguments parsed so far */
+    int args[4];
+} Pending;
+
+typedef struct {
+    Ast* ast;
+    Pending* ops;
+    size_t op_len;
+    size_t op_cap;          /* max_depth */
+    int* vals;
+    size_t val_len;
+} ParseStack;
+
+static int binary_prec(TokenKind kind, BinaryOp* op) {
+    switch (kind) {
+        case TOK_PLUS: *op = BIN_ADD; return 1;
+        case TOK_MINUS: *op = BIN_SUB; return 1;
+        case TOK_STAR: *op = BIN_MUL; return 2;
+        case TOK_SLASH: *op = BIN_DIV; return 2;
+        case TOK_CARET: *op = BIN_POW; return 3;
+        default: return 0;
+    }
+}
+
+static Status ps_open(ParseStack* ps, Pending p) {
+    if (ps->op_len >= ps->op_cap) {
+        return status_err("error: expression too deep");
+    }
+    ps->ops[ps->op_len++] = p;
+    return status_ok();
+}
 
-static Status parse_primary(TokenStream* ts, Ast* ast, int* out) {
+static Status ps_emit(ParseStack* ps, const AstNode* n) {
+    int id = AST_NODE_INVALID;
+    Status st = ast_push(ps->ast, n, &id);
+    if (!st.ok) {
+        return st;
+    }
+    ps->vals[ps->val_len++] = id;
+    return status_ok();
+}
+
+/* Pops the top operator and emits its node. */
+static Status ps_reduce(ParseStack* ps) {
+    const Pending* p = &ps->ops[--ps->op_len];
+    AstNode n;
+    memset(&n, 0, sizeof(n));
+    if (p->kind == PEND_UNARY) {
+        n.kind = AST_UNARY;
+        n.as.unary.op = (UnaryOp)p->op;
+        n.as.unary.child = ps->vals[--ps->val_len];
+    } else {
+        n.kind = AST_BINARY;
+        n.as.binary.op = (BinaryOp)p->op;
+        n.as.binary.rhs = ps->vals[--ps->val_len];
+        n.as.binary.lhs = ps->vals[--ps->val_len];
+    }
+    return ps_emit(ps, &n);
+}
+
+/* Reduces operators that bind tighter than a following binary operator of
+   precedence prec; prec 0 reduces everything down to the innermost group. */
+static Status ps_reduce_above(ParseStack* ps, int prec) {
+    while (ps->op_len > 0) {
+        const Pending* top = &ps->ops[ps->op_len - 1];
+        if (top->kind == PEND_PAREN || top->kind == PEND_CALL) {
+            break;
+        }
+        /* '^' is right associative */
+        if (top->kind == PEND_BINARY && prec > 0 &&
+            (top->prec < prec || (top->prec == prec && top->op == BIN_POW))) {
+            break;
+        }
+        Status st = ps_reduce(ps);
+        if (!st.ok) {
+            return st;
+        }
+    }
+    return status_ok();
+}
+
+static Status ps_close_call(ParseStack* ps) {
+    Pending call = ps->ops[--ps->op_len];
+    if (call.user) {
+        if (call.argc != symtab_get(ps->ast->symbols, call.op)->arity) {
+            return status_err("error: wrong number of function args");
+        }
+    } else {
+        const BuiltinFunc* fn = builtins_func(call.op);
+        if (call.argc != fn->arity) {
+            return status_err(fn->arity_msg);
+        }
+    }
+    AstNode n;
+    memset(&n, 0, sizeof(n));
+    n.kind = call.user ? AST_USER_CALL : AST_CALL;
+    n.as.call.fn = call.op;
+    n.as.call.argc = call.argc;
+    memcpy(n.as.call.args, call.args, sizeof(call.args));
+    return ps_emit(ps, &n);
+}
+
+static int find_input(const Ast* ast, const char* name, size_t len) {
+    for (size_t i = 0; i < ast->input_count; i++) {
+        const char* in = ast->inputs[i];
+        size_t k = 0;
+        while (k < len && in[k] != '\0' && tolower((unsigned char)in[k]) == tolower((unsigned char)name[k])) {
+            k++;
+        }
+        if (k == len && in[k] == '\0') {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+/* Parses one operand position: prefix operators, then a primary or the
+   opening of a group. Sets *done when a complete operand was produced. */
+static Status parse_operand(TokenStream* ts, ParseStack* ps, bool* done) {
+    *done = false;
     const Token* t = ts_peek(ts);
+    if (ts_match(ts, TOK_PLUS) || ts_match(ts, TOK_MINUS)) {
+        Pending p = { .kind = PEND_UNARY, .op = t->kind == TOK_PLUS ? UN_POS : UN_NEG };
+        return ps_open(ps, p);
+    }
+
+    AstNode n;
+    memset(&n, 0, sizeof(n));
     if (ts_match(ts, TOK_NUMBER)) {
-        AstNode n;
-        memset(&n, 0, sizeof(n));
         n.kind = AST_NUM;
         n.as.num = t->number;
-        return ast_push(ast, n, out);
+        *done = true;
+        return ps_emit(ps, &n);
     }
 
     if (ts_match(ts, TOK_IDENT)) {
         Token ident = *t;
         if (ts_match(ts, TOK_LPAREN)) {
-            AstNode call;
-            memset(&call, 0, sizeof(call));
-            call.kind = AST_CALL;
-            token_to_ident16(&ident, call.as.call.name);
-            call.as.call.argc = 0;
-
-            if (!ts_match(ts, TOK_RPAREN)) {
-                while (1) {
-                    if (call.as.call.argc >= 4) {
-                        return status_err("error: too many function args");
-                    }
-                    int arg_id = AST_NODE_INVALID;
-                    Status st = parse_expr(ts, ast, &arg_id);
-                    if (!st.ok) {
-                        return st;
-                    }
-                    call.as.call.args[call.as.call.argc++] = arg_id;
-
-                    if (ts_match(ts, TOK_COMMA)) {
-                        continue;
-                    }
-                    if (ts_match(ts, TOK_RPAREN)) {
-                        break;
-                    }
-                    return status_err("error: expected ',' or ')'");
+            Pending p = { .kind = PEND_CALL, .op = builtins_find_func(ident.start, ident.len) };
+            if (p.op < 0) {
+                const SymTab* syms = ps->ast->symbols;
+                p.op = symtab_find(syms, ident.start, ident.len);
+                p.user = true;
+                if (p.op < 0 || symtab_get(syms, p.op)->kind != SYMBOL_FUNC) {
+                    return status_err("error: unknown function");
                 }
             }
-            return ast_push(ast, call, out);
+            Status st = ps_open(ps, p);
+            if (!st.ok || !ts_match(ts, TOK_RPAREN)) {
+                return st;
+            }
+            *done = true;
+            return ps_close_call(ps);
         }
 
-        AstNode v;
-        memset(&v, 0, sizeof(v));
-        v.kind = AST_VAR;
-        token_to_ident16(&ident, v.as.var.name);
-        return ast_push(ast, v, out);
+        n.kind = AST_VAR;
+        int input = find_input(ps->ast, ident.start, ident.len);
+        n.as.var.sym = input >= 0 ? SYM_INPUT + input : builtins_find_var(ident.start, ident.len);
+        if (n.as.var.sym < 0) {
+            const SymTab* syms = ps->ast->symbols;
+            n.kind = AST_USER_VAR;
+            n.as.var.sym = symtab_find(syms, ident.start, ident.len);
+            if (n.as.var.sym < 0 || symtab_get(syms, n.as.var.sym)->kind != SYMBOL_VAR) {
+                return status_err("error: unknown variable");
+            }
+        }
+        *done = true;
+        return ps_emit(ps, &n);
     }
 
     if (ts_match(ts, TOK_LPAREN)) {
-        Status st = parse_expr(ts, ast, out);
-        if (!st.ok) {
-            return st;
+        Pending p = { .kind = PEND_PAREN };
+        return ps_open(ps, p);
+    }
+
+    return status_err("error: expected primary expression");
+}
+
+/* Called when an expression ends inside the innermost group (or at the top
+   level). Sets *more when another operand must follow. */
+static Status close_group(TokenStream* ts, ParseStack* ps, bool* more, bool* finished) {
+    *more = false;
+    *finished = false;
+    if (ps->op_len == 0) {
+        if (ts_peek(ts)->kind != TOK_END) {
+            return status_err("error: unexpected trailing tokens");
         }
+        *finished = true;
+        return status_ok();
+    }
+
+    Pending* top = &ps->ops[ps->op_len - 1];
+    if (top->kind == PEND_PAREN) {
         if (!ts_match(ts, TOK_RPAREN)) {
             return status_err("error: expected ')'");
         }
+        ps->op_len--;
         return status_ok();
     }
 
-    return status_err("error: expected primary expression");
-}
-
-static Status parse_unary(TokenStream* ts, Ast* ast, int* out) {
-    if (ts_match(ts, TOK_PLUS)) {
-        int child = AST_NODE_INVALID;
-        Status st = parse_unary(ts, ast, &child);
-        if (!st.ok) {
-            return st;
+    top->args[top->argc++] = ps->vals[--ps->val_len];
+    if (ts_match(ts, TOK_COMMA)) {
+        if (top->argc >= 4) {
+            return status_err("error: too many function args");
         }
-        AstNode n;
-        memset(&n, 0, sizeof(n));
-        n.kind = AST_UNARY;
-        n.as.unary.op = UN_POS;
-        n.as.unary.child = child;
-        return ast_push(ast, n, out);
+        *more = true;
+        return status_ok();
     }
-    if (ts_match(ts, TOK_MINUS)) {
-        int child = AST_NODE_INVALID;
-        Status st = parse_unary(ts, ast, &child);
-        if (!st.ok) {
-            return st;
-        }
-        AstNode n;
-        memset(&n, 0, sizeof(n));
-        n.kind = AST_UNARY;
-        n.as.unary.op = UN_NEG;
-        n.as.unary.child = child;
-        return ast_push(ast, n, out);
+    if (ts_match(ts, TOK_RPAREN)) {
+        return ps_close_call(ps);
     }
-    return parse_primary(ts, ast, out);
+    return status_err("error: expected ',' or ')'");
 }
 
-static Status parse_pow(TokenStream* ts, Ast* ast, int* out) {
-    int left = AST_NODE_INVALID;
-    Status st = parse_unary(ts, ast, &left);
-    if (!st.ok) {
-        return st;
-    }
+Status parser_parse_depth(const Token* tokens, size_t token_count, size_t max_depth, Ast* out) {
+    ast_clear(out);
 
-    if (ts_match(ts, TOK_CARET)) {
-        int right = AST_NODE_INVALID;
-        st = parse_pow(ts, ast, &right); /* right associative */
-        if (!st.ok) {
-            return st;
-        }
-        AstNode n;
-        memset(&n, 0, sizeof(n));
-        n.kind = AST_BINARY;
-        n.as.binary.op = BIN_POW;
-        n.as.binary.lhs = left;
-        n.as.binary.rhs = right;
-        return ast_push(ast, n, out);
+    if (token_count == 0) {
+        return status_err("error: empty input");
     }
 
-    *out = left;
-    return status_ok();
-}
-
-static Status parse_mul(TokenStream* ts, Ast* ast, int* out) {
-    int expr = AST_NODE_INVALID;
-    Status st = parse_pow(ts, ast, &expr);
+    Status st = reserve(out, token_count);
     if (!st.ok) {
         return st;
     }
 
+    /* every pending entry consumed a token, and there is at most one value
+       per pending entry plus the one being built */
+    size_t cap = max_depth < token_count ? max_depth : token_count;
+    ParseStack ps = { .ast = out, .op_cap = cap };
+    ps.ops = arena_alloc(out->arena, (cap + 1) * sizeof(Pending));
+    ps.vals = arena_alloc(out->arena, (cap + 1) * sizeof(int));
+    if (ps.ops == NULL || ps.vals == NULL) {
+        return status_err("error: out of memory");
+    }
+
+    TokenStream ts = { .tokens = tokens, .token_count = token_count, .pos = 0 };
+    bool want_operand = true;
     while (1) {
-        if (ts_match(ts, TOK_STAR)) {
-            int rhs = AST_NODE_INVALID;
-            st = parse_pow(ts, ast, &rhs);
-            if (!st.ok) {
-                return st;
-            }
-            AstNode n;
-            memset(&n, 0, sizeof(n));
-            n.kind = AST_BINARY;
-            n.as.binary.op = BIN_MUL;
-            n.as.binary.lhs = expr;
-            n.as.binary.rhs = rhs;
-            st = ast_push(ast, n, &expr);
+        if (want_operand) {
+            bool done = false;
+            st = parse_operand(&ts, &ps, &done);
             if (!st.ok) {
                 return st;
             }
+            want_operand = !done;
             continue;
         }
-        if (ts_match(ts, TOK_SLASH)) {
-            int rhs = AST_NODE_INVALID;
-            st = parse_pow(ts, ast, &rhs);
-            if (!st.ok) {
-                return st;
-            }
-            AstNode n;
-            memset(&n, 0, sizeof(n));
-            n.kind = AST_BINARY;
-            n.as.binary.op = BIN_DIV;
-            n.as.binary.lhs = expr;
-            n.as.binary.rhs = rhs;
-            st = ast_push(ast, n, &expr);
+
+        BinaryOp op = BIN_ADD;
+        int prec = binary_prec(ts_peek(&ts)->kind, &op);
+        st = ps_reduce_above(&ps, prec);
+        if (!st.ok) {
+            return st;
+        }
+        if (prec > 0) {
+            ts_advance(&ts);
+            Pending p = { .kind = PEND_BINARY, .op = op, .prec = prec };
+            st = ps_open(&ps, p);
             if (!st.ok) {
                 return st;
             }
+            want_operand = true;
             continue;
         }
-        break;
-    }
 
-    *out = expr;
-    return status_ok();
-}
-
-static Status parse_add(TokenStream* ts, Ast* ast, int* out) {
-    int expr = AST_NODE_INVALID;
-    Status st = parse_mul(ts, ast, &expr);
-    if (!st.ok) {
-        return st;
-    }
-
-    while (1) {
-        if (ts_match(ts, TOK_PLUS)) {
-            int rhs = AST_NODE_INVALID;
-            st = parse_mul(ts, ast, &rhs);
-            if (!st.ok) {
-                return st;
-            }
-            AstNode n;
-            memset(&n, 0, sizeof(n));
-            n.kind = AST_BINARY;
-            n.as.binary.op = BIN_ADD;
-            n.as.binary.lhs = expr;
-            n.as.binary.rhs = rhs;
-            st = ast_push(ast, n, &expr);
-            if (!st.ok) {
-                return st;
-            }
-            continue;
+        bool finished = false;
+        st = close_group(&ts, &ps, &want_operand, &finished);
+        if (!st.ok) {
+            return st;
         }
-        if (ts_match(ts, TOK_MINUS)) {
-            int rhs = AST_NODE_INVALID;
-            st = parse_mul(ts, ast, &rhs);
-            if (!st.ok) {
-                return st;
-            }
-            AstNode n;
-            memset(&n, 0, sizeof(n));
-            n.kind = AST_BINARY;
-            n.as.binary.op = BIN_SUB;
-            n.as.binary.lhs = expr;
-            n.as.binary.rhs = rhs;
-            st = ast_push(ast, n, &expr);
-            if (!st.ok) {
-                return st;
-            }
-            continue;
+        if (finished) {
+            break;
         }
-        break;
     }
 
-    *out = expr;
+    out->root = ps.vals[0];
     return status_ok();
 }
 
-static Status parse_expr(TokenStream* ts, Ast* ast, int* out) {
-    return parse_add(ts, ast, out);
-}
-
 Status parser_parse(const Token* tokens, size_t token_count, Ast* out) {
-    out->node_len = 0;
-    out->root = AST_NODE_INVALID;
-
-    if (token_count == 0) {
-        return status_err("error: empty input");
-    }
-
-    TokenStream ts = { .tokens = tokens, .token_count = token_count, .pos = 0 };
-
-    int root = AST_NODE_INVALID;
-    Status st = parse_expr(&ts, out, &root);
-    if (!st.ok) {
-        return st;
-    }
-
-    if (ts_peek(&ts)->kind != TOK_END) {
-        return status_err("error: unexpected trailing tokens");
-    }
-
-    out->root = root;
-    return status_ok();
+    return parser_parse_depth(tokens, token_count, PARSER_MAX_DEPTH, out);
 }
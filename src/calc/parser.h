@@ -2,19 +2,30 @@
 
 #include "util/status.h"
 #include "calc/tokens.h"
+#include "util/arena.h"
 
 #include <stddef.h>
+#include <stdint.h>
 
 typedef enum {
     AST_NODE_INVALID = -1,
 } AstNodeId;
 
+typedef struct SymTab SymTab;   /* calc/symtab.h */
+
+/* Upper bound on AST_STORE/AST_LOAD slots in one Ast. */
+#define AST_MAX_SLOTS 64
+
 typedef enum {
     AST_NUM,
     AST_VAR,
     AST_UNARY,
     AST_BINARY,
     AST_CALL,
+    AST_STORE,   /* evaluates child and keeps its value in a slot */
+    AST_LOAD,    /* value of a slot stored earlier in evaluation order */
+    AST_USER_VAR,    /* user variable: as.var.sym is its symbol id */
+    AST_USER_CALL,   /* user function: as.call.fn is its symbol id */
 } AstKind;
 
 typedef enum {
@@ -36,22 +47,72 @@ typedef struct {
     size_t pos;
 } TokenStream;
 
+/* One node in decoded form, used while building and rewriting trees. */
 typedef struct {
     AstKind kind;
     union {
         double num;
-        struct { char name[16]; } var;
+        struct { int sym; } var;           /* BuiltinVar */
         struct { UnaryOp op; int child; } unary;
         struct { BinaryOp op; int lhs; int rhs; } binary;
-        struct { char name[16]; int args[4]; size_t argc; } call;
+        struct { int fn; int args[4]; size_t argc; } call;   /* fn: builtins_func id */
+        struct { int child; int slot; } store;
+        struct { int slot; } load;
     } as;
 } AstNode;
 
+/* Nodes are stored column-wise in post-order: operands always precede the
+   node that uses them and the root is the last node. Per node:
+
+     kind  AstKind
+     op    UnaryOp / BinaryOp, BuiltinVar, builtins_func id, symbol id, or slot
+     lhs   unary, binary-left or store child; AST_NUM: index into nums;
+           AST_CALL/AST_USER_CALL: index of the first argument in args
+     rhs   binary-right child; AST_CALL/AST_USER_CALL: argument count
+
+   Names never reach the tree: the parser resolves them to ids in the builtin
+   registry, to SYM_INPUT + i for the caller's inputs[i] (matched
+   case-insensitively, before the builtins), or to ids in the user symbol
+   table (after the builtins). All arrays live in the arena and grow there. */
 typedef struct {
-    AstNode* nodes;
+    uint8_t* kind;
+    uint16_t* op;
+    int32_t* lhs;
+    int32_t* rhs;
     size_t node_cap;
     size_t node_len;
+    double* nums;
+    size_t num_cap;
+    size_t num_len;
+    int32_t* args;
+    size_t arg_cap;
+    size_t arg_len;
     int root;
+    size_t slot_count;
+    Arena* arena;
+    const char* const* inputs;   /* set after ast_init; values come from EvalContext */
+    size_t input_count;
+    const SymTab* symbols;       /* set after ast_init; NULL for none */
 } Ast;
 
+/* An empty tree whose storage will be taken from arena. */
+void ast_init(Ast* ast, Arena* arena);
+
+/* Drops all nodes but keeps the storage. */
+void ast_clear(Ast* ast);
+
+/* Appends node and returns its id in *out_id. */
+Status ast_push(Ast* ast, const AstNode* node, int* out_id);
+
+AstNode ast_node(const Ast* ast, int id);
+
+/* Bytes of node, literal and argument storage in use. */
+size_t ast_bytes(const Ast* ast);
+
+/* Default limit on pending operators and open parentheses/calls. */
+#define PARSER_MAX_DEPTH 1024
+
+/* Parses without recursion; input nested deeper than max_depth fails with
+   "error: expression too deep". parser_parse uses PARSER_MAX_DEPTH. */
+Status parser_parse_depth(const Token* tokens, size_t token_count, size_t max_depth, Ast* out);
 Status parser_parse(const Token* tokens, size_t token_count, Ast* out);
@@ -0,0 +1,237 @@
+#include "calc/rng.h"
+
+#include "calc/vecmath.h"
+
+#include <math.h>
+#include <string.h>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+/* Normal pairs made per round of vecmath calls. */
+#define RNG_PAIRS 128
+
+static uint64_t rotl(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+static uint64_t splitmix64(uint64_t* x) {
+    uint64_t z = (*x += 0x9e3779b97f4a7c15u);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9u;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebu;
+    return z ^ (z >> 31);
+}
+
+/* One xoshiro256++ step of a single generator. */
+static uint64_t next1(uint64_t s[4]) {
+    uint64_t out = rotl(s[0] + s[3], 23) + s[0];
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+    return out;
+}
+
+/* Advances s by 2^128 steps. */
+static void jump(uint64_t s[4]) {
+    static const uint64_t k_jump[4] = { 0x180ec6d33cfd0abau, 0xd5a61266f0c9392cu, 0xa9582618e03fc9aau,
+                                        0x39abdc4529b1661cu };
+    uint64_t t[4] = { 0, 0, 0, 0 };
+    for (size_t i = 0; i < 4; i++) {
+        for (int b = 0; b < 64; b++) {
+            if (k_jump[i] & ((uint64_t)1 << b)) {
+                for (size_t j = 0; j < 4; j++) t[j] ^= s[j];
+            }
+            (void)next1(s);
+        }
+    }
+    memcpy(s, t, sizeof(t));
+}
+
+void rng_seed(Rng* r, uint64_t seed, size_t stream) {
+    uint64_t s[4];
+    for (size_t j = 0; j < 4; j++) s[j] = splitmix64(&seed);
+    for (size_t i = 0; i < RNG_LANES * stream; i++) jump(s);
+    for (size_t k = 0; k < RNG_LANES; k++) {
+        for (size_t j = 0; j < 4; j++) r->s[j][k] = s[j];
+        jump(s);
+    }
+    r->pos = RNG_LANES;
+    r->spare = 0.0;
+    r->has_spare = false;
+}
+
+/* The top 52 bits as the mantissa of a double in [1, 2), minus 1: exact,
+   and integer operations only, unlike a conversion from uint64_t. */
+static double to_unit(uint64_t x) {
+    uint64_t bits = (x >> 12) | 0x3ff0000000000000u;
+    double d;
+    memcpy(&d, &bits, sizeof(d));
+    return d - 1.0;
+}
+
+/* One step of every lane, for the few draws that do not fill whole
+   steps. */
+static void step(Rng* r, uint64_t out[RNG_LANES]) {
+    uint64_t* s0 = r->s[0];
+    uint64_t* s1 = r->s[1];
+    uint64_t* s2 = r->s[2];
+    uint64_t* s3 = r->s[3];
+    for (size_t k = 0; k < RNG_LANES; k++) {
+        out[k] = rotl(s0[k] + s3[k], 23) + s0[k];
+        uint64_t t = s1[k] << 17;
+        s2[k] ^= s0[k];
+        s3[k] ^= s1[k];
+        s1[k] ^= s2[k];
+        s0[k] ^= s3[k];
+        s2[k] ^= t;
+        s3[k] = rotl(s3[k], 45);
+    }
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define RNG_X86 1
+#else
+#define RNG_X86 0
+#endif
+
+#if defined(__GNUC__)
+
+_Static_assert(RNG_LANES == 4, "the bulk steps keep one lane per vector element");
+
+typedef uint64_t v4u __attribute__((vector_size(32)));
+typedef double v4d __attribute__((vector_size(32)));
+
+/* steps steps of every lane straight into out, each state word held in one
+   vector for the whole loop: the same arithmetic as step and to_unit. */
+#define RNG_BULK(attr, name)                                                  \
+    attr static void name(uint64_t s[4][RNG_LANES], double* out, size_t steps) { \
+        v4u s0, s1, s2, s3;                                                   \
+        memcpy(&s0, s[0], sizeof(s0));                                        \
+        memcpy(&s1, s[1], sizeof(s1));                                        \
+        memcpy(&s2, s[2], sizeof(s2));                                        \
+        memcpy(&s3, s[3], sizeof(s3));                                        \
+        for (size_t i = 0; i < steps; i++) {                                  \
+            v4u x = s0 + s3;                                                  \
+            x = ((x << 23) | (x >> 41)) + s0;                                 \
+            v4u t = s1 << 17;                                                 \
+            s2 ^= s0;                                                         \
+            s3 ^= s1;                                                         \
+            s1 ^= s2;                                                         \
+            s0 ^= s3;                                                         \
+            s2 ^= t;                                                          \
+            s3 = (s3 << 45) | (s3 >> 19);                                     \
+            v4u bits = (x >> 12) | 0x3ff0000000000000u;                       \
+            v4d d;                                                            \
+            memcpy(&d, &bits, sizeof(d));                                     \
+            d -= 1.0;                                                         \
+            memcpy(out + RNG_LANES * i, &d, sizeof(d));                       \
+        }                                                                     \
+        memcpy(s[0], &s0, sizeof(s0));                                        \
+        memcpy(s[1], &s1, sizeof(s1));                                        \
+        memcpy(s[2], &s2, sizeof(s2));                                        \
+        memcpy(s[3], &s3, sizeof(s3));                                        \
+    }
+
+RNG_BULK(, bulk_generic)
+#if RNG_X86
+RNG_BULK(__attribute__((target("avx2"))), bulk_avx2)
+#endif
+
+#else /* no vector extensions */
+
+static void bulk_generic(uint64_t s[4][RNG_LANES], double* out, size_t steps) {
+    Rng r;
+    memcpy(r.s, s, sizeof(r.s));
+    uint64_t x[RNG_LANES];
+    for (size_t i = 0; i < steps; i++) {
+        step(&r, x);
+        for (size_t k = 0; k < RNG_LANES; k++) out[RNG_LANES * i + k] = to_unit(x[k]);
+    }
+    memcpy(s, r.s, sizeof(r.s));
+}
+
+#endif
+
+/* Both kernel sets give identical bits; AVX2 is just wider. */
+static bool has_avx2(void) {
+#if RNG_X86
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") != 0;
+#else
+    return false;
+#endif
+}
+
+void rng_fill_uniform(Rng* r, double* out, size_t n) {
+    size_t i = 0;
+    while (i < n && r->pos < RNG_LANES) {
+        out[i++] = to_unit(r->buf[r->pos++]);
+    }
+    size_t steps = (n - i) / RNG_LANES;
+#if RNG_X86 && defined(__GNUC__)
+    if (has_avx2()) {
+        bulk_avx2(r->s, out + i, steps);
+    } else
+#endif
+    {
+        bulk_generic(r->s, out + i, steps);
+    }
+    i += steps * RNG_LANES;
+    if (i < n) {
+        step(r, r->buf);
+        r->pos = 0;
+        while (i < n) out[i++] = to_unit(r->buf[r->pos++]);
+    }
+}
+
+double rng_uniform(Rng* r) {
+    double u;
+    rng_fill_uniform(r, &u, 1);
+    return u;
+}
+
+void rng_fill_normal(Rng* r, double* out, size_t n) {
+    bool wide = has_avx2();
+    VecMathFn ln = wide ? vecmath_find("ln")->avx2 : vecmath_find("ln")->generic;
+    VecMathFn cs = wide ? vecmath_find("cos")->avx2 : vecmath_find("cos")->generic;
+    VecMathFn sn = wide ? vecmath_find("sin")->avx2 : vecmath_find("sin")->generic;
+    size_t i = 0;
+    if (n > 0 && r->has_spare) {
+        out[i++] = r->spare;
+        r->has_spare = false;
+    }
+    while (i < n) {
+        size_t pairs = (n - i + 1) / 2 < RNG_PAIRS ? (n - i + 1) / 2 : RNG_PAIRS;
+        double u[2 * RNG_PAIRS];
+        double rad[RNG_PAIRS], ang[RNG_PAIRS], c[RNG_PAIRS], s[RNG_PAIRS];
+        rng_fill_uniform(r, u, 2 * pairs);
+        for (size_t p = 0; p < pairs; p++) {
+            rad[p] = 1.0 - u[2 * p];    /* (0, 1], so the log is finite */
+            ang[p] = (2.0 * M_PI) * u[2 * p + 1];
+        }
+        ln(rad, rad, pairs, false);
+        cs(ang, c, pairs, false);
+        sn(ang, s, pairs, false);
+        for (size_t p = 0; p < pairs; p++) {
+            double m = sqrt(-2.0 * rad[p]);
+            out[i++] = m * c[p];
+            if (i < n) {
+                out[i++] = m * s[p];
+            } else {
+                r->spare = m * s[p];
+                r->has_spare = true;
+            }
+        }
+    }
+}
+
+double rng_normal(Rng* r) {
+    double z;
+    rng_fill_normal(r, &z, 1);
+    return z;
+}
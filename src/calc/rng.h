@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Generators advanced in lockstep; one step yields one output per lane. */
+#define RNG_LANES 4
+
+/* xoshiro256++ run as RNG_LANES interleaved generators, state word j of lane
+   k in s[j][k] so one step is a handful of 4-wide integer operations. The
+   output sequence is lane 0, 1, 2, 3 of step 0, then of step 1 and so on,
+   and the fill functions produce exactly what the same number of single
+   draws would, so a batch and a scalar evaluation see the same numbers.
+
+   Streams are 2^128 steps apart (the xoshiro jump polynomial): lane k of
+   stream w starts RNG_LANES * w + k jumps past the seed's state, so
+   distinct streams of one seed never overlap in practice. */
+typedef struct Rng {
+    uint64_t s[4][RNG_LANES];
+    uint64_t buf[RNG_LANES];    /* outputs of the last step not yet used */
+    size_t pos;                 /* next unused entry of buf */
+    double spare;               /* second normal of the last pair */
+    bool has_spare;
+} Rng;
+
+void rng_seed(Rng* r, uint64_t seed, size_t stream);
+
+/* Uniform on [0, 1), in steps of 2^-52. */
+double rng_uniform(Rng* r);
+
+/* Standard normal, by Box-Muller over pairs of uniforms. */
+double rng_normal(Rng* r);
+
+void rng_fill_uniform(Rng* r, double* out, size_t n);
+void rng_fill_normal(Rng* r, double* out, size_t n);
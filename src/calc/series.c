@@ -0,0 +1,235 @@
+#define _POSIX_C_SOURCE 199309L
+
+#include "calc/series.h"
+
+#include "calc/batch.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Terms evaluated by one batch run. */
+#define SERIES_BLOCK 2048
+
+/* A running sum s + c or product p + c, c holding the rounding error. */
+typedef struct {
+    double v;
+    double c;
+} Compensated;
+
+typedef struct {
+    Compensated acc;
+    Status failure;          /* at index fail_at */
+    double fail_at;
+} SeriesChunk;
+
+typedef struct {
+    const EvalContext* ctx;
+    BatchPlan plan;
+    const char* var;
+    SeriesKind kind;
+    double from;
+    size_t terms;
+    size_t chunk_count;
+    SeriesChunk* chunks;
+
+    pthread_mutex_t lock;
+    size_t next_chunk;
+    size_t failed_chunk;     /* lowest chunk with an error so far */
+    Status failure;          /* a batch run failed as a whole */
+} SeriesJob;
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+/* Neumaier's variant of Kahan summation: also exact when x is larger than
+   the running sum. */
+static void sum_add(Compensated* a, double x) {
+    double t = a->v + x;
+    if (fabs(a->v) >= fabs(x)) {
+        a->c += (a->v - t) + x;
+    } else {
+        a->c += (x - t) + a->v;
+    }
+    a->v = t;
+}
+
+/* Graillat's compensated product: fma recovers the rounding error of each
+   multiplication exactly. */
+static void prod_mul(Compensated* a, double x) {
+    double p = a->v * x;
+    a->c = a->c * x + fma(a->v, x, -p);
+    a->v = p;
+}
+
+static void combine(SeriesKind kind, Compensated* a, const Compensated* b) {
+    if (kind == SERIES_SUM) {
+        sum_add(a, b->v);
+        a->c += b->c;
+    } else {
+        /* (a.v + a.c)(b.v + b.c): prod_mul covers all but a.v * b.c */
+        double c = a->v * b->c;
+        prod_mul(a, b->v);
+        a->c += c;
+    }
+}
+
+static void reduce_chunk(SeriesJob* job, size_t k, double* xs, double* ys, uint8_t* err) {
+    SeriesChunk* chunk = &job->chunks[k];
+    size_t base = k * SERIES_CHUNK;
+    size_t m = job->terms - base < SERIES_CHUNK ? job->terms - base : SERIES_CHUNK;
+    for (size_t done = 0; done < m; done += SERIES_BLOCK) {
+        size_t n = m - done < SERIES_BLOCK ? m - done : SERIES_BLOCK;
+        double first = job->from + (double)(base + done);
+        for (size_t i = 0; i < n; i++) {
+            xs[i] = first + (double)i;
+        }
+        const BatchInput in = { job->var, xs };
+        BatchReport rep;
+        Status st = batch_plan_run(&job->plan, job->ctx, &in, 1, n, ys, err, &rep);
+        if (!st.ok) {
+            pthread_mutex_lock(&job->lock);
+            if (job->failure.ok) job->failure = st;
+            pthread_mutex_unlock(&job->lock);
+            return;
+        }
+        if (rep.errors > 0) {
+            for (size_t i = 0; i < n; i++) {
+                if (err[i] != 0) {
+                    chunk->failure = status_err(batch_error_message(&rep, err[i]));
+                    chunk->fail_at = xs[i];
+                    return;
+                }
+            }
+        }
+        /* local accumulators stay in registers; through chunk they would
+           be reloaded after every store to ys's memory */
+        if (job->kind == SERIES_SUM) {
+            /* four interleaved sums hide the latency of the dependent adds;
+               which term goes to which is fixed by its index */
+            Compensated lane[4] = { { 0.0, 0.0 }, { 0.0, 0.0 }, { 0.0, 0.0 }, { 0.0, 0.0 } };
+            size_t i = 0;
+            for (; i + 4 <= n; i += 4) {
+                sum_add(&lane[0], ys[i]);
+                sum_add(&lane[1], ys[i + 1]);
+                sum_add(&lane[2], ys[i + 2]);
+                sum_add(&lane[3], ys[i + 3]);
+            }
+            for (; i < n; i++) sum_add(&lane[0], ys[i]);
+            for (size_t j = 0; j < 4; j++) combine(SERIES_SUM, &chunk->acc, &lane[j]);
+        } else {
+            Compensated acc = chunk->acc;
+            for (size_t i = 0; i < n; i++) prod_mul(&acc, ys[i]);
+            chunk->acc = acc;
+        }
+    }
+}
+
+static void series_worker(void* p, size_t worker) {
+    (void)worker;
+    SeriesJob* job = p;
+    double* xs = malloc(SERIES_BLOCK * sizeof(double));
+    double* ys = malloc(SERIES_BLOCK * sizeof(double));
+    uint8_t* err = malloc(SERIES_BLOCK);
+
+    pthread_mutex_lock(&job->lock);
+    if (xs == NULL || ys == NULL || err == NULL) {
+        if (job->failure.ok) job->failure = status_err("error: out of memory");
+    }
+    /* chunks past a failed one cannot change the outcome */
+    while (job->failure.ok && job->next_chunk < job->chunk_count && job->next_chunk < job->failed_chunk) {
+        size_t k = job->next_chunk++;
+        pthread_mutex_unlock(&job->lock);
+        reduce_chunk(job, k, xs, ys, err);
+        pthread_mutex_lock(&job->lock);
+        if (!job->chunks[k].failure.ok && k < job->failed_chunk) {
+            job->failed_chunk = k;
+        }
+    }
+    pthread_mutex_unlock(&job->lock);
+
+    free(xs);
+    free(ys);
+    free(err);
+}
+
+Status series_run(const Ast* ast, const EvalContext* ctx, ThreadPool* pool, SeriesKind kind, double from, double to,
+                  SeriesResult* out) {
+    double t0 = now_sec();
+    memset(out, 0, sizeof(*out));
+    out->value = kind == SERIES_SUM ? 0.0 : 1.0;
+    out->threads = 1;
+    if (ast->input_count != 1) {
+        return status_err("error: series needs exactly one index");
+    }
+    if (!isfinite(from) || !isfinite(to) || floor(from) != from || floor(to) != to) {
+        return status_err("error: series bounds must be integers");
+    }
+    if (to < from) {
+        return status_ok();
+    }
+    if (to - from + 1.0 > SERIES_MAX_TERMS) {
+        return status_err("error: series has too many terms");
+    }
+
+    SeriesJob job;
+    job.ctx = ctx;
+    job.var = ast->inputs[0];
+    job.kind = kind;
+    job.from = from;
+    job.terms = (size_t)(to - from) + 1;
+    job.chunk_count = (job.terms + SERIES_CHUNK - 1) / SERIES_CHUNK;
+    job.next_chunk = 0;
+    job.failed_chunk = SIZE_MAX;
+    job.failure = status_ok();
+    job.chunks = malloc(job.chunk_count * sizeof(SeriesChunk));
+    if (job.chunks == NULL) {
+        return status_err("error: out of memory");
+    }
+    for (size_t k = 0; k < job.chunk_count; k++) {
+        job.chunks[k].acc = (Compensated){ kind == SERIES_SUM ? 0.0 : 1.0, 0.0 };
+        job.chunks[k].failure = status_ok();
+    }
+    Status st = batch_plan_init(&job.plan, ast, BATCH_ISA_AUTO);
+    if (!st.ok) {
+        free(job.chunks);
+        return st;
+    }
+    pthread_mutex_init(&job.lock, NULL);
+
+    /* one chunk needs no threads */
+    if (pool != NULL && job.chunk_count > 1) {
+        thread_pool_start(pool, series_worker, &job);
+        thread_pool_wait(pool);
+        out->threads = pool->count;
+    } else {
+        series_worker(&job, 0);
+    }
+
+    st = job.failure;
+    if (st.ok && job.failed_chunk != SIZE_MAX) {
+        st = job.chunks[job.failed_chunk].failure;
+    }
+    if (st.ok) {
+        Compensated total = job.chunks[0].acc;
+        for (size_t k = 1; k < job.chunk_count; k++) {
+            combine(kind, &total, &job.chunks[k].acc);
+        }
+        out->value = total.v + total.c;
+        out->terms = job.terms;
+        out->chunks = job.chunk_count;
+        if (!isfinite(out->value)) {
+            st = status_err("error: non-finite result");
+        }
+    }
+    out->seconds = now_sec() - t0;
+
+    pthread_mutex_destroy(&job.lock);
+    batch_plan_free(&job.plan);
+    free(job.chunks);
+    return st;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "util/status.h"
+#include "util/thread_pool.h"
+#include "calc/parser.h"
+#include "calc/eval.h"
+
+#include <stddef.h>
+
+/* Consecutive indices reduced as one unit of work. The split depends only
+   on the range, never on the thread count. */
+#define SERIES_CHUNK 65536
+
+#define SERIES_MAX_TERMS 1e10
+
+typedef enum {
+    SERIES_SUM,
+    SERIES_PROD,
+} SeriesKind;
+
+typedef struct {
+    double value;
+    size_t terms;
+    size_t chunks;
+    size_t threads;
+    double seconds;
+} SeriesResult;
+
+/* The sum or product of ast, whose only input is the index, over the
+   integers from..to (empty, giving 0 or 1, when to < from). The body is
+   compiled once to a batch plan. Each chunk of SERIES_CHUNK indices is
+   reduced with compensation (Neumaier sums over four interleaved lanes, or
+   the fma-based error-free product) in an order fixed by the indices, and
+   the chunk results are combined the same way in chunk order, so the value
+   is bit-for-bit the same with any number of threads. pool NULL runs on the calling thread.
+   Fails with the body's error at the lowest failing index. */
+Status series_run(const Ast* ast, const EvalContext* ctx, ThreadPool* pool, SeriesKind kind, double from, double to,
+                  SeriesResult* out);
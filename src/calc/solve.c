@@ -0,0 +1,224 @@
+#include "calc/solve.h"
+
+#include <float.h>
+#include <math.h>
+#include <string.h>
+
+typedef struct {
+    const Program* prog;
+    EvalContext ctx;         /* with one input */
+    SolveResult* out;
+    bool bracketed;          /* f(lo) and f(hi) differ in sign */
+    double lo, flo, hi, fhi;
+} Solver;
+
+static Status eval_f(Solver* s, double x, double* fx) {
+    s->ctx.inputs = &x;
+    s->out->evaluations++;
+    Status st = bytecode_run(s->prog, &s->ctx, fx);
+    s->ctx.inputs = NULL;
+    return st;
+}
+
+static Status eval_fd(Solver* s, double x, double* fx, double* dfx) {
+    Dual in = { x, 1.0 };
+    Dual r = { 0.0, 0.0 };
+    s->out->evaluations++;
+    Status st = bytecode_run_dual(s->prog, &s->ctx, &in, &r);
+    *fx = r.v;
+    *dfx = r.d;
+    return st;
+}
+
+/* Records f(x1) = f1 after f(x) = fx: shrinks the bracket when x1 is
+   inside it, or starts one when the two differ in sign. */
+static void note(Solver* s, double x, double fx, double x1, double f1) {
+    if (s->bracketed && x1 > s->lo && x1 < s->hi) {
+        if ((f1 < 0.0) == (s->flo < 0.0)) {
+            s->lo = x1;
+            s->flo = f1;
+        } else {
+            s->hi = x1;
+            s->fhi = f1;
+        }
+    } else if ((fx < 0.0) != (f1 < 0.0)) {
+        s->bracketed = true;
+        s->lo = x < x1 ? x : x1;
+        s->flo = x < x1 ? fx : f1;
+        s->hi = x < x1 ? x1 : x;
+        s->fhi = x < x1 ? f1 : fx;
+    }
+}
+
+static double x_tol(double x) {
+    return 4.0 * DBL_EPSILON * fmax(fabs(x), 1.0);
+}
+
+static bool done(Solver* s, double x, double fx) {
+    s->out->root = x;
+    s->out->value = fx;
+    return true;
+}
+
+/* Safeguarded Newton from x. Returns true once converged. */
+static bool newton(Solver* s, double x, double fx, double dfx) {
+    for (s->out->newton = 0; s->out->newton < SOLVE_MAX_NEWTON; s->out->newton++) {
+        if (fx == 0.0) {
+            return done(s, x, fx);
+        }
+        double step = fx / dfx;
+        if (!isfinite(step) || dfx == 0.0) {
+            return false;
+        }
+        if (fabs(step) <= x_tol(x)) {
+            s->out->newton++;
+            return done(s, x, fx);
+        }
+        bool moved = false;
+        for (int tries = 0; tries < 8 && !moved; tries++, step *= 0.5) {
+            double x1 = x - step;
+            bool bisect = s->bracketed && !(x1 > s->lo && x1 < s->hi);
+            if (bisect) {
+                x1 = 0.5 * (s->lo + s->hi);
+            }
+            double f1 = 0.0, d1 = 0.0;
+            if (!eval_fd(s, x1, &f1, &d1).ok) {
+                continue;
+            }
+            note(s, x, fx, x1, f1);
+            if (fabs(x1 - x) <= x_tol(x1)) {
+                s->out->newton++;
+                return done(s, fabs(f1) <= fabs(fx) ? x1 : x, fabs(f1) <= fabs(fx) ? f1 : fx);
+            }
+            if (fabs(f1) < fabs(fx) || bisect) {
+                x = x1;
+                fx = f1;
+                dfx = d1;
+                moved = true;
+            }
+        }
+        if (!moved) {
+            return false;
+        }
+        if (s->bracketed && s->hi - s->lo <= x_tol(s->lo)) {
+            s->out->newton++;
+            return done(s, fabs(s->flo) < fabs(s->fhi) ? s->lo : s->hi, fabs(s->flo) < fabs(s->fhi) ? s->flo : s->fhi);
+        }
+    }
+    return false;
+}
+
+/* Looks for a sign change at guess +- h, h doubling. Points where f fails
+   are skipped. */
+static void find_bracket(Solver* s, double guess, double fguess) {
+    double h = fmax(fabs(guess) * 0.01, 0.01);
+    double prev_lo = guess, fprev_lo = fguess, prev_hi = guess, fprev_hi = fguess;
+    for (size_t i = 0; i < SOLVE_MAX_BRACKET && !s->bracketed; i++, h *= 2.0) {
+        double xs[2] = { guess + h, guess - h };
+        for (int k = 0; k < 2 && !s->bracketed; k++) {
+            double fx = 0.0;
+            s->out->bracket++;
+            if (!isfinite(xs[k]) || !eval_f(s, xs[k], &fx).ok) {
+                continue;
+            }
+            if (k == 0) {
+                note(s, prev_hi, fprev_hi, xs[k], fx);
+                prev_hi = xs[k];
+                fprev_hi = fx;
+            } else {
+                note(s, prev_lo, fprev_lo, xs[k], fx);
+                prev_lo = xs[k];
+                fprev_lo = fx;
+            }
+        }
+    }
+}
+
+/* Brent's method on the bracket [lo, hi]: inverse quadratic or secant
+   steps, falling back to bisection when they do not shrink it fast enough. */
+static bool brent(Solver* s) {
+    double a = s->lo, fa = s->flo, b = s->hi, fb = s->fhi;
+    double c = a, fc = fa, d = b - a, e = d;
+    for (s->out->brent = 0; s->out->brent < SOLVE_MAX_BRENT; s->out->brent++) {
+        if ((fb > 0.0) == (fc > 0.0)) {
+            c = a;
+            fc = fa;
+            d = e = b - a;
+        }
+        if (fabs(fc) < fabs(fb)) {
+            a = b; b = c; c = a;
+            fa = fb; fb = fc; fc = fa;
+        }
+        double tol = 0.5 * x_tol(b);
+        double m = 0.5 * (c - b);
+        if (fabs(m) <= tol || fb == 0.0) {
+            return done(s, b, fb);
+        }
+        if (fabs(e) >= tol && fabs(fa) > fabs(fb)) {
+            double p, q, r;
+            double t = fb / fa;
+            if (a == c) {
+                p = 2.0 * m * t;
+                q = 1.0 - t;
+            } else {
+                q = fa / fc;
+                r = fb / fc;
+                p = t * (2.0 * m * q * (q - r) - (b - a) * (r - 1.0));
+                q = (q - 1.0) * (r - 1.0) * (t - 1.0);
+            }
+            if (p > 0.0) {
+                q = -q;
+            } else {
+                p = -p;
+            }
+            if (2.0 * p < fmin(3.0 * m * q - fabs(tol * q), fabs(e * q))) {
+                e = d;
+                d = p / q;
+            } else {
+                d = m;
+                e = m;
+            }
+        } else {
+            d = m;
+            e = m;
+        }
+        a = b;
+        fa = fb;
+        b += fabs(d) > tol ? d : (m > 0.0 ? tol : -tol);
+        if (!eval_f(s, b, &fb).ok) {
+            /* inside a sign change but undefined here: halve instead */
+            b = a + m;
+            if (!eval_f(s, b, &fb).ok) {
+                return false;
+            }
+        }
+    }
+    return false;
+}
+
+Status solve_run(const Program* prog, const EvalContext* ctx, double guess, SolveResult* out) {
+    memset(out, 0, sizeof(*out));
+    Solver s;
+    s.prog = prog;
+    s.ctx = *ctx;
+    s.ctx.inputs = NULL;
+    s.ctx.input_count = 1;
+    s.out = out;
+    s.bracketed = false;
+
+    double fx = 0.0, dfx = 0.0;
+    Status st = eval_fd(&s, guess, &fx, &dfx);
+    if (!st.ok) {
+        return st;
+    }
+    if (newton(&s, guess, fx, dfx)) {
+        return status_ok();
+    }
+    if (!s.bracketed) {
+        find_bracket(&s, guess, fx);
+    }
+    if (s.bracketed && brent(&s)) {
+        return status_ok();
+    }
+    return status_err("error: no root found");
+}
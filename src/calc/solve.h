@@ -0,0 +1,32 @@
+#pragma once
+
+#include "util/status.h"
+#include "calc/bytecode.h"
+#include "calc/eval.h"
+
+#include <stddef.h>
+
+#define SOLVE_MAX_NEWTON 60
+#define SOLVE_MAX_BRENT 200
+
+/* Sign changes looked for by doubling the distance from the guess. */
+#define SOLVE_MAX_BRACKET 80
+
+typedef struct {
+    double root;
+    double value;            /* f(root) */
+    size_t newton;           /* Newton iterations */
+    size_t brent;            /* Brent iterations, 0 when Newton converged */
+    size_t bracket;          /* points tried while looking for a sign change */
+    size_t evaluations;      /* passes over prog; a dual pass gives f and f' */
+} SolveResult;
+
+/* Finds x with f(x) = 0 near guess, where f is prog with x as its only
+   input. Newton steps use exact derivatives from bytecode_run_dual, so each
+   costs one pass where finite differences would need two. A step is halved
+   until |f| decreases, and is replaced by bisection when it leaves a known
+   sign change. When Newton stalls (zero or non-finite derivative, no
+   decrease, iteration limit) Brent's method finishes on a bracket, searched
+   outward from guess if none was seen. Fails with the evaluation error at
+   guess, or "error: no root found". */
+Status solve_run(const Program* prog, const EvalContext* ctx, double guess, SolveResult* out);
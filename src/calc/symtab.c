@@ -0,0 +1,649 @@
+#include "calc/symtab.h"
+
+#include "calc/builtins.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* FNV-1a over the lowercased name. */
+static uint32_t name_hash(const char* name, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (uint32_t)tolower((unsigned char)name[i]);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static bool name_eq(const char* entry, const char* name, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (entry[i] != (char)tolower((unsigned char)name[i])) {
+            return false;
+        }
+    }
+    return entry[len] == '\0';
+}
+
+void symtab_init(SymTab* t) {
+    memset(t, 0, sizeof(*t));
+}
+
+static void free_symbol(Symbol* s) {
+    free(s->body.code);
+    free(s->source);
+    free(s->deps);
+    free(s->users);
+}
+
+void symtab_free(SymTab* t) {
+    for (size_t i = 0; i < t->count; i++) {
+        free_symbol(&t->symbols[i]);
+    }
+    free(t->symbols);
+    free(t->slots);
+    memset(t, 0, sizeof(*t));
+}
+
+/* The slot holding name, or the empty slot where it would go. */
+static SymSlot* probe(const SymTab* t, uint32_t h, const char* name, size_t len) {
+    size_t i = h & t->slot_mask;
+    while (t->slots[i].index != 0) {
+        const SymSlot* s = &t->slots[i];
+        if (s->hash == h && name_eq(t->symbols[s->index - 1].name, name, len)) {
+            break;
+        }
+        i = (i + 1) & t->slot_mask;
+    }
+    return &t->slots[i];
+}
+
+int symtab_find(const SymTab* t, const char* name, size_t len) {
+    if (t == NULL || t->count == 0 || len >= SYMTAB_NAME_MAX) {
+        return -1;
+    }
+    const SymSlot* s = probe(t, name_hash(name, len), name, len);
+    return s->index != 0 ? (int)s->index - 1 : -1;
+}
+
+const Symbol* symtab_get(const SymTab* t, int id) {
+    if (t == NULL || id < 0 || (size_t)id >= t->count) {
+        return NULL;
+    }
+    return &t->symbols[id];
+}
+
+static bool rehash(SymTab* t, size_t slot_cap) {
+    SymSlot* slots = calloc(slot_cap, sizeof(SymSlot));
+    if (slots == NULL) {
+        return false;
+    }
+    for (size_t i = 0; i <= t->slot_mask && t->slots != NULL; i++) {
+        SymSlot s = t->slots[i];
+        if (s.index == 0) {
+            continue;
+        }
+        size_t j = s.hash & (slot_cap - 1);
+        while (slots[j].index != 0) {
+            j = (j + 1) & (slot_cap - 1);
+        }
+        slots[j] = s;
+    }
+    free(t->slots);
+    t->slots = slots;
+    t->slot_mask = slot_cap - 1;
+    return true;
+}
+
+/* Adds a symbol for a name known to be absent. */
+static Status add(SymTab* t, const char* name, size_t len, SymbolKind kind, int* id) {
+    if (len == 0 || len >= SYMTAB_NAME_MAX) {
+        return status_err("error: name too long");
+    }
+    if (t->count >= SYMTAB_MAX_SYMBOLS) {
+        return status_err("error: too many symbols");
+    }
+    if (t->count == t->cap) {
+        size_t cap = t->cap ? t->cap * 2 : 16;
+        Symbol* grown = realloc(t->symbols, cap * sizeof(Symbol));
+        if (grown == NULL) {
+            return status_err("error: out of memory");
+        }
+        t->symbols = grown;
+        t->cap = cap;
+    }
+    size_t slot_cap = t->slots ? t->slot_mask + 1 : 0;
+    if ((t->count + 1) * 2 > slot_cap && !rehash(t, slot_cap ? slot_cap * 2 : 32)) {
+        return status_err("error: out of memory");
+    }
+
+    Symbol* s = &t->symbols[t->count];
+    memset(s, 0, sizeof(*s));
+    for (size_t i = 0; i < len; i++) {
+        s->name[i] = (char)tolower((unsigned char)name[i]);
+    }
+    s->kind = kind;
+    uint32_t h = name_hash(name, len);
+    SymSlot* slot = probe(t, h, name, len);
+    slot->hash = h;
+    slot->index = (uint32_t)++t->count;
+    *id = (int)t->count - 1;
+    return status_ok();
+}
+
+/* The symbols and context body reads, each symbol once. */
+static Status collect_deps(const Program* body, int** deps, size_t* dep_count, unsigned* env) {
+    size_t n = 0;
+    *env = 0;
+    for (size_t i = 0; i < body->code_len; i++) {
+        switch (body->code[i].op) {
+            case OP_ANS: *env |= SYMTAB_DEP_ANS; break;
+            case OP_MEM: *env |= SYMTAB_DEP_MEM; break;
+            case OP_CALL: {
+                const BuiltinFunc* f = builtins_func(builtins_func_id(body->code[i].as.fn));
+                *env |= SYMTAB_DEP_MODE | (f != NULL && f->fill != NULL ? SYMTAB_DEP_RANDOM : 0u);
+                break;
+            }
+            case OP_USER_VAR:
+            case OP_USER_CALL: n++; break;
+            default: break;
+        }
+    }
+    *deps = NULL;
+    *dep_count = 0;
+    if (n == 0) {
+        return status_ok();
+    }
+    int* ids = malloc(n * sizeof(int));
+    if (ids == NULL) {
+        return status_err("error: out of memory");
+    }
+    n = 0;
+    for (size_t i = 0; i < body->code_len; i++) {
+        const Instr* ip = &body->code[i];
+        int id = ip->op == OP_USER_VAR ? (int)ip->arg : ip->op == OP_USER_CALL ? ip->as.sym : -1;
+        bool seen = id < 0;
+        for (size_t j = 0; j < n && !seen; j++) {
+            seen = ids[j] == id;
+        }
+        if (!seen) {
+            ids[n++] = id;
+        }
+    }
+    *deps = ids;
+    *dep_count = n;
+    return status_ok();
+}
+
+static void visit(SymTab* t, int id, uint8_t bit, int* seen, size_t* n) {
+    if ((t->symbols[id].mark & bit) == 0) {
+        t->symbols[id].mark |= bit;
+        seen[(*n)++] = id;
+    }
+}
+
+/* Breadth-first walk from the from list along deps (forward) or users edges.
+   Sets bit in the mark of every symbol reached and lists them in seen, which
+   has room for t->count. */
+static size_t reach(SymTab* t, const int* from, size_t from_count, bool forward, uint8_t bit, int* seen) {
+    size_t n = 0;
+    for (size_t i = 0; i < from_count; i++) {
+        visit(t, from[i], bit, seen, &n);
+    }
+    for (size_t q = 0; q < n; q++) {
+        const Symbol* s = &t->symbols[seen[q]];
+        const int* next = forward ? s->deps : s->users;
+        size_t k = forward ? s->dep_count : s->user_count;
+        for (size_t i = 0; i < k; i++) {
+            visit(t, next[i], bit, seen, &n);
+        }
+    }
+    return n;
+}
+
+/* Whether giving symbol id a body that reads deps closes a cycle through a
+   variable: some variable would both feed the body and read id. Recursion
+   among functions alone is fine, since function bodies are never
+   recomputed. */
+static Status check_cycle(SymTab* t, int id, const int* deps, size_t dep_count, bool* cycle) {
+    *cycle = false;
+    int* seen = malloc(2 * t->count * sizeof(int));
+    if (seen == NULL) {
+        return status_err("error: out of memory");
+    }
+    size_t nf = reach(t, deps, dep_count, true, 1, seen);
+    size_t nb = reach(t, &id, 1, false, 2, seen + t->count);
+    for (size_t i = 0; i < nf; i++) {
+        const Symbol* s = &t->symbols[seen[i]];
+        if (s->mark == 3 && s->kind == SYMBOL_VAR && (s->body.code != NULL || seen[i] == id)) {
+            *cycle = true;
+        }
+    }
+    for (size_t i = 0; i < nf; i++) {
+        t->symbols[seen[i]].mark = 0;
+    }
+    for (size_t i = 0; i < nb; i++) {
+        t->symbols[seen[t->count + i]].mark = 0;
+    }
+    free(seen);
+    return status_ok();
+}
+
+/* Makes deps (taking ownership on success) what symbol id reads, moving id
+   between the users lists of its old and new dependencies. */
+static Status set_deps(SymTab* t, int id, int* deps, size_t dep_count, unsigned env) {
+    for (size_t i = 0; i < dep_count; i++) {
+        Symbol* d = &t->symbols[deps[i]];
+        if (d->user_count == d->user_cap) {
+            size_t cap = d->user_cap ? d->user_cap * 2 : 4;
+            int* grown = realloc(d->users, cap * sizeof(int));
+            if (grown == NULL) {
+                return status_err("error: out of memory");
+            }
+            d->users = grown;
+            d->user_cap = cap;
+        }
+    }
+    Symbol* s = &t->symbols[id];
+    for (size_t i = 0; i < s->dep_count; i++) {
+        Symbol* d = &t->symbols[s->deps[i]];
+        for (size_t j = 0; j < d->user_count; j++) {
+            if (d->users[j] == id) {
+                d->users[j] = d->users[--d->user_count];
+                break;
+            }
+        }
+    }
+    free(s->deps);
+    s->deps = deps;
+    s->dep_count = dep_count;
+    s->env = env;
+    t->env |= env;
+    for (size_t i = 0; i < dep_count; i++) {
+        Symbol* d = &t->symbols[deps[i]];
+        d->users[d->user_count++] = id;
+    }
+    return status_ok();
+}
+
+static void make_dirty(SymTab* t, int id, int* queue, size_t* n) {
+    Symbol* s = &t->symbols[id];
+    if (!s->dirty) {
+        s->dirty = true;
+        t->dirty_count++;
+        if (queue != NULL) {
+            queue[(*n)++] = id;
+        }
+    }
+}
+
+/* Marks everything reading the first n queued symbols dirty, transitively.
+   Without a queue, marks every symbol that reads anything. */
+static void spread_dirty(SymTab* t, int* queue, size_t n) {
+    if (queue == NULL) {
+        for (size_t i = 0; i < t->count; i++) {
+            if (t->symbols[i].dep_count > 0 || t->symbols[i].env != 0) {
+                make_dirty(t, (int)i, NULL, NULL);
+            }
+        }
+        return;
+    }
+    for (size_t q = 0; q < n; q++) {
+        const Symbol* s = &t->symbols[queue[q]];
+        for (size_t i = 0; i < s->user_count; i++) {
+            make_dirty(t, s->users[i], queue, &n);
+        }
+    }
+    free(queue);
+}
+
+/* Symbol id changed: its readers need recomputing. */
+static void touch(SymTab* t, int id) {
+    const Symbol* s = &t->symbols[id];
+    if (s->user_count == 0) {
+        return;
+    }
+    int* queue = malloc(t->count * sizeof(int));
+    size_t n = 0;
+    for (size_t i = 0; queue != NULL && i < s->user_count; i++) {
+        make_dirty(t, s->users[i], queue, &n);
+    }
+    spread_dirty(t, queue, n);
+}
+
+void symtab_touch_env(SymTab* t, unsigned env) {
+    if ((t->env & env) == 0) {
+        return;
+    }
+    int* queue = malloc(t->count * sizeof(int));
+    size_t n = 0;
+    for (size_t i = 0; queue != NULL && i < t->count; i++) {
+        if (t->symbols[i].env & env) {
+            make_dirty(t, (int)i, queue, &n);
+        }
+    }
+    spread_dirty(t, queue, n);
+}
+
+/* Copies body and source for the table to own. */
+static Status copy_body(const Program* body, const char* source, Program* out, char** text) {
+    Instr* code = malloc((body->code_len + 1) * sizeof(Instr));
+    *text = malloc(strlen(source) + 1);
+    if (code == NULL || *text == NULL) {
+        free(code);
+        free(*text);
+        *text = NULL;
+        return status_err("error: out of memory");
+    }
+    memcpy(code, body->code, body->code_len * sizeof(Instr));
+    strcpy(*text, source);
+    *out = *body;
+    out->code = code;
+    out->code_cap = body->code_len;
+    return status_ok();
+}
+
+static void set_body(Symbol* s, const Program* body, char* source) {
+    free(s->body.code);
+    free(s->source);
+    if (body != NULL) {
+        s->body = *body;
+    } else {
+        memset(&s->body, 0, sizeof(s->body));
+    }
+    s->source = source;
+}
+
+Status symtab_set_var(SymTab* t, const char* name, size_t len, double value, int* id) {
+    int found = symtab_find(t, name, len);
+    if (found >= 0 && t->symbols[found].kind != SYMBOL_VAR) {
+        return status_err("error: name is already a function");
+    }
+    if (found < 0) {
+        Status st = add(t, name, len, SYMBOL_VAR, &found);
+        if (!st.ok) {
+            return st;
+        }
+    }
+    Symbol* s = &t->symbols[found];
+    (void)set_deps(t, found, NULL, 0, 0);
+    set_body(s, NULL, NULL);
+    s->value = value;
+    s->error = NULL;
+    if (s->dirty) {
+        s->dirty = false;
+        t->dirty_count--;
+    }
+    touch(t, found);
+    *id = found;
+    return status_ok();
+}
+
+Status symtab_define_var(SymTab* t, const char* name, size_t len, const Program* formula, const char* source,
+                         const EvalContext* ctx, int* id) {
+    int found = symtab_find(t, name, len);
+    if (found >= 0 && t->symbols[found].kind != SYMBOL_VAR) {
+        return status_err("error: name is already a function");
+    }
+    EvalContext inner = *ctx;
+    inner.symbols = t;
+    double value = 0.0;
+    Status st = bytecode_run(formula, &inner, &value);
+    if (!st.ok) {
+        return st;
+    }
+
+    int* deps = NULL;
+    size_t dep_count = 0;
+    unsigned env = 0;
+    st = collect_deps(formula, &deps, &dep_count, &env);
+    bool cycle = false;
+    if (st.ok && found >= 0) {
+        st = check_cycle(t, found, deps, dep_count, &cycle);
+    }
+    /* a constant needs no formula */
+    if (!st.ok || cycle || (dep_count == 0 && env == 0)) {
+        free(deps);
+        return st.ok ? symtab_set_var(t, name, len, value, id) : st;
+    }
+
+    Program body;
+    char* text = NULL;
+    st = copy_body(formula, source, &body, &text);
+    bool added = found < 0;
+    if (st.ok && added) {
+        st = add(t, name, len, SYMBOL_VAR, &found);
+    }
+    if (st.ok) {
+        st = set_deps(t, found, deps, dep_count, env);
+        if (!st.ok && added) {
+            symtab_forget_last(t);
+        }
+    }
+    if (!st.ok) {
+        free(deps);
+        if (text != NULL) {
+            free(body.code);
+            free(text);
+        }
+        return st;
+    }
+
+    Symbol* s = &t->symbols[found];
+    set_body(s, &body, text);
+    s->value = value;
+    s->error = NULL;
+    if (s->dirty) {
+        s->dirty = false;
+        t->dirty_count--;
+    }
+    touch(t, found);
+    *id = found;
+    return status_ok();
+}
+
+Status symtab_declare_func(SymTab* t, const char* name, size_t len, size_t arity, int* id, bool* added) {
+    int found = symtab_find(t, name, len);
+    *added = found < 0;
+    if (found >= 0 && t->symbols[found].kind != SYMBOL_FUNC) {
+        return status_err("error: name is already a variable");
+    }
+    if (found < 0) {
+        Status st = add(t, name, len, SYMBOL_FUNC, &found);
+        if (!st.ok) {
+            return st;
+        }
+    }
+    t->symbols[found].arity = arity;
+    *id = found;
+    return status_ok();
+}
+
+Status symtab_define_func(SymTab* t, int id, const Program* body, const char* source) {
+    int* deps = NULL;
+    size_t dep_count = 0;
+    unsigned env = 0;
+    Status st = collect_deps(body, &deps, &dep_count, &env);
+    bool cycle = false;
+    if (st.ok) st = check_cycle(t, id, deps, dep_count, &cycle);
+    if (st.ok && cycle) st = status_err("error: circular definition");
+    Program copy;
+    char* text = NULL;
+    if (st.ok) st = copy_body(body, source, &copy, &text);
+    if (st.ok) {
+        st = set_deps(t, id, deps, dep_count, env);
+        if (!st.ok) {
+            free(copy.code);
+            free(text);
+        }
+    }
+    if (!st.ok) {
+        free(deps);
+        return st;
+    }
+    set_body(&t->symbols[id], &copy, text);
+    touch(t, id);
+    t->func_version++;
+    return status_ok();
+}
+
+void symtab_forget_last(SymTab* t) {
+    if (t->count == 0) {
+        return;
+    }
+    int id = (int)t->count - 1;
+    Symbol* s = &t->symbols[id];
+    (void)set_deps(t, id, NULL, 0, 0);
+    if (s->dirty) {
+        t->dirty_count--;
+    }
+    SymSlot* slot = probe(t, name_hash(s->name, strlen(s->name)), s->name, strlen(s->name));
+    slot->index = 0;
+    slot->hash = 0;
+    free_symbol(s);
+    t->count--;
+}
+
+typedef struct {
+    int id;
+    size_t next;    /* next dependency to look at */
+} UpdateFrame;
+
+Status symtab_update(SymTab* t, const EvalContext* ctx) {
+    if (t->dirty_count == 0) {
+        return status_ok();
+    }
+    UpdateFrame* stack = malloc(t->count * sizeof(UpdateFrame));
+    if (stack == NULL) {
+        return status_err("error: out of memory");
+    }
+    EvalContext inner = *ctx;
+    inner.symbols = t;
+    t->stats.updates++;
+    for (size_t i = 0; i < t->count; i++) {
+        if (t->symbols[i].kind == SYMBOL_VAR && t->symbols[i].body.code != NULL) {
+            t->stats.full++;
+        }
+    }
+
+    /* depth-first over dirty dependencies, recomputing on the way out; a
+       clean symbol never reads a dirty one, so the walk stops there. mark
+       flags symbols on the stack, which only function recursion revisits. */
+    for (size_t i = 0; i < t->count && t->dirty_count > 0; i++) {
+        if (!t->symbols[i].dirty) {
+            continue;
+        }
+        size_t len = 0;
+        stack[len++] = (UpdateFrame){ (int)i, 0 };
+        t->symbols[i].mark = 1;
+        while (len > 0) {
+            UpdateFrame* f = &stack[len - 1];
+            Symbol* s = &t->symbols[f->id];
+            if (f->next < s->dep_count) {
+                Symbol* d = &t->symbols[s->deps[f->next]];
+                if (d->dirty && d->mark == 0) {
+                    d->mark = 1;
+                    stack[len++] = (UpdateFrame){ s->deps[f->next], 0 };
+                }
+                f->next++;
+                continue;
+            }
+            if (s->kind == SYMBOL_VAR && s->body.code != NULL) {
+                double v = 0.0;
+                Status st = bytecode_run(&s->body, &inner, &v);
+                s->value = st.ok ? v : s->value;
+                s->error = st.ok ? NULL : st.msg;
+                t->stats.recomputed++;
+            }
+            s->dirty = false;
+            s->mark = 0;
+            t->dirty_count--;
+            len--;
+        }
+    }
+    free(stack);
+    return status_ok();
+}
+
+/* The checks before running function id's body, and the context it runs in. */
+static Status enter_call(const SymTab* t, int id, size_t argc, const EvalContext* ctx, EvalContext* inner) {
+    const Symbol* s = symtab_get(t, id);
+    if (s == NULL || s->kind != SYMBOL_FUNC) {
+        return status_err("error: unknown function");
+    }
+    if (s->body.code == NULL) {
+        return status_err("error: function has no body");
+    }
+    /* a caller compiled before the function was redefined */
+    if (argc != s->arity) {
+        return status_err("error: wrong number of function args");
+    }
+    if (ctx->call_depth >= ctx->max_call_depth) {
+        return status_err("error: recursion too deep");
+    }
+    *inner = *ctx;
+    inner->inputs = NULL;
+    inner->input_count = argc;
+    inner->call_depth = ctx->call_depth + 1;
+    return status_ok();
+}
+
+Status symtab_call(const SymTab* t, int id, const double* args, size_t argc, const EvalContext* ctx, double* out) {
+    EvalContext inner;
+    Status st = enter_call(t, id, argc, ctx, &inner);
+    if (!st.ok) {
+        return st;
+    }
+    inner.inputs = args;
+    return bytecode_run(&t->symbols[id].body, &inner, out);
+}
+
+Status symtab_call_dual(const SymTab* t, int id, const Dual* args, size_t argc, const EvalContext* ctx, Dual* out) {
+    EvalContext inner;
+    Status st = enter_call(t, id, argc, ctx, &inner);
+    if (!st.ok) {
+        return st;
+    }
+    return bytecode_run_dual(&t->symbols[id].body, &inner, args, out);
+}
+
+bool symtab_random(const SymTab* t, int id) {
+    if ((t->env & SYMTAB_DEP_RANDOM) == 0) {
+        return false;
+    }
+    /* depth-first over function deps; t is const, so the marks are local */
+    uint8_t* seen = calloc(t->count, 1);
+    int* stack = malloc(t->count * sizeof(int));
+    bool found = seen == NULL || stack == NULL; /* assume the worst */
+    size_t len = 0;
+    if (!found && id >= 0 && (size_t)id < t->count) {
+        seen[id] = 1;
+        stack[len++] = id;
+    }
+    while (!found && len > 0) {
+        const Symbol* s = &t->symbols[stack[--len]];
+        found = (s->env & SYMTAB_DEP_RANDOM) != 0;
+        for (size_t i = 0; i < s->dep_count; i++) {
+            int d = s->deps[i];
+            if (!seen[d] && t->symbols[d].kind == SYMBOL_FUNC) {
+                seen[d] = 1;
+                stack[len++] = d;
+            }
+        }
+    }
+    free(seen);
+    free(stack);
+    return found;
+}
+
+Status symtab_value(const SymTab* t, int id, double* out) {
+    const Symbol* s = symtab_get(t, id);
+    if (s == NULL || s->kind != SYMBOL_VAR) {
+        return status_err("error: unknown variable");
+    }
+    if (s->error != NULL) {
+        return status_err(s->error);
+    }
+    *out = s->value;
+    return status_ok();
+}
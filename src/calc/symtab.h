@@ -0,0 +1,143 @@
+#pragma once
+
+#include "util/status.h"
+#include "calc/bytecode.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Symbol ids are stored in the op column of AST nodes. */
+#define SYMTAB_MAX_SYMBOLS 65535
+
+#define SYMTAB_NAME_MAX 64
+
+/* Default limit on nested user function calls. */
+#define SYMTAB_MAX_CALL_DEPTH 256
+
+typedef enum {
+    SYMBOL_VAR,
+    SYMBOL_FUNC,
+} SymbolKind;
+
+/* Context a body can read besides other symbols. */
+#define SYMTAB_DEP_ANS 1u
+#define SYMTAB_DEP_MEM 2u
+#define SYMTAB_DEP_MODE 4u        /* any builtin call: trig reads the angle mode */
+#define SYMTAB_DEP_RANDOM 8u      /* rand or randn: the body is not a pure function */
+
+typedef struct {
+    char name[SYMTAB_NAME_MAX];   /* lowercase */
+    SymbolKind kind;
+    double value;                 /* SYMBOL_VAR */
+    const char* error;            /* SYMBOL_VAR: why the formula last failed, or NULL */
+    size_t arity;                 /* SYMBOL_FUNC */
+    Program body;                 /* function body or variable formula, owned; empty for a plain value */
+    char* source;                 /* the definition as typed, owned */
+
+    int* deps;                    /* symbols body reads, owned */
+    size_t dep_count;
+    int* users;                   /* symbols whose body reads this one, owned */
+    size_t user_count;
+    size_t user_cap;
+    unsigned env;                 /* SYMTAB_DEP_* body reads */
+    bool dirty;                   /* something body reads has changed */
+    uint8_t mark;                 /* scratch for graph walks */
+} Symbol;
+
+typedef struct {
+    uint32_t hash;
+    uint32_t index;               /* symbol index + 1; 0 marks an empty slot */
+} SymSlot;
+
+/* Formula variables recomputed by symtab_update. */
+typedef struct {
+    size_t updates;               /* symtab_update calls that found work */
+    size_t recomputed;            /* formulas evaluated by those calls */
+    size_t full;                  /* formulas a full re-evaluation would have evaluated */
+} SymTabStats;
+
+/* User variables and functions. Names hash into a flat open-addressing table
+   (linear probing, at most half full) of 8-byte slots that point into a dense
+   symbol array; the index in that array is the symbol id. The parser resolves
+   names to ids once, so evaluation never hashes. Symbols are never removed
+   (except a failed definition, by symtab_forget_last), so ids held by
+   compiled programs stay valid; redefining keeps the id. Names are
+   case-insensitive, like the builtins.
+
+   A variable defined by a formula keeps it, spreadsheet style. Bodies form a
+   dependency graph (deps, and users in reverse) over the symbols and the
+   context they read. A change marks only what is downstream of it dirty, and
+   symtab_update recomputes those formulas, each after the ones it reads.
+   Reads never recompute, so evaluation stays const and thread-safe. A formula
+   that would read itself, directly or through others, is evaluated once and
+   kept as a plain value, so x = x + 1 increments x; so is a constant. */
+struct SymTab {
+    SymSlot* slots;
+    size_t slot_mask;
+    Symbol* symbols;
+    size_t count;
+    size_t cap;
+    size_t dirty_count;
+    unsigned env;                 /* union of every symbol's env */
+    uint64_t func_version;        /* bumped by each function (re)definition */
+    SymTabStats stats;
+};
+
+void symtab_init(SymTab* t);
+void symtab_free(SymTab* t);
+
+/* Id of name (not NUL-terminated), or -1. */
+int symtab_find(const SymTab* t, const char* name, size_t len);
+const Symbol* symtab_get(const SymTab* t, int id);
+
+/* Adds name as a variable or sets its value, dropping any formula. Fails
+   when name is a function. */
+Status symtab_set_var(SymTab* t, const char* name, size_t len, double value, int* id);
+
+/* Adds or redefines name as a variable computed by formula, evaluated now
+   with ctx and again whenever something it reads changes. Nothing changes
+   when the evaluation fails. source is the definition as typed. */
+Status symtab_define_var(SymTab* t, const char* name, size_t len, const Program* formula, const char* source,
+                         const EvalContext* ctx, int* id);
+
+/* Adds name as a function of arity arguments with no body yet, or changes the
+   arity of an existing one, so a body can refer to its own function. *added
+   tells whether the symbol is new. Fails when name is a variable. */
+Status symtab_declare_func(SymTab* t, const char* name, size_t len, size_t arity, int* id, bool* added);
+
+/* Copies body and source into the table as the definition of function id,
+   and bumps func_version: programs compiled against the old body (the
+   optimizer shares calls it knew to be pure) may need compiling again.
+   Fails with "error: circular definition" when a formula variable the body
+   reads already depends on the function. */
+Status symtab_define_func(SymTab* t, int id, const Program* body, const char* source);
+
+/* Marks everything reading any of the SYMTAB_DEP_* bits in env dirty, after
+   ans, mem or the angle mode changed. */
+void symtab_touch_env(SymTab* t, unsigned env);
+
+/* Recomputes every dirty formula, dependencies first, with ctx. A formula
+   that fails keeps the error, and reading the variable reports it until a
+   later recomputation succeeds. Fails only when memory runs out. */
+Status symtab_update(SymTab* t, const EvalContext* ctx);
+
+/* Removes the most recently added symbol, for a definition that failed. Safe
+   with linear probing: no later insertion can have probed past its slot. */
+void symtab_forget_last(SymTab* t);
+
+/* Runs function id with argc arguments bound to its parameters, one level
+   deeper than ctx. Fails with "error: recursion too deep" beyond
+   ctx->max_call_depth nested calls. */
+Status symtab_call(const SymTab* t, int id, const double* args, size_t argc, const EvalContext* ctx, double* out);
+
+/* symtab_call in dual numbers, for bytecode_run_dual. */
+Status symtab_call_dual(const SymTab* t, int id, const Dual* args, size_t argc, const EvalContext* ctx, Dual* out);
+
+/* Whether calling function id draws random numbers, in its own body or in
+   a function it calls. A formula variable that draws keeps one value, so
+   reading it does not count. */
+bool symtab_random(const SymTab* t, int id);
+
+/* The value of variable id, or the error of its formula. */
+Status symtab_value(const SymTab* t, int id, double* out);
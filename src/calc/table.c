@@ -0,0 +1,229 @@
+#define _POSIX_C_SOURCE 199309L
+
+#include "calc/table.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Longest row: two formatted numbers or a number and an error message. */
+#define TABLE_ROW_MAX 160
+
+typedef enum {
+    SLOT_FREE,
+    SLOT_BUSY,
+    SLOT_READY,
+} SlotState;
+
+/* Text of one chunk, waiting for the writer. */
+typedef struct {
+    char* text;
+    size_t len;
+    SlotState state;
+    size_t chunk;            /* the one it takes next, in writing order */
+} TableSlot;
+
+typedef struct {
+    const TableSpec* spec;
+    const EvalContext* ctx;
+    BatchPlan plan;
+    size_t chunks;
+    bool exact_end;
+
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    size_t next_chunk;       /* next one a worker claims */
+    TableSlot* slots;        /* chunk c goes to slots[c % slot_count] */
+    size_t slot_count;
+    size_t errors;
+    Status failure;          /* first batch failure; stops everyone */
+} TableJob;
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+Status table_row_count(double from, double to, double step, size_t* rows) {
+    if (!isfinite(from) || !isfinite(to) || !isfinite(step)) {
+        return status_err("error: table range is not finite");
+    }
+    if (step == 0.0) {
+        return status_err("error: table step is zero");
+    }
+    double q = (to - from) / step;
+    if (q < -1e-9) {
+        return status_err("error: table step points away from the end");
+    }
+    double n = floor(q + 1e-9) + 1.0;
+    if (n > (double)TABLE_MAX_ROWS) {
+        return status_err("error: table has too many rows");
+    }
+    *rows = (size_t)n;
+    return status_ok();
+}
+
+static double row_x(const TableJob* job, size_t i) {
+    const TableSpec* s = job->spec;
+    if (job->exact_end && i + 1 == s->rows) {
+        return s->to;
+    }
+    return s->from + (double)i * s->step;
+}
+
+static size_t format_chunk(const TableJob* job, const double* xs, const double* ys, const uint8_t* err,
+                           const BatchReport* rep, size_t m, char* text) {
+    FormatMode mode = job->spec->format;
+    size_t len = 0;
+    for (size_t i = 0; i < m; i++) {
+        char* row = text + len;
+        size_t n = format_double(xs[i], mode, row, 64);
+        row[n++] = '\t';
+        if (err[i] == 0) {
+            n += format_double(ys[i], mode, row + n, 64);
+        } else {
+            const char* msg = batch_error_message(rep, err[i]);
+            size_t k = strlen(msg);
+            if (k > TABLE_ROW_MAX - n - 2) k = TABLE_ROW_MAX - n - 2;
+            memcpy(row + n, msg, k);
+            n += k;
+        }
+        row[n++] = '\n';
+        len += n;
+    }
+    return len;
+}
+
+static void table_worker(void* p, size_t worker) {
+    (void)worker;
+    TableJob* job = p;
+    double* xs = malloc(TABLE_CHUNK * sizeof(double));
+    double* ys = malloc(TABLE_CHUNK * sizeof(double));
+    uint8_t* err = malloc(TABLE_CHUNK);
+
+    pthread_mutex_lock(&job->lock);
+    if (xs == NULL || ys == NULL || err == NULL) {
+        if (job->failure.ok) job->failure = status_err("error: out of memory");
+        pthread_cond_broadcast(&job->changed);
+    }
+    while (job->failure.ok && job->next_chunk < job->chunks) {
+        size_t c = job->next_chunk++;
+        TableSlot* slot = &job->slots[c % job->slot_count];
+        /* free once chunk c - slot_count has been written, whichever
+           worker claimed it */
+        while (job->failure.ok && (slot->state != SLOT_FREE || slot->chunk != c)) {
+            pthread_cond_wait(&job->changed, &job->lock);
+        }
+        if (!job->failure.ok) {
+            break;
+        }
+        slot->state = SLOT_BUSY;
+        pthread_mutex_unlock(&job->lock);
+
+        size_t base = c * TABLE_CHUNK;
+        size_t m = job->spec->rows - base < TABLE_CHUNK ? job->spec->rows - base : TABLE_CHUNK;
+        for (size_t i = 0; i < m; i++) {
+            xs[i] = row_x(job, base + i);
+        }
+        const BatchInput in = { job->spec->ast->inputs[0], xs };
+        BatchReport rep;
+        Status st = batch_plan_run(&job->plan, job->ctx, &in, 1, m, ys, err, &rep);
+        if (st.ok) {
+            slot->len = format_chunk(job, xs, ys, err, &rep, m, slot->text);
+        }
+
+        pthread_mutex_lock(&job->lock);
+        if (!st.ok && job->failure.ok) {
+            job->failure = st;
+        }
+        job->errors += rep.errors;
+        slot->state = SLOT_READY;
+        pthread_cond_broadcast(&job->changed);
+    }
+    pthread_mutex_unlock(&job->lock);
+
+    free(xs);
+    free(ys);
+    free(err);
+}
+
+Status table_run(const TableSpec* spec, const EvalContext* ctx, ThreadPool* pool, Outbuf* out, TableStats* stats) {
+    double t0 = now_sec();
+    if (spec->ast->input_count != 1) {
+        return status_err("error: table needs exactly one variable");
+    }
+
+    TableJob job;
+    job.spec = spec;
+    job.ctx = ctx;
+    job.chunks = (spec->rows + TABLE_CHUNK - 1) / TABLE_CHUNK;
+    job.exact_end = spec->rows > 0 &&
+                    fabs(spec->from + (double)(spec->rows - 1) * spec->step - spec->to) <= 1e-9 * fabs(spec->step);
+    job.next_chunk = 0;
+    job.errors = 0;
+    job.failure = status_ok();
+    /* enough slots that every worker can run ahead of the writer */
+    job.slot_count = 2 * pool->count;
+    job.slots = calloc(job.slot_count, sizeof(TableSlot));
+    if (job.slots == NULL) {
+        return status_err("error: out of memory");
+    }
+    Status st = status_ok();
+    for (size_t i = 0; i < job.slot_count && st.ok; i++) {
+        job.slots[i].text = malloc(TABLE_CHUNK * TABLE_ROW_MAX);
+        job.slots[i].chunk = i;
+        if (job.slots[i].text == NULL) {
+            st = status_err("error: out of memory");
+        }
+    }
+    if (st.ok) {
+        st = batch_plan_init(&job.plan, spec->ast, spec->isa);
+    }
+    if (!st.ok) {
+        for (size_t i = 0; i < job.slot_count; i++) free(job.slots[i].text);
+        free(job.slots);
+        return st;
+    }
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.changed, NULL);
+
+    thread_pool_start(pool, table_worker, &job);
+    for (size_t c = 0; c < job.chunks; c++) {
+        TableSlot* slot = &job.slots[c % job.slot_count];
+        pthread_mutex_lock(&job.lock);
+        while (job.failure.ok && slot->state != SLOT_READY) {
+            pthread_cond_wait(&job.changed, &job.lock);
+        }
+        bool failed = !job.failure.ok;
+        pthread_mutex_unlock(&job.lock);
+        if (failed) {
+            break;
+        }
+        /* the slot is ours until marked free */
+        outbuf_write(out, slot->text, slot->len);
+        pthread_mutex_lock(&job.lock);
+        slot->state = SLOT_FREE;
+        slot->chunk += job.slot_count;
+        pthread_cond_broadcast(&job.changed);
+        pthread_mutex_unlock(&job.lock);
+    }
+    thread_pool_wait(pool);
+    outbuf_flush(out);
+
+    st = job.failure;
+    if (stats != NULL) {
+        stats->rows = st.ok ? spec->rows : 0;
+        stats->errors = job.errors;
+        stats->threads = pool->count;
+        stats->seconds = now_sec() - t0;
+    }
+    pthread_cond_destroy(&job.changed);
+    pthread_mutex_destroy(&job.lock);
+    batch_plan_free(&job.plan);
+    for (size_t i = 0; i < job.slot_count; i++) free(job.slots[i].text);
+    free(job.slots);
+    return st;
+}
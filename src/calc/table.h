@@ -0,0 +1,42 @@
+#pragma once
+
+#include "util/status.h"
+#include "util/outbuf.h"
+#include "util/thread_pool.h"
+#include "calc/batch.h"
+#include "calc/format.h"
+
+#include <stddef.h>
+
+/* Rows evaluated and formatted as one unit of work. */
+#define TABLE_CHUNK 1024
+
+#define TABLE_MAX_ROWS ((size_t)100000000)
+
+/* expr tabulated at var = from, from + step, ... up to to. ast has exactly
+   one input, the variable. */
+typedef struct {
+    const Ast* ast;
+    double from;
+    double to;
+    double step;
+    size_t rows;          /* from table_row_count */
+    BatchIsa isa;
+    FormatMode format;
+} TableSpec;
+
+typedef struct {
+    size_t rows;
+    size_t errors;        /* rows printed as an error message */
+    size_t threads;
+    double seconds;
+} TableStats;
+
+/* Rows from..to inclusive; to counts when it is within rounding of a step. */
+Status table_row_count(double from, double to, double step, size_t* rows);
+
+/* Writes one "x<TAB>value" line per row to out, in order, while the pool's
+   workers evaluate and format later chunks. A row whose evaluation fails
+   prints the error message in place of the value. The expression is
+   compiled once for all workers. */
+Status table_run(const TableSpec* spec, const EvalContext* ctx, ThreadPool* pool, Outbuf* out, TableStats* stats);
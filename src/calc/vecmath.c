@@ -0,0 +1,344 @@
+#include "calc/vecmath.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+/* The builtins' conversions, as written in builtins.c, so deg mode feeds
+   exactly the same argument to the polynomial that libm would get. */
+#define DEG_IN (M_PI / 180.0)
+#define DEG_OUT (180.0 / M_PI)
+
+/* Scalar references, used for lanes the polynomials do not cover. */
+static double ref_sin(double x) { return sin(x); }
+static double ref_cos(double x) { return cos(x); }
+static double ref_tan(double x) { return tan(x); }
+static double ref_ln(double x) { return log(x); }
+static double ref_log(double x) { return log10(x); }
+
+#if defined(__GNUC__)
+
+typedef double v4d __attribute__((vector_size(32)));
+typedef int64_t v4l __attribute__((vector_size(32)));
+
+#define VM_INLINE static inline __attribute__((always_inline))
+
+VM_INLINE v4d splat(double c) {
+    return (v4d){ c, c, c, c };
+}
+
+VM_INLINE v4d select_pd(v4l mask, v4d a, v4d b) {
+    return (v4d)(((v4l)a & mask) | ((v4l)b & ~mask));
+}
+
+VM_INLINE v4d abs_pd(v4d x) {
+    return (v4d)((v4l)x & (v4l){ INT64_MAX, INT64_MAX, INT64_MAX, INT64_MAX });
+}
+
+/* x with the sign of s flipped where s is negative. */
+VM_INLINE v4d xorsign_pd(v4d x, v4d s) {
+    return (v4d)((v4l)x ^ ((v4l)s & (v4l){ INT64_MIN, INT64_MIN, INT64_MIN, INT64_MIN }));
+}
+
+VM_INLINE v4d sqrt_pd(v4d x) {
+    return (v4d){ sqrt(x[0]), sqrt(x[1]), sqrt(x[2]), sqrt(x[3]) };
+}
+
+VM_INLINE bool any(v4l m) {
+    return (m[0] | m[1] | m[2] | m[3]) != 0;
+}
+
+/* 1.5 * 2^52: adding it rounds to an integer kept in the low mantissa bits. */
+#define ROUND_MAGIC 6755399441055744.0
+
+/* sin and cos of r + y, r in [-pi/4, pi/4] and y the low part of the
+   reduction: fdlibm's __kernel_sin/__kernel_cos. */
+VM_INLINE v4d poly_sin(v4d r, v4d y, v4d z) {
+    v4d v = z * r;
+    v4d p = 2.75573137070700676789e-06 + z * (-2.50507602534068634195e-08 + z * 1.58969099521155010221e-10);
+    p = 8.33333333332248946124e-03 + z * (-1.98412698298579493134e-04 + z * p);
+    return r - ((z * (0.5 * y - v * p) - y) - v * -1.66666666666666324348e-01);
+}
+
+VM_INLINE v4d poly_cos(v4d r, v4d y, v4d z) {
+    v4d p = -2.75573143513906633035e-07 + z * (2.08757232129817482790e-09 + z * -1.13596475577881948265e-11);
+    p = 4.16666666666666019037e-02 + z * (-1.38888888888741095749e-03 + z * (2.48015872894767294178e-05 + z * p));
+    v4d hz = 0.5 * z;
+    v4d w = 1.0 - hz;
+    return w + (((1.0 - w) - hz) + (z * z * p - r * y));
+}
+
+/* Reduces x by k * pi/2 into r + y, fdlibm's medium-size path with all three
+   rounds: pi/2 is split into 33-bit pieces so k * piece is exact for
+   |k| < 2^20, and each round carries its rounding error forward. Lanes beyond
+   1e5 (or not finite) are flagged for libm. */
+VM_INLINE v4d reduce_pio2(v4d x, v4d* y, v4l* quadrant, v4l* slow) {
+    v4d kd = x * 6.36619772367581382433e-01 + ROUND_MAGIC;
+    *quadrant = (v4l)kd & 3;
+    kd = kd - ROUND_MAGIC;
+    *slow = ~(v4l)(abs_pd(x) <= 1e5);
+
+    v4d t = x - kd * 1.57079632673412561417e+00;
+    v4d w = kd * 6.07710050630396597660e-11;
+    v4d r = t - w;
+    w = kd * 2.02226624879595063154e-21 - ((t - r) - w);
+    t = r;
+    w = kd * 2.02226624871116645580e-21;
+    r = t - w;
+    w = kd * 8.47842766036889956997e-32 - ((t - r) - w);
+    v4d hi = r - w;
+    *y = (r - hi) - w;
+    return hi;
+}
+
+VM_INLINE v4d core_sin(v4d x, v4l* slow) {
+    v4l q;
+    v4d y;
+    v4d r = reduce_pio2(x, &y, &q, slow);
+    v4d z = r * r;
+    v4d v = select_pd((q & 1) != 0, poly_cos(r, y, z), poly_sin(r, y, z));
+    return select_pd((q & 2) != 0, -v, v);
+}
+
+VM_INLINE v4d core_cos(v4d x, v4l* slow) {
+    v4l q;
+    v4d y;
+    v4d r = reduce_pio2(x, &y, &q, slow);
+    v4d z = r * r;
+    v4d v = select_pd((q & 1) != 0, poly_sin(r, y, z), poly_cos(r, y, z));
+    return select_pd(((q + 1) & 2) != 0, -v, v);
+}
+
+VM_INLINE v4d core_tan(v4d x, v4l* slow) {
+    v4l q;
+    v4d y;
+    v4d r = reduce_pio2(x, &y, &q, slow);
+    v4d z = r * r;
+    v4d s = poly_sin(r, y, z);
+    v4d c = poly_cos(r, y, z);
+    v4l odd = (q & 1) != 0;
+    return select_pd(odd, -c, s) / select_pd(odd, s, c);
+}
+
+/* Cephes atan: reduce to |x| <= 0.66 via pi/2 - atan(1/x) or
+   pi/4 + atan((x-1)/(x+1)), then a rational approximation. */
+VM_INLINE v4d core_atan(v4d x, v4l* slow) {
+    const double morebits = 6.123233995736765886130e-17;
+    *slow = (v4l){ 0, 0, 0, 0 };
+    v4d a = abs_pd(x);
+    v4l big = a > 2.41421356237309504880;
+    v4l mid = (a > 0.66) & ~big;
+    v4d t = select_pd(big, -1.0 / a, select_pd(mid, (a - 1.0) / (a + 1.0), a));
+    v4d base = select_pd(big, splat(M_PI / 2), select_pd(mid, splat(M_PI / 4), splat(0.0)));
+    v4d extra = select_pd(big, splat(morebits), select_pd(mid, splat(0.5 * morebits), splat(0.0)));
+    v4d z = t * t;
+    v4d p = (((-8.750608600031904122785e-1 * z - 1.615753718733365076637e1) * z - 7.500855792314704667340e1) * z -
+             1.228866684490136173410e2) * z - 6.485021904942025371773e1;
+    v4d q = ((((z + 2.485846490142306297962e1) * z + 1.650270098316988542046e2) * z + 4.328810604912902668951e2) * z +
+             4.853903996359136964868e2) * z + 1.945506571482613964425e2;
+    v4d r = t * (z * p / q) + t;
+    return xorsign_pd(base + (r + extra), x);
+}
+
+/* Cephes asin on |x|: a rational in x^2 below 0.625, otherwise one in 1 - x
+   around pi/2 - 2 asin(sqrt((1 - x) / 2)). */
+VM_INLINE v4d asin_abs(v4d a) {
+    const double morebits = 6.123233995736765886130e-17;
+    v4d zz = 1.0 - a;
+    v4d rp = (((2.967721961301243206100e-3 * zz - 5.634242780008963776856e-1) * zz + 6.968710824104713396794e0) * zz -
+              2.556901049652824852289e1) * zz + 2.853665548261061424989e1;
+    v4d sq = (((zz - 2.194779531642920639778e1) * zz + 1.470656354026814941758e2) * zz - 3.838770957603691357202e2) * zz +
+             3.424398657913078477438e2;
+    v4d p = zz * rp / sq;
+    v4d root = sqrt_pd(zz + zz);
+    v4d hi = ((M_PI / 4 - root) - (root * p - morebits)) + M_PI / 4;
+
+    v4d z = a * a;
+    v4d pp = ((((4.253011369004428248960e-3 * z - 6.019598008014123785661e-1) * z + 5.444622390564711410273e0) * z -
+               1.626247967210700244449e1) * z + 1.956261983317594739197e1) * z - 8.198089802484824371615e0;
+    v4d qq = ((((z - 1.474091372988853791896e1) * z + 7.049610280856842141659e1) * z - 1.471791292232726029859e2) * z +
+              1.395105614657485689735e2) * z - 4.918853881490881290097e1;
+    v4d lo = a * (z * pp / qq) + a;
+    return select_pd(a > 0.625, hi, lo);
+}
+
+VM_INLINE v4d core_asin(v4d x, v4l* slow) {
+    *slow = (v4l){ 0, 0, 0, 0 };
+    return xorsign_pd(asin_abs(abs_pd(x)), x);
+}
+
+VM_INLINE v4d core_acos(v4d x, v4l* slow) {
+    const double morebits = 6.123233995736765886130e-17;
+    *slow = (v4l){ 0, 0, 0, 0 };
+    v4l lo = x < -0.5;
+    v4l hi = x > 0.5;
+    v4d t = select_pd(hi, sqrt_pd(0.5 * (1.0 - x)), select_pd(lo, sqrt_pd(0.5 * (1.0 + x)), x));
+    v4d as = xorsign_pd(asin_abs(abs_pd(t)), t);
+    v4d mid = ((M_PI / 4 - as) + morebits) + M_PI / 4;
+    return select_pd(hi, 2.0 * as, select_pd(lo, M_PI - 2.0 * as, mid));
+}
+
+/* fdlibm log: x = 2^e * m with m in [sqrt(2)/2, sqrt(2)), f = m - 1 and
+   log(1 + f) = f - f^2/2 + s (f^2/2 + R(s^2)) with s = f / (2 + f). Returns
+   e, and the parts hfsq and tail with log(m) = f - (hfsq - tail). */
+VM_INLINE v4d log_parts(v4d x, v4d* f, v4d* hfsq, v4d* tail) {
+    v4l bits = (v4l)x;
+    v4l e = ((bits >> 52) & 0x7ff) - 1023;
+    v4d m = (v4d)((bits & 0x000fffffffffffff) | 0x3ff0000000000000);
+    v4l high = m > 1.41421356237309504880;
+    m = select_pd(high, 0.5 * m, m);
+    e = e - high;
+    *f = m - 1.0;
+    v4d s = *f / (2.0 + *f);
+    v4d z = s * s;
+    v4d w = z * z;
+    v4d t1 = w * (3.999999999940941908e-01 + w * (2.222219843214978396e-01 + w * 1.531383769920937332e-01));
+    v4d t2 = z * (6.666666666666735130e-01 +
+                  w * (2.857142874366239149e-01 + w * (1.818357216161805012e-01 + w * 1.479819860511658591e-01)));
+    v4d r = t2 + t1;
+    *hfsq = 0.5 * *f * *f;
+    *tail = s * (*hfsq + r);
+    return __builtin_convertvector(e, v4d);
+}
+
+/* Lanes that are not positive normal numbers go to libm. */
+VM_INLINE v4l log_slow(v4d x) {
+    return ~((v4l)(x >= 2.2250738585072014e-308) & (v4l)(x <= 1.7976931348623157e308));
+}
+
+VM_INLINE v4d core_ln(v4d x, v4l* slow) {
+    *slow = log_slow(x);
+    v4d f, hfsq, tail;
+    v4d e = log_parts(x, &f, &hfsq, &tail);
+    return e * 6.93147180369123816490e-01 - ((hfsq - (tail + e * 1.90821492927058770002e-10)) - f);
+}
+
+VM_INLINE v4d core_log(v4d x, v4l* slow) {
+    *slow = log_slow(x);
+    v4d f, hfsq, tail;
+    v4d e = log_parts(x, &f, &hfsq, &tail);
+    v4d lm = f - (hfsq - tail);
+    return e * 3.01029995663611771306e-01 + (e * 3.69423907715893078616e-13 + lm * 4.34294481903251816668e-01);
+}
+
+VM_INLINE v4d core_sqrt(v4d x, v4l* slow) {
+    *slow = (v4l){ 0, 0, 0, 0 };
+    return sqrt_pd(x);
+}
+
+VM_INLINE v4d core_abs(v4d x, v4l* slow) {
+    *slow = (v4l){ 0, 0, 0, 0 };
+    return abs_pd(x);
+}
+
+/* One step of 4 lanes: core on v, then ref for the lanes core flags. */
+#define VM_STEP(core, ref, v, r)                                                       \
+    do {                                                                               \
+        v4l slow;                                                                      \
+        r = core(v, &slow) * post;                                                     \
+        if (any(slow)) {                                                               \
+            for (size_t j = 0; j < 4; j++) {                                           \
+                if (slow[j]) r[j] = (ref)(v[j]) * post;                                \
+            }                                                                          \
+        }                                                                              \
+    } while (0)
+
+/* Defines name(x, out, n, deg) around core. in_scale/out_scale are the deg
+   mode factors applied before and after it; slow lanes use ref on the
+   scaled argument. The tail is padded with 0.5, inside every domain. */
+#define VM_KERNEL(attr, name, core, ref, in_scale, out_scale)                         \
+    attr static void name(const double* x, double* out, size_t n, bool deg) {         \
+        const double pre = deg ? (in_scale) : 1.0;                                   \
+        const double post = deg ? (out_scale) : 1.0;                                 \
+        size_t i = 0;                                                                 \
+        v4d v, r;                                                                     \
+        for (; i + 4 <= n; i += 4) {                                                  \
+            memcpy(&v, x + i, sizeof(v));                                             \
+            v = v * pre;                                                              \
+            VM_STEP(core, ref, v, r);                                                 \
+            memcpy(out + i, &r, sizeof(r));                                           \
+        }                                                                             \
+        if (i < n) {                                                                  \
+            v = splat(0.5);                                                           \
+            memcpy(&v, x + i, (n - i) * sizeof(double));                              \
+            v = v * pre;                                                              \
+            VM_STEP(core, ref, v, r);                                                 \
+            memcpy(out + i, &r, (n - i) * sizeof(double));                            \
+        }                                                                             \
+    }
+
+#define VM_KERNELS(attr, suffix)                                                       \
+    VM_KERNEL(attr, sin_##suffix, core_sin, ref_sin, DEG_IN, 1.0)                      \
+    VM_KERNEL(attr, cos_##suffix, core_cos, ref_cos, DEG_IN, 1.0)                      \
+    VM_KERNEL(attr, tan_##suffix, core_tan, ref_tan, DEG_IN, 1.0)                      \
+    VM_KERNEL(attr, asin_##suffix, core_asin, asin, 1.0, DEG_OUT)                      \
+    VM_KERNEL(attr, acos_##suffix, core_acos, acos, 1.0, DEG_OUT)                      \
+    VM_KERNEL(attr, atan_##suffix, core_atan, atan, 1.0, DEG_OUT)                      \
+    VM_KERNEL(attr, ln_##suffix, core_ln, ref_ln, 1.0, 1.0)                            \
+    VM_KERNEL(attr, log_##suffix, core_log, ref_log, 1.0, 1.0)                         \
+    VM_KERNEL(attr, sqrt_##suffix, core_sqrt, sqrt, 1.0, 1.0)                          \
+    VM_KERNEL(attr, abs_##suffix, core_abs, fabs, 1.0, 1.0)
+
+VM_KERNELS(, generic)
+
+#if defined(__x86_64__) || defined(__i386__)
+VM_KERNELS(__attribute__((target("avx2"))), avx2)
+#define AVX2(name) name##_avx2
+#else
+#define AVX2(name) name##_generic
+#endif
+
+#else /* no vector extensions: libm loops */
+
+#define VM_KERNEL(name, fn, in_scale, out_scale)                               \
+    static void name(const double* x, double* out, size_t n, bool deg) {       \
+        const double pre = deg ? (in_scale) : 1.0;                            \
+        const double post = deg ? (out_scale) : 1.0;                          \
+        for (size_t i = 0; i < n; i++) out[i] = fn(x[i] * pre) * post;        \
+    }
+
+VM_KERNEL(sin_generic, ref_sin, DEG_IN, 1.0)
+VM_KERNEL(cos_generic, ref_cos, DEG_IN, 1.0)
+VM_KERNEL(tan_generic, ref_tan, DEG_IN, 1.0)
+VM_KERNEL(asin_generic, asin, 1.0, DEG_OUT)
+VM_KERNEL(acos_generic, acos, 1.0, DEG_OUT)
+VM_KERNEL(atan_generic, atan, 1.0, DEG_OUT)
+VM_KERNEL(ln_generic, ref_ln, 1.0, 1.0)
+VM_KERNEL(log_generic, ref_log, 1.0, 1.0)
+VM_KERNEL(sqrt_generic, sqrt, 1.0, 1.0)
+VM_KERNEL(abs_generic, fabs, 1.0, 1.0)
+#define AVX2(name) name##_generic
+
+#endif
+
+/* Sorted by name like the builtin table. */
+static const VecMathKernel k_kernels[] = {
+    { "abs", abs_generic, AVX2(abs), 0 },
+    { "acos", acos_generic, AVX2(acos), 2 },
+    { "asin", asin_generic, AVX2(asin), 2 },
+    { "atan", atan_generic, AVX2(atan), 2 },
+    { "cos", cos_generic, AVX2(cos), 1 },
+    { "ln", ln_generic, AVX2(ln), 1 },
+    { "log", log_generic, AVX2(log), 2 },
+    { "sin", sin_generic, AVX2(sin), 1 },
+    { "sqrt", sqrt_generic, AVX2(sqrt), 0 },
+    { "tan", tan_generic, AVX2(tan), 3 },
+};
+
+const VecMathKernel* vecmath_find(const char* name) {
+    for (size_t i = 0; i < sizeof(k_kernels) / sizeof(k_kernels[0]); i++) {
+        if (strcmp(k_kernels[i].name, name) == 0) {
+            return &k_kernels[i];
+        }
+    }
+    return NULL;
+}
+
+const VecMathKernel* vecmath_kernels(size_t* count) {
+    *count = sizeof(k_kernels) / sizeof(k_kernels[0]);
+    return k_kernels;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Bulk versions of the builtin functions, 4 doubles per step. A kernel writes
+   out[i] = f(x[i]) for n elements (x may equal out) and applies the same
+   degree conversion as the builtin when deg is set, fused into the loop.
+   Arguments a polynomial does not cover (|x| > 1e5 radians for sin/cos/tan,
+   non-normal or non-positive input for ln/log) go to libm lane by lane.
+
+   max_ulp bounds the distance to the libm-based builtin over each function's
+   domain, checked by the sweep in tests/test_main.c:
+
+     abs, sqrt          0      exact
+     sin, cos           1      three-part pi/2 reduction, fdlibm polynomials
+     tan                3      quotient of the sin and cos polynomials
+     asin, acos         2      Cephes rational approximations
+     atan               2      Cephes rational approximation
+     ln                 1      fdlibm log
+     log                2      log of the mantissa times 1/ln 10
+
+   The deg-mode output scaling of asin/acos/atan accounts for their second
+   ulp; in radians they stay within 1. */
+typedef void (*VecMathFn)(const double* x, double* out, size_t n, bool deg);
+
+typedef struct {
+    const char* name;     /* builtin this replaces */
+    VecMathFn generic;    /* baseline vector ISA: SSE2 on x86-64, NEON on AArch64 */
+    VecMathFn avx2;       /* bit-identical results with 256-bit registers */
+    unsigned max_ulp;
+} VecMathKernel;
+
+/* Lookup by builtin name; NULL when the function has no kernel. */
+const VecMathKernel* vecmath_find(const char* name);
+
+const VecMathKernel* vecmath_kernels(size_t* count);
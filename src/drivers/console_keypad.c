@@ -1,28 +1,115 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include "drivers/console_keypad.h"
 
-#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
-static bool console_read_line(Keypad* self, char* out, size_t out_cap) {
-    (void)self;
-    if (out_cap == 0) {
+/* Bytes asked for per read(2). */
+#define CONSOLE_READ 4096
+
+/* A line that grows past this without a newline is returned in pieces. */
+#define CONSOLE_LINE_MAX ((size_t)1 << 20)
+
+/* stdin read with read(2) rather than stdio, so that a line left over from
+   the last read is visible to pending instead of hidden in a FILE buffer.
+   A partial line stays buffered until the rest arrives. */
+typedef struct {
+    char* data;
+    size_t cap;
+    size_t start;
+    size_t len;
+    bool eof;
+} ConsoleInput;
+
+static ConsoleInput console_input;
+
+/* One read(2), appended to what is buffered; blocks only if nothing has
+   arrived. False once input has ended. */
+static bool console_fill(ConsoleInput* in) {
+    if (in->eof) {
         return false;
     }
+    if (in->start > 0) {
+        memmove(in->data, in->data + in->start, in->len - in->start);
+        in->len -= in->start;
+        in->start = 0;
+    }
+    if (in->cap - in->len < CONSOLE_READ) {
+        size_t cap = in->cap != 0 ? in->cap * 2 : CONSOLE_READ * 2;
+        char* grown = realloc(in->data, cap);
+        if (grown == NULL) {
+            in->eof = true;
+            return false;
+        }
+        in->data = grown;
+        in->cap = cap;
+    }
+    ssize_t r;
+    do {
+        r = read(STDIN_FILENO, in->data + in->len, in->cap - in->len);
+    } while (r < 0 && errno == EINTR);
+    if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return true;
+    }
+    if (r <= 0) {
+        in->eof = true;
+        return false;
+    }
+    in->len += (size_t)r;
+    return true;
+}
+
+static const char* buffered_newline(const ConsoleInput* in) {
+    return in->len > in->start ? memchr(in->data + in->start, '\n', in->len - in->start) : NULL;
+}
+
+static bool console_pending(Keypad* self) {
+    (void)self;
+    const ConsoleInput* in = &console_input;
+    return in->eof || in->len - in->start >= CONSOLE_LINE_MAX || buffered_newline(in) != NULL;
+}
 
-    if (fgets(out, (int)out_cap, stdin) == NULL) {
+static bool console_poll(Keypad* self) {
+    (void)self;
+    return console_fill(&console_input);
+}
+
+static bool console_read_line(Keypad* self, Arena* arena, char** out) {
+    ConsoleInput* in = &console_input;
+    while (!console_pending(self)) {
+        (void)console_fill(in);
+    }
+    const char* nl = buffered_newline(in);
+    size_t avail = in->len - in->start;
+    if (avail == 0) {
+        return false;   /* end of input */
+    }
+    /* without a newline: the end of input, or a piece of a very long line */
+    size_t take = nl != NULL ? (size_t)(nl - (in->data + in->start)) + 1 : avail;
+    char* buf = arena_alloc(arena, take + 1);
+    if (buf == NULL) {
         return false;
     }
+    memcpy(buf, in->data + in->start, take);
+    in->start += take;
 
-    size_t n = strlen(out);
-    while (n > 0 && (out[n - 1] == '\n' || out[n - 1] == '\r')) {
-        out[n - 1] = '\0';
+    size_t n = take;
+    while (n > 0 && (buf[n - 1] == '\n' || buf[n - 1] == '\r')) {
         n--;
     }
+    buf[n] = '\0';
+    *out = buf;
     return true;
 }
 
 Keypad console_keypad_create(void) {
     Keypad k;
     k.read_line = console_read_line;
+    k.pending = console_pending;
+    k.poll = console_poll;
+    k.fd = STDIN_FILENO;
     return k;
 }
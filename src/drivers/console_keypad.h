@@ -1,14 +1,29 @@
 #pragma once
 
+#include "util/arena.h"
+
 #include <stdbool.h>
 #include <stddef.h>
 
 typedef struct Keypad Keypad;
 
-typedef bool (*KeypadReadLineFn)(Keypad* self, char* out, size_t out_cap);
+/* Reads one line without its terminator into memory from arena. Returns false
+   at end of input. */
+typedef bool (*KeypadReadLineFn)(Keypad* self, Arena* arena, char** out);
+
+/* True if read_line would return without waiting for more input. */
+typedef bool (*KeypadPendingFn)(Keypad* self);
+
+/* Buffers the input that has arrived, with one read that waits only if
+   none has (so not once fd is readable); a partial line stays buffered.
+   Returns false once input has ended. */
+typedef bool (*KeypadPollFn)(Keypad* self);
 
 struct Keypad {
     KeypadReadLineFn read_line;
+    KeypadPendingFn pending;
+    KeypadPollFn poll;
+    int fd;                  /* readable when input arrives, -1 if unknown */
 };
 
 Keypad console_keypad_create(void);
@@ -0,0 +1,264 @@
+#define _DEFAULT_SOURCE
+
+#include "kernel/coro.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if !defined(CORO_UCONTEXT) && !(defined(__x86_64__) || defined(__aarch64__))
+#define CORO_UCONTEXT 1
+#endif
+
+#ifdef CORO_UCONTEXT
+#include <ucontext.h>
+#endif
+
+struct Coro {
+#ifdef CORO_UCONTEXT
+    ucontext_t ctx;
+    ucontext_t caller;
+#else
+    void* sp;                /* saved stack pointer while suspended */
+    void* caller_sp;         /* of the coro_resume that runs it */
+#endif
+    CoroFn fn;
+    void* arg;
+    Coro* outer;             /* coroutine that resumed this one, if any */
+    unsigned char* map;      /* guard page, then the stack */
+    size_t map_size;
+    size_t stack_size;
+    bool done;
+};
+
+static _Thread_local Coro* coro_running;
+
+static void coro_main(Coro* c);
+
+#ifndef CORO_UCONTEXT
+
+/* coro_swap saves the callee-saved registers on the current stack, stores
+   its pointer to *save, and pops the same frame from load. A new stack gets
+   a frame that "returns" to coro_trampoline, which calls the entry function
+   from one callee-saved register with the Coro from another. */
+void coro_swap(void** save, void* load);
+void coro_trampoline(void);
+
+#if defined(__x86_64__)
+__asm__(
+    ".text\n"
+    ".globl coro_swap\n"
+    ".hidden coro_swap\n"
+    ".type coro_swap, @function\n"
+    "coro_swap:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    subq $8, %rsp\n"
+    "    stmxcsr (%rsp)\n"
+    "    fnstcw 4(%rsp)\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    ldmxcsr (%rsp)\n"
+    "    fldcw 4(%rsp)\n"
+    "    addq $8, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size coro_swap, .-coro_swap\n"
+    ".globl coro_trampoline\n"
+    ".hidden coro_trampoline\n"
+    ".type coro_trampoline, @function\n"
+    "coro_trampoline:\n"
+    "    movq %r12, %rdi\n"
+    "    callq *%r13\n"
+    "    ud2\n"
+    ".size coro_trampoline, .-coro_trampoline\n");
+
+/* mxcsr and x87 control word, r15..r12, rbx, rbp, return address */
+#define CORO_FRAME_WORDS 8
+
+static void frame_init(uintptr_t* f, Coro* c) {
+    f[0] = 0x1f80u | ((uintptr_t)0x037fu << 32);   /* the ABI's initial values */
+    f[3] = (uintptr_t)coro_main;                  /* r13 */
+    f[4] = (uintptr_t)c;                          /* r12 */
+    f[7] = (uintptr_t)coro_trampoline;
+}
+
+#elif defined(__aarch64__)
+__asm__(
+    ".text\n"
+    ".globl coro_swap\n"
+    ".hidden coro_swap\n"
+    ".type coro_swap, %function\n"
+    "coro_swap:\n"
+    "    sub sp, sp, #160\n"
+    "    stp x19, x20, [sp, #0]\n"
+    "    stp x21, x22, [sp, #16]\n"
+    "    stp x23, x24, [sp, #32]\n"
+    "    stp x25, x26, [sp, #48]\n"
+    "    stp x27, x28, [sp, #64]\n"
+    "    stp x29, x30, [sp, #80]\n"
+    "    stp d8, d9, [sp, #96]\n"
+    "    stp d10, d11, [sp, #112]\n"
+    "    stp d12, d13, [sp, #128]\n"
+    "    stp d14, d15, [sp, #144]\n"
+    "    mov x2, sp\n"
+    "    str x2, [x0]\n"
+    "    mov sp, x1\n"
+    "    ldp x19, x20, [sp, #0]\n"
+    "    ldp x21, x22, [sp, #16]\n"
+    "    ldp x23, x24, [sp, #32]\n"
+    "    ldp x25, x26, [sp, #48]\n"
+    "    ldp x27, x28, [sp, #64]\n"
+    "    ldp x29, x30, [sp, #80]\n"
+    "    ldp d8, d9, [sp, #96]\n"
+    "    ldp d10, d11, [sp, #112]\n"
+    "    ldp d12, d13, [sp, #128]\n"
+    "    ldp d14, d15, [sp, #144]\n"
+    "    add sp, sp, #160\n"
+    "    ret\n"
+    ".size coro_swap, .-coro_swap\n"
+    ".globl coro_trampoline\n"
+    ".hidden coro_trampoline\n"
+    ".type coro_trampoline, %function\n"
+    "coro_trampoline:\n"
+    "    mov x0, x19\n"
+    "    blr x20\n"
+    "    brk #0\n"
+    ".size coro_trampoline, .-coro_trampoline\n");
+
+/* x19..x28, x29, x30, d8..d15 */
+#define CORO_FRAME_WORDS 20
+
+static void frame_init(uintptr_t* f, Coro* c) {
+    f[0] = (uintptr_t)c;                          /* x19 */
+    f[1] = (uintptr_t)coro_main;                  /* x20 */
+    f[11] = (uintptr_t)coro_trampoline;           /* x30 */
+}
+#endif
+
+#else
+
+/* makecontext passes only int arguments, so the new coroutine finds itself
+   here. */
+static _Thread_local Coro* coro_starting;
+
+static void ucontext_entry(void) {
+    coro_main(coro_starting);
+}
+
+#endif
+
+static void coro_main(Coro* c) {
+    c->fn(c->arg);
+    c->done = true;
+    coro_suspend(c);
+}
+
+Status coro_create(Coro** out, size_t stack_size, CoroFn fn, void* arg) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t size = stack_size != 0 ? stack_size : CORO_STACK_DEFAULT;
+    size = (size + page - 1) / page * page;
+    Coro* c = malloc(sizeof(Coro));
+    if (c == NULL) {
+        return status_err("error: out of memory");
+    }
+    c->map_size = size + page;
+    void* map = mmap(NULL, c->map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        free(c);
+        return status_err("error: out of memory");
+    }
+    c->map = map;
+    c->stack_size = size;
+    (void)mprotect(c->map, page, PROT_NONE);
+    if (!coro_reset(c, fn, arg)) {
+        coro_free(c);
+        return status_err("error: cannot create coroutine");
+    }
+    *out = c;
+    return status_ok();
+}
+
+bool coro_reset(Coro* c, CoroFn fn, void* arg) {
+    c->fn = fn;
+    c->arg = arg;
+    c->outer = NULL;
+    c->done = false;
+#ifdef CORO_UCONTEXT
+    if (getcontext(&c->ctx) != 0) {
+        return false;
+    }
+    c->ctx.uc_stack.ss_sp = c->map + (c->map_size - c->stack_size);
+    c->ctx.uc_stack.ss_size = c->stack_size;
+    c->ctx.uc_link = NULL;
+    makecontext(&c->ctx, ucontext_entry, 0);
+#else
+    uintptr_t* frame = (uintptr_t*)(void*)(c->map + c->map_size) - CORO_FRAME_WORDS;
+    memset(frame, 0, CORO_FRAME_WORDS * sizeof(uintptr_t));
+    frame_init(frame, c);
+    c->sp = frame;
+    c->caller_sp = NULL;
+#endif
+    return true;
+}
+
+void coro_free(Coro* c) {
+    if (c == NULL) {
+        return;
+    }
+    munmap(c->map, c->map_size);
+    free(c);
+}
+
+void coro_resume(Coro* c) {
+    c->outer = coro_running;
+    coro_running = c;
+#ifdef CORO_UCONTEXT
+    coro_starting = c;
+    swapcontext(&c->caller, &c->ctx);
+#else
+    coro_swap(&c->caller_sp, c->sp);
+#endif
+    coro_running = c->outer;
+}
+
+void coro_suspend(Coro* c) {
+#ifdef CORO_UCONTEXT
+    swapcontext(&c->ctx, &c->caller);
+#else
+    coro_swap(&c->sp, c->caller_sp);
+#endif
+}
+
+Coro* coro_current(void) {
+    return coro_running;
+}
+
+bool coro_done(const Coro* c) {
+    return c->done;
+}
+
+size_t coro_stack_size(const Coro* c) {
+    return c->stack_size;
+}
+
+const char* coro_backend(void) {
+#if defined(CORO_UCONTEXT)
+    return "ucontext";
+#elif defined(__x86_64__)
+    return "x86-64";
+#else
+    return "aarch64";
+#endif
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include "util/status.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef void (*CoroFn)(void* arg);
+
+/* A function running on a stack of its own that can suspend itself and be
+   resumed where it stopped, possibly on another thread. A switch saves only
+   the callee-saved registers, in hand-written code on x86-64 and aarch64;
+   other targets, or builds with -DCORO_UCONTEXT, use ucontext, which also
+   saves the signal mask with a system call per switch. The stack has an
+   unmapped guard page below it, so an overflow faults instead of
+   corrupting memory. */
+typedef struct Coro Coro;
+
+/* Stack size for 0. */
+#define CORO_STACK_DEFAULT ((size_t)256 * 1024)
+
+Status coro_create(Coro** out, size_t stack_size, CoroFn fn, void* arg);
+
+/* A coroutine still suspended is dropped without unwinding its frames. */
+void coro_free(Coro* c);
+
+/* Starts c over as fn(arg) on the same stack, dropping its frames as
+   coro_free does. Not for a running coroutine. False if ucontext fails. */
+bool coro_reset(Coro* c, CoroFn fn, void* arg);
+
+/* Runs c until it suspends or fn returns. Not for a running or finished
+   coroutine. */
+void coro_resume(Coro* c);
+
+/* From inside c: returns to the coro_resume that ran it. */
+void coro_suspend(Coro* c);
+
+/* The coroutine running on this thread, NULL outside one. */
+Coro* coro_current(void);
+
+bool coro_done(const Coro* c);
+
+/* Usable stack, after rounding up to whole pages. */
+size_t coro_stack_size(const Coro* c);
+
+/* The switch implementation: "x86-64", "aarch64" or "ucontext". */
+const char* coro_backend(void);
@@ -1,55 +1,1109 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include "kernel/kernel.h"
 
+#include "util/thread_pool.h"
+#include "util/ws_deque.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <sched.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#define KERNEL_EPOLL 1
+#else
+#define KERNEL_EPOLL 0
+#endif
+
+/* epoll data of the timer and wakeup fds; a task's is its slot and
+   watch_seq */
+#define KERNEL_TIMER_TAG UINT64_MAX
+#define KERNEL_WAKE_TAG (UINT64_MAX - 1)
+#define KERNEL_EVENTS 16
+
+/* Slots stay below this, so a task's tag never matches the ones above. */
+#define KERNEL_MAX_SLOTS (UINT32_MAX / 2)
+
+/* Rounds of finding nothing to run before an idle worker sleeps. */
+#define KERNEL_IDLE_SPINS 64
+#define KERNEL_NO_WORKER SIZE_MAX
+
+struct KernelSmp {
+    Kernel* kernel;
+    pthread_t* threads;
+    size_t count;            /* workers started */
+    WsDeque* deques;         /* one per worker, then the inbox */
+    size_t deque_count;
+    pthread_mutex_t inbox_lock;   /* serializes pushes from other threads */
+    _Atomic int64_t queued;  /* jobs in the deques */
+    atomic_size_t sleepers;
+    atomic_bool stop;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;     /* jobs queued, or stop */
+};
+
+typedef struct {
+    KernelSmp* smp;
+    size_t index;
+} KernelWorkerArg;
+
+/* The worker this thread is, the task it is running, and the kernel whose
+   loop it runs. */
+static _Thread_local KernelSmp* tls_smp;
+static _Thread_local size_t tls_worker = KERNEL_NO_WORKER;
+static _Thread_local KernelTask* tls_task;
+static _Thread_local Kernel* tls_loop;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t now_tick(void) {
+    return now_ns() / TIMER_WHEEL_TICK_NS;
+}
 
 void kernel_init(Kernel* k) {
+    k->chunks = NULL;
+    k->chunk_count = 0;
+    k->slot_count = 0;
+    k->free_tasks = NULL;
     k->task_count = 0;
+    for (size_t p = 0; p < KERNEL_PRIORITIES; p++) {
+        k->run_head[p] = NULL;
+        k->run_tail[p] = NULL;
+    }
+    k->stamp = 0;
+    k->spare_count = 0;
     k->tick = 0;
     k->running = false;
-    for (size_t i = 0; i < sizeof(k->tasks) / sizeof(k->tasks[0]); i++) {
-        k->tasks[i].fn = NULL;
-        k->tasks[i].ctx = NULL;
-        k->tasks[i].name = NULL;
-        k->tasks[i].active = false;
+    k->workers = 0;
+    k->smp = NULL;
+    k->epoll_fd = -1;
+    k->timer_fd = -1;
+    k->wake_fd = -1;
+    k->timer_armed_ns = 0;
+    k->idle_ns = 0;
+    k->wakeups = 0;
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&k->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    timer_wheel_init(&k->timers, now_tick());
+}
+
+static KernelTask* task_at(const Kernel* k, uint32_t slot) {
+    return &k->chunks[slot / KERNEL_TASK_CHUNK][slot % KERNEL_TASK_CHUNK];
+}
+
+void kernel_free(Kernel* k) {
+    for (uint32_t i = 0; i < k->slot_count; i++) {
+        coro_free(task_at(k, i)->co);
+    }
+    for (size_t i = 0; i < k->chunk_count; i++) {
+        free(k->chunks[i]);
+    }
+    for (size_t i = 0; i < k->spare_count; i++) {
+        coro_free(k->spare_coros[i]);
     }
+    free(k->chunks);
+    k->chunks = NULL;
+    k->chunk_count = 0;
+    k->slot_count = 0;
+    timer_wheel_free(&k->timers);
+    pthread_mutex_destroy(&k->lock);
 }
 
-bool kernel_add_task(Kernel* k, KernelTaskFn fn, void* ctx, const char* name) {
-    if (k->task_count >= (sizeof(k->tasks) / sizeof(k->tasks[0]))) {
-        return false;
+/* The live task named id, NULL if none. */
+static KernelTask* find_task(const Kernel* k, KernelTaskId id) {
+    uint32_t slot = (uint32_t)id;
+    if (id == 0 || slot >= k->slot_count) {
+        return NULL;
     }
-    k->tasks[k->task_count].fn = fn;
-    k->tasks[k->task_count].ctx = ctx;
-    k->tasks[k->task_count].name = name;
-    k->tasks[k->task_count].active = true;
+    KernelTask* t = task_at(k, slot);
+    return t->id == id ? t : NULL;
+}
+
+/* A free slot, from the free list or a new chunk; NULL when out of
+   memory. */
+static KernelTask* alloc_task(Kernel* k) {
+    KernelTask* t = k->free_tasks;
+    if (t != NULL) {
+        k->free_tasks = t->next;
+    } else {
+        if (k->slot_count >= KERNEL_MAX_SLOTS) {
+            return NULL;
+        }
+        if (k->slot_count == k->chunk_count * KERNEL_TASK_CHUNK) {
+            KernelTask** grown = realloc(k->chunks, (k->chunk_count + 1) * sizeof(KernelTask*));
+            if (grown == NULL) {
+                return NULL;
+            }
+            k->chunks = grown;
+            k->chunks[k->chunk_count] = malloc(KERNEL_TASK_CHUNK * sizeof(KernelTask));
+            if (k->chunks[k->chunk_count] == NULL) {
+                return NULL;
+            }
+            k->chunk_count++;
+        }
+        t = task_at(k, k->slot_count);
+        t->slot = k->slot_count++;
+        t->gen = 1;
+        t->watch_seq = 0;
+        t->co = NULL;
+    }
+    t->id = ((uint64_t)t->gen << 32) | t->slot;
     k->task_count++;
-    return true;
+    return t;
+}
+
+static void release_task(Kernel* k, KernelTask* t) {
+    t->gen = t->gen >= UINT32_MAX - 1 ? 1 : t->gen + 1;   /* ids are never 0 */
+    t->id = 0;
+    t->next = k->free_tasks;
+    k->free_tasks = t;
+    k->task_count--;
+}
+
+/* Appends t to its class's runnable list, for the next pass to begin. */
+static void queue_push(Kernel* k, KernelTask* t) {
+    KernelPriority p = t->priority;
+    t->queued = true;
+    t->stamp = k->stamp;
+    t->next = NULL;
+    t->prev = k->run_tail[p];
+    if (t->prev != NULL) {
+        t->prev->next = t;
+    } else {
+        k->run_head[p] = t;
+    }
+    k->run_tail[p] = t;
+}
+
+static void queue_remove(Kernel* k, KernelTask* t) {
+    KernelPriority p = t->priority;
+    if (t->prev != NULL) {
+        t->prev->next = t->next;
+    } else {
+        k->run_head[p] = t->next;
+    }
+    if (t->next != NULL) {
+        t->next->prev = t->prev;
+    } else {
+        k->run_tail[p] = t->prev;
+    }
+    t->queued = false;
+}
+
+/* A task that becomes ready while it runs is queued when the run ends, so
+   it never runs on two threads at once. */
+static void make_ready(Kernel* k, KernelTask* t) {
+    if (t->running) {
+        t->again = true;
+    } else if (!t->queued) {
+        queue_push(k, t);
+    }
+}
+
+static uint64_t watch_tag(const KernelTask* t) {
+    return ((uint64_t)t->watch_seq << 32) | t->slot;
+}
+
+/* Registers a plain task's fd with epoll (op 0), or re-arms it
+   (EPOLL_CTL_MOD): with workers it reports one event per run. Regular files
+   cannot be registered, but they never block either, so such a task is
+   polled every pass. */
+static void watch(Kernel* k, KernelTask* t, int op) {
+    if (op == 0) {
+        t->polled = false;
+        t->watch_seq++;
+    }
+    if (t->co != NULL || t->fd < 0 || t->polled) {
+        return;
+    }
+#if KERNEL_EPOLL
+    if (k->epoll_fd >= 0) {
+        struct epoll_event ev;
+        ev.events = (uint32_t)EPOLLIN | (k->smp != NULL ? (uint32_t)EPOLLONESHOT : 0u);
+        ev.data.u64 = watch_tag(t);
+        if (epoll_ctl(k->epoll_fd, op != 0 ? op : EPOLL_CTL_ADD, t->fd, &ev) == 0 || op != 0) {
+            return;
+        }
+    }
+#endif
+    t->polled = true;
+}
+
+static void unwatch(Kernel* k, KernelTask* t) {
+#if KERNEL_EPOLL
+    if (t->co == NULL && t->fd >= 0 && !t->polled && k->epoll_fd >= 0) {
+        (void)epoll_ctl(k->epoll_fd, EPOLL_CTL_DEL, t->fd, NULL);
+    }
+#else
+    (void)k;
+#endif
+}
+
+static void wake(Kernel* k) {
+    /* kernel_run's own thread is not asleep */
+    if (k->wake_fd >= 0 && tls_loop != k) {
+        uint64_t one = 1;
+        (void)!write(k->wake_fd, &one, sizeof(one));
+    }
+}
+
+static KernelTaskId add_task(Kernel* k, KernelTaskFn fn, void* ctx, const char* name, int fd, uint64_t timeout_ms,
+                             Coro* co) {
+    pthread_mutex_lock(&k->lock);
+    KernelTask* t = alloc_task(k);
+    if (t == NULL) {
+        pthread_mutex_unlock(&k->lock);
+        return 0;
+    }
+    t->fn = fn;
+    t->ctx = ctx;
+    t->name = name;
+    t->kernel = k;
+    t->priority = KERNEL_PRIO_NORMAL;
+    t->fd = fd;
+    t->timeout_ns = timeout_ms * 1000000u;
+    t->timeout_timer = 0;
+    t->polled = false;
+    t->running = false;
+    t->again = false;
+    t->exiting = false;
+    t->job = (KernelJob){ NULL, NULL, NULL, t };
+    t->co = co;
+    t->wait = KERNEL_WAIT_NONE;
+    t->wait_fd = -1;
+    t->wait_ns = 0;
+    t->armed_fd = -1;
+    t->fd_ready = false;
+    t->wait_ok = false;
+    t->runs = 0;
+    t->run_ns = 0;
+    if (k->running) {
+        watch(k, t, 0);
+    }
+    queue_push(k, t);
+    KernelTaskId id = t->id;
+    pthread_mutex_unlock(&k->lock);
+    wake(k);
+    return id;
+}
+
+KernelTaskId kernel_add_wait_task(Kernel* k, KernelTaskFn fn, void* ctx, const char* name, int fd,
+                                  uint64_t timeout_ms) {
+    return add_task(k, fn, ctx, name, fd, timeout_ms, NULL);
+}
+
+KernelTaskId kernel_add_task(Kernel* k, KernelTaskFn fn, void* ctx, const char* name) {
+    return kernel_add_wait_task(k, fn, ctx, name, -1, 0);
+}
+
+/* Keeps a default-size stack for the next coroutine task. */
+static void drop_coro(Kernel* k, Coro* co) {
+    pthread_mutex_lock(&k->lock);
+    if (coro_stack_size(co) == CORO_STACK_DEFAULT && k->spare_count < KERNEL_SPARE_COROS) {
+        k->spare_coros[k->spare_count++] = co;
+        co = NULL;
+    }
+    pthread_mutex_unlock(&k->lock);
+    coro_free(co);
+}
+
+KernelTaskId kernel_add_coroutine(Kernel* k, KernelTaskFn fn, void* ctx, const char* name, size_t stack_size) {
+    Coro* co = NULL;
+    if (stack_size == 0 || stack_size == CORO_STACK_DEFAULT) {
+        pthread_mutex_lock(&k->lock);
+        if (k->spare_count > 0) {
+            co = k->spare_coros[--k->spare_count];
+        }
+        pthread_mutex_unlock(&k->lock);
+    }
+    if (co != NULL && !coro_reset(co, fn, ctx)) {
+        coro_free(co);
+        co = NULL;
+    }
+    if (co == NULL && !coro_create(&co, stack_size, fn, ctx).ok) {
+        return 0;
+    }
+    KernelTaskId id = add_task(k, fn, ctx, name, -1, 0, co);
+    if (id == 0) {
+        drop_coro(k, co);
+    }
+    return id;
+}
+
+/* Rounds up: a timer never fires early. */
+static TimerId add_timer_ns(Kernel* k, uint64_t delay_ns, uint64_t period_ns, TimerFn fn, void* ctx) {
+    uint64_t expires = (now_ns() + delay_ns + TIMER_WHEEL_TICK_NS - 1) / TIMER_WHEEL_TICK_NS;
+    uint64_t period = (period_ns + TIMER_WHEEL_TICK_NS - 1) / TIMER_WHEEL_TICK_NS;
+    pthread_mutex_lock(&k->lock);
+    TimerId id = timer_wheel_add(&k->timers, expires, period, fn, ctx);
+    pthread_mutex_unlock(&k->lock);
+    return id;
+}
+
+TimerId kernel_add_timer(Kernel* k, uint64_t delay_ms, uint64_t period_ms, TimerFn fn, void* ctx) {
+    TimerId id = add_timer_ns(k, delay_ms * 1000000u, period_ms * 1000000u, fn, ctx);
+    /* kernel_run may be asleep until a later deadline */
+    wake(k);
+    return id;
+}
+
+bool kernel_cancel_timer(Kernel* k, TimerId id) {
+    pthread_mutex_lock(&k->lock);
+    bool found = timer_wheel_cancel(&k->timers, id);
+    pthread_mutex_unlock(&k->lock);
+    return found;
+}
+
+/* Runs under the lock, from timer_wheel_advance. */
+static void task_timeout(void* ctx) {
+    KernelTask* t = ctx;
+    t->timeout_timer = 0;
+    make_ready(t->kernel, t);
+}
+
+static void cancel_task_timer(Kernel* k, KernelTask* t) {
+    if (t->timeout_timer != 0) {
+        (void)timer_wheel_cancel(&k->timers, t->timeout_timer);
+        t->timeout_timer = 0;
+    }
+}
+
+/* Restarts t's timeout after a run. */
+static void rearm_timeout(Kernel* k, KernelTask* t) {
+    if (t->timeout_ns == 0) {
+        return;
+    }
+    cancel_task_timer(k, t);
+    t->timeout_timer = add_timer_ns(k, t->timeout_ns, 0, task_timeout, t);
+    if (t->timeout_timer == 0) {
+        make_ready(k, t);
+    }
+}
+
+static void disarm_wait_fd(Kernel* k, KernelTask* t) {
+#if KERNEL_EPOLL
+    if (t->armed_fd >= 0 && k->epoll_fd >= 0) {
+        (void)epoll_ctl(k->epoll_fd, EPOLL_CTL_DEL, t->armed_fd, NULL);
+    }
+#else
+    (void)k;
+#endif
+    t->armed_fd = -1;
+}
+
+/* Drops t's waits and frees its slot. Under the lock, t not running. */
+static void finish_task(Kernel* k, KernelTask* t) {
+    if (t->queued) {
+        queue_remove(k, t);
+    }
+    cancel_task_timer(k, t);
+    unwatch(k, t);
+    if (t->co != NULL) {
+        disarm_wait_fd(k, t);
+        drop_coro(k, t->co);
+        t->co = NULL;
+    }
+    release_task(k, t);
+}
+
+bool kernel_remove_task(Kernel* k, KernelTaskId id) {
+    pthread_mutex_lock(&k->lock);
+    KernelTask* t = find_task(k, id);
+    bool found = t != NULL && !t->exiting;
+    if (found && t->running) {
+        t->exiting = true;
+    } else if (found) {
+        finish_task(k, t);
+    }
+    pthread_mutex_unlock(&k->lock);
+    return found;
+}
+
+/* The coroutine task running on this thread, if the caller is on its
+   stack. */
+static KernelTask* current_coroutine(void) {
+    KernelTask* t = tls_task;
+    return t != NULL && t->co != NULL && coro_current() == t->co ? t : NULL;
+}
+
+void kernel_exit(Kernel* k) {
+    KernelTask* t = tls_task;
+    if (t == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&k->lock);
+    t->exiting = true;
+    pthread_mutex_unlock(&k->lock);
+    if (current_coroutine() == t) {
+        coro_suspend(t->co);
+    }
+}
+
+KernelTaskId kernel_current(const Kernel* k) {
+    (void)k;
+    return tls_task != NULL ? tls_task->id : 0;
+}
+
+bool kernel_set_priority(Kernel* k, KernelTaskId id, KernelPriority priority) {
+    if ((unsigned)priority >= KERNEL_PRIORITIES) {
+        return false;
+    }
+    pthread_mutex_lock(&k->lock);
+    KernelTask* t = find_task(k, id);
+    if (t != NULL && t->queued) {
+        queue_remove(k, t);
+        t->priority = priority;
+        queue_push(k, t);
+    } else if (t != NULL) {
+        t->priority = priority;
+    }
+    pthread_mutex_unlock(&k->lock);
+    return t != NULL;
+}
+
+const KernelTask* kernel_task(Kernel* k, KernelTaskId id) {
+    pthread_mutex_lock(&k->lock);
+    const KernelTask* t = find_task(k, id);
+    pthread_mutex_unlock(&k->lock);
+    return t;
+}
+
+size_t kernel_tasks(Kernel* k, KernelTaskInfo* out, size_t cap) {
+    size_t n = 0;
+    pthread_mutex_lock(&k->lock);
+    for (uint32_t i = 0; i < k->slot_count; i++) {
+        const KernelTask* t = task_at(k, i);
+        if (t->id == 0) {
+            continue;
+        }
+        if (n < cap) {
+            out[n] = (KernelTaskInfo){ t->id, t->name, t->priority, t->co != NULL, t->runs, t->run_ns };
+        }
+        n++;
+    }
+    pthread_mutex_unlock(&k->lock);
+    return n;
+}
+
+void kernel_run_again(Kernel* k) {
+    KernelTask* t = tls_task;
+    if (t != NULL && t->co == NULL) {
+        pthread_mutex_lock(&k->lock);
+        make_ready(k, t);
+        pthread_mutex_unlock(&k->lock);
+    }
+}
+
+void kernel_yield(Kernel* k) {
+    (void)k;
+    KernelTask* t = current_coroutine();
+    if (t != NULL) {
+        t->wait = KERNEL_WAIT_YIELD;
+        coro_suspend(t->co);
+    }
+}
+
+void kernel_sleep(Kernel* k, uint64_t ms) {
+    (void)k;
+    KernelTask* t = current_coroutine();
+    if (t == NULL) {
+        struct timespec ts = { (time_t)(ms / 1000u), (long)(ms % 1000u) * 1000000L };
+        while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+        }
+        return;
+    }
+    t->wait = KERNEL_WAIT_SLEEP;
+    t->wait_ns = ms * 1000000u;
+    coro_suspend(t->co);
+}
+
+bool kernel_wait_fd(Kernel* k, int fd, uint64_t timeout_ms) {
+    (void)k;
+    KernelTask* t = current_coroutine();
+    if (t == NULL) {
+        struct pollfd p = { fd, POLLIN, 0 };
+        int ms = timeout_ms == 0 ? -1 : timeout_ms > INT_MAX ? INT_MAX : (int)timeout_ms;
+        int r;
+        do {
+            r = poll(&p, 1, ms);
+        } while (r < 0 && errno == EINTR);
+        return r > 0;
+    }
+    t->wait = KERNEL_WAIT_FD;
+    t->wait_fd = fd;
+    t->wait_ns = timeout_ms * 1000000u;
+    coro_suspend(t->co);
+    return t->wait_ok;
+}
+
+/* Has epoll report t's wait_fd once. An fd it cannot watch is left with
+   armed_fd -1 and polled every pass instead. */
+static void arm_wait_fd(Kernel* k, KernelTask* t) {
+#if KERNEL_EPOLL
+    if (k->epoll_fd < 0) {
+        return;
+    }
+    /* events of an earlier wait that are still on their way are dropped */
+    t->watch_seq++;
+    struct epoll_event ev;
+    ev.events = (uint32_t)EPOLLIN | (uint32_t)EPOLLONESHOT;
+    ev.data.u64 = watch_tag(t);
+    /* MOD fails if the fd was closed and its number reused */
+    if (t->armed_fd == t->wait_fd && epoll_ctl(k->epoll_fd, EPOLL_CTL_MOD, t->wait_fd, &ev) == 0) {
+        return;
+    }
+    disarm_wait_fd(k, t);
+    if (epoll_ctl(k->epoll_fd, EPOLL_CTL_ADD, t->wait_fd, &ev) == 0) {
+        t->armed_fd = t->wait_fd;
+    }
+#else
+    (void)k;
+    (void)t;
+#endif
+}
+
+static bool polls_wait_fd(const KernelTask* t) {
+    return t->co != NULL && t->wait == KERNEL_WAIT_FD && t->armed_fd < 0;
+}
+
+static bool fd_readable(int fd) {
+    struct pollfd p = { fd, POLLIN, 0 };
+    return poll(&p, 1, 0) > 0;
+}
+
+/* Sets up the wait of a coroutine that suspended itself. */
+static void coroutine_suspended(Kernel* k, KernelTask* t) {
+    bool timed = t->wait == KERNEL_WAIT_SLEEP || (t->wait == KERNEL_WAIT_FD && t->wait_ns != 0);
+    if (t->wait == KERNEL_WAIT_FD) {
+        arm_wait_fd(k, t);
+    }
+    if (timed) {
+        t->timeout_timer = add_timer_ns(k, t->wait_ns, 0, task_timeout, t);
+    }
+    /* a polled fd is checked each time the task comes up */
+    if (t->wait == KERNEL_WAIT_YIELD || polls_wait_fd(t) || (timed && t->timeout_timer == 0)) {
+        make_ready(k, t);
+    }
+}
+
+static bool always_ready(const KernelTask* t) {
+    return t->co == NULL && (t->polled || (t->fd < 0 && t->timeout_ns == 0));
+}
+
+/* Ends t if it exited, else sets up what it waits for. Under the lock,
+   with t no longer running. */
+static void after_run(Kernel* k, KernelTask* t) {
+    if (t->exiting || (t->co != NULL && coro_done(t->co))) {
+        finish_task(k, t);
+        return;
+    }
+    bool again = t->again;
+    t->again = false;
+    if (t->co != NULL) {
+        coroutine_suspended(k, t);
+        return;
+    }
+    rearm_timeout(k, t);
+#if KERNEL_EPOLL
+    if (k->smp != NULL) {
+        watch(k, t, EPOLL_CTL_MOD);
+    }
+#endif
+    if (again || always_ready(t)) {
+        make_ready(k, t);
+    }
+}
+
+/* Drops the timer and fd events of the wait that has ended, and resumes the
+   coroutine. */
+static void resume_coroutine(Kernel* k, KernelTask* t) {
+    pthread_mutex_lock(&k->lock);
+    cancel_task_timer(k, t);
+    t->watch_seq++;
+    t->wait_ok = t->fd_ready;
+    t->fd_ready = false;
+    t->wait = KERNEL_WAIT_NONE;
+    pthread_mutex_unlock(&k->lock);
+    coro_resume(t->co);
 }
 
 void kernel_stop(Kernel* k) {
     k->running = false;
+    wake(k);
 }
 
 uint64_t kernel_tick(const Kernel* k) {
     return k->tick;
 }
 
-void kernel_run(Kernel* k) {
-    k->running = true;
-    while (k->running) {
-        for (size_t i = 0; i < k->task_count; i++) {
-            if (!k->tasks[i].active || k->tasks[i].fn == NULL) {
-                continue;
+void kernel_stats(Kernel* k, KernelStats* out) {
+    out->passes = k->tick;
+    out->wakeups = k->wakeups;
+    out->idle_ns = k->idle_ns;
+    pthread_mutex_lock(&k->lock);
+    out->tasks = k->task_count;
+    out->timers_pending = k->timers.count;
+    out->timers_fired = k->timers.fired;
+    pthread_mutex_unlock(&k->lock);
+    out->workers = k->smp != NULL ? k->smp->count : 0;
+}
+
+static void run_task(Kernel* k, KernelTask* t) {
+    KernelTask* outer = tls_task;
+    tls_task = t;
+    uint64_t t0 = now_ns();
+    if (t->co != NULL) {
+        resume_coroutine(k, t);
+    } else {
+        t->fn(t->ctx);
+    }
+    uint64_t t1 = now_ns();
+    tls_task = outer;
+    t->runs++;
+    t->run_ns += t1 - t0;
+}
+
+static void run_job(Kernel* k, KernelJob* job) {
+    KernelTask* t = job->task;
+    if (t == NULL) {
+        /* job may be gone once pending drops */
+        KernelGroup* g = job->group;
+        job->fn(job->ctx);
+        atomic_fetch_sub_explicit(&g->pending, 1, memory_order_release);
+        return;
+    }
+    pthread_mutex_lock(&k->lock);
+    bool exiting = t->exiting;
+    pthread_mutex_unlock(&k->lock);
+    if (!exiting) {
+        run_task(k, t);
+    }
+    pthread_mutex_lock(&k->lock);
+    t->running = false;
+    after_run(k, t);
+    pthread_mutex_unlock(&k->lock);
+    wake(k);
+}
+
+/* Queues job on this thread's deque if it is a worker, else on the inbox. */
+static bool smp_push(KernelSmp* smp, KernelJob* job) {
+    Status st;
+    if (tls_smp == smp && tls_worker != KERNEL_NO_WORKER) {
+        st = ws_deque_push(&smp->deques[tls_worker], job);
+    } else {
+        pthread_mutex_lock(&smp->inbox_lock);
+        st = ws_deque_push(&smp->deques[smp->deque_count - 1], job);
+        pthread_mutex_unlock(&smp->inbox_lock);
+    }
+    if (!st.ok) {
+        return false;
+    }
+    /* a worker going to sleep counts itself before it checks queued, so one
+       of the two sees the other */
+    atomic_fetch_add(&smp->queued, 1);
+    if (atomic_load(&smp->sleepers) > 0) {
+        pthread_mutex_lock(&smp->lock);
+        pthread_cond_signal(&smp->wake);
+        pthread_mutex_unlock(&smp->lock);
+    }
+    return true;
+}
+
+/* The newest job of this thread's own deque, else the oldest of another. */
+static KernelJob* smp_find(KernelSmp* smp) {
+    size_t self = tls_smp == smp ? tls_worker : KERNEL_NO_WORKER;
+    KernelJob* job = NULL;
+    if (self != KERNEL_NO_WORKER) {
+        job = ws_deque_take(&smp->deques[self]);
+    }
+    size_t start = self != KERNEL_NO_WORKER ? self + 1 : 0;
+    for (size_t i = 0; job == NULL && i < smp->deque_count; i++) {
+        size_t victim = (start + i) % smp->deque_count;
+        if (victim != self) {
+            job = ws_deque_steal(&smp->deques[victim]);
+        }
+    }
+    if (job != NULL) {
+        atomic_fetch_sub(&smp->queued, 1);
+    }
+    return job;
+}
+
+static void* smp_worker(void* p) {
+    KernelWorkerArg arg = *(KernelWorkerArg*)p;
+    free(p);
+    KernelSmp* smp = arg.smp;
+    tls_smp = smp;
+    tls_worker = arg.index;
+    unsigned idle = 0;
+    while (!atomic_load(&smp->stop)) {
+        KernelJob* job = smp_find(smp);
+        if (job != NULL) {
+            run_job(smp->kernel, job);
+            idle = 0;
+            continue;
+        }
+        if (++idle < KERNEL_IDLE_SPINS) {
+            sched_yield();
+            continue;
+        }
+        pthread_mutex_lock(&smp->lock);
+        atomic_fetch_add(&smp->sleepers, 1);
+        while (atomic_load(&smp->queued) <= 0 && !atomic_load(&smp->stop)) {
+            pthread_cond_wait(&smp->wake, &smp->lock);
+        }
+        atomic_fetch_sub(&smp->sleepers, 1);
+        pthread_mutex_unlock(&smp->lock);
+        idle = 0;
+    }
+    tls_smp = NULL;
+    tls_worker = KERNEL_NO_WORKER;
+    return NULL;
+}
+
+static void smp_free(KernelSmp* smp) {
+    for (size_t i = 0; i < smp->deque_count; i++) {
+        ws_deque_free(&smp->deques[i]);
+    }
+    pthread_cond_destroy(&smp->wake);
+    pthread_mutex_destroy(&smp->lock);
+    pthread_mutex_destroy(&smp->inbox_lock);
+    free(smp->deques);
+    free(smp->threads);
+    free(smp);
+}
+
+static KernelSmp* smp_start(Kernel* k) {
+    size_t n = k->workers;
+    KernelSmp* smp = malloc(sizeof(KernelSmp));
+    if (smp == NULL) {
+        return NULL;
+    }
+    smp->kernel = k;
+    smp->count = 0;
+    smp->deque_count = 0;
+    smp->threads = malloc(n * sizeof(pthread_t));
+    smp->deques = malloc((n + 1) * sizeof(WsDeque));
+    atomic_init(&smp->queued, 0);
+    atomic_init(&smp->sleepers, 0);
+    atomic_init(&smp->stop, false);
+    pthread_mutex_init(&smp->inbox_lock, NULL);
+    pthread_mutex_init(&smp->lock, NULL);
+    pthread_cond_init(&smp->wake, NULL);
+    if (smp->threads == NULL || smp->deques == NULL) {
+        smp_free(smp);
+        return NULL;
+    }
+    for (; smp->deque_count < n + 1; smp->deque_count++) {
+        if (!ws_deque_init(&smp->deques[smp->deque_count], 64).ok) {
+            smp_free(smp);
+            return NULL;
+        }
+    }
+    for (size_t i = 0; i < n; i++) {
+        KernelWorkerArg* arg = malloc(sizeof(*arg));
+        if (arg == NULL) {
+            break;
+        }
+        arg->smp = smp;
+        arg->index = i;
+        if (pthread_create(&smp->threads[i], NULL, smp_worker, arg) != 0) {
+            free(arg);
+            break;
+        }
+        smp->count++;
+    }
+    if (smp->count == 0) {
+        smp_free(smp);
+        return NULL;
+    }
+    return smp;
+}
+
+/* Lets the workers finish what they are running. Runs still queued are
+   dropped, and their tasks go back on the runnable lists. */
+static void smp_stop(Kernel* k) {
+    KernelSmp* smp = k->smp;
+    atomic_store(&smp->stop, true);
+    pthread_mutex_lock(&smp->lock);
+    pthread_cond_broadcast(&smp->wake);
+    pthread_mutex_unlock(&smp->lock);
+    for (size_t i = 0; i < smp->count; i++) {
+        pthread_join(smp->threads[i], NULL);
+    }
+    k->smp = NULL;
+    smp_free(smp);
+    pthread_mutex_lock(&k->lock);
+    for (uint32_t i = 0; i < k->slot_count; i++) {
+        KernelTask* t = task_at(k, i);
+        if (t->id != 0 && t->running) {
+            t->running = false;
+            t->again = false;
+            if (t->exiting) {
+                finish_task(k, t);
+            } else if (!t->queued) {
+                queue_push(k, t);
+            }
+        }
+    }
+    pthread_mutex_unlock(&k->lock);
+}
+
+void kernel_enable_smp(Kernel* k, size_t workers) {
+    k->workers = workers != 0 ? workers : thread_pool_cpu_count();
+}
+
+void kernel_group_init(KernelGroup* g) {
+    atomic_init(&g->pending, 0);
+}
+
+void kernel_spawn(Kernel* k, KernelGroup* g, KernelJob* job, KernelTaskFn fn, void* ctx) {
+    job->fn = fn;
+    job->ctx = ctx;
+    job->group = g;
+    job->task = NULL;
+    atomic_fetch_add_explicit(&g->pending, 1, memory_order_relaxed);
+    if (k->smp == NULL || !smp_push(k->smp, job)) {
+        run_job(k, job);
+    }
+}
+
+void kernel_wait(Kernel* k, KernelGroup* g) {
+    KernelSmp* smp = k->smp;
+    while (atomic_load_explicit(&g->pending, memory_order_acquire) > 0) {
+        KernelJob* job = smp != NULL ? smp_find(smp) : NULL;
+        if (job != NULL) {
+            run_job(k, job);
+        } else {
+            sched_yield();
+        }
+    }
+}
+
+static void open_waits(Kernel* k) {
+#if KERNEL_EPOLL
+    k->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (k->epoll_fd >= 0) {
+        k->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u64 = KERNEL_TIMER_TAG;
+        if (k->timer_fd < 0 || epoll_ctl(k->epoll_fd, EPOLL_CTL_ADD, k->timer_fd, &ev) != 0) {
+            if (k->timer_fd >= 0) {
+                close(k->timer_fd);
             }
-            k->tasks[i].fn(k->tasks[i].ctx);
-            if (!k->running) {
-                break;
+            close(k->epoll_fd);
+            k->timer_fd = -1;
+            k->epoll_fd = -1;
+        }
+    }
+    if (k->epoll_fd >= 0) {
+        k->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u64 = KERNEL_WAKE_TAG;
+        if (k->wake_fd >= 0 && epoll_ctl(k->epoll_fd, EPOLL_CTL_ADD, k->wake_fd, &ev) != 0) {
+            close(k->wake_fd);
+            k->wake_fd = -1;
+        }
+        if (k->wake_fd >= 0 && k->workers > 0) {
+            k->smp = smp_start(k);
+        }
+    }
+#endif
+    k->timer_armed_ns = 0;
+    pthread_mutex_lock(&k->lock);
+    for (uint32_t i = 0; i < k->slot_count; i++) {
+        KernelTask* t = task_at(k, i);
+        if (t->id == 0) {
+            continue;
+        }
+        watch(k, t, 0);
+        t->armed_fd = -1;
+        if (t->co != NULL && t->wait == KERNEL_WAIT_FD) {
+            arm_wait_fd(k, t);
+        }
+    }
+    pthread_mutex_unlock(&k->lock);
+}
+
+static void close_waits(Kernel* k) {
+    if (k->smp != NULL) {
+        smp_stop(k);
+    }
+    pthread_mutex_lock(&k->lock);
+    if (k->wake_fd >= 0) {
+        close(k->wake_fd);
+    }
+    if (k->timer_fd >= 0) {
+        close(k->timer_fd);
+    }
+    if (k->epoll_fd >= 0) {
+        close(k->epoll_fd);
+    }
+    k->wake_fd = -1;
+    k->timer_fd = -1;
+    k->epoll_fd = -1;
+    for (uint32_t i = 0; i < k->slot_count; i++) {
+        task_at(k, i)->armed_fd = -1;
+    }
+    pthread_mutex_unlock(&k->lock);
+}
+
+static bool has_runnable(Kernel* k) {
+    pthread_mutex_lock(&k->lock);
+    bool any = false;
+    for (size_t p = 0; p < KERNEL_PRIORITIES; p++) {
+        any = any || k->run_head[p] != NULL;
+    }
+    pthread_mutex_unlock(&k->lock);
+    return any;
+}
+
+/* Sets the timer fd to when the wheel next has work, if that changed. */
+static void arm_timer(Kernel* k) {
+#if KERNEL_EPOLL
+    pthread_mutex_lock(&k->lock);
+    uint64_t next = timer_wheel_next(&k->timers);
+    pthread_mutex_unlock(&k->lock);
+    uint64_t due = next != UINT64_MAX ? next * TIMER_WHEEL_TICK_NS : 0;
+    if (due == k->timer_armed_ns) {
+        return;
+    }
+    struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+    its.it_value.tv_sec = (time_t)(due / 1000000000u);
+    its.it_value.tv_nsec = (long)(due % 1000000000u);
+    if (timerfd_settime(k->timer_fd, TFD_TIMER_ABSTIME, &its, NULL) == 0) {
+        k->timer_armed_ns = due;
+    }
+#else
+    (void)k;
+#endif
+}
+
+static void advance_timers(Kernel* k) {
+    pthread_mutex_lock(&k->lock);
+    timer_wheel_advance(&k->timers, now_tick());
+    pthread_mutex_unlock(&k->lock);
+}
+
+/* Takes pending fd events, sleeping until there is one if block. */
+static void wait_events(Kernel* k, bool block) {
+#if KERNEL_EPOLL
+    if (k->epoll_fd < 0) {
+        return;
+    }
+    if (block) {
+        arm_timer(k);
+    }
+    struct epoll_event ev[KERNEL_EVENTS];
+    uint64_t t0 = block ? now_ns() : 0;
+    int n = epoll_wait(k->epoll_fd, ev, KERNEL_EVENTS, block ? -1 : 0);
+    if (block) {
+        k->idle_ns += now_ns() - t0;
+        k->wakeups += n > 0 ? 1u : 0u;
+    }
+    pthread_mutex_lock(&k->lock);
+    for (int i = 0; i < n; i++) {
+        uint64_t tag = ev[i].data.u64;
+        uint64_t count;
+        if (tag == KERNEL_TIMER_TAG) {
+            (void)!read(k->timer_fd, &count, sizeof(count));
+            k->timer_armed_ns = 0;
+            continue;
+        }
+        if (tag == KERNEL_WAKE_TAG) {
+            (void)!read(k->wake_fd, &count, sizeof(count));
+            continue;
+        }
+        uint32_t slot = (uint32_t)tag;
+        KernelTask* t = slot < k->slot_count ? task_at(k, slot) : NULL;
+        if (t == NULL || t->id == 0 || t->watch_seq != (uint32_t)(tag >> 32)) {
+            continue;   /* removed, or an earlier wait */
+        }
+        if (t->co == NULL) {
+            make_ready(k, t);
+        } else if (t->wait == KERNEL_WAIT_FD) {
+            t->fd_ready = true;
+            make_ready(k, t);
+        }
+    }
+    pthread_mutex_unlock(&k->lock);
+#else
+    (void)k;
+    (void)block;
+#endif
+}
+
+/* Runs, or hands to the workers, the tasks of the highest priority class
+   that were runnable when the pass began. */
+static void run_pass(Kernel* k) {
+    pthread_mutex_lock(&k->lock);
+    uint64_t limit = k->stamp++;
+    size_t p = 0;
+    while (p < KERNEL_PRIORITIES && (k->run_head[p] == NULL || k->run_head[p]->stamp > limit)) {
+        p++;
+    }
+    while (p < KERNEL_PRIORITIES && k->running) {
+        KernelTask* t = k->run_head[p];
+        if (t == NULL || t->stamp > limit) {
+            break;
+        }
+        queue_remove(k, t);
+        if (polls_wait_fd(t)) {
+            if (!fd_readable(t->wait_fd)) {
+                queue_push(k, t);   /* after limit: looked at again next pass */
+                continue;
             }
+            t->fd_ready = true;
         }
-        k->tick++;
-        if (k->tick == UINT64_MAX) {
-            fprintf(stderr, "kernel: tick overflow, stopping\n");
-            k->running = false;
+        t->running = true;
+        pthread_mutex_unlock(&k->lock);
+        if (k->smp == NULL || !smp_push(k->smp, &t->job)) {
+            run_job(k, &t->job);
+        }
+        pthread_mutex_lock(&k->lock);
+    }
+    pthread_mutex_unlock(&k->lock);
+}
+
+static void end_pass(Kernel* k) {
+    if (++k->tick == UINT64_MAX) {
+        fprintf(stderr, "kernel: tick overflow, stopping\n");
+        k->running = false;
+    }
+}
+
+void kernel_run(Kernel* k) {
+    Kernel* outer = tls_loop;
+    tls_loop = k;
+    k->running = true;
+    open_waits(k);
+    while (k->running) {
+        advance_timers(k);
+        bool any = has_runnable(k);
+        wait_events(k, !any);
+        if (!any) {
+            advance_timers(k);
         }
+        run_pass(k);
+        end_pass(k);
     }
+    close_waits(k);
+    tls_loop = outer;
 }
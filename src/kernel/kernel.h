@@ -1,27 +1,239 @@
 #pragma once
 
+#include "kernel/coro.h"
+#include "kernel/timer_wheel.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 
 typedef void (*KernelTaskFn)(void* ctx);
 
+typedef struct KernelTask KernelTask;
+typedef struct Kernel Kernel;
+
+/* Names a task until it is removed or ends; 0 names none. */
+typedef uint64_t KernelTaskId;
+
+/* Tasks per chunk of the task table. Chunks never move, so neither do
+   tasks. */
+#define KERNEL_TASK_CHUNK 64
+
+/* Default-size coroutine stacks kept for new coroutine tasks. */
+#define KERNEL_SPARE_COROS 32
+
+/* Priority classes, highest first. A pass runs only the highest class
+   that has runnable tasks, so a task that is always ready keeps lower
+   classes from running. */
+typedef enum {
+    KERNEL_PRIO_HIGH,
+    KERNEL_PRIO_NORMAL,
+    KERNEL_PRIO_LOW,
+    KERNEL_PRIORITIES,
+} KernelPriority;
+
+/* Subtasks that can be waited for together. */
+typedef struct {
+    atomic_size_t pending;
+} KernelGroup;
+
+/* One unit of work for the SMP workers: a subtask, or a task's run. */
 typedef struct {
+    KernelTaskFn fn;
+    void* ctx;
+    KernelGroup* group;
+    KernelTask* task;        /* NULL for a subtask */
+} KernelJob;
+
+/* What a suspended coroutine task waits for. */
+typedef enum {
+    KERNEL_WAIT_NONE,
+    KERNEL_WAIT_YIELD,
+    KERNEL_WAIT_SLEEP,
+    KERNEL_WAIT_FD,
+} KernelWait;
+
+/* A task runs on the first pass after it is added, then whenever it is
+   ready: always for a plain task, else when its fd is readable or
+   timeout_ns has passed since its last run, whichever comes first. A
+   coroutine task is resumed once what it waits for has happened. A ready
+   task sits on the runnable list of its class, so a pass visits only
+   those. Fields other than the counters are guarded by Kernel.lock. */
+struct KernelTask {
     KernelTaskFn fn;
     void* ctx;
     const char* name;
-    bool active;
-} KernelTask;
+    Kernel* kernel;
+    KernelTaskId id;         /* 0 while the slot is free */
+    uint32_t slot;
+    uint32_t gen;            /* bumped when the slot is freed */
+    KernelPriority priority;
+    int fd;                  /* -1 for none */
+    uint64_t timeout_ns;     /* 0 for none */
+    TimerId timeout_timer;
+    uint32_t watch_seq;      /* tags this task's epoll events; stale ones differ */
+    bool polled;             /* fd cannot be waited on, e.g. a regular file */
+    bool queued;             /* on a runnable list */
+    bool running;            /* being run, or handed to the workers */
+    bool again;              /* ready while running: queue after the run */
+    bool exiting;            /* removed while running: freed after the run */
+    uint64_t stamp;          /* pass it was queued in */
+    KernelTask* prev;        /* runnable list */
+    KernelTask* next;        /* runnable list, or the free list */
+    KernelJob job;
+    Coro* co;                /* NULL unless added by kernel_add_coroutine */
+    KernelWait wait;
+    int wait_fd;
+    uint64_t wait_ns;        /* sleep, or timeout of a wait_fd (0 for none) */
+    int armed_fd;            /* coroutine fd in epoll, -1 for none */
+    bool fd_ready;           /* wait_fd became readable */
+    bool wait_ok;            /* what kernel_wait_fd returns */
+    _Atomic uint64_t runs;
+    _Atomic uint64_t run_ns; /* time spent in fn */
+};
 
-typedef struct {
-    KernelTask tasks[16];
+typedef struct KernelSmp KernelSmp;
+
+struct Kernel {
+    KernelTask** chunks;     /* slot i is chunks[i / KERNEL_TASK_CHUNK] */
+    size_t chunk_count;
+    uint32_t slot_count;     /* slots ever used */
+    KernelTask* free_tasks;
     size_t task_count;
-    uint64_t tick;
-    bool running;
-} Kernel;
+    KernelTask* run_head[KERNEL_PRIORITIES];
+    KernelTask* run_tail[KERNEL_PRIORITIES];
+    uint64_t stamp;          /* passes begun */
+    Coro* spare_coros[KERNEL_SPARE_COROS];
+    size_t spare_count;
+    _Atomic uint64_t tick;   /* scheduler passes */
+    _Atomic bool running;
+    size_t workers;          /* SMP worker threads, 0 for none */
+    KernelSmp* smp;          /* while kernel_run runs with workers */
+    int epoll_fd;            /* -1 outside kernel_run */
+    int timer_fd;
+    int wake_fd;             /* work for kernel_run from another thread */
+    uint64_t timer_armed_ns; /* deadline timer_fd is set to, 0 for none */
+    pthread_mutex_t lock;    /* tasks and timers; recursive, as timer
+                                callbacks may add timers and tasks */
+    TimerWheel timers;       /* ticks of the monotonic clock */
+    _Atomic uint64_t idle_ns;     /* time blocked waiting for a ready task */
+    _Atomic uint64_t wakeups;     /* waits that ended with something to do */
+};
+
+typedef struct {
+    uint64_t passes;
+    uint64_t wakeups;
+    uint64_t idle_ns;
+    size_t tasks;
+    size_t timers_pending;
+    uint64_t timers_fired;
+    size_t workers;          /* 0 when tasks run on kernel_run's thread */
+} KernelStats;
+
+typedef struct {
+    KernelTaskId id;
+    const char* name;
+    KernelPriority priority;
+    bool coroutine;
+    uint64_t runs;
+    uint64_t run_ns;
+} KernelTaskInfo;
 
 void kernel_init(Kernel* k);
-bool kernel_add_task(Kernel* k, KernelTaskFn fn, void* ctx, const char* name);
+void kernel_free(Kernel* k);
+
+/* The add functions return 0 when out of memory, and may be called from
+   any thread, including from a task. A new task has KERNEL_PRIO_NORMAL. */
+KernelTaskId kernel_add_task(Kernel* k, KernelTaskFn fn, void* ctx, const char* name);
+
+/* Adds a task that waits for fd to be readable (fd -1 for none) and runs at
+   least every timeout_ms (0 for never). */
+KernelTaskId kernel_add_wait_task(Kernel* k, KernelTaskFn fn, void* ctx, const char* name, int fd,
+                                  uint64_t timeout_ms);
+
+/* Removes a task in O(1): at once if it is not running, else when its run
+   ends (a coroutine: when it next suspends). Its pending waits are dropped,
+   and a coroutine's frames are discarded without unwinding. False if id
+   names no task. */
+bool kernel_remove_task(Kernel* k, KernelTaskId id);
+
+/* From inside a task: removes it. A plain task's run goes on to its end;
+   a coroutine never returns from this call. */
+void kernel_exit(Kernel* k);
+
+/* The task running on this thread, 0 for none. */
+KernelTaskId kernel_current(const Kernel* k);
+
+bool kernel_set_priority(Kernel* k, KernelTaskId id, KernelPriority priority);
+
+/* The task named id, NULL if none. Valid until it is removed. */
+const KernelTask* kernel_task(Kernel* k, KernelTaskId id);
+
+/* Fills out with up to cap tasks in slot order; returns how many there
+   are. */
+size_t kernel_tasks(Kernel* k, KernelTaskInfo* out, size_t cap);
+
+/* From inside a task: run it again on the next pass without waiting, e.g.
+   when input it has already read is still buffered. */
+void kernel_run_again(Kernel* k);
+
+/* Adds a task that runs fn(ctx) once, as a coroutine on a stack of its own
+   (stack_size bytes, 0 for CORO_STACK_DEFAULT). Instead of blocking, fn
+   suspends itself with the calls below, and the other tasks run meanwhile;
+   the task ends when fn returns. */
+KernelTaskId kernel_add_coroutine(Kernel* k, KernelTaskFn fn, void* ctx, const char* name, size_t stack_size);
+
+/* From inside a coroutine task: resumes on the next pass. */
+void kernel_yield(Kernel* k);
+
+/* From inside a coroutine task: resumes once ms have passed. */
+void kernel_sleep(Kernel* k, uint64_t ms);
+
+/* From inside a coroutine task: resumes once fd is readable (true) or
+   timeout_ms have passed (false; 0 waits forever). A regular file is always
+   readable. Outside a coroutine this and kernel_sleep block the thread, and
+   kernel_yield returns at once. */
+bool kernel_wait_fd(Kernel* k, int fd, uint64_t timeout_ms);
+
+/* Calls fn(ctx) from kernel_run's thread once delay_ms has passed, then
+   every period_ms if that is not 0. Timers share one timing wheel, so
+   pending ones cost nothing per pass, and the kernel sleeps until the next
+   is due. Callable from any thread. Returns 0 when out of memory. */
+TimerId kernel_add_timer(Kernel* k, uint64_t delay_ms, uint64_t period_ms, TimerFn fn, void* ctx);
+bool kernel_cancel_timer(Kernel* k, TimerId id);
+
+/* Runs tasks on workers threads (0 for one per online CPU) from the next
+   kernel_run. A ready task is queued for the workers and runs on one of
+   them while kernel_run's thread goes on waiting for events, so a long run
+   no longer holds up the other tasks; a task never runs on two workers at
+   once. Needs epoll: if it or the threads cannot be set up, tasks run on
+   kernel_run's thread as without this call. */
+void kernel_enable_smp(Kernel* k, size_t workers);
+
+void kernel_group_init(KernelGroup* g);
+
+/* Runs fn(ctx) as a subtask in g. With workers it goes on the calling
+   worker's Chase-Lev deque, which the worker takes from newest first while
+   idle workers steal the oldest; otherwise it runs right away. job is the
+   subtask's storage and must live until kernel_wait on g returns. */
+void kernel_spawn(Kernel* k, KernelGroup* g, KernelJob* job, KernelTaskFn fn, void* ctx);
+
+/* Returns once every subtask spawned in g has finished, running queued
+   subtasks on this thread meanwhile. */
+void kernel_wait(Kernel* k, KernelGroup* g);
+
 void kernel_stop(Kernel* k);
+
+/* Runs ready tasks, in the order they became ready within a priority class,
+   until kernel_stop. When none is ready the kernel sleeps in epoll_wait,
+   with one timerfd for the next timer or timeout, so waiting tasks cost no
+   CPU; plain tasks are always ready and keep it from sleeping. If epoll is
+   unavailable the kernel polls fds and timeouts every pass instead of
+   sleeping. */
 void kernel_run(Kernel* k);
 uint64_t kernel_tick(const Kernel* k);
+
+/* Callable from any thread, including from a task. */
+void kernel_stats(Kernel* k, KernelStats* out);
@@ -0,0 +1,209 @@
+#include "kernel/timer_wheel.h"
+
+#include <stdlib.h>
+
+#define TIMER_NONE UINT32_MAX
+#define TIMER_FIRING (TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS)
+#define TIMER_MASK ((uint64_t)TIMER_WHEEL_SLOTS - 1)
+
+void timer_wheel_init(TimerWheel* w, uint64_t now) {
+    w->nodes = NULL;
+    w->node_cap = 0;
+    w->free_head = TIMER_NONE;
+    for (size_t i = 0; i < sizeof(w->heads) / sizeof(w->heads[0]); i++) {
+        w->heads[i] = TIMER_NONE;
+    }
+    for (size_t l = 0; l < TIMER_WHEEL_LEVELS; l++) {
+        w->occupied[l] = 0;
+    }
+    w->now = now;
+    w->count = 0;
+    w->fired = 0;
+}
+
+void timer_wheel_free(TimerWheel* w) {
+    free(w->nodes);
+    timer_wheel_init(w, w->now);
+}
+
+static void list_push(TimerWheel* w, uint32_t i, uint32_t list) {
+    TimerNode* n = &w->nodes[i];
+    n->list = list;
+    n->prev = TIMER_NONE;
+    n->next = w->heads[list];
+    if (n->next != TIMER_NONE) {
+        w->nodes[n->next].prev = i;
+    }
+    w->heads[list] = i;
+    if (list != TIMER_FIRING) {
+        w->occupied[list / TIMER_WHEEL_SLOTS] |= (uint64_t)1 << (list % TIMER_WHEEL_SLOTS);
+    }
+}
+
+static void list_remove(TimerWheel* w, uint32_t i) {
+    TimerNode* n = &w->nodes[i];
+    if (n->prev != TIMER_NONE) {
+        w->nodes[n->prev].next = n->next;
+    } else {
+        w->heads[n->list] = n->next;
+    }
+    if (n->next != TIMER_NONE) {
+        w->nodes[n->next].prev = n->prev;
+    }
+    if (w->heads[n->list] == TIMER_NONE && n->list != TIMER_FIRING) {
+        w->occupied[n->list / TIMER_WHEEL_SLOTS] &= ~((uint64_t)1 << (n->list % TIMER_WHEEL_SLOTS));
+    }
+}
+
+/* Links node i into the slot of its expiry, at the level its distance from
+   now fits. */
+static void place(TimerWheel* w, uint32_t i) {
+    uint64_t e = w->nodes[i].expires;
+    uint64_t d = e > w->now ? e - w->now : 0;
+    for (uint32_t l = 0; l < TIMER_WHEEL_LEVELS; l++) {
+        if (d < (uint64_t)1 << (TIMER_WHEEL_BITS * (l + 1))) {
+            list_push(w, i, l * TIMER_WHEEL_SLOTS + (uint32_t)((e >> (TIMER_WHEEL_BITS * l)) & TIMER_MASK));
+            return;
+        }
+    }
+    /* past the top level: its farthest slot, placed again when that cascades */
+    uint32_t top = TIMER_WHEEL_LEVELS - 1;
+    uint64_t slot = (w->now >> (TIMER_WHEEL_BITS * top)) + TIMER_MASK;
+    list_push(w, i, top * TIMER_WHEEL_SLOTS + (uint32_t)(slot & TIMER_MASK));
+}
+
+static uint32_t node_alloc(TimerWheel* w) {
+    if (w->free_head == TIMER_NONE) {
+        if (w->node_cap >= TIMER_NONE / 2) {
+            return TIMER_NONE;
+        }
+        uint32_t cap = w->node_cap > 0 ? w->node_cap * 2 : 64;
+        TimerNode* grown = realloc(w->nodes, cap * sizeof(TimerNode));
+        if (grown == NULL) {
+            return TIMER_NONE;
+        }
+        for (uint32_t i = w->node_cap; i < cap; i++) {
+            grown[i].gen = 1;
+            grown[i].list = TIMER_NONE;
+            grown[i].next = i + 1 < cap ? i + 1 : TIMER_NONE;
+        }
+        w->nodes = grown;
+        w->free_head = w->node_cap;
+        w->node_cap = cap;
+    }
+    uint32_t i = w->free_head;
+    w->free_head = w->nodes[i].next;
+    return i;
+}
+
+static void node_free(TimerWheel* w, uint32_t i) {
+    TimerNode* n = &w->nodes[i];
+    n->gen = n->gen == UINT32_MAX ? 1 : n->gen + 1;   /* ids are never 0 */
+    n->list = TIMER_NONE;
+    n->next = w->free_head;
+    w->free_head = i;
+    w->count--;
+}
+
+TimerId timer_wheel_add(TimerWheel* w, uint64_t expires, uint64_t period, TimerFn fn, void* ctx) {
+    uint32_t i = node_alloc(w);
+    if (i == TIMER_NONE) {
+        return 0;
+    }
+    TimerNode* n = &w->nodes[i];
+    n->expires = expires > w->now ? expires : w->now + 1;
+    n->period = period;
+    n->fn = fn;
+    n->ctx = ctx;
+    place(w, i);
+    w->count++;
+    return ((uint64_t)n->gen << 32) | i;
+}
+
+bool timer_wheel_cancel(TimerWheel* w, TimerId id) {
+    uint32_t i = (uint32_t)id;
+    if (i >= w->node_cap || w->nodes[i].gen != (uint32_t)(id >> 32) || w->nodes[i].list == TIMER_NONE) {
+        return false;
+    }
+    list_remove(w, i);
+    node_free(w, i);
+    return true;
+}
+
+uint64_t timer_wheel_next(const TimerWheel* w) {
+    uint64_t best = UINT64_MAX;
+    for (uint32_t l = 0; l < TIMER_WHEEL_LEVELS; l++) {
+        uint64_t bits = w->occupied[l];
+        if (bits == 0) {
+            continue;
+        }
+        uint32_t shift = TIMER_WHEEL_BITS * l;
+        uint64_t cur = w->now >> shift;
+        /* bit k of rot is the slot k + 1 after the current one; the current
+           slot itself is a whole turn away */
+        uint32_t r = (uint32_t)((cur + 1) & TIMER_MASK);
+        uint64_t rot = r != 0 ? (bits >> r) | (bits << (TIMER_WHEEL_SLOTS - r)) : bits;
+        uint64_t t = (cur + (uint64_t)__builtin_ctzll(rot) + 1) << shift;
+        if (t < best) {
+            best = t;
+        }
+    }
+    return best;
+}
+
+static void cascade(TimerWheel* w, uint32_t list) {
+    while (w->heads[list] != TIMER_NONE) {
+        uint32_t i = w->heads[list];
+        list_remove(w, i);
+        place(w, i);
+    }
+}
+
+/* Fires level 0's slot for tick w->now. A periodic timer that fell behind
+   target skips the periods it missed rather than firing once for each. */
+static void fire(TimerWheel* w, uint32_t slot, uint64_t target) {
+    /* moved to a list of their own first: callbacks may add timers to the
+       slot, or cancel ones still waiting to fire */
+    while (w->heads[slot] != TIMER_NONE) {
+        uint32_t i = w->heads[slot];
+        list_remove(w, i);
+        list_push(w, i, TIMER_FIRING);
+    }
+    while (w->heads[TIMER_FIRING] != TIMER_NONE) {
+        uint32_t i = w->heads[TIMER_FIRING];
+        TimerNode* n = &w->nodes[i];
+        TimerFn fn = n->fn;
+        void* ctx = n->ctx;
+        list_remove(w, i);
+        if (n->period != 0) {
+            n->expires += n->period;
+            if (n->expires <= target) {
+                n->expires += (target - n->expires) / n->period * n->period + n->period;
+            }
+            place(w, i);
+        } else {
+            node_free(w, i);
+        }
+        w->fired++;
+        fn(ctx);
+    }
+}
+
+void timer_wheel_advance(TimerWheel* w, uint64_t now) {
+    while (w->now < now) {
+        uint64_t t = timer_wheel_next(w);
+        if (t > now) {
+            w->now = now;
+            return;
+        }
+        w->now = t;
+        for (uint32_t l = 1; l < TIMER_WHEEL_LEVELS; l++) {
+            uint32_t shift = TIMER_WHEEL_BITS * l;
+            if ((t & (((uint64_t)1 << shift) - 1)) != 0) {
+                break;
+            }
+            cascade(w, l * TIMER_WHEEL_SLOTS + (uint32_t)((t >> shift) & TIMER_MASK));
+        }
+        fire(w, (uint32_t)(t & TIMER_MASK), now);
+    }
+}
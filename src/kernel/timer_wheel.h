@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Length of one wheel tick. */
+#define TIMER_WHEEL_TICK_NS 1000000u
+
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 6
+
+typedef void (*TimerFn)(void* ctx);
+
+/* Names a timer until it fires for the last time or is cancelled; 0 names
+   none. */
+typedef uint64_t TimerId;
+
+typedef struct {
+    uint64_t expires;        /* tick */
+    uint64_t period;         /* ticks, 0 for one-shot */
+    TimerFn fn;
+    void* ctx;
+    uint32_t prev;
+    uint32_t next;           /* also links the free list */
+    uint32_t list;           /* index into TimerWheel.heads */
+    uint32_t gen;            /* bumped when the node is freed */
+} TimerNode;
+
+/* Hierarchical timing wheel (Varghese and Lauck): level l has 64 slots of
+   64^l ticks each, and a timer due d ticks from now sits in the level where
+   d fits, at the slot of its expiry. Timers of a higher-level slot move down
+   (cascade) when the wheel reaches that slot. Add and cancel are O(1): the
+   timers are nodes of one array, linked into doubly linked slot lists by
+   index. A bitmap per level finds the next occupied slot, so advancing
+   skips empty ticks and the wheel can say how long a caller may sleep.
+   Delays beyond the top level (about 2 years) wait in its last slot. */
+typedef struct {
+    TimerNode* nodes;
+    uint32_t node_cap;
+    uint32_t free_head;
+    uint32_t heads[TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS + 1];   /* last: timers being fired */
+    uint64_t occupied[TIMER_WHEEL_LEVELS];
+    uint64_t now;            /* last tick processed */
+    size_t count;            /* pending timers */
+    uint64_t fired;
+} TimerWheel;
+
+void timer_wheel_init(TimerWheel* w, uint64_t now);
+void timer_wheel_free(TimerWheel* w);
+
+/* Calls fn(ctx) at tick expires (at the next tick if that has passed), then
+   every period ticks after it if period is not 0. Returns 0 when out of
+   memory. */
+TimerId timer_wheel_add(TimerWheel* w, uint64_t expires, uint64_t period, TimerFn fn, void* ctx);
+
+/* False if id has already fired for the last time or was cancelled. */
+bool timer_wheel_cancel(TimerWheel* w, TimerId id);
+
+/* Processes every tick up to now, firing timers in expiry order. Callbacks
+   may add and cancel timers, including their own. */
+void timer_wheel_advance(TimerWheel* w, uint64_t now);
+
+/* The next tick at which advance has work to do, UINT64_MAX if none: an
+   expiry, or a cascade that may bring one closer. */
+uint64_t timer_wheel_next(const TimerWheel* w);
@@ -14,11 +14,12 @@ int main(void) {
     CalcApp app;
     calc_app_init(&app, &kernel, &display, &keypad);
 
-    kernel_add_task(&kernel, calc_app_task, &app, "calc_app");
+    kernel_add_coroutine(&kernel, calc_app_task, &app, "calc_app", CALC_APP_STACK);
 
     kernel_run(&kernel);
 
     calc_app_deinit(&app);
+    kernel_free(&kernel);
 
     /* If booted as an initramfs PID 1 under QEMU, exiting would panic.
        Attempt a clean poweroff in that case. */
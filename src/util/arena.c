@@ -0,0 +1,107 @@
+#include "util/arena.h"
+
+#include <stdalign.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct ArenaChunk {
+    ArenaChunk* next;
+    size_t cap;
+    size_t used;
+    max_align_t data[];
+};
+
+#define ARENA_ALIGN alignof(max_align_t)
+
+static size_t align_up(size_t n) {
+    return (n + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+}
+
+static ArenaChunk* chunk_new(Arena* a, size_t cap) {
+    ArenaChunk* c = malloc(sizeof(ArenaChunk) + cap);
+    if (c == NULL) {
+        return NULL;
+    }
+    c->next = NULL;
+    c->cap = cap;
+    c->used = 0;
+    a->reserved += cap;
+    a->chunk_count++;
+    a->mallocs++;
+    return c;
+}
+
+void arena_init(Arena* a, size_t chunk_size) {
+    memset(a, 0, sizeof(*a));
+    a->chunk_size = chunk_size ? align_up(chunk_size) : ARENA_CHUNK_SIZE;
+}
+
+void arena_free(Arena* a) {
+    ArenaChunk* c = a->first;
+    while (c != NULL) {
+        ArenaChunk* next = c->next;
+        free(c);
+        c = next;
+    }
+    a->first = NULL;
+    a->current = NULL;
+    a->reserved = 0;
+    a->chunk_count = 0;
+}
+
+void arena_reset(Arena* a) {
+    if (a->chunk_count > 1) {
+        size_t total = a->reserved;
+        arena_free(a);
+        a->first = chunk_new(a, total);   /* on failure the next alloc retries */
+    }
+    for (ArenaChunk* c = a->first; c != NULL; c = c->next) {
+        c->used = 0;
+    }
+    a->current = a->first;
+}
+
+void* arena_alloc(Arena* a, size_t size) {
+    size = align_up(size ? size : 1);
+    ArenaChunk* c = a->current;
+    while (c != NULL && c->cap - c->used < size) {
+        c = c->next;
+    }
+    if (c == NULL) {
+        c = chunk_new(a, size > a->chunk_size ? size : a->chunk_size);
+        if (c == NULL) {
+            return NULL;
+        }
+        ArenaChunk** link = &a->first;
+        while (*link != NULL) {
+            link = &(*link)->next;
+        }
+        *link = c;
+    }
+    a->current = c;
+    void* p = (char*)c->data + c->used;
+    c->used += size;
+    return p;
+}
+
+void* arena_grow(Arena* a, void* ptr, size_t old_size, size_t new_size) {
+    if (ptr == NULL) {
+        return arena_alloc(a, new_size);
+    }
+    if (new_size <= old_size) {
+        return ptr;
+    }
+    ArenaChunk* c = a->current;
+    size_t old_aligned = align_up(old_size ? old_size : 1);
+    if (c != NULL && (char*)ptr + old_aligned == (char*)c->data + c->used &&
+        c->cap - (c->used - old_aligned) >= align_up(new_size)) {
+        c->used = c->used - old_aligned + align_up(new_size);
+        return ptr;
+    }
+    void* p = arena_alloc(a, new_size);
+    if (p != NULL) {
+        memcpy(p, ptr, old_size);
+    }
+    return p;
+}
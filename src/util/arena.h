@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stddef.h>
+
+/* Default size of the first chunk and minimum size of later ones. */
+#define ARENA_CHUNK_SIZE (64 * 1024)
+
+typedef struct ArenaChunk ArenaChunk;
+
+/* Bump allocator for per-line scratch data. Allocations live until the next
+   arena_reset; there is no per-allocation free. */
+typedef struct {
+    ArenaChunk* first;
+    ArenaChunk* current;
+    size_t chunk_size;
+    size_t reserved;      /* bytes held in chunks */
+    size_t chunk_count;
+    size_t mallocs;       /* chunks ever requested from malloc */
+} Arena;
+
+/* chunk_size 0 selects ARENA_CHUNK_SIZE. No memory is taken until the first
+   allocation. */
+void arena_init(Arena* a, size_t chunk_size);
+void arena_free(Arena* a);
+
+/* Makes all memory available again without returning it. If the last round
+   spilled into several chunks they are merged into one of the combined size,
+   so repeating the same work afterwards needs no malloc at all. */
+void arena_reset(Arena* a);
+
+/* Returns size bytes aligned for any type, or NULL when out of memory. */
+void* arena_alloc(Arena* a, size_t size);
+
+/* Resizes an allocation from this arena, in place when it is the most recent
+   one and the chunk has room. ptr may be NULL. */
+void* arena_grow(Arena* a, void* ptr, size_t old_size, size_t new_size);
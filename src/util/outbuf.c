@@ -0,0 +1,32 @@
+#include "util/outbuf.h"
+
+#include <string.h>
+
+void outbuf_init(Outbuf* b, OutbufSink sink, void* ctx) {
+    b->len = 0;
+    b->sink = sink;
+    b->ctx = ctx;
+}
+
+void outbuf_flush(Outbuf* b) {
+    if (b->len == 0) {
+        return;
+    }
+    b->data[b->len] = '\0';
+    b->sink(b->ctx, b->data);
+    b->len = 0;
+}
+
+void outbuf_write(Outbuf* b, const char* s, size_t n) {
+    while (n > 0) {
+        size_t room = OUTBUF_CAP - 1 - b->len;
+        size_t k = n < room ? n : room;
+        memcpy(b->data + b->len, s, k);
+        b->len += k;
+        s += k;
+        n -= k;
+        if (b->len == OUTBUF_CAP - 1) {
+            outbuf_flush(b);
+        }
+    }
+}
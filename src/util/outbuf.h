@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stddef.h>
+
+#define OUTBUF_CAP (64 * 1024)
+
+/* Receives one NUL-terminated piece of buffered output. */
+typedef void (*OutbufSink)(void* ctx, const char* s);
+
+/* Collects output and hands it to the sink in pieces of up to OUTBUF_CAP - 1
+   bytes, so a slow sink (a console that flushes every write) is called
+   rarely. */
+typedef struct {
+    char data[OUTBUF_CAP];
+    size_t len;
+    OutbufSink sink;
+    void* ctx;
+} Outbuf;
+
+void outbuf_init(Outbuf* b, OutbufSink sink, void* ctx);
+void outbuf_write(Outbuf* b, const char* s, size_t n);
+void outbuf_flush(Outbuf* b);
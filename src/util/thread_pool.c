@@ -0,0 +1,262 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "util/thread_pool.h"
+
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef struct {
+    ThreadPool* pool;
+    size_t index;
+} WorkerArg;
+
+size_t thread_pool_cpu_count(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (size_t)n : 1;
+}
+
+static void* worker_main(void* p) {
+    WorkerArg arg = *(WorkerArg*)p;
+    free(p);
+    ThreadPool* pool = arg.pool;
+    uint64_t seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->stop && pool->generation == seen) {
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        }
+        if (pool->stop) {
+            break;
+        }
+        seen = pool->generation;
+        ThreadPoolFn fn = pool->fn;
+        void* ctx = pool->ctx;
+        pthread_mutex_unlock(&pool->lock);
+
+        fn(ctx, arg.index);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->running == 0) {
+            pthread_cond_signal(&pool->done);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+Status thread_pool_init(ThreadPool* pool, size_t threads) {
+    pool->count = 0;
+    pool->fn = NULL;
+    pool->ctx = NULL;
+    pool->generation = 0;
+    pool->running = 0;
+    pool->stop = false;
+    if (threads == 0) {
+        threads = thread_pool_cpu_count();
+    }
+    pool->threads = malloc(threads * sizeof(pthread_t));
+    if (pool->threads == NULL) {
+        return status_err("error: out of memory");
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    for (size_t i = 0; i < threads; i++) {
+        WorkerArg* arg = malloc(sizeof(*arg));
+        if (arg == NULL) {
+            break;
+        }
+        arg->pool = pool;
+        arg->index = i;
+        if (pthread_create(&pool->threads[i], NULL, worker_main, arg) != 0) {
+            free(arg);
+            break;
+        }
+        pool->count++;
+    }
+    if (pool->count == 0) {
+        thread_pool_free(pool);
+        return status_err("error: cannot start threads");
+    }
+    return status_ok();
+}
+
+void thread_pool_free(ThreadPool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    for (size_t i = 0; i < pool->count; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+    pool->threads = NULL;
+    pool->count = 0;
+}
+
+void thread_pool_start(ThreadPool* pool, ThreadPoolFn fn, void* ctx) {
+    pthread_mutex_lock(&pool->lock);
+    pool->fn = fn;
+    pool->ctx = ctx;
+    pool->running = pool->count;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void thread_pool_wait(ThreadPool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->running > 0) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* A worker's tasks in items[head, tail), task_size bytes each. */
+typedef struct {
+    pthread_mutex_t lock;
+    unsigned char* items;
+    size_t head;
+    size_t tail;
+    size_t cap;              /* in tasks */
+} TaskDeque;
+
+struct ThreadPoolTasks {
+    ThreadPoolTaskFn fn;
+    void* ctx;
+    size_t task_size;
+    TaskDeque* deques;
+    size_t count;
+    atomic_size_t pending;   /* pushed and not yet finished */
+    atomic_size_t run;
+    atomic_size_t steals;
+    atomic_bool failed;
+};
+
+static bool deque_push(TaskDeque* d, const void* task, size_t size) {
+    pthread_mutex_lock(&d->lock);
+    if (d->tail == d->cap) {
+        if (d->head > 0) {
+            memmove(d->items, d->items + d->head * size, (d->tail - d->head) * size);
+            d->tail -= d->head;
+            d->head = 0;
+        }
+        if (d->tail == d->cap) {
+            size_t cap = d->cap ? d->cap * 2 : 64;
+            unsigned char* grown = realloc(d->items, cap * size);
+            if (grown == NULL) {
+                pthread_mutex_unlock(&d->lock);
+                return false;
+            }
+            d->items = grown;
+            d->cap = cap;
+        }
+    }
+    memcpy(d->items + d->tail * size, task, size);
+    d->tail++;
+    pthread_mutex_unlock(&d->lock);
+    return true;
+}
+
+/* Takes the newest task (back) or the oldest (front). */
+static bool deque_take(TaskDeque* d, void* task, size_t size, bool back) {
+    pthread_mutex_lock(&d->lock);
+    bool found = d->head < d->tail;
+    if (found) {
+        size_t i = back ? --d->tail : d->head++;
+        memcpy(task, d->items + i * size, size);
+    }
+    pthread_mutex_unlock(&d->lock);
+    return found;
+}
+
+void thread_pool_push_task(ThreadPoolTasks* tasks, size_t worker, const void* task) {
+    atomic_fetch_add(&tasks->pending, 1);
+    if (!deque_push(&tasks->deques[worker], task, tasks->task_size)) {
+        atomic_store(&tasks->failed, true);
+        atomic_fetch_sub(&tasks->pending, 1);
+    }
+}
+
+static void task_worker(void* p, size_t worker) {
+    ThreadPoolTasks* tasks = p;
+    unsigned char* task = malloc(tasks->task_size);
+    if (task == NULL) {
+        /* the other workers, or the caller, drain this deque */
+        return;
+    }
+    for (;;) {
+        bool found = deque_take(&tasks->deques[worker], task, tasks->task_size, true);
+        for (size_t i = 1; !found && i < tasks->count; i++) {
+            found = deque_take(&tasks->deques[(worker + i) % tasks->count], task, tasks->task_size, false);
+            if (found) {
+                atomic_fetch_add(&tasks->steals, 1);
+            }
+        }
+        if (found) {
+            tasks->fn(tasks->ctx, tasks, worker, task);
+            atomic_fetch_add(&tasks->run, 1);
+            atomic_fetch_sub(&tasks->pending, 1);
+            continue;
+        }
+        if (atomic_load(&tasks->pending) == 0) {
+            break;
+        }
+        sched_yield();
+    }
+    free(task);
+}
+
+Status thread_pool_run_tasks(ThreadPool* pool, ThreadPoolTaskFn fn, void* ctx, const void* initial, size_t count,
+                             size_t task_size, ThreadPoolTaskStats* stats) {
+    ThreadPoolTasks tasks;
+    tasks.fn = fn;
+    tasks.ctx = ctx;
+    tasks.task_size = task_size;
+    tasks.count = pool != NULL ? pool->count : 1;
+    tasks.deques = calloc(tasks.count, sizeof(TaskDeque));
+    if (tasks.deques == NULL) {
+        return status_err("error: out of memory");
+    }
+    atomic_init(&tasks.pending, 0);
+    atomic_init(&tasks.run, 0);
+    atomic_init(&tasks.steals, 0);
+    atomic_init(&tasks.failed, false);
+    for (size_t i = 0; i < tasks.count; i++) {
+        pthread_mutex_init(&tasks.deques[i].lock, NULL);
+    }
+    for (size_t i = 0; i < count; i++) {
+        thread_pool_push_task(&tasks, i % tasks.count, (const unsigned char*)initial + i * task_size);
+    }
+
+    if (pool != NULL) {
+        thread_pool_start(pool, task_worker, &tasks);
+        thread_pool_wait(pool);
+    }
+    /* runs everything without a pool, and whatever a worker that could not
+       start left behind with one */
+    task_worker(&tasks, 0);
+    if (atomic_load(&tasks.pending) > 0) {
+        atomic_store(&tasks.failed, true);
+    }
+
+    if (stats != NULL) {
+        stats->tasks = atomic_load(&tasks.run);
+        stats->steals = atomic_load(&tasks.steals);
+        stats->threads = tasks.count;
+    }
+    for (size_t i = 0; i < tasks.count; i++) {
+        pthread_mutex_destroy(&tasks.deques[i].lock);
+        free(tasks.deques[i].items);
+    }
+    free(tasks.deques);
+    return atomic_load(&tasks.failed) ? status_err("error: out of memory") : status_ok();
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "util/status.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Runs fn(ctx, worker) once on every worker, worker in [0, count). */
+typedef void (*ThreadPoolFn)(void* ctx, size_t worker);
+
+/* Fixed set of threads that sleep between jobs. One job runs at a time: it
+   is started from one thread, which may do other work until it waits. */
+typedef struct {
+    pthread_t* threads;
+    size_t count;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;     /* new job or shutdown */
+    pthread_cond_t done;     /* a worker finished the job */
+    ThreadPoolFn fn;
+    void* ctx;
+    uint64_t generation;     /* bumped per job */
+    size_t running;
+    bool stop;
+} ThreadPool;
+
+/* threads 0 selects one per online CPU. */
+Status thread_pool_init(ThreadPool* pool, size_t threads);
+void thread_pool_free(ThreadPool* pool);
+
+void thread_pool_start(ThreadPool* pool, ThreadPoolFn fn, void* ctx);
+void thread_pool_wait(ThreadPool* pool);
+
+size_t thread_pool_cpu_count(void);
+
+/* Tasks of the same fixed size, run on the pool with work stealing. Each
+   worker has its own deque: it pushes and pops new tasks at the back, so it
+   works depth-first on what it just split off, and an idle worker steals
+   from the front of another's, taking the oldest (largest) piece. */
+typedef struct ThreadPoolTasks ThreadPoolTasks;
+
+/* Runs one task on worker. It may push more tasks. */
+typedef void (*ThreadPoolTaskFn)(void* ctx, ThreadPoolTasks* tasks, size_t worker, const void* task);
+
+typedef struct {
+    size_t tasks;            /* run, including the initial ones */
+    size_t steals;           /* taken from another worker's deque */
+    size_t threads;
+} ThreadPoolTaskStats;
+
+/* Runs the count initial tasks (task_size bytes each, spread over the
+   workers) and everything they push, returning once all have finished.
+   pool NULL runs them on the calling thread. Fails only when a push ran out
+   of memory; the tasks that were pushed still ran. */
+Status thread_pool_run_tasks(ThreadPool* pool, ThreadPoolTaskFn fn, void* ctx, const void* tasks, size_t count,
+                             size_t task_size, ThreadPoolTaskStats* stats);
+
+/* Queues task on worker's deque, from inside a task running on worker. */
+void thread_pool_push_task(ThreadPoolTasks* tasks, size_t worker, const void* task);
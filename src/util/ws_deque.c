@@ -0,0 +1,102 @@
+#include "util/ws_deque.h"
+
+#include <stdlib.h>
+
+struct WsDequeArray {
+    int64_t cap;             /* a power of two */
+    WsDequeArray* prev;      /* the array this one replaced */
+    _Atomic(void*) items[];
+};
+
+static WsDequeArray* array_new(int64_t cap, WsDequeArray* prev) {
+    WsDequeArray* a = malloc(sizeof(WsDequeArray) + (size_t)cap * sizeof(a->items[0]));
+    if (a != NULL) {
+        a->cap = cap;
+        a->prev = prev;
+    }
+    return a;
+}
+
+Status ws_deque_init(WsDeque* d, size_t cap) {
+    int64_t n = 16;
+    while ((size_t)n < cap) n *= 2;
+    WsDequeArray* a = array_new(n, NULL);
+    if (a == NULL) {
+        return status_err("error: out of memory");
+    }
+    atomic_init(&d->top, 0);
+    atomic_init(&d->bottom, 0);
+    atomic_init(&d->array, a);
+    return status_ok();
+}
+
+void ws_deque_free(WsDeque* d) {
+    WsDequeArray* a = atomic_load_explicit(&d->array, memory_order_relaxed);
+    while (a != NULL) {
+        WsDequeArray* prev = a->prev;
+        free(a);
+        a = prev;
+    }
+    atomic_store_explicit(&d->array, NULL, memory_order_relaxed);
+}
+
+Status ws_deque_push(WsDeque* d, void* item) {
+    int64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    int64_t t = atomic_load_explicit(&d->top, memory_order_acquire);
+    WsDequeArray* a = atomic_load_explicit(&d->array, memory_order_relaxed);
+    if (b - t > a->cap - 1) {
+        WsDequeArray* grown = array_new(a->cap * 2, a);
+        if (grown == NULL) {
+            return status_err("error: out of memory");
+        }
+        for (int64_t i = t; i < b; i++) {
+            void* x = atomic_load_explicit(&a->items[i & (a->cap - 1)], memory_order_relaxed);
+            atomic_store_explicit(&grown->items[i & (grown->cap - 1)], x, memory_order_relaxed);
+        }
+        atomic_store_explicit(&d->array, grown, memory_order_release);
+        a = grown;
+    }
+    atomic_store_explicit(&a->items[b & (a->cap - 1)], item, memory_order_relaxed);
+    /* a release store rather than the paper's fence: the same on x86 and
+       visible to ThreadSanitizer */
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_release);
+    return status_ok();
+}
+
+void* ws_deque_take(WsDeque* d) {
+    int64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+    WsDequeArray* a = atomic_load_explicit(&d->array, memory_order_relaxed);
+    atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t t = atomic_load_explicit(&d->top, memory_order_relaxed);
+    void* item = NULL;
+    if (t <= b) {
+        item = atomic_load_explicit(&a->items[b & (a->cap - 1)], memory_order_relaxed);
+        if (t == b) {
+            /* the last item: race the thieves for it */
+            if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1, memory_order_seq_cst,
+                                                         memory_order_relaxed)) {
+                item = NULL;
+            }
+            atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+        }
+    } else {
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    }
+    return item;
+}
+
+void* ws_deque_steal(WsDeque* d) {
+    int64_t t = atomic_load_explicit(&d->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+    if (t >= b) {
+        return NULL;
+    }
+    WsDequeArray* a = atomic_load_explicit(&d->array, memory_order_acquire);
+    void* item = atomic_load_explicit(&a->items[t & (a->cap - 1)], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed)) {
+        return NULL;
+    }
+    return item;
+}
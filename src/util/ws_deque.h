@@ -0,0 +1,37 @@
+#pragma once
+
+#include "util/status.h"
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct WsDequeArray WsDequeArray;
+
+/* Chase-Lev work-stealing deque of pointers, in the C11 formulation of Le,
+   Pop, Cohen and Zappa Nardelli. One owner pushes and takes at the bottom,
+   touching no shared cache line unless the deque is nearly empty; any
+   thread steals the oldest item from the top with one CAS. Pushes from
+   several threads must be serialized by the caller.
+
+   The array doubles when full. A thief may still be reading a replaced
+   array, so replaced arrays are kept until ws_deque_free. */
+typedef struct {
+    _Atomic int64_t top;
+    _Atomic int64_t bottom;
+    _Atomic(WsDequeArray*) array;
+} WsDeque;
+
+/* cap is rounded up to a power of two. */
+Status ws_deque_init(WsDeque* d, size_t cap);
+void ws_deque_free(WsDeque* d);
+
+/* Owner only. Fails only when out of memory. */
+Status ws_deque_push(WsDeque* d, void* item);
+
+/* Owner only: the newest item, or NULL if empty. */
+void* ws_deque_take(WsDeque* d);
+
+/* Any thread: the oldest item, or NULL if empty or another thread took it
+   first. */
+void* ws_deque_steal(WsDeque* d);
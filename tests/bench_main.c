@@ -0,0 +1,553 @@
+#define _POSIX_C_SOURCE 199309L
+
+#include "calc/lexer.h"
+#include "calc/parser.h"
+#include "calc/eval.h"
+#include "calc/bytecode.h"
+#include "calc/batch.h"
+#include "calc/builtins.h"
+#include "calc/vecmath.h"
+#include "kernel/coro.h"
+#include "kernel/kernel.h"
+#include "kernel/timer_wheel.h"
+#include "util/thread_pool.h"
+#include "util/arena.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static uint64_t rng_state = 0x2545f4914f6cdd1du;
+
+static unsigned rng_below(unsigned n) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (unsigned)(rng_state % n);
+}
+
+/* Appends a random balanced expression of the given depth. Every third level
+   goes through a bounded function so the value stays finite. */
+static size_t gen_expr(char* out, size_t len, int depth) {
+    static const char* const leaves[] = { "ans", "1.5", "2", "pi", "0.25", "mem" };
+    static const char* const ops[] = { "+", "-", "*" };
+    static const char* const fns[] = { "sin", "cos", "atan" };
+    if (depth == 0) {
+        return len + (size_t)sprintf(out + len, "%s", leaves[rng_below(6)]);
+    }
+    if (depth % 3 == 0) {
+        len += (size_t)sprintf(out + len, "%s(", fns[rng_below(3)]);
+    } else {
+        out[len++] = '(';
+    }
+    len = gen_expr(out, len, depth - 1);
+    len += (size_t)sprintf(out + len, "%s", ops[rng_below(3)]);
+    len = gen_expr(out, len, depth - 1);
+    out[len++] = ')';
+    return len;
+}
+
+typedef struct {
+    const char* name;
+    double best;
+} Timing;
+
+/* Per-element bytecode_run against batch_eval on each ISA. */
+static int bench_batch(Arena* arena, const char* expr) {
+    static const char* const names[] = { "x", "y" };
+    const size_t n = (size_t)1 << 20;
+    double* xs = malloc(n * sizeof(double));
+    double* ys = malloc(n * sizeof(double));
+    double* out = malloc(n * sizeof(double));
+    uint8_t* err = malloc(n);
+    if (xs == NULL || ys == NULL || out == NULL || err == NULL) {
+        return 1;
+    }
+    for (size_t i = 0; i < n; i++) {
+        xs[i] = 0.5 + (double)rng_below(1000000) / 1000.0;
+        ys[i] = 1.0 + (double)rng_below(1000) / 10.0;
+    }
+
+    arena_reset(arena);
+    Token* tokens = NULL;
+    size_t tok_count = 0;
+    Ast ast;
+    ast_init(&ast, arena);
+    ast.inputs = names;
+    ast.input_count = 2;
+    Status st = lexer_tokenize_arena(expr, arena, &tokens, &tok_count);
+    if (st.ok) st = parser_parse(tokens, tok_count, &ast);
+    Program prog = { .code = arena_alloc(arena, ast.node_len * sizeof(Instr)), .code_cap = ast.node_len };
+    if (st.ok) st = bytecode_compile(&ast, &prog);
+    if (!st.ok) {
+        fprintf(stderr, "%s\n", st.msg);
+        return 1;
+    }
+
+    EvalContext ctx;
+    eval_context_init(&ctx);
+    double best = 1e9;
+    for (int rep = 0; rep < 3; rep++) {
+        double t0 = now_sec();
+        for (size_t i = 0; i < n; i++) {
+            double vals[2] = { xs[i], ys[i] };
+            ctx.inputs = vals;
+            ctx.input_count = 2;
+            st = bytecode_run(&prog, &ctx, &out[i]);
+        }
+        double t1 = now_sec();
+        if (t1 - t0 < best) best = t1 - t0;
+    }
+    printf("%s\n  %-13s %8.3f ms  %6.2f ns/elem\n", expr, "bytecode_run", best * 1e3, best * 1e9 / (double)n);
+
+    ctx.inputs = NULL;
+    ctx.input_count = 0;
+    const BatchInput in[] = { { "x", xs }, { "y", ys } };
+    static const BatchIsa isas[] = { BATCH_ISA_SCALAR, BATCH_ISA_SSE2, BATCH_ISA_AVX2 };
+    for (size_t k = 0; k < sizeof(isas) / sizeof(isas[0]); k++) {
+        BatchReport rep;
+        best = 1e9;
+        for (int r = 0; r < 3; r++) {
+            double t0 = now_sec();
+            st = batch_eval_isa(&ast, &ctx, in, 2, n, isas[k], out, err, &rep);
+            double t1 = now_sec();
+            if (t1 - t0 < best) best = t1 - t0;
+        }
+        if (!st.ok) {
+            fprintf(stderr, "%s\n", st.msg);
+            return 1;
+        }
+        char name[32];
+        snprintf(name, sizeof(name), "batch %s", batch_isa_name(rep.isa));
+        printf("  %-13s %8.3f ms  %6.2f ns/elem\n", name, best * 1e3, best * 1e9 / (double)n);
+    }
+
+    free(xs);
+    free(ys);
+    free(out);
+    free(err);
+    return 0;
+}
+
+/* Each vecmath kernel against a loop over its builtin, in radians. */
+static int bench_vecmath(void) {
+    const size_t n = (size_t)1 << 16;
+    double* xs = malloc(n * sizeof(double));
+    double* out = malloc(n * sizeof(double));
+    if (xs == NULL || out == NULL) {
+        return 1;
+    }
+    for (size_t i = 0; i < n; i++) {
+        xs[i] = (double)(rng_below(2000000) + 1) / 1000000.0;   /* (0, 2]: in every domain */
+    }
+    EvalContext ctx;
+    eval_context_init(&ctx);
+    ctx.angle_mode_deg = 0;
+    BatchIsa isa = batch_best_isa();
+
+    printf("vecmath (%zu elements, ns/elem)\n  %-6s %8s %8s %8s\n", n, "fn", "builtin", "generic", "avx2");
+    size_t count = 0;
+    const VecMathKernel* kernels = vecmath_kernels(&count);
+    for (size_t k = 0; k < count; k++) {
+        const VecMathKernel* vk = &kernels[k];
+        const BuiltinFunc* f = builtins_func(builtins_find_func(vk->name, strlen(vk->name)));
+        double t[3] = { 1e9, 1e9, 1e9 };
+        for (int rep = 0; rep < 5; rep++) {
+            double t0 = now_sec();
+            for (size_t i = 0; i < n; i++) {
+                (void)f->fn(&xs[i], &ctx, &out[i]);
+            }
+            double t1 = now_sec();
+            vk->generic(xs, out, n, false);
+            double t2 = now_sec();
+            if (isa == BATCH_ISA_AVX2) vk->avx2(xs, out, n, false);
+            double t3 = now_sec();
+            if (t1 - t0 < t[0]) t[0] = t1 - t0;
+            if (t2 - t1 < t[1]) t[1] = t2 - t1;
+            if (t3 - t2 < t[2]) t[2] = t3 - t2;
+        }
+        printf("  %-6s %8.2f %8.2f %8.2f\n", vk->name, t[0] * 1e9 / (double)n, t[1] * 1e9 / (double)n,
+               t[2] * 1e9 / (double)n);
+    }
+
+    free(xs);
+    free(out);
+    return 0;
+}
+
+static void bench_timer_fn(void* ctx) {
+    (*(size_t*)ctx)++;
+}
+
+/* Add and cancel with many timers pending, then firing them all. */
+static int bench_timers(void) {
+    const size_t pending = 50000;
+    const size_t ops = 1000000;
+    TimerId* ids = malloc(pending * sizeof(TimerId));
+    if (ids == NULL) {
+        return 1;
+    }
+    TimerWheel w;
+    timer_wheel_init(&w, 0);
+    size_t fired = 0;
+    for (size_t i = 0; i < pending; i++) {
+        ids[i] = timer_wheel_add(&w, 1 + rng_below(1000000), 0, bench_timer_fn, &fired);
+    }
+    double t0 = now_sec();
+    for (size_t i = 0; i < ops; i++) {
+        size_t j = rng_below((unsigned)pending);
+        timer_wheel_cancel(&w, ids[j]);
+        ids[j] = timer_wheel_add(&w, 1 + rng_below(1000000), 0, bench_timer_fn, &fired);
+    }
+    double t1 = now_sec();
+    for (uint64_t now = 0; now <= 1000000; now += 16) {
+        timer_wheel_advance(&w, now);
+    }
+    double t2 = now_sec();
+    printf("timer wheel (%zu pending): %.1f ns per cancel + add, %.1f ns per timer fired (%zu)\n", pending,
+           (t1 - t0) * 1e9 / (double)ops, (t2 - t1) * 1e9 / (double)fired, fired);
+    timer_wheel_free(&w);
+    free(ids);
+    return fired == pending ? 0 : 1;
+}
+
+static void bench_coro_fn(void* p) {
+    size_t* n = p;
+    for (;;) {
+        (*n)++;
+        coro_suspend(coro_current());
+    }
+}
+
+typedef struct {
+    Kernel* kernel;
+    size_t yields;
+} BenchYield;
+
+static void bench_yield_task(void* p) {
+    BenchYield* b = p;
+    for (size_t i = 0; i < b->yields; i++) {
+        kernel_yield(b->kernel);
+    }
+    kernel_stop(b->kernel);
+}
+
+/* A bare resume + suspend pair, then a kernel_yield round trip through the
+   scheduler. */
+static int bench_coro(void) {
+    const size_t n = 2000000;
+    size_t count = 0;
+    Coro* co = NULL;
+    if (!coro_create(&co, 0, bench_coro_fn, &count).ok) {
+        return 1;
+    }
+    double t0 = now_sec();
+    for (size_t i = 0; i < n; i++) {
+        coro_resume(co);
+    }
+    double t1 = now_sec();
+    coro_free(co);
+
+    Kernel k;
+    kernel_init(&k);
+    BenchYield b = { &k, n };
+    kernel_add_coroutine(&k, bench_yield_task, &b, "yield", 0);
+    double t2 = now_sec();
+    kernel_run(&k);
+    double t3 = now_sec();
+    kernel_free(&k);
+    printf("coroutine switch (%s): %.1f ns per switch, %.1f ns per kernel_yield round trip\n", coro_backend(),
+           (t1 - t0) * 1e9 / (double)(2 * n), (t3 - t2) * 1e9 / (double)n);
+    return count == n ? 0 : 1;
+}
+
+typedef struct {
+    Kernel* kernel;
+    size_t sessions;
+    size_t added;
+    size_t ended;
+} BenchSessions;
+
+static void bench_noop(void* p) {
+    (void)p;
+}
+
+static void bench_session(void* p) {
+    BenchSessions* b = p;
+    if (++b->ended == b->sessions) {
+        kernel_stop(b->kernel);
+    }
+}
+
+static void bench_spawner(void* p) {
+    BenchSessions* b = p;
+    if (b->added < b->sessions && kernel_add_coroutine(b->kernel, bench_session, b, "session", 0) != 0) {
+        b->added++;
+    }
+}
+
+/* Task add + remove with 1000 tasks live, a short coroutine task from add
+   to end, and kernel_yield with 1000 tasks waiting on timeouts, which the
+   scheduler should not visit. */
+static int bench_tasks(void) {
+    enum { LIVE = 1000 };
+    const size_t n = 1000000;
+    KernelTaskId ids[LIVE];
+    Kernel k;
+    kernel_init(&k);
+    for (size_t i = 0; i < LIVE; i++) {
+        ids[i] = kernel_add_task(&k, bench_noop, NULL, "noop");
+    }
+    double t0 = now_sec();
+    for (size_t i = 0; i < n; i++) {
+        kernel_remove_task(&k, ids[i % LIVE]);
+        ids[i % LIVE] = kernel_add_task(&k, bench_noop, NULL, "noop");
+    }
+    double t1 = now_sec();
+    kernel_free(&k);
+
+    const size_t sessions = 200000;
+    BenchSessions b = { &k, sessions, 0, 0 };
+    kernel_init(&k);
+    kernel_add_task(&k, bench_spawner, &b, "spawner");
+    double t2 = now_sec();
+    kernel_run(&k);
+    double t3 = now_sec();
+    kernel_free(&k);
+
+    kernel_init(&k);
+    for (size_t i = 0; i < LIVE; i++) {
+        kernel_add_wait_task(&k, bench_noop, NULL, "waiter", -1, 1000000);
+    }
+    BenchYield y = { &k, n };
+    kernel_add_coroutine(&k, bench_yield_task, &y, "yield", 0);
+    double t4 = now_sec();
+    kernel_run(&k);
+    double t5 = now_sec();
+    KernelStats ks;
+    kernel_stats(&k, &ks);
+    kernel_free(&k);
+    printf("kernel tasks: %.1f ns per add + remove, %.1f ns per coroutine task, "
+           "%.1f ns per kernel_yield with %d waiting\n",
+           (t1 - t0) * 1e9 / (double)n, (t3 - t2) * 1e9 / (double)sessions, (t5 - t4) * 1e9 / (double)n, LIVE);
+    return b.ended == sessions && ks.tasks == LIVE ? 0 : 1;
+}
+
+/* A range of elements for bench_kernel_smp, split in halves down to
+   KERNEL_BENCH_GRAIN. */
+#define KERNEL_BENCH_GRAIN 4096
+
+typedef struct {
+    Kernel* kernel;
+    const BatchPlan* plan;
+    const double* xs;
+    double* out;
+    uint8_t* err;
+    size_t lo;
+    size_t hi;
+} KernelBenchRange;
+
+static void kernel_bench_range(void* p) {
+    const KernelBenchRange* r = p;
+    if (r->hi - r->lo > KERNEL_BENCH_GRAIN) {
+        size_t mid = r->lo + (r->hi - r->lo) / 2;
+        KernelBenchRange left = *r;
+        KernelBenchRange right = *r;
+        left.hi = mid;
+        right.lo = mid;
+        KernelGroup g;
+        KernelJob job;
+        kernel_group_init(&g);
+        kernel_spawn(r->kernel, &g, &job, kernel_bench_range, &left);
+        kernel_bench_range(&right);
+        kernel_wait(r->kernel, &g);
+        return;
+    }
+    EvalContext ctx;
+    eval_context_init(&ctx);
+    const BatchInput in[] = { { "x", r->xs + r->lo } };
+    BatchReport rep;
+    (void)batch_plan_run(r->plan, &ctx, in, 1, r->hi - r->lo, r->out + r->lo, r->err + r->lo, &rep);
+}
+
+typedef struct {
+    KernelBenchRange root;
+    double seconds;
+} KernelBenchRun;
+
+static void kernel_bench_task(void* p) {
+    KernelBenchRun* run = p;
+    double t0 = now_sec();
+    kernel_bench_range(&run->root);
+    run->seconds = now_sec() - t0;
+    kernel_stop(run->root.kernel);
+}
+
+/* One CPU-bound task that splits a batch evaluation into range subtasks,
+   with 1 to N workers against the kernel without SMP. */
+static int bench_kernel_smp(Arena* arena) {
+    static const char* const names[] = { "x" };
+    const char* expr = "sin(x)^2 + ln(x) * cos(x/3)";
+    const size_t n = (size_t)1 << 21;
+    double* xs = malloc(n * sizeof(double));
+    double* want = malloc(n * sizeof(double));
+    double* out = malloc(n * sizeof(double));
+    uint8_t* err = malloc(n);
+    if (xs == NULL || want == NULL || out == NULL || err == NULL) {
+        return 1;
+    }
+    for (size_t i = 0; i < n; i++) {
+        xs[i] = 0.5 + (double)rng_below(1000000) / 1000.0;
+    }
+
+    arena_reset(arena);
+    Token* tokens = NULL;
+    size_t tok_count = 0;
+    Ast ast;
+    ast_init(&ast, arena);
+    ast.inputs = names;
+    ast.input_count = 1;
+    BatchPlan plan;
+    Status st = lexer_tokenize_arena(expr, arena, &tokens, &tok_count);
+    if (st.ok) st = parser_parse(tokens, tok_count, &ast);
+    if (st.ok) st = batch_plan_init(&plan, &ast, BATCH_ISA_SCALAR);
+    if (!st.ok) {
+        fprintf(stderr, "%s\n", st.msg);
+        return 1;
+    }
+
+    size_t cpus = thread_pool_cpu_count();
+    printf("kernel smp: %s over %zu elements, %zu cpus\n", expr, n, cpus);
+    int rc = 0;
+    double base = 0.0;
+    /* 0 (no SMP), then powers of two and cpus itself */
+    for (size_t workers = 0; workers <= cpus && rc == 0;
+         workers = workers == 0 ? 1 : workers < cpus && workers * 2 > cpus ? cpus : workers * 2) {
+        double best = 1e9;
+        for (int rep = 0; rep < 3; rep++) {
+            Kernel k;
+            kernel_init(&k);
+            if (workers > 0) {
+                kernel_enable_smp(&k, workers);
+            }
+            KernelBenchRun run = { { &k, &plan, xs, workers == 0 ? want : out, err, 0, n }, 0.0 };
+            kernel_add_task(&k, kernel_bench_task, &run, "bench");
+            kernel_run(&k);
+            kernel_free(&k);
+            if (run.seconds < best) best = run.seconds;
+        }
+        if (workers == 0) {
+            base = best;
+            printf("  %-13s %8.3f ms\n", "no smp", best * 1e3);
+            continue;
+        }
+        if (memcmp(out, want, n * sizeof(double)) != 0) {
+            fprintf(stderr, "kernel smp: %zu workers disagree\n", workers);
+            rc = 1;
+        }
+        char name[32];
+        snprintf(name, sizeof(name), "%zu workers", workers);
+        printf("  %-13s %8.3f ms  %5.2fx\n", name, best * 1e3, base / best);
+    }
+
+    batch_plan_free(&plan);
+    free(xs);
+    free(want);
+    free(out);
+    free(err);
+    return rc;
+}
+
+int main(void) {
+    const int depth = 17;
+    char* text = malloc((size_t)16 << depth);
+    if (text == NULL) {
+        return 1;
+    }
+    size_t len = gen_expr(text, 0, depth);
+    text[len] = '\0';
+
+    Arena arena;
+    arena_init(&arena, 0);
+
+    EvalContext ctx;
+    eval_context_init(&ctx);
+    ctx.ans = 0.75;
+    ctx.mem = 3.0;
+    ctx.mem_set = 1;
+
+    Timing parse = { "parse", 1e9 };
+    Timing tree = { "eval_ast", 1e9 };
+    Timing vm = { "bytecode_run", 1e9 };
+    double value = 0.0;
+    size_t node_len = 0;
+    size_t tree_bytes = 0;
+    for (int rep = 0; rep < 5; rep++) {
+        arena_reset(&arena);
+        Token* tokens = NULL;
+        size_t tok_count = 0;
+        Status st = lexer_tokenize_arena(text, &arena, &tokens, &tok_count);
+        if (!st.ok) {
+            fprintf(stderr, "%s\n", st.msg);
+            return 1;
+        }
+
+        Ast ast;
+        ast_init(&ast, &arena);
+        double t0 = now_sec();
+        st = parser_parse(tokens, tok_count, &ast);
+        double t1 = now_sec();
+        if (!st.ok) {
+            fprintf(stderr, "%s\n", st.msg);
+            return 1;
+        }
+        node_len = ast.node_len;
+        tree_bytes = ast_bytes(&ast);
+
+        double v = 0.0;
+        double t2 = now_sec();
+        for (int i = 0; i < 10; i++) {
+            st = eval_ast(&ast, ast.root, &ctx, &v);
+        }
+        double t3 = now_sec();
+
+        Program prog = { .code = arena_alloc(&arena, ast.node_len * sizeof(Instr)), .code_cap = ast.node_len };
+        st = bytecode_compile(&ast, &prog);
+        double t4 = now_sec();
+        for (int i = 0; i < 10; i++) {
+            st = bytecode_run(&prog, &ctx, &value);
+        }
+        double t5 = now_sec();
+        if (!st.ok || value != v) {
+            fprintf(stderr, "paths disagree: %s\n", st.ok ? "value" : st.msg);
+            return 1;
+        }
+
+        if (t1 - t0 < parse.best) parse.best = t1 - t0;
+        if ((t3 - t2) / 10 < tree.best) tree.best = (t3 - t2) / 10;
+        if ((t5 - t4) / 10 < vm.best) vm.best = (t5 - t4) / 10;
+    }
+
+    printf("tree: %zu nodes, %.1f bytes/node, value %.17g\n", node_len, (double)tree_bytes / (double)node_len, value);
+    const Timing* all[] = { &parse, &tree, &vm };
+    for (size_t i = 0; i < sizeof(all) / sizeof(all[0]); i++) {
+        printf("%-13s %8.3f ms  %6.2f ns/node\n", all[i]->name, all[i]->best * 1e3,
+               all[i]->best * 1e9 / (double)node_len);
+    }
+
+    int rc = bench_batch(&arena, "x*x*0.5 + y*3 - x/y") || bench_batch(&arena, "sin(x)^2 + ln(x)") ||
+             bench_vecmath() || bench_timers() || bench_coro() || bench_tasks() ||
+             bench_kernel_smp(&arena);
+
+    arena_free(&arena);
+    free(text);
+    return rc;
+}
@@ -1,49 +1,1103 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include "calc/lexer.h"
 #include "calc/parser.h"
 #include "calc/eval.h"
+#include "calc/bytecode.h"
+#include "calc/builtins.h"
+#include "calc/optimize.h"
+#include "calc/expr_cache.h"
+#include "calc/exact.h"
+#include "calc/number.h"
+#include "calc/format.h"
+#include "calc/batch.h"
+#include "calc/vecmath.h"
+#include "calc/table.h"
+#include "calc/symtab.h"
+#include "calc/integrate.h"
+#include "calc/solve.h"
+#include "calc/series.h"
+#include "calc/rng.h"
+#include "calc/montecarlo.h"
+#include "kernel/coro.h"
+#include "kernel/kernel.h"
+#include "kernel/timer_wheel.h"
+#include "util/arena.h"
+#include "util/ws_deque.h"
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+static int fails = 0;
+
+static void expect_ok(Status st, const char* msg) {
+    if (!st.ok) {
+        fprintf(stderr, "FAIL: %s: %s\n", msg, st.msg ? st.msg : "(no msg)");
+        fails++;
+    }
+}
+
+static void expect_err(Status st, const char* want, const char* msg) {
+    if (st.ok || st.msg == NULL || strcmp(st.msg, want) != 0) {
+        fprintf(stderr, "FAIL: %s: got '%s' expected '%s'\n", msg, st.ok ? "ok" : st.msg, want);
+        fails++;
+    }
+}
+
+static void expect_near(double a, double b, double eps, const char* msg) {
+    double d = a - b;
+    if (d < 0) d = -d;
+    if (d > eps) {
+        fprintf(stderr, "FAIL: %s: got %.17g expected %.17g\n", msg, a, b);
+        fails++;
+    }
+}
+
+/* Scratch for the helpers below; reset on every call. */
+static Arena test_arena;
+
+static Status eval_expr(const char* expr, int deg, double ans, double mem, int mem_set, double* out) {
+    Token tokens[256];
+    size_t tok_count = 0;
+    Status st = lexer_tokenize(expr, tokens, 256, &tok_count);
+    if (!st.ok) return st;
+
+    arena_reset(&test_arena);
+    Ast ast;
+    ast_init(&ast, &test_arena);
+    st = parser_parse(tokens, tok_count, &ast);
+    if (!st.ok) return st;
+
+    EvalContext ctx;
+    eval_context_init(&ctx);
+    ctx.angle_mode_deg = deg;
+    ctx.ans = ans;
+    ctx.mem = mem;
+    ctx.mem_set = mem_set;
+    return eval_ast(&ast, ast.root, &ctx, out);
+}
+
+/* The exact int64 value of expr, or false. */
+static bool exact_expr(const char* expr, int64_t* out) {
+    Token tokens[256];
+    size_t tok_count = 0;
+    arena_reset(&test_arena);
+    Ast ast;
+    ast_init(&ast, &test_arena);
+    return lexer_tokenize(expr, tokens, 256, &tok_count).ok && parser_parse(tokens, tok_count, &ast).ok &&
+           exact_eval(&ast, out);
+}
+
+static void expect_exact(const char* expr, bool ok, int64_t want) {
+    int64_t v = 0;
+    bool got = exact_expr(expr, &v);
+    if (got != ok || (ok && v != want)) {
+        fprintf(stderr, "FAIL: exact %s: %s %lld, want %s %lld\n", expr, got ? "ok" : "none", (long long)v,
+                ok ? "ok" : "none", (long long)want);
+        fails++;
+    }
+}
+
+static Status eval_expr_vm(const char* expr, int deg, double ans, double mem, int mem_set, int optimize,
+                           OptimizeStats* stats, double* out) {
+    Token tokens[256];
+    size_t tok_count = 0;
+    Status st = lexer_tokenize(expr, tokens, 256, &tok_count);
+    if (!st.ok) return st;
+
+    arena_reset(&test_arena);
+    Ast ast;
+    ast_init(&ast, &test_arena);
+    st = parser_parse(tokens, tok_count, &ast);
+    if (!st.ok) return st;
+
+    EvalContext ctx;
+    eval_context_init(&ctx);
+    ctx.angle_mode_deg = deg;
+    ctx.ans = ans;
+    ctx.mem = mem;
+    ctx.mem_set = mem_set;
+
+    if (optimize) {
+        st = optimize_ast(&ast, &ctx, stats);
+        if (!st.ok) return st;
+        /* the optimized tree must still evaluate identically through eval_ast */
+        double tree = 0.0;
+        Status tst = eval_ast(&ast, ast.root, &ctx, &tree);
+        Instr code[256];
+        Program prog = { .code = code, .code_cap = 256, .code_len = 0, .stack_need = 0 };
+        st = bytecode_compile(&ast, &prog);
+        if (!st.ok) return st;
+        st = bytecode_run(&prog, &ctx, out);
+        if (st.ok != tst.ok || (st.ok && memcmp(&tree, out, sizeof(tree)) != 0) ||
+            (!st.ok && strcmp(st.msg, tst.msg) != 0)) {
+            fprintf(stderr, "FAIL: %s: optimized eval_ast and VM disagree\n", expr);
+            fails++;
+        }
+        return st;
+    }
+
+    Instr code[256];
+    Program prog = { .code = code, .code_cap = 256, .code_len = 0, .stack_need = 0 };
+    st = bytecode_compile(&ast, &prog);
+    if (!st.ok) return st;
+    return bytecode_run(&prog, &ctx, out);
+}
+
+/* The bytecode VM, with or without the optimizer, must agree with eval_ast on
+   both values and error messages. */
+static void expect_same_paths(const char* expr, int deg, int mem_set, int optimize) {
+    double a = 0.0, b = 0.0;
+    Status sa = eval_expr(expr, deg, 41.0, 7.0, mem_set, &a);
+    Status sb = eval_expr_vm(expr, deg, 41.0, 7.0, mem_set, optimize, NULL, &b);
+    if (sa.ok != sb.ok) {
+        fprintf(stderr, "FAIL: %s: eval %s, vm %s\n", expr, sa.ok ? "ok" : sa.msg, sb.ok ? "ok" : sb.msg);
+        fails++;
+        return;
+    }
+    if (!sa.ok) {
+        if (strcmp(sa.msg, sb.msg) != 0) {
+            fprintf(stderr, "FAIL: %s: eval '%s', vm '%s'\n", expr, sa.msg, sb.msg);
+            fails++;
+        }
+        return;
+    }
+    /* strength reduction may change the last bits */
+    double tol = optimize ? 1e-13 * fabs(a) : 0.0;
+    if (memcmp(&a, &b, sizeof(a)) != 0 && !(fabs(a - b) <= tol)) {
+        fprintf(stderr, "FAIL: %s: eval %.17g, vm %.17g\n", expr, a, b);
+        fails++;
+    }
+}
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15u;
+
+static uint64_t rng_next(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static unsigned rng_below(unsigned n) {
+    return (unsigned)(rng_next() % n);
+}
+
+/* number_parse must agree with strtod in the C locale: same bits, same
+   length consumed, and ERANGE exactly when it reports out of range. */
+static void expect_number_like_strtod(const char* s) {
+    static int reported = 0;
+    errno = 0;
+    char* end = NULL;
+    double want = strtod(s, &end);
+    int want_range = errno == ERANGE;
+
+    double got = 0.0;
+    size_t len = 0;
+    Status st = number_parse(s, &len, &got);
+    int got_range = !st.ok && strcmp(st.msg, "error: number out of range") == 0;
+    if (end == s) {
+        if (st.ok || len != 0) {
+            if (reported++ < 10) fprintf(stderr, "FAIL: number '%s' should be invalid\n", s);
+            fails++;
+        }
+        return;
+    }
+    if (len != (size_t)(end - s) || got_range != want_range ||
+        (!got_range && memcmp(&got, &want, sizeof(got)) != 0) || (!st.ok && !got_range)) {
+        if (reported++ < 10) {
+            fprintf(stderr, "FAIL: number '%.60s' got %a len %zu range %d, strtod %a len %zu range %d\n", s, got,
+                    len, got_range, want, (size_t)(end - s), want_range);
+        }
+        fails++;
+    }
+}
+
+static void random_digits(char* out, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        out[i] = (char)('0' + rng_below(10));
+    }
+    out[n] = '\0';
+}
+
+/* Significant digits in a formatted number: from the first to the last
+   nonzero digit of the mantissa. */
+static int significant_digits(const char* s) {
+    int n = 0;
+    int last = 0;
+    for (; *s && *s != 'e'; s++) {
+        if (*s < '0' || *s > '9') continue;
+        if (n == 0 && *s == '0') continue;
+        n++;
+        if (*s != '0') last = n;
+    }
+    return last;
+}
+
+/* format_double must match printf in g15 mode, and in shortest mode read back
+   as the same double using no more digits than the shortest %e rendering. */
+static void expect_format_like_printf(double d, int check_shortest) {
+    static int reported = 0;
+    char want[64];
+    char got[64];
+    snprintf(want, sizeof(want), "%.15g", d);
+    if (strcmp(want, "-0") == 0) strcpy(want, "0");
+    format_double(d, FORMAT_G15, got, sizeof(got));
+    if (strcmp(got, want) != 0) {
+        if (reported++ < 10) fprintf(stderr, "FAIL: g15 format of %a: got '%s' expected '%s'\n", d, got, want);
+        fails++;
+    }
+
+    format_double(d, FORMAT_SHORTEST, got, sizeof(got));
+    double back = strtod(got, NULL);
+    if (memcmp(&back, &d, sizeof(d)) != 0 && !(d == 0.0 && back == 0.0)) {
+        if (reported++ < 10) fprintf(stderr, "FAIL: shortest format of %a does not round-trip: '%s'\n", d, got);
+        fails++;
+        return;
+    }
+    if (check_shortest && d != 0.0) {
+        int p = 1;
+        for (; p < 17; p++) {
+            snprintf(want, sizeof(want), "%.*e", p - 1, d);
+            if (strtod(want, NULL) == d) break;
+        }
+        if (significant_digits(got) > p) {
+            if (reported++ < 10) fprintf(stderr, "FAIL: shortest format of %a: '%s' is not shortest\n", d, got);
+            fails++;
+        }
+    }
+}
+
+/* Runs expr through the arena-backed pipeline the app uses. */
+static Status eval_expr_arena(const char* expr, Arena* arena, double ans, double* out) {
+    Token* tokens = NULL;
+    size_t tok_count = 0;
+    Status st = lexer_tokenize_arena(expr, arena, &tokens, &tok_count);
+    if (!st.ok) return st;
+
+    Ast ast;
+    ast_init(&ast, arena);
+    st = parser_parse(tokens, tok_count, &ast);
+    if (!st.ok) return st;
+
+    EvalContext ctx;
+    eval_context_init(&ctx);
+    ctx.ans = ans;
+    st = optimize_ast(&ast, &ctx, NULL);
+    if (!st.ok) return st;
+
+    Program prog = { .code = arena_alloc(arena, ast.node_len * sizeof(Instr)), .code_cap = ast.node_len };
+    st = bytecode_compile(&ast, &prog);
+    if (!st.ok) return st;
+    return bytecode_run(&prog, &ctx, out);
+}
+
+/* Parses and evaluates expr with explicit nesting limits. */
+static Status eval_deep(const char* expr, size_t parse_depth, size_t eval_depth, double* out) {
+    arena_reset(&test_arena);
+    Token* tokens = NULL;
+    size_t tok_count = 0;
+    Status st = lexer_tokenize_arena(expr, &test_arena, &tokens, &tok_count);
+    if (!st.ok) return st;
+
+    Ast ast;
+    ast_init(&ast, &test_arena);
+    st = parser_parse_depth(tokens, tok_count, parse_depth, &ast);
+    if (!st.ok) return st;
+
+    EvalContext ctx;
+    eval_context_init(&ctx);
+    ctx.max_depth = eval_depth;
+    return eval_ast(&ast, ast.root, &ctx, out);
+}
+
+/* Builds prefix, repeated n times, then middle, then suffix n times. */
+static char* nest(const char* prefix, const char* middle, const char* suffix, size_t n) {
+    size_t lp = strlen(prefix), lm = strlen(middle), ls = strlen(suffix);
+    char* s = malloc(n * (lp + ls) + lm + 1);
+    if (s == NULL) return NULL;
+    char* p = s;
+    for (size_t i = 0; i < n; i++, p += lp) memcpy(p, prefix, lp);
+    memcpy(p, middle, lm);
+    p += lm;
+    for (size_t i = 0; i < n; i++, p += ls) memcpy(p, suffix, ls);
+    *p = '\0';
+    return s;
+}
+
+/* Every ISA's batch result must match eval_ast element by element: errors by
+   message, values bit for bit on the scalar path and to a few ulp where the
+   vector paths use vecmath kernels. */
+static void expect_batch_like_scalar(const char* expr, int optimize, int mem_set, const double* xs, const double* ys,
+                                     size_t n) {
+    static const char* const names[] = { "x", "y" };
+    arena_reset(&test_arena);
+    Token* tokens = NULL;
+    size_t tok_count = 0;
+    Ast ast;
+    ast_init(&ast, &test_arena);
+    ast.inputs = names;
+    ast.input_count = 2;
+    EvalContext ctx;
+    eval_context_init(&ctx);
+    ctx.mem = 2.0;
+    ctx.mem_set = mem_set;
+    Status st = lexer_tokenize_arena(expr, &test_arena, &tokens, &tok_count);
+    if (st.ok) st = parser_parse(tokens, tok_count, &ast);
+    if (st.ok && optimize) st = optimize_ast(&ast, &ctx, NULL);
+    if (!st.ok) {
+        fprintf(stderr, "FAIL: %s: %s\n", expr, st.msg);
+        fails++;
+        return;
+    }
+
+    double* out = malloc(n * sizeof(double));
+    uint8_t* err = malloc(n);
+    static const BatchIsa isas[] = { BATCH_ISA_SCALAR, BATCH_ISA_SSE2, BATCH_ISA_AVX2 };
+    for (size_t k = 0; out != NULL && err != NULL && k < sizeof(isas) / sizeof(isas[0]); k++) {
+        const BatchInput in[] = { { "y", ys }, { "X", xs } };
+        BatchReport rep;
+        st = batch_eval_isa(&ast, &ctx, in, 2, n, isas[k], out, err, &rep);
+        if (!st.ok) {
+            fprintf(stderr, "FAIL: %s: batch %s\n", expr, st.msg);
+            fails++;
+            break;
+        }
+        size_t errors = 0;
+        for (size_t i = 0; i < n; i++) {
+            double vals[2] = { xs[i], ys[i] };
+            ctx.inputs = vals;
+            ctx.input_count = 2;
+            double want = 0.0;
+            Status ws = eval_ast(&ast, ast.root, &ctx, &want);
+            const char* got = batch_error_message(&rep, err[i]);
+            errors += err[i] != 0;
+            bool same = isas[k] == BATCH_ISA_SCALAR ? memcmp(&want, &out[i], sizeof(want)) == 0
+                                                    : fabs(out[i] - want) <= 1e-12 * (1.0 + fabs(want));
+            if (ws.ok ? (err[i] != 0 || !same) : (got == NULL || strcmp(got, ws.msg) != 0)) {
+                fprintf(stderr, "FAIL: %s [%s] x=%g y=%g: batch %s %.17g, scalar %s %.17g\n", expr,
+                        batch_isa_name(rep.isa), xs[i], ys[i], got ? got : "ok", out[i], ws.ok ? "ok" : ws.msg, want);
+                fails++;
+                break;
+            }
+        }
+        if (errors != rep.errors) {
+            fprintf(stderr, "FAIL: %s: %zu errors reported, %zu marked\n", expr, rep.errors, errors);
+            fails++;
+        }
+    }
+    free(out);
+    free(err);
+}
+
+static uint64_t ulp_distance(double a, double b) {
+    int64_t ia, ib;
+    memcpy(&ia, &a, sizeof(ia));
+    memcpy(&ib, &b, sizeof(ib));
+    /* map to a monotonic integer line so -0 and +0 are neighbours */
+    if (ia < 0) ia = INT64_MIN - ia;
+    if (ib < 0) ib = INT64_MIN - ib;
+    return ia > ib ? (uint64_t)ia - (uint64_t)ib : (uint64_t)ib - (uint64_t)ia;
+}
+
+/* Sweeps one vecmath kernel against its builtin in both angle modes: within
+   max_ulp where the builtin succeeds, non-finite where it fails, and the same
+   bits from the generic and AVX2 variants. */
+static void expect_kernel_like_builtin(const VecMathKernel* vk) {
+    enum { N = 20000 };
+    static double xs[N], gen[N], wide[N];
+    for (size_t i = 0; i < N; i++) {
+        double u = (double)(rng_next() >> 11) * 0x1p-53;
+        double sign = rng_below(2) ? -1.0 : 1.0;
+        switch (i % 5) {
+            case 0: xs[i] = sign * u; break;                              /* asin/acos domain */
+            case 1: xs[i] = sign * 20.0 * u; break;
+            case 2: xs[i] = sign * pow(10.0, 600.0 * u - 300.0); break;   /* all magnitudes */
+            case 3: xs[i] = (double)((int)rng_below(4001) - 2000) * (M_PI / 2.0); break;
+            default: xs[i] = (double)((int)rng_below(801) - 400) * 45.0 + (u - 0.5) * 1e-9; break;
+        }
+    }
+    xs[0] = 0.0;
+    xs[1] = -0.0;
+    xs[2] = 1.0;
+    xs[3] = -1.0;
+    xs[4] = INFINITY;
+    xs[5] = NAN;
+    xs[6] = 4.9e-324;
+
+    int id = builtins_find_func(vk->name, strlen(vk->name));
+    const BuiltinFunc* f = builtins_func(id);
+    if (f == NULL) {
+        fprintf(stderr, "FAIL: vecmath %s has no builtin\n", vk->name);
+        fails++;
+        return;
+    }
+    for (int deg = 0; deg <= 1; deg++) {
+        EvalContext ctx;
+        eval_context_init(&ctx);
+        ctx.angle_mode_deg = deg;
+        vk->generic(xs, gen, N, deg != 0);
+        vk->avx2(xs, wide, N, deg != 0);
+        for (size_t i = 0; i < N; i++) {
+            double want = 0.0;
+            Status st = f->fn(&xs[i], &ctx, &want);
+            bool bad = memcmp(&gen[i], &wide[i], sizeof(double)) != 0;
+            if (st.ok && isfinite(want)) {
+                bad = bad || ulp_distance(gen[i], want) > vk->max_ulp;
+            } else {
+                bad = bad || isfinite(gen[i]);
+            }
+            if (bad) {
+                fprintf(stderr, "FAIL: vecmath %s(%.17g) deg=%d: %.17g / %.17g, builtin %s %.17g\n", vk->name, xs[i],
+                        deg, gen[i], wide[i], st.ok ? "ok" : st.msg, want);
+                fails++;
+                break;
+            }
+        }
+    }
+}
+
+typedef struct {
+    char* data;
+    size_t len;
+    size_t calls;
+} TextSink;
+
+static void text_sink(void* ctx, const char* s) {
+    TextSink* t = ctx;
+    size_t n = strlen(s);
+    char* grown = realloc(t->data, t->len + n + 1);
+    if (grown == NULL) return;
+    t->data = grown;
+    memcpy(t->data + t->len, s, n + 1);
+    t->len += n;
+    t->calls++;
+}
+
+/* A threaded table must print the rows eval_ast gives, in order. */
+static void expect_table_like_scalar(ThreadPool* pool, const char* expr, double from, double to, double step) {
+    static const char* const names[] = { "t" };
+    static Outbuf out;
+    arena_reset(&test_arena);
+    Token* tokens = NULL;
+    size_t tok_count = 0;
+    Ast ast;
+    ast_init(&ast, &test_arena);
+    ast.inputs = names;
+    ast.input_count = 1;
+    EvalContext ctx;
+    eval_context_init(&ctx);
+    TableSpec spec = { .ast = &ast, .from = from, .to = to, .step = step, .isa = BATCH_ISA_SCALAR,
+                       .format = FORMAT_SHORTEST };
+    Status st = lexer_tokenize_arena(expr, &test_arena, &tokens, &tok_count);
+    if (st.ok) st = parser_parse(tokens, tok_count, &ast);
+    if (st.ok) st = table_row_count(from, to, step, &spec.rows);
+    TextSink sink = { NULL, 0, 0 };
+    outbuf_init(&out, text_sink, &sink);
+    TableStats stats;
+    if (st.ok) st = table_run(&spec, &ctx, pool, &out, &stats);
+    if (!st.ok) {
+        fprintf(stderr, "FAIL: table %s: %s\n", expr, st.msg);
+        fails++;
+        free(sink.data);
+        return;
+    }
+
+    size_t pos = 0;
+    size_t errors = 0;
+    for (size_t i = 0; i < spec.rows; i++) {
+        double vals[1] = { i + 1 == spec.rows ? to : from + (double)i * step };
+        ctx.inputs = vals;
+        ctx.input_count = 1;
+        double v = 0.0;
+        Status vs = eval_ast(&ast, ast.root, &ctx, &v);
+        char row[160], x[64], y[64];
+        format_double(vals[0], FORMAT_SHORTEST, x, sizeof(x));
+        format_double(v, FORMAT_SHORTEST, y, sizeof(y));
+        int n = snprintf(row, sizeof(row), "%s\t%s\n", x, vs.ok ? y : vs.msg);
+        errors += !vs.ok;
+        if (sink.data == NULL || pos + (size_t)n > sink.len || memcmp(sink.data + pos, row, (size_t)n) != 0) {
+            fprintf(stderr, "FAIL: table %s: row %zu should be %s", expr, i, row);
+            fails++;
+            break;
+        }
+        pos += (size_t)n;
+    }
+    if (pos != sink.len || stats.rows != spec.rows || stats.errors != errors || sink.calls > sink.len / 1000 + 1) {
+        fprintf(stderr, "FAIL: table %s: %zu of %zu bytes, %zu rows, %zu errors, %zu writes\n", expr, pos, sink.len,
+                stats.rows, stats.errors, sink.calls);
+        fails++;
+    }
+    free(sink.data);
+}
+
+/* Evaluates expr against symbols on one path: 0 eval_ast, 1 optimized
+   bytecode, 2 a one-element batch. */
+static Status eval_with_symbols(const SymTab* symbols, const char* expr, int path, double* out) {
+    arena_reset(&test_arena);
+    Token* tokens = NULL;
+    size_t tok_count = 0;
+    Ast ast;
+    ast_init(&ast, &test_arena);
+    ast.symbols = symbols;
+    EvalContext ctx;
+    eval_context_init(&ctx);
+    ctx.symbols = symbols;
+    Status st = lexer_tokenize_arena(expr, &test_arena, &tokens, &tok_count);
+    if (st.ok) st = parser_parse(tokens, tok_count, &ast);
+    if (!st.ok) return st;
+    if (path == 0) return eval_ast(&ast, ast.root, &ctx, out);
+    if (path == 1) {
+        st = optimize_ast(&ast, &ctx, NULL);
+        Program prog = { .code = arena_alloc(&test_arena, (ast.node_len + 1) * sizeof(Instr)), .code_cap = ast.node_len };
+        if (st.ok) st = bytecode_compile(&ast, &prog);
+        return st.ok ? bytecode_run(&prog, &ctx, out) : st;
+    }
+    uint8_t err = 0;
+    BatchReport rep;
+    st = batch_eval(&ast, &ctx, NULL, 0, 1, out, &err, &rep);
+    return st.ok && err != 0 ? status_err(batch_error_message(&rep, err)) : st;
+}
+
+static Status define_func(SymTab* symbols, const char* name, const char* const* params, size_t argc,
+                          const char* body) {
+    int id = -1;
+    bool added = false;
+    Status st = symtab_declare_func(symbols, name, strlen(name), argc, &id, &added);
+    if (!st.ok) return st;
+    arena_reset(&test_arena);
+    Token* tokens = NULL;
+    size_t tok_count = 0;
+    Ast ast;
+    ast_init(&ast, &test_arena);
+    ast.inputs = params;
+    ast.input_count = argc;
+    ast.symbols = symbols;
+    st = lexer_tokenize_arena(body, &test_arena, &tokens, &tok_count);
+    if (st.ok) st = parser_parse(tokens, tok_count, &ast);
+    Program prog = { .code = arena_alloc(&test_arena, (ast.node_len + 1) * sizeof(Instr)), .code_cap = ast.node_len };
+    if (st.ok) st = bytecode_compile(&ast, &prog);
+    if (st.ok) st = symtab_define_func(symbols, id, &prog, body);
+    if (!st.ok && added) symtab_forget_last(symbols);
+    return st;
+}
+
+/* Integrates expr over x, on pool and on the calling thread; both must
+   agree exactly, whichever worker took which interval, including when the
+   split budget runs out or an interval fails. */
+static Status integrate_expr(ThreadPool* pool, const char* expr, double a, double b, IntegrateResult* r) {
+    static const char* const names[] = { "x" };
+    arena_reset(&test_arena);
+    Token* tokens = NULL;
+    size_t tok_count = 0;
+    Ast ast;
+    ast_init(&ast, &test_arena);
+    ast.inputs = names;
+    ast.input_count = 1;
+    EvalContext ctx;
+    eval_context_init(&ctx);
+    ctx.angle_mode_deg = 0;
+    Status st = lexer_tokenize_arena(expr, &test_arena, &tokens, &tok_count);
+    if (st.ok) st = parser_parse(tokens, tok_count, &ast);
+    if (st.ok) st = integrate_run(&ast, &ctx, pool, a, b, r);
+    IntegrateResult single;
+    Status st1 = st.ok ? integrate_run(&ast, &ctx, NULL, a, b, &single) : st;
+    if (st.ok != st1.ok || (!st.ok && strcmp(st.msg, st1.msg) != 0) ||
+        (st.ok && (single.value != r->value || single.error != r->error || single.evaluations != r->evaluations ||
+                   single.intervals != r->intervals || single.converged != r->converged))) {
+        fprintf(stderr, "FAIL: integrate %s differs between pool and caller\n", expr);
+        fails++;
+    }
+    return st;
+}
+
+static void expect_integral(ThreadPool* pool, const char* expr, double a, double b, double want) {
+    IntegrateResult r;
+    Status st = integrate_expr(pool, expr, a, b, &r);
+    if (!st.ok || !r.converged || fabs(r.value - want) > 1e-12 * fmax(1.0, fabs(want)) ||
+        r.evaluations != (r.intervals ? 15 * (2 * r.intervals - 1) : 0)) {
+        fprintf(stderr, "FAIL: integrate %s from %g to %g: %s %.17g (err %g, %zu intervals), want %.17g\n", expr, a, b,
+                st.ok ? "ok" : st.msg, r.value, r.error, r.intervals, want);
+        fails++;
+    }
+}
+
+/* Compiles expr, with x as its input, into the test arena. */
+static Status compile_in_x(const char* expr, const SymTab* symbols, Program* prog) {
+    static const char* const names[] = { "x" };
+    arena_reset(&test_arena);
+    Token* tokens = NULL;
+    size_t tok_count = 0;
+    Ast ast;
+    ast_init(&ast, &test_arena);
+    ast.inputs = names;
+    ast.input_count = 1;
+    ast.symbols = symbols;
+    Status st = lexer_tokenize_arena(expr, &test_arena, &tokens, &tok_count);
+    if (st.ok) st = parser_parse(tokens, tok_count, &ast);
+    if (!st.ok) return st;
+    prog->code = arena_alloc(&test_arena, (ast.node_len + 1) * sizeof(Instr));
+    prog->code_cap = ast.node_len;
+    return bytecode_compile(&ast, prog);
+}
+
+/* f'(x) from the dual pass, against want; f(x) must match bytecode_run. */
+static void expect_derivative(const char* expr, double x, int deg, double want) {
+    Program prog = { 0 };
+    EvalContext ctx;
+    eval_context_init(&ctx);
+    ctx.angle_mode_deg = deg;
+    ctx.inputs = &x;
+    ctx.input_count = 1;
+    Dual in = { x, 1.0 };
+    Dual r = { 0.0, 0.0 };
+    double v = 0.0;
+    Status st = compile_in_x(expr, NULL, &prog);
+    if (st.ok) st = bytecode_run(&prog, &ctx, &v);
+    if (st.ok) st = bytecode_run_dual(&prog, &ctx, &in, &r);
+    if (!st.ok || r.v != v || fabs(r.d - want) > 1e-13 * fmax(1.0, fabs(want))) {
+        fprintf(stderr, "FAIL: d/dx %s at %g (%s): %s %.17g, want %.17g\n", expr, x, deg ? "deg" : "rad",
+                st.ok ? "ok" : st.msg, r.d, want);
+        fails++;
+    }
+}
+
+static Status solve_expr(const char* expr, const SymTab* symbols, int deg, double guess, SolveResult* r) {
+    Program prog = { 0 };
+    EvalContext ctx;
+    eval_context_init(&ctx);
+    ctx.angle_mode_deg = deg;
+    ctx.symbols = symbols;
+    Status st = compile_in_x(expr, symbols, &prog);
+    return st.ok ? solve_run(&prog, &ctx, guess, r) : st;
+}
+
+static void expect_root(const char* expr, int deg, double guess, double want, size_t max_evals) {
+    SolveResult r;
+    Status st = solve_expr(expr, NULL, deg, guess, &r);
+    if (!st.ok || fabs(r.root - want) > 1e-12 * fmax(1.0, fabs(want)) || r.evaluations > max_evals) {
+        fprintf(stderr, "FAIL: solve %s from %g: %s %.17g after %zu evaluations, want %.17g\n", expr, guess,
+                st.ok ? "ok" : st.msg, r.root, r.evaluations, want);
+        fails++;
+    }
+}
+
+/* A series on pool and on the calling thread, which must agree exactly. */
+static Status series_expr(ThreadPool* pool, SeriesKind kind, const char* expr, double from, double to, double* out) {
+    static const char* const names[] = { "i" };
+    arena_reset(&test_arena);
+    Token* tokens = NULL;
+    size_t tok_count = 0;
+    Ast ast;
+    ast_init(&ast, &test_arena);
+    ast.inputs = names;
+    ast.input_count = 1;
+    EvalContext ctx;
+    eval_context_init(&ctx);
+    Status st = lexer_tokenize_arena(expr, &test_arena, &tokens, &tok_count);
+    if (st.ok) st = parser_parse(tokens, tok_count, &ast);
+    SeriesResult r, single;
+    if (st.ok) st = series_run(&ast, &ctx, pool, kind, from, to, &r);
+    Status st1 = series_run(&ast, &ctx, NULL, kind, from, to, &single);
+    if (st.ok != st1.ok || (st.ok && memcmp(&r.value, &single.value, sizeof(double)) != 0) ||
+        (!st.ok && strcmp(st.msg, st1.msg) != 0)) {
+        fprintf(stderr, "FAIL: series %s differs between pool and caller\n", expr);
+        fails++;
+    }
+    *out = r.value;
+    return st;
+}
+
+static void expect_series(ThreadPool* pool, SeriesKind kind, const char* expr, double from, double to, double want,
+                          double tol) {
+    double v = 0.0;
+    Status st = series_expr(pool, kind, expr, from, to, &v);
+    if (!st.ok || fabs(v - want) > tol * fabs(want)) {
+        fprintf(stderr, "FAIL: series %s over %g..%g: %s %.17g, want %.17g\n", expr, from, to, st.ok ? "ok" : st.msg,
+                v, want);
+        fails++;
+    }
+}
+
+/* n values of expr drawn from stream 0 of seed: one element at a time on
+   path 0 (eval_ast) and 1 (optimizer and bytecode), in one batch on path 2. */
+static Status random_expr(const SymTab* symbols, const char* expr, int path, uint64_t seed, size_t n, double* out) {
+    arena_reset(&test_arena);
+    Token* tokens = NULL;
+    size_t tok_count = 0;
+    Ast ast;
+    ast_init(&ast, &test_arena);
+    ast.symbols = symbols;
+    Rng rng;
+    rng_seed(&rng, seed, 0);
+    EvalContext ctx;
+    eval_context_init(&ctx);
+    ctx.symbols = symbols;
+    ctx.rng = &rng;
+    Status st = lexer_tokenize_arena(expr, &test_arena, &tokens, &tok_count);
+    if (st.ok) st = parser_parse(tokens, tok_count, &ast);
+    if (st.ok && path == 1) st = optimize_ast(&ast, &ctx, NULL);
+    if (!st.ok) return st;
+    if (path == 2) {
+        uint8_t* err = arena_alloc(&test_arena, n);
+        BatchReport rep;
+        st = batch_eval(&ast, &ctx, NULL, 0, n, out, err, &rep);
+        return st.ok && rep.errors > 0 ? status_err("error: batch element failed") : st;
+    }
+    Program prog = { .code = arena_alloc(&test_arena, (ast.node_len + 1) * sizeof(Instr)), .code_cap = ast.node_len };
+    st = bytecode_compile(&ast, &prog);
+    for (size_t i = 0; i < n && st.ok; i++) {
+        st = path == 0 ? eval_ast(&ast, ast.root, &ctx, &out[i]) : bytecode_run(&prog, &ctx, &out[i]);
+    }
+    return st;
+}
+
+static Status mc_expr(ThreadPool* pool, const char* expr, double samples, uint64_t seed, MonteCarloResult* r) {
+    arena_reset(&test_arena);
+    Token* tokens = NULL;
+    size_t tok_count = 0;
+    Ast ast;
+    ast_init(&ast, &test_arena);
+    EvalContext ctx;
+    eval_context_init(&ctx);
+    Status st = lexer_tokenize_arena(expr, &test_arena, &tokens, &tok_count);
+    if (st.ok) st = parser_parse(tokens, tok_count, &ast);
+    MonteCarloResult again;
+    if (st.ok) st = montecarlo_run(&ast, &ctx, pool, samples, seed, r);
+    if (st.ok && (!montecarlo_run(&ast, &ctx, pool, samples, seed, &again).ok ||
+                  memcmp(&r->mean, &again.mean, sizeof(double)) != 0 ||
+                  memcmp(&r->variance, &again.variance, sizeof(double)) != 0)) {
+        fprintf(stderr, "FAIL: mc %s is not reproducible\n", expr);
+        fails++;
+    }
+    return st;
+}
+
+/* The mean within 5 half-widths of want (a miss once in millions of seeds)
+   and the variance within 1%. */
+static void expect_mc(ThreadPool* pool, const char* expr, double samples, double mean, double variance) {
+    MonteCarloResult r;
+    Status st = mc_expr(pool, expr, samples, 42, &r);
+    if (!st.ok || fabs(r.mean - mean) > 5.0 * r.half_width || fabs(r.variance - variance) > 0.01 * variance ||
+        r.samples != (size_t)samples) {
+        fprintf(stderr, "FAIL: mc %s: %s mean %.17g +- %.3g variance %.17g, want %.17g and %.17g\n", expr,
+                st.ok ? "ok" : st.msg, r.mean, r.half_width, r.variance, mean, variance);
+        fails++;
+    }
+}
+
+static Status define_var(SymTab* symbols, const char* name, const char* formula, const EvalContext* ctx) {
+    arena_reset(&test_arena);
+    Token* tokens = NULL;
+    size_t tok_count = 0;
+    Ast ast;
+    ast_init(&ast, &test_arena);
+    ast.symbols = symbols;
+    Status st = lexer_tokenize_arena(formula, &test_arena, &tokens, &tok_count);
+    if (st.ok) st = parser_parse(tokens, tok_count, &ast);
+    Program prog = { .code = arena_alloc(&test_arena, (ast.node_len + 1) * sizeof(Instr)), .code_cap = ast.node_len };
+    if (st.ok) st = bytecode_compile(&ast, &prog);
+    int id = -1;
+    if (st.ok) st = symtab_define_var(symbols, name, strlen(name), &prog, formula, ctx, &id);
+    return st;
+}
+
+static double symbol_value(const SymTab* symbols, const char* name) {
+    const Symbol* s = symtab_get(symbols, symtab_find(symbols, name, strlen(name)));
+    return s != NULL && s->error == NULL ? s->value : NAN;
+}
+
+static void expect_symbols(const SymTab* symbols, const char* expr, double want) {
+    for (int path = 0; path < 3; path++) {
+        double v = 0.0;
+        Status st = eval_with_symbols(symbols, expr, path, &v);
+        if (!st.ok || v != want) {
+            fprintf(stderr, "FAIL: %s on path %d: %s %.17g, want %.17g\n", expr, path, st.ok ? "ok" : st.msg, v, want);
+            fails++;
+        }
+    }
+}
+
+static void expect_symbols_err(const SymTab* symbols, const char* expr, const char* want) {
+    for (int path = 0; path < 3; path++) {
+        double v = 0.0;
+        expect_err(eval_with_symbols(symbols, expr, path, &v), want, expr);
+    }
+}
+
+/* Records the tick each timer fired at. */
+typedef struct {
+    TimerWheel* wheel;
+    uint64_t expires;
+    uint64_t fired_at;
+    int fires;
+} WheelProbe;
+
+static void wheel_probe(void* p) {
+    WheelProbe* probe = p;
+    probe->fired_at = probe->wheel->now;
+    probe->fires++;
+}
+
+/* A writer on a timeout feeds a reader that waits on a pipe. */
+typedef struct {
+    Kernel* kernel;
+    int fds[2];
+    int written;
+    int received;
+    int plain_runs;
+} KernelTest;
+
+static void kernel_test_writer(void* p) {
+    KernelTest* t = p;
+    if (t->written < 3 && write(t->fds[1], "x", 1) == 1) {
+        t->written++;
+    }
+}
+
+static void kernel_test_reader(void* p) {
+    KernelTest* t = p;
+    char c;
+    while (read(t->fds[0], &c, 1) == 1) {
+        t->received++;
+    }
+    if (t->received == 3) {
+        kernel_stop(t->kernel);
+    }
+}
+
+static void kernel_test_tick(void* p) {
+    KernelTest* t = p;
+    if (++t->plain_runs == 5) {
+        kernel_stop(t->kernel);
+    }
+}
+
+static void kernel_test_plain(void* p) {
+    KernelTest* t = p;
+    t->plain_runs++;
+}
+
+/* Coroutines: a producer that sleeps between writes, a consumer that waits
+   on the pipe, and one that only yields. */
+typedef struct {
+    Kernel* kernel;
+    int fds[2];
+    int sent;
+    int received;
+    int timeouts;
+    int yields;
+    int waits;               /* of the consumer */
+    uint64_t timeout_ns;     /* how long the final, empty wait took */
+} CoroTest;
+
+static uint64_t test_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void coro_test_producer(void* p) {
+    CoroTest* t = p;
+    for (int i = 0; i < 3; i++) {
+        if (write(t->fds[1], "x", 1) == 1) {
+            t->sent++;
+        }
+        kernel_sleep(t->kernel, 2);
+    }
+}
+
+static void coro_test_consumer(void* p) {
+    CoroTest* t = p;
+    while (t->received < 3) {
+        t->waits++;
+        if (!kernel_wait_fd(t->kernel, t->fds[0], 1000)) {
+            t->timeouts++;
+            continue;
+        }
+        char c;
+        while (read(t->fds[0], &c, 1) == 1) {
+            t->received++;
+        }
+    }
+    uint64_t t0 = test_now_ns();
+    if (!kernel_wait_fd(t->kernel, t->fds[0], 3)) {
+        t->timeout_ns = test_now_ns() - t0;
+    }
+    kernel_stop(t->kernel);
+}
+
+static void coro_test_yielder(void* p) {
+    CoroTest* t = p;
+    for (int i = 0; i < 10; i++) {
+        t->yields++;
+        kernel_yield(t->kernel);
+    }
+}
+
+static void coro_test_counter(void* p) {
+    int* n = p;
+    for (;;) {
+        (*n)++;
+        coro_suspend(coro_current());
+    }
+}
+
+/* Thieves mark each item they get; the owner marks what it takes. */
+#define WS_TEST_ITEMS 200000
+
+typedef struct {
+    WsDeque deque;
+    _Atomic unsigned char seen[WS_TEST_ITEMS];
+    atomic_bool done;
+} WsTest;
+
+static void* ws_test_thief(void* p) {
+    WsTest* t = p;
+    while (!atomic_load(&t->done)) {
+        size_t* item = ws_deque_steal(&t->deque);
+        if (item != NULL) {
+            atomic_fetch_add(&t->seen[*item], 1);
+        }
+    }
+    return NULL;
+}
+
+/* Sums lo..hi-1 by splitting it into subtasks. */
+typedef struct {
+    Kernel* kernel;
+    uint64_t lo;
+    uint64_t hi;
+    uint64_t sum;
+} KernelSum;
+
+static void kernel_test_sum(void* p) {
+    KernelSum* s = p;
+    if (s->hi - s->lo <= 64) {
+        s->sum = 0;
+        for (uint64_t i = s->lo; i < s->hi; i++) {
+            s->sum += i;
+        }
+        return;
+    }
+    uint64_t mid = s->lo + (s->hi - s->lo) / 2;
+    KernelSum left = { s->kernel, s->lo, mid, 0 };
+    KernelSum right = { s->kernel, mid, s->hi, 0 };
+    KernelGroup g;
+    KernelJob jobs[2];
+    kernel_group_init(&g);
+    kernel_spawn(s->kernel, &g, &jobs[0], kernel_test_sum, &left);
+    kernel_spawn(s->kernel, &g, &jobs[1], kernel_test_sum, &right);
+    kernel_wait(s->kernel, &g);
+    s->sum = left.sum + right.sum;
+}
+
+static void kernel_test_sum_task(void* p) {
+    KernelSum* s = p;
+    kernel_test_sum(s);
+    kernel_stop(s->kernel);
+}
 
-#include <stdio.h>
-#include <string.h>
+/* A spawner adds short tasks that exit on their first run, a few at a
+   time, until it has added CHURN_TASKS; a listener coroutine does the same
+   with coroutine sessions that yield twice. */
+#define CHURN_TASKS 1000
+#define CHURN_SESSIONS 200
 
-static int fails = 0;
+typedef struct {
+    Kernel* kernel;
+    int added;
+    KernelTaskId first;
+    atomic_int ran;
+    atomic_int ended;
+} KernelChurn;
 
-static void expect_ok(Status st, const char* msg) {
-    if (!st.ok) {
-        fprintf(stderr, "FAIL: %s: %s\n", msg, st.msg ? st.msg : "(no msg)");
-        fails++;
+static void churn_task(void* p) {
+    KernelChurn* c = p;
+    atomic_fetch_add(&c->ran, 1);
+    kernel_exit(c->kernel);
+}
+
+static void churn_spawner(void* p) {
+    KernelChurn* c = p;
+    for (int i = 0; i < 10 && c->added < CHURN_TASKS; i++, c->added++) {
+        KernelTaskId id = kernel_add_task(c->kernel, churn_task, c, "churn");
+        c->first = c->first != 0 ? c->first : id;
+    }
+    KernelStats ks;
+    kernel_stats(c->kernel, &ks);
+    if (c->added == CHURN_TASKS && ks.tasks == 1) {
+        kernel_exit(c->kernel);
+        kernel_stop(c->kernel);
     }
 }
 
-static void expect_near(double a, double b, double eps, const char* msg) {
-    double d = a - b;
-    if (d < 0) d = -d;
-    if (d > eps) {
-        fprintf(stderr, "FAIL: %s: got %.17g expected %.17g\n", msg, a, b);
-        fails++;
+static void churn_session(void* p) {
+    KernelChurn* c = p;
+    kernel_yield(c->kernel);
+    kernel_yield(c->kernel);
+    atomic_fetch_add(&c->ran, 1);
+    if (atomic_fetch_add(&c->ended, 1) == CHURN_SESSIONS) {
+        kernel_stop(c->kernel);
     }
 }
 
-static Status eval_expr(const char* expr, int deg, double ans, double mem, int mem_set, double* out) {
-    Token tokens[256];
-    size_t tok_count = 0;
-    Status st = lexer_tokenize(expr, tokens, 256, &tok_count);
-    if (!st.ok) return st;
+static void churn_listener(void* p) {
+    KernelChurn* c = p;
+    for (; c->added < CHURN_SESSIONS; c->added++) {
+        KernelTaskId id = kernel_add_coroutine(c->kernel, churn_session, c, "session", 0);
+        c->first = c->first != 0 ? c->first : id;
+        kernel_yield(c->kernel);
+    }
+    if (atomic_fetch_add(&c->ended, 1) == CHURN_SESSIONS) {
+        kernel_stop(c->kernel);
+    }
+}
 
-    AstNode nodes[256];
-    Ast ast = { .nodes = nodes, .node_cap = 256, .node_len = 0, .root = AST_NODE_INVALID };
-    st = parser_parse(tokens, tok_count, &ast);
-    if (!st.ok) return st;
+/* A high-priority task that runs three times, and a low one that notes
+   how often the high one ran before it. */
+typedef struct {
+    Kernel* kernel;
+    int high_runs;
+    int high_before_low;
+    bool woke;               /* a removed sleeper went on */
+} KernelPrio;
 
-    EvalContext ctx;
-    eval_context_init(&ctx);
-    ctx.angle_mode_deg = deg;
-    ctx.ans = ans;
-    ctx.mem = mem;
-    ctx.mem_set = mem_set;
-    return eval_ast(&ast, ast.root, &ctx, out);
+static void prio_high(void* p) {
+    KernelPrio* t = p;
+    if (++t->high_runs == 3) {
+        kernel_exit(t->kernel);
+    }
+}
+
+static void prio_low(void* p) {
+    KernelPrio* t = p;
+    t->high_before_low = t->high_runs;
+    kernel_stop(t->kernel);
+}
+
+static void prio_sleeper(void* p) {
+    KernelPrio* t = p;
+    kernel_sleep(t->kernel, 10000);
+    t->woke = true;
 }
 
 int main(void) {
+    arena_init(&test_arena, 0);
+
     {
         double v = 0.0;
         Status st = eval_expr("2+2*3", 1, 0, 0, 0, &v);
@@ -89,6 +1143,1242 @@ int main(void) {
         }
     }
 
+    {
+        /* registry is sorted and lookups are case-insensitive */
+        for (size_t i = 1; i < builtins_func_count(); i++) {
+            if (strcmp(builtins_func((int)i - 1)->name, builtins_func((int)i)->name) >= 0) {
+                fprintf(stderr, "FAIL: builtin table not sorted at %s\n", builtins_func((int)i)->name);
+                fails++;
+            }
+        }
+        for (size_t i = 0; i < builtins_func_count(); i++) {
+            const char* name = builtins_func((int)i)->name;
+            if (builtins_find_func(name, strlen(name)) != (int)i) {
+                fprintf(stderr, "FAIL: lookup of %s\n", name);
+                fails++;
+            }
+        }
+        if (builtins_find_func("SQRT", 4) < 0 || builtins_find_func("sq", 2) >= 0 || builtins_find_func("sqrtx", 5) >= 0) {
+            fprintf(stderr, "FAIL: builtin lookup edge cases\n");
+            fails++;
+        }
+        if (builtins_find_var("PI", 2) != SYM_PI || builtins_find_var("mem", 3) != SYM_MEM || builtins_find_var("x", 1) >= 0) {
+            fprintf(stderr, "FAIL: builtin var lookup\n");
+            fails++;
+        }
+
+        double v = 0.0;
+        expect_err(eval_expr("1/0+sin(1,2)", 1, 0, 0, 0, &v), "error: sin(x) expects 1 arg", "arity checked at parse time");
+        expect_err(eval_expr("1/0+foo(2)", 1, 0, 0, 0, &v), "error: unknown function", "unknown function at parse time");
+        expect_err(eval_expr("1/0+foo", 1, 0, 0, 0, &v), "error: unknown variable", "unknown variable at parse time");
+        expect_ok(eval_expr("SQRT(16)+Abs(-2)", 1, 0, 0, 0, &v), "case-insensitive call");
+        expect_near(v, 6.0, 1e-12, "SQRT(16)+Abs(-2)");
+    }
+    {
+        static const char* const corpus[] = {
+            "2+2*3", "(2+2)*3", "2^3^2", "-2^2", "+-+3", "1-2-3", "8/2/2",
+            "sin(30)+cos(60)*tan(45)", "asin(0.5)+acos(0.5)+atan(1)",
+            "sqrt(16)+abs(-3)+ln(e)+log(1000)", "pi*e", "ans/2+mem",
+            "1/0", "1/(2-2)", "sqrt(-1)", "ln(0)", "log(-1)", "10^400",
+            "asin(2)", "asin(2)+1", "foo", "1+foo(2)", "bar()",
+            "sin()", "sin(1,2)", "sin(1/0,2)", "sin(1,1/0)", "foo(1/0,2)",
+            "foo(1,1/0)", "1/0+foo", "foo+1/0", "cos(1,2,3,4)", "tan(90)",
+            "sin(pi/4)*sin(pi/4) + 2^10", "sqrt(ans)*sqrt(ans)+sqrt(ans)",
+            "(ans+1)*(ans+1)-(ans+1)/(ans+1)", "mem*2+mem*2", "ln(mem-7)+ln(mem-7)",
+            "1/(ans-41)+1/(ans-41)", "sqrt(-ans)+sqrt(-ans)", "asin(2)*0", "+(+ans)",
+            "10^200*10^200", "sin(ans)^2+cos(ans)^2", "-(-(ans))*-(-(ans))",
+            "ans^2", "ans^3", "ans^7", "(ans+1)^8", "ans^9", "ans^2.5", "(-ans)^3", "mem^2",
+            "ans/4", "ans/3", "ans/0.125", "ans/(2-2)", "ans^100", "(ans*1e300)^2",
+            "3*ans^3 + 2*ans^2 + ans + 1", "ans^2 - 2*ans + 1 - ans*ans", "1 - ans + ans^2/2 - ans^3/6",
+            "sin(ans)^2 + 2*sin(ans) + 1", "ans*ans*ans - ans", "2*ans^2 + sin(ans)",
+        };
+        for (size_t i = 0; i < sizeof(corpus) / sizeof(corpus[0]); i++) {
+            expect_same_paths(corpus[i], 1, 1, 0);
+            expect_same_paths(corpus[i], 0, 0, 0);
+            expect_same_paths(corpus[i], 1, 1, 1);
+            expect_same_paths(corpus[i], 0, 0, 1);
+        }
+    }
+    {
+        OptimizeStats stats;
+        double v = 0.0;
+        Status st = eval_expr_vm("sin(pi/4)*sin(pi/4) + 2^10", 0, 0, 0, 0, 1, &stats, &v);
+        expect_ok(st, "fold constant tree");
+        expect_near(v, 1024.5, 1e-12, "sin(pi/4)^2+2^10");
+        if (stats.nodes_after != 1 || stats.nodes_before != 13) {
+            fprintf(stderr, "FAIL: constant tree folded to %zu of %zu nodes\n", stats.nodes_after, stats.nodes_before);
+            fails++;
+        }
+
+        st = eval_expr_vm("sin(30)", 1, 0, 0, 0, 1, &stats, &v);
+        expect_ok(st, "fold respects deg");
+        expect_near(v, 0.5, 1e-12, "folded sin(30) deg");
+        st = eval_expr_vm("sin(30)", 0, 0, 0, 0, 1, &stats, &v);
+        expect_ok(st, "fold respects rad");
+        expect_near(v, sin(30.0), 1e-12, "folded sin(30) rad");
+
+        st = eval_expr_vm("sqrt(ans+1)*sqrt(ans+1)", 1, 8.0, 0, 0, 1, &stats, &v);
+        expect_ok(st, "cse");
+        expect_near(v, 9.0, 1e-12, "sqrt(ans+1)^2");
+        if (stats.shared != 1 || stats.nodes_after >= stats.nodes_before) {
+            fprintf(stderr, "FAIL: cse shared %zu, %zu -> %zu nodes\n", stats.shared, stats.nodes_before, stats.nodes_after);
+            fails++;
+        }
+
+        st = eval_expr_vm("3*ans^3 + 2*ans^2 + ans + 1", 1, 2.0, 0, 0, 1, &stats, &v);
+        expect_ok(st, "horner");
+        expect_near(v, 35.0, 1e-12, "3x^3+2x^2+x+1");
+        if (stats.reduced == 0 || stats.nodes_after >= stats.nodes_before) {
+            fprintf(stderr, "FAIL: horner reduced %zu, %zu -> %zu nodes\n", stats.reduced, stats.nodes_before, stats.nodes_after);
+            fails++;
+        }
+        st = eval_expr_vm("ans^4", 1, 3.0, 0, 0, 1, &stats, &v);
+        expect_ok(st, "pow chain");
+        expect_near(v, 81.0, 0.0, "x^4");
+        if (stats.reduced != 1) {
+            fprintf(stderr, "FAIL: ans^4 not reduced\n");
+            fails++;
+        }
+        expect_err(eval_expr_vm("(ans*1e200)^2", 1, 3.0, 0, 0, 1, NULL, &v), "error: result is not finite", "pow chain overflow");
+        expect_err(eval_expr_vm("mem^3+mem", 1, 0, 0, 0, 1, NULL, &v), "error: mem is unset", "horner keeps mem error");
+        /* Horner output for two high-degree polynomials does not fit the DAG */
+        expect_err(eval_expr_vm("(ans^32+ans)*(mem^32+mem)", 1, 0, 0, 0, 1, NULL, &v), "error: mem is unset",
+                   "horner overflow keeps mem error");
+        st = eval_expr_vm("(ans^32+ans)*(mem^32+mem)", 1, 1.0, 1.0, 1, 1, &stats, &v);
+        expect_ok(st, "horner overflow");
+        expect_near(v, 4.0, 0.0, "(x^32+x)*(y^32+y)");
+        expect_same_paths("(ans^31-2*ans^2+ans)*(mem^30+3*mem^7-mem)+(ans^29+ans)*(mem^32+mem)", 1, 1, 1);
+
+        expect_err(eval_expr_vm("2+1/(3-3)", 1, 0, 0, 0, 1, NULL, &v), "error: division by zero", "folding keeps div by zero");
+        expect_err(eval_expr_vm("sqrt(1-2)", 1, 0, 0, 0, 1, NULL, &v), "error: sqrt domain", "folding keeps domain error");
+        expect_err(eval_expr_vm("10^400-1", 1, 0, 0, 0, 1, NULL, &v), "error: result is not finite", "folding keeps overflow");
+        expect_err(eval_expr_vm("mem*mem", 1, 0, 0, 0, 1, NULL, &v), "error: mem is unset", "mem never folded");
+    }
+
+    {
+        char key[EXPR_CACHE_KEY_MAX];
+        size_t n = expr_cache_normalize("  SIN( 30 ) +  Ans ", key, sizeof(key));
+        if (n != strlen("sin(30)+ans") || strcmp(key, "sin(30)+ans") != 0) {
+            fprintf(stderr, "FAIL: normalize gave '%s'\n", key);
+            fails++;
+        }
+        n = expr_cache_normalize("1 2", key, sizeof(key));
+        if (strcmp(key, "1 2") != 0) {
+            fprintf(stderr, "FAIL: normalize must keep separating space, got '%s'\n", key);
+            fails++;
+        }
+        /* "1e -5" does not lex, so it must not find the program of "1e-5" */
+        char other[EXPR_CACHE_KEY_MAX];
+        expr_cache_normalize("1e -5", key, sizeof(key));
+        expr_cache_normalize("1E-5", other, sizeof(other));
+        if (strcmp(key, "1e -5") != 0 || strcmp(other, "1e-5") != 0) {
+            fprintf(stderr, "FAIL: normalize joined an exponent sign: '%s' and '%s'\n", key, other);
+            fails++;
+        }
+        expr_cache_normalize("0x1P +3 - 2", key, sizeof(key));
+        if (strcmp(key, "0x1p +3-2") != 0) {
+            fprintf(stderr, "FAIL: normalize gave '%s' for a hex exponent\n", key);
+            fails++;
+        }
+        double spaced;
+        expect_err(eval_expr_vm("1e -5", 1, 0, 0, 0, 1, NULL, &spaced), "error: unexpected trailing tokens",
+                   "spaced exponent");
+
+        static ExprCache cache;
+        expr_cache_init(&cache);
+        Instr code[1];
+        memset(code, 0, sizeof(code));
+        code[0].op = OP_PUSH;
+        Program prog = { .code = code, .code_cap = 1, .code_len = 1, .stack_need = 1 };
+        char k[32];
+        for (int i = 0; i < EXPR_CACHE_CAP + 1; i++) {
+            if (i == EXPR_CACHE_CAP) {
+                /* touch entry 0 so entry 1 is the least recently used */
+                (void)expr_cache_get(&cache, "0", 1, 1);
+            }
+            code[0].as.num = (double)i;
+            int len = snprintf(k, sizeof(k), "%d", i);
+            expect_ok(expr_cache_put(&cache, k, (size_t)len, 1, &prog), "cache put");
+        }
+        const Program* hit = expr_cache_get(&cache, "0", 1, 1);
+        if (hit == NULL || hit->code[0].as.num != 0.0) {
+            fprintf(stderr, "FAIL: recently used entry evicted\n");
+            fails++;
+        }
+        if (expr_cache_get(&cache, "1", 1, 1) != NULL || cache.evictions != 1) {
+            fprintf(stderr, "FAIL: LRU entry not evicted\n");
+            fails++;
+        }
+        if (expr_cache_get(&cache, "0", 1, 0) != NULL) {
+            fprintf(stderr, "FAIL: angle mode must be part of the key\n");
+            fails++;
+        }
+        hit = expr_cache_get(&cache, "64", 2, 1);
+        if (hit == NULL || hit->code[0].as.num != 64.0 || cache.hits != 3 || cache.misses != 2) {
+            fprintf(stderr, "FAIL: cache counters %zu hits %zu misses\n", cache.hits, cache.misses);
+            fails++;
+        }
+        /* programs compiled before a function was redefined are dropped */
+        expr_cache_sync(&cache, 0);
+        bool kept = expr_cache_get(&cache, "64", 2, 1) != NULL;
+        expr_cache_sync(&cache, 1);
+        if (!kept || expr_cache_get(&cache, "64", 2, 1) != NULL || cache.count != 0) {
+            fprintf(stderr, "FAIL: cache kept programs across a function redefinition\n");
+            fails++;
+        }
+        expr_cache_free(&cache);
+    }
+
+    {
+        static const char* const edge[] = {
+            "0", "00", "0.", ".0", ".", ".e5", "1e", "1e+", "1e-x", "1.e5", "5.", ".5e-3", "00012.5000e-0001",
+            "0x", "0x.", "0x.8", "0X1P-2", "0x1p", "0x1.8p+1", "0xg", "1e400", "1e-400", "2.4703282292062327e-324",
+            "2.4703282292062328e-324", "4.9406564584124654e-324", "2.2250738585072011e-308",
+            "2.2250738585072012e-308", "2.2250738585072013e-308", "2.2250738585072014e-308",
+            "1.7976931348623157e308", "1.7976931348623158e308", "1.7976931348623159e308", "9007199254740993",
+            "123456789012345678901234567890", "1e23", "8.98846567431158e307", "0x1p-1074", "0x1p-1075",
+            "0x1.8p-1075", "0x1.fffffffffffff8p-1023", "0x1.fffffffffffffp1023", "0x1.fffffffffffff8p1023",
+            "0x578.687bda11592p-1034", "0x2fa1a356e2e001p-1078", "0x60d77c27e35c2ap-1078",
+            "0x0.fffffffffffff8p-1022", "0x0.fffffffffffffcp-1022", "0x1.00000000000008p-1075",
+            "0x1.00000000000004p-1075",
+            "1e99999999999999999999", "1e-99999999999999999999", "0.000000000000000000000000000000000001e37",
+        };
+        for (size_t i = 0; i < sizeof(edge) / sizeof(edge[0]); i++) {
+            expect_number_like_strtod(edge[i]);
+        }
+
+        static char buf[2048];
+        char digits[1024];
+        for (int i = 0; i < 200000; i++) {
+            switch (i % 7) {
+                case 0: { /* short mantissas, the common case */
+                    random_digits(digits, 1 + rng_below(19));
+                    size_t dot = rng_below((unsigned)strlen(digits) + 1);
+                    snprintf(buf, sizeof(buf), "%.*s.%se%d", (int)dot, digits, digits + dot,
+                             (int)rng_below(80) - 40);
+                    break;
+                }
+                case 1: { /* shortest and near-shortest renderings of random doubles */
+                    uint64_t bits = rng_next() & 0x7fefffffffffffffu;
+                    double d;
+                    memcpy(&d, &bits, sizeof(d));
+                    snprintf(buf, sizeof(buf), "%.*g", 15 + (int)rng_below(4), d);
+                    break;
+                }
+                case 2: { /* halfway points between neighbours, exact and perturbed */
+                    uint64_t bits = rng_next() & 0x7fefffffffffffffu;
+                    double d;
+                    memcpy(&d, &bits, sizeof(d));
+                    long double mid = ((long double)d + (long double)nextafter(d, INFINITY)) / 2;
+                    int n = snprintf(buf, sizeof(buf), "%.*Le", (int)rng_below(780), mid);
+                    char* e = strchr(buf, 'e');
+                    if (e != NULL && rng_below(2) && n + 2 < (int)sizeof(buf)) {
+                        memmove(e + 1, e, strlen(e) + 1);
+                        *e = (char)('0' + rng_below(10));
+                    }
+                    break;
+                }
+                case 3: { /* long mantissas that need the slow path */
+                    random_digits(digits, 1 + rng_below(900));
+                    snprintf(buf, sizeof(buf), "%s.%se%d", digits, digits + strlen(digits) / 2,
+                             (int)rng_below(1400) - 1100);
+                    break;
+                }
+                case 4: { /* near the overflow and underflow thresholds */
+                    random_digits(digits, 1 + rng_below(25));
+                    int exp = rng_below(2) ? 290 + (int)rng_below(30) : -345 + (int)rng_below(45);
+                    snprintf(buf, sizeof(buf), "%c.%se%d", digits[0], digits + 1, exp);
+                    break;
+                }
+                case 5: { /* hex floats with more than 53 bits, rounded to subnormals */
+                    size_t n = 1 + rng_below(30);
+                    for (size_t k = 0; k < n; k++) {
+                        digits[k] = "0123456789abcdef"[k == 0 ? 1 + rng_below(15) : rng_below(16)];
+                    }
+                    digits[n] = '\0';
+                    size_t dot = rng_below((unsigned)n + 1);
+                    snprintf(buf, sizeof(buf), "0x%.*s.%sp%d", (int)dot, digits, digits + dot,
+                             -1000 - (int)rng_below(200));
+                    break;
+                }
+                default: { /* hex floats */
+                    snprintf(buf, sizeof(buf), "0x1.%013llxp%d", (unsigned long long)(rng_next() >> 12),
+                             (int)rng_below(2200) - 1100);
+                    if (rng_below(2)) {
+                        random_digits(digits, 1 + rng_below(30));
+                        snprintf(buf, sizeof(buf), "0x%s.%sp%d", digits, digits + strlen(digits) / 3,
+                                 (int)rng_below(2200) - 1100);
+                    }
+                    break;
+                }
+            }
+            expect_number_like_strtod(buf);
+        }
+    }
+
+    {
+        static const struct { double v; const char* shortest; const char* g15; } cases[] = {
+            { 0.1 + 0.2, "0.30000000000000004", "0.3" },
+            { 1.0 / 3.0, "0.3333333333333333", "0.333333333333333" },
+            { 100.0, "100", "100" },
+            { -2.5, "-2.5", "-2.5" },
+            { -0.0, "0", "0" },
+            { 1e15, "1000000000000000", "1e+15" },
+            { 1e17, "1e+17", "1e+17" },
+            { 123456789012345678.0, "1.2345678901234568e+17", "1.23456789012346e+17" },
+            { 0.0001, "0.0001", "0.0001" },
+            { 0.00001, "1e-05", "1e-05" },
+            { 5e-324, "5e-324", "4.94065645841247e-324" },
+            { 1.7976931348623157e308, "1.7976931348623157e+308", "1.79769313486232e+308" },
+        };
+        for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+            char buf[64];
+            format_double(cases[i].v, FORMAT_SHORTEST, buf, sizeof(buf));
+            if (strcmp(buf, cases[i].shortest) != 0) {
+                fprintf(stderr, "FAIL: shortest format: got '%s' expected '%s'\n", buf, cases[i].shortest);
+                fails++;
+            }
+            format_double(cases[i].v, FORMAT_G15, buf, sizeof(buf));
+            if (strcmp(buf, cases[i].g15) != 0) {
+                fprintf(stderr, "FAIL: g15 format: got '%s' expected '%s'\n", buf, cases[i].g15);
+                fails++;
+            }
+        }
+        char small[4];
+        if (format_double(-1.0 / 3.0, FORMAT_SHORTEST, small, sizeof(small)) != 3 || strcmp(small, "-0.") != 0) {
+            fprintf(stderr, "FAIL: format must truncate to the buffer\n");
+            fails++;
+        }
+        format_double(NAN, FORMAT_SHORTEST, small, sizeof(small));
+        expect_err(strcmp(small, "nan") == 0 ? status_err("") : status_ok(), "", "nan format");
+        format_double(-INFINITY, FORMAT_G15, small, sizeof(small));
+        expect_err(strcmp(small, "-in") == 0 ? status_err("") : status_ok(), "", "-inf format truncated");
+
+        for (int i = 0; i < 200000; i++) {
+            double d;
+            if (i % 2 == 0) {
+                uint64_t bits = rng_next() & 0xffefffffffffffffu;
+                memcpy(&d, &bits, sizeof(d));
+            } else {
+                /* short decimals hit the trailing-zero and exact-tie paths */
+                d = (double)(int64_t)(rng_next() % 2000000001u) - 1e9;
+                d /= (double)(1u << rng_below(20)) * pow(10.0, (double)((int)rng_below(40) - 20));
+            }
+            expect_format_like_printf(d, i < 20000);
+        }
+        expect_format_like_printf(1234567890123455.0, 1);
+        expect_format_like_printf(0.5, 1);
+        expect_format_like_printf(2.2250738585072014e-308, 1);
+    }
+
+    {
+        Arena arena;
+        arena_init(&arena, 1024);
+        char* a = arena_alloc(&arena, 3);
+        double* b = arena_alloc(&arena, sizeof(double));
+        if (a == NULL || b == NULL || (size_t)b % sizeof(double) != 0) {
+            fprintf(stderr, "FAIL: arena allocations must be aligned\n");
+            fails++;
+        }
+        int* grown = arena_alloc(&arena, 4 * sizeof(int));
+        grown[3] = 7;
+        if (arena_grow(&arena, grown, 4 * sizeof(int), 64 * sizeof(int)) != grown) {
+            fprintf(stderr, "FAIL: latest arena allocation must grow in place\n");
+            fails++;
+        }
+        int* moved = arena_grow(&arena, grown, 64 * sizeof(int), 4096 * sizeof(int));
+        if (moved == NULL || moved[3] != 7 || arena.chunk_count != 2) {
+            fprintf(stderr, "FAIL: arena growth past a chunk must copy into a new chunk\n");
+            fails++;
+        }
+        size_t reserved = arena.reserved;
+        arena_reset(&arena);
+        if (arena.chunk_count != 1 || arena.reserved != reserved) {
+            fprintf(stderr, "FAIL: arena reset must merge chunks (%zu chunks)\n", arena.chunk_count);
+            fails++;
+        }
+        arena_free(&arena);
+
+        /* 100k+ tokens; after the first line the arena must not malloc again */
+        size_t terms = 50000;
+        char* big = malloc(terms * 10 + 1);
+        size_t len = 0;
+        for (size_t i = 0; i < terms; i++) {
+            len += (size_t)sprintf(big + len, i ? "+ans*%zu" : "%zu", i % 7);
+        }
+        arena_init(&arena, 0);
+        size_t mallocs = 0;
+        for (int round = 0; round < 3; round++) {
+            arena_reset(&arena);
+            double v = 0.0;
+            expect_ok(eval_expr_arena(big, &arena, 2.0, &v), "100k-token expression");
+            expect_near(v, 2.0 * (double)(terms / 7 * 21 + 15), 1e-6, "100k-token expression value");
+            if (round == 2 && arena.mallocs != mallocs) {
+                fprintf(stderr, "FAIL: steady-state lines must not malloc (%zu -> %zu)\n", mallocs, arena.mallocs);
+                fails++;
+            }
+            mallocs = arena.mallocs;
+        }
+        arena_free(&arena);
+        free(big);
+    }
+
+    {
+        /* the parser reports the same errors a recursive descent would */
+        static const struct { const char* expr; const char* err; } cases[] = {
+            { "(", "error: expected primary expression" },
+            { "()", "error: expected primary expression" },
+            { "1+", "error: expected primary expression" },
+            { "1 2", "error: unexpected trailing tokens" },
+            { "(1+2))", "error: unexpected trailing tokens" },
+            { "(1 2", "error: expected ')'" },
+            { "((1)", "error: expected ')'" },
+            { "sin(1 2", "error: expected ',' or ')'" },
+            { "sin(", "error: expected primary expression" },
+            { "sin()", "error: sin(x) expects 1 arg" },
+            { "abs(1,2,3,4,5)", "error: too many function args" },
+            { "-foo(", "error: unknown function" },
+        };
+        for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+            double v = 0.0;
+            expect_err(eval_expr(cases[i].expr, 1, 0, 0, 0, &v), cases[i].err, cases[i].expr);
+        }
+
+        double v = 0.0;
+        expect_ok(eval_expr("2^-3^2", 1, 0, 0, 0, &v), "2^-3^2");
+        expect_near(v, 512.0, 0.0, "unary binds tighter than ^ on the right");
+        expect_ok(eval_expr("2^-1*4-3*-2^2", 1, 0, 0, 0, &v), "mixed prefix and binary");
+        expect_near(v, -10.0, 0.0, "2^-1*4-3*-2^2");
+        expect_ok(eval_expr("-(1+2)*sin(-(30))", 1, 0, 0, 0, &v), "prefix before groups");
+        expect_near(v, 1.5, 1e-12, "-(1+2)*sin(-(30))");
+
+        /* deep nesting fails cleanly by default and works when allowed */
+        char* parens = nest("(", "7", ")", 100000);
+        char* negs = nest("-", "1", "", 100001);
+        char* pows = nest("1^", "1", "", 100000);
+        char* calls = nest("abs(", "-2", ")", 50000);
+        if (parens == NULL || negs == NULL || pows == NULL || calls == NULL) {
+            fprintf(stderr, "FAIL: out of memory\n");
+            fails++;
+        } else {
+            expect_err(eval_deep(parens, PARSER_MAX_DEPTH, EVAL_MAX_DEPTH, &v), "error: expression too deep", "deep parens");
+            expect_ok(eval_deep(parens, 100000, EVAL_MAX_DEPTH, &v), "deep parens allowed");
+            expect_near(v, 7.0, 0.0, "deep parens value");
+            expect_err(eval_deep(negs, 100000, EVAL_MAX_DEPTH, &v), "error: expression too deep", "parse limit exact");
+            expect_err(eval_deep(negs, 100001, EVAL_MAX_DEPTH, &v), "error: expression too deep", "deep eval");
+            expect_ok(eval_deep(negs, 100001, 100002, &v), "deep negation allowed");
+            expect_near(v, -1.0, 0.0, "deep negation value");
+            expect_ok(eval_deep(pows, 200000, 200000, &v), "right-associative chain");
+            expect_near(v, 1.0, 0.0, "pow chain value");
+            expect_ok(eval_deep(calls, 50001, 50002, &v), "nested calls");
+            expect_near(v, 2.0, 0.0, "nested calls value");
+        }
+        free(parens);
+        free(negs);
+        free(pows);
+        free(calls);
+    }
+
+    {
+        const size_t n = 1003;   /* several blocks plus a ragged tail */
+        double* xs = malloc(n * sizeof(double));
+        double* ys = malloc(n * sizeof(double));
+        if (xs == NULL || ys == NULL) {
+            fprintf(stderr, "FAIL: out of memory\n");
+            fails++;
+        } else {
+            for (size_t i = 0; i < n; i++) {
+                xs[i] = (double)((int)rng_below(4001) - 2000) / 100.0;
+                ys[i] = i % 7 == 0 ? xs[i] : (double)rng_below(1000) / 10.0;
+            }
+            xs[5] = 0.0;
+            xs[6] = -0.0;
+            xs[7] = 1e300;
+            xs[8] = -1e-310;
+            static const char* const exprs[] = {
+                "sin(x)^2 + ln(x)",
+                "x*y/(x-y) - -x",
+                "(x*1e200)*y + 1",
+                "sqrt(x) + mem",
+                "sin(x)*sin(x) + sin(x) + x^3 + 2*x^2 + x",
+                "1/x + atan(y/x) - abs(x)^y",
+            };
+            for (size_t i = 0; i < sizeof(exprs) / sizeof(exprs[0]); i++) {
+                expect_batch_like_scalar(exprs[i], 0, 0, xs, ys, n);
+                expect_batch_like_scalar(exprs[i], 1, 1, xs, ys, n);
+            }
+
+            static const char* const only_x[] = { "x" };
+            arena_reset(&test_arena);
+            Token* tokens = NULL;
+            size_t tok_count = 0;
+            Ast ast;
+            ast_init(&ast, &test_arena);
+            ast.inputs = only_x;
+            ast.input_count = 1;
+            Status st = lexer_tokenize_arena("x+1", &test_arena, &tokens, &tok_count);
+            if (st.ok) st = parser_parse(tokens, tok_count, &ast);
+            EvalContext ctx;
+            eval_context_init(&ctx);
+            const BatchInput wrong[] = { { "y", ys } };
+            uint8_t err[4];
+            double out[4];
+            expect_err(batch_eval(&ast, &ctx, wrong, 1, 4, out, err, NULL), "error: unbound input", "batch input missing");
+            double v = 0.0;
+            expect_err(eval_ast(&ast, ast.root, &ctx, &v), "error: unknown variable", "input without a value");
+        }
+        free(xs);
+        free(ys);
+    }
+
+    {
+        size_t count = 0;
+        const VecMathKernel* kernels = vecmath_kernels(&count);
+        for (size_t i = 0; i < count; i++) {
+            expect_kernel_like_builtin(&kernels[i]);
+        }
+        if (vecmath_find("sin") == NULL || vecmath_find("pow") != NULL) {
+            fprintf(stderr, "FAIL: vecmath_find\n");
+            fails++;
+        }
+    }
+
+    {
+        size_t rows = 0;
+        expect_ok(table_row_count(0.0, 360.0, 0.001, &rows), "table rows");
+        expect_near((double)rows, 360001.0, 0.0, "table rows to the end");
+        expect_ok(table_row_count(1.0, 0.0, -0.25, &rows), "table rows down");
+        expect_near((double)rows, 5.0, 0.0, "table rows down count");
+        expect_ok(table_row_count(5.0, 5.0, 1.0, &rows), "table single row");
+        expect_near((double)rows, 1.0, 0.0, "table single row count");
+        expect_err(table_row_count(0.0, 1.0, 0.0, &rows), "error: table step is zero", "table zero step");
+        expect_err(table_row_count(0.0, 1.0, -1.0, &rows), "error: table step points away from the end", "table wrong way");
+        expect_err(table_row_count(0.0, 1e300, 1.0, &rows), "error: table has too many rows", "table too long");
+
+        ThreadPool pool;
+        Status st = thread_pool_init(&pool, 3);
+        expect_ok(st, "thread pool");
+        if (st.ok) {
+            expect_table_like_scalar(&pool, "ln(t) + 1/t", -2.0, 2.0, 0.001);
+            expect_table_like_scalar(&pool, "sin(t)*cos(t)", 0.0, 360.0, 0.01);
+            expect_table_like_scalar(&pool, "t^2", 3.0, 3.0, 1.0);
+
+            expect_integral(&pool, "x^2", 0.0, 1.0, 1.0 / 3.0);
+            expect_integral(&pool, "4 / (1 + x^2)", 0.0, 1.0, M_PI);
+            expect_integral(&pool, "4 / (1 + x^2)", 1.0, 0.0, -M_PI);
+            expect_integral(&pool, "sqrt(x)", 0.0, 1.0, 2.0 / 3.0);
+            expect_integral(&pool, "abs(x - 0.3)", 0.0, 1.0, 0.29);
+            expect_integral(&pool, "sin(x) * cos(x)", 0.0, 200.0, 0.5 * sin(200.0) * sin(200.0));
+            expect_integral(&pool, "x", 2.0, 2.0, 0.0);
+            long double basel = 0.0L;
+            for (int i = 300000; i >= 1; i--) basel += 1.0L / ((long double)i * i);
+            expect_series(&pool, SERIES_SUM, "1 / i^2", 1.0, 300000.0, (double)basel, 2e-16);
+            expect_series(&pool, SERIES_SUM, "i", 1.0, 1000.0, 500500.0, 0.0);
+            expect_series(&pool, SERIES_SUM, "0.1", 1.0, 1e5, 1e4, 0.0);
+            long double alternating = 0.0L;
+            for (int i = 200000; i >= 1; i--) alternating += (i % 2 ? -1.0L : 1.0L) / i;
+            expect_series(&pool, SERIES_SUM, "(-1)^i / i", 1.0, 200000.0, (double)alternating, 2e-16);
+            expect_series(&pool, SERIES_PROD, "i", 1.0, 20.0, 2432902008176640000.0, 0.0);
+            expect_series(&pool, SERIES_PROD, "1 + 1/(i*(i+2))", 1.0, 200000.0, 2.0 * 200001.0 / 200002.0, 1e-13);
+            expect_series(&pool, SERIES_SUM, "i", 5.0, 4.0, 0.0, 0.0);
+            expect_series(&pool, SERIES_PROD, "i", 5.0, 4.0, 1.0, 0.0);
+            double v = 0.0;
+            expect_err(series_expr(&pool, SERIES_SUM, "1/(i - 70000) + sqrt(i - 100)", -5.0, 100000.0, &v),
+                       "error: sqrt domain", "series fails at its lowest index");
+            expect_err(series_expr(&pool, SERIES_SUM, "1/(i - 70000)", 0.0, 100000.0, &v), "error: division by zero",
+                       "series fails past the first chunk");
+            expect_err(series_expr(&pool, SERIES_SUM, "i", 0.5, 3.0, &v), "error: series bounds must be integers",
+                       "series with fractional bounds");
+
+            expect_mc(&pool, "rand()", 1e6, 0.5, 1.0 / 12.0);
+            expect_mc(&pool, "randn()", 1e6, 0.0, 1.0);
+            expect_mc(&pool, "randn()^2", 1e6, 1.0, 2.0);
+            expect_mc(&pool, "4 * sqrt(1 - rand()^2)", 1e6, M_PI, 16.0 * (2.0 / 3.0) - M_PI * M_PI);
+            expect_mc(&pool, "rand() - rand()", 1e6, 0.0, 1.0 / 6.0);
+            expect_mc(&pool, "3", 10.0, 3.0, 0.0);
+            MonteCarloResult one, three;
+            expect_ok(mc_expr(NULL, "randn()", 1e5, 7, &one), "mc on the caller");
+            expect_ok(mc_expr(&pool, "randn()", 1e5, 7, &three), "mc on the pool");
+            if (one.threads != 1 || three.threads != 3 || one.mean == three.mean) {
+                fprintf(stderr, "FAIL: mc streams should follow the thread count\n");
+                fails++;
+            }
+            expect_err(mc_expr(&pool, "sqrt(rand() - 0.999)", 1e5, 1, &one), "error: sqrt domain", "mc sample error");
+            expect_err(mc_expr(&pool, "rand()", 1.0, 1, &one), "error: mc needs a whole number of at least 2 samples",
+                       "mc with one sample");
+
+            IntegrateResult r;
+            expect_err(integrate_expr(&pool, "1 / x", -1.0, 1.0, &r), "error: division by zero", "integrate 1/x");
+            expect_err(integrate_expr(&pool, "ln(x)", -2.0, 1.0, &r), "error: ln domain", "integrate ln(x)");
+            expect_err(integrate_expr(&pool, "x", 0.0, INFINITY, &r), "error: integration bounds must be finite",
+                       "integrate to infinity");
+            /* failures deep in the bisection, the leftmost one wins */
+            for (int i = 0; i < 5; i++) {
+                expect_err(integrate_expr(&pool, "ln(abs(x - 0.875)) + 1 / (x - 0.375)", 0.0, 1.0, &r),
+                           "error: division by zero", "integrate, pole left of a log");
+                expect_err(integrate_expr(&pool, "ln(abs(x - 0.125)) + 1 / (x - 0.375)", 0.0, 1.0, &r),
+                           "error: ln domain", "integrate, log left of a pole");
+            }
+            /* too many wiggles for the split budget */
+            expect_ok(integrate_expr(&pool, "sin(1e7 * x)", 0.0, 1.0, &r), "integrate past the split budget");
+            if (r.converged) {
+                fprintf(stderr, "FAIL: integrate sin(1e7 * x) should run out of splits\n");
+                fails++;
+            }
+            thread_pool_free(&pool);
+        }
+    }
+
+    {
+        const double k = M_PI / 180.0;
+        expect_derivative("x^3 - 2*x", 2.0, 0, 10.0);
+        expect_derivative("1 / x + x / 4", 2.0, 0, 0.0);
+        expect_derivative("2^x", 3.0, 0, 8.0 * log(2.0));
+        expect_derivative("x^x", 2.0, 0, 4.0 * (log(2.0) + 1.0));
+        expect_derivative("(-2)^2 * x", 1.0, 0, 4.0);
+        expect_derivative("-x", 1.0, 0, -1.0);
+        expect_derivative("abs(x - 3)", 1.0, 0, -1.0);
+        expect_derivative("sqrt(x)", 4.0, 0, 0.25);
+        expect_derivative("ln(x^2)", 3.0, 0, 2.0 / 3.0);
+        expect_derivative("log(x)", 5.0, 0, 1.0 / (5.0 * log(10.0)));
+        expect_derivative("sin(x)", 0.5, 0, cos(0.5));
+        expect_derivative("cos(2*x)", 0.5, 0, -2.0 * sin(1.0));
+        expect_derivative("tan(x)", 0.5, 0, 1.0 / (cos(0.5) * cos(0.5)));
+        expect_derivative("asin(x)", 0.5, 0, 1.0 / sqrt(0.75));
+        expect_derivative("acos(x)", 0.5, 0, -1.0 / sqrt(0.75));
+        expect_derivative("atan(x)", 2.0, 0, 0.2);
+        expect_derivative("sin(x)", 30.0, 1, k * cos(30.0 * k));
+        expect_derivative("cos(x)", 30.0, 1, -k * sin(30.0 * k));
+        expect_derivative("tan(x)", 30.0, 1, k / (cos(30.0 * k) * cos(30.0 * k)));
+        expect_derivative("asin(x)", 0.5, 1, 1.0 / (k * sqrt(0.75)));
+        expect_derivative("acos(x)", 0.5, 1, -1.0 / (k * sqrt(0.75)));
+        expect_derivative("atan(x)", 2.0, 1, 0.2 / k);
+        expect_derivative("sin(asin(x))", 0.3, 1, 1.0);
+        expect_derivative("sqrt(4)", 1.0, 0, 0.0);
+
+        expect_root("x^2 - 2", 0, 1.0, sqrt(2.0), 8);
+        expect_root("cos(x) - x", 0, 1.0, 0.73908513321516064, 6);
+        expect_root("sin(x) - 0.5", 1, 20.0, 30.0, 6);
+        expect_root("x^3 - 2*x + 2", 0, 0.0, -1.7692923542386314, 30);
+        expect_root("ln(x) - 1", 0, 10.0, exp(1.0), 10);
+        expect_root("sqrt(x) - 0.5", 0, 4.0, 0.25, 12);
+        SolveResult r;
+        /* zero slope at the guess: Brent on a bracket found around it */
+        Status st = solve_expr("x^2 - 4", NULL, 0, 0.0, &r);
+        if (!st.ok || fabs(fabs(r.root) - 2.0) > 1e-12 || r.brent == 0) {
+            fprintf(stderr, "FAIL: solve x^2 - 4 from 0: %.17g, %zu Brent iterations\n", r.root, r.brent);
+            fails++;
+        }
+        expect_err(solve_expr("x^2 + 1", NULL, 0, 0.0, &r), "error: no root found", "solve without a root");
+        expect_err(solve_expr("ln(x)", NULL, 0, -1.0, &r), "error: ln domain", "solve from outside the domain");
+
+        SymTab t;
+        symtab_init(&t);
+        static const char* const a[] = { "a" };
+        expect_ok(define_func(&t, "f", a, 1, "a^2 - 5"), "define f");
+        st = solve_expr("f(x)", &t, 0, 1.0, &r);
+        if (!st.ok || fabs(r.root - sqrt(5.0)) > 1e-12 || r.evaluations > 10) {
+            fprintf(stderr, "FAIL: solve f(x) through a user function\n");
+            fails++;
+        }
+        symtab_free(&t);
+    }
+
+    {
+        /* fills give exactly the numbers single draws would, whatever the split */
+        enum { N = 1001 };
+        static double one[N], bulk[N];
+        for (int normal = 0; normal <= 1; normal++) {
+            Rng a, b;
+            rng_seed(&a, 9, 2);
+            rng_seed(&b, 9, 2);
+            for (size_t i = 0; i < N; i++) one[i] = normal ? rng_normal(&a) : rng_uniform(&a);
+            static const size_t splits[] = { 3, 1, 250, 4, 5, 738 };
+            size_t done = 0;
+            for (size_t k = 0; k < sizeof(splits) / sizeof(splits[0]); k++) {
+                if (normal) rng_fill_normal(&b, bulk + done, splits[k]);
+                else rng_fill_uniform(&b, bulk + done, splits[k]);
+                done += splits[k];
+            }
+            bool in_range = true;
+            for (size_t i = 0; i < N && !normal; i++) in_range = in_range && one[i] >= 0.0 && one[i] < 1.0;
+            if (done != N || memcmp(one, bulk, sizeof(one)) != 0 || !in_range) {
+                fprintf(stderr, "FAIL: rng fill %s differs from single draws\n", normal ? "normal" : "uniform");
+                fails++;
+            }
+        }
+        Rng s0, s1, again;
+        rng_seed(&s0, 9, 0);
+        rng_seed(&s1, 9, 1);
+        rng_seed(&again, 9, 0);
+        double x0 = rng_uniform(&s0), x1 = rng_uniform(&s1);
+        if (x0 == x1 || x0 != rng_uniform(&again)) {
+            fprintf(stderr, "FAIL: rng streams\n");
+            fails++;
+        }
+
+        /* one draw per element: every path sees the same numbers */
+        static const char* const single[] = { "rand()", "randn()", "2*rand() - 1", "sqrt(rand()) + sqrt(rand())*0" };
+        for (size_t k = 0; k < sizeof(single) / sizeof(single[0]); k++) {
+            for (int path = 0; path <= 2; path++) {
+                Status st = random_expr(NULL, single[k], path, 5, N, path == 0 ? one : bulk);
+                if (!st.ok || (path > 0 && k < 3 && memcmp(one, bulk, sizeof(one)) != 0)) {
+                    fprintf(stderr, "FAIL: %s path %d: %s\n", single[k], path, st.ok ? "values differ" : st.msg);
+                    fails++;
+                }
+            }
+        }
+        /* repeated calls are separate draws, never folded or shared */
+        SymTab t;
+        symtab_init(&t);
+        static const char* const params[] = { "a" };
+        expect_ok(define_func(&t, "f", params, 1, "a + rand()"), "define f(a) = a + rand()");
+        expect_ok(define_func(&t, "g", params, 1, "f(a) * 2"), "define g(a) = f(a) * 2");
+        expect_ok(define_func(&t, "h", params, 1, "a * 2"), "define h(a) = a * 2");
+        if (symtab_random(&t, symtab_find(&t, "h", 1)) || !symtab_random(&t, symtab_find(&t, "g", 1))) {
+            fprintf(stderr, "FAIL: symtab_random\n");
+            fails++;
+        }
+        static const char* const pairs[] = { "rand() - rand()", "randn() - randn()", "f(1) - f(1)", "g(0) - g(0)" };
+        for (size_t k = 0; k < sizeof(pairs) / sizeof(pairs[0]); k++) {
+            for (int path = 0; path <= 2; path++) {
+                Status st = random_expr(&t, pairs[k], path, 5, 64, bulk);
+                size_t zeros = 0;
+                for (size_t i = 0; i < 64; i++) zeros += bulk[i] == 0.0;
+                if (!st.ok || zeros > 0) {
+                    fprintf(stderr, "FAIL: %s path %d gave %zu zeros\n", pairs[k], path, zeros);
+                    fails++;
+                }
+            }
+        }
+        expect_ok(random_expr(&t, "h(3) - h(3)", 1, 5, 1, bulk), "pure function");
+        expect_near(bulk[0], 0.0, 0.0, "h(3) - h(3)");
+        /* a program that shared h's calls is stale once h draws */
+        uint64_t version = t.func_version;
+        expect_ok(define_func(&t, "h", params, 1, "a * rand()"), "redefine h(a) = a * rand()");
+        if (t.func_version == version || !symtab_random(&t, symtab_find(&t, "h", 1))) {
+            fprintf(stderr, "FAIL: redefining h must bump func_version\n");
+            fails++;
+        }
+        symtab_free(&t);
+
+        double v = 0.0;
+        expect_err(eval_expr("rand()", 1, 0, 0, 0, &v), "error: random numbers are unavailable here", "rand without rng");
+        expect_err(eval_expr("rand(1)", 1, 0, 0, 0, &v), "error: rand() expects no args", "rand arity");
+    }
+
+    {
+        expect_exact("2^40 + 17*3", true, 1099511627827);
+        expect_exact("3^39", true, 4052555153018976267);
+        expect_exact("3^39 + 1 - 3^39", true, 1);
+        expect_exact("(-2)^63", true, INT64_MIN);
+        expect_exact("-(2^62) * 2", true, INT64_MIN);
+        expect_exact("2^62 * 2", false, 0);
+        expect_exact("2^63", false, 0);
+        expect_exact("-2^3 + +4", true, -4);
+        expect_exact("0^0 + 1^1000000000000 + (-1)^999", true, 1);
+        expect_exact("1e3 * 2", true, 2000);
+        expect_exact("2^-1", false, 0);
+        expect_exact("8 / 2", false, 0);
+        expect_exact("2.5 * 2", false, 0);
+        expect_exact("9007199254740992 + 1", false, 0);
+        expect_exact("pi", false, 0);
+        expect_exact("sqrt(4)", false, 0);
+
+        /* folded exactly inside a larger expression, then rounded once */
+        double v = 0.0;
+        expect_ok(eval_expr_vm("(3^39 + 1 - 3^39) * pi / pi", 1, 0, 0, 0, 1, NULL, &v), "exact fold");
+        expect_near(v, 1.0, 0.0, "(3^39 + 1 - 3^39) * pi / pi optimized");
+        expect_ok(eval_expr_vm("(3^39 + 1 - 3^39) * pi / pi", 1, 0, 0, 0, 0, NULL, &v), "double evaluation");
+        expect_near(v, 0.0, 0.0, "(3^39 + 1 - 3^39) * pi / pi in doubles");
+
+        char buf[32];
+        static const int64_t ints[] = { 0, 7, -42, INT64_MAX, INT64_MIN };
+        static const char* const texts[] = { "0", "7", "-42", "9223372036854775807", "-9223372036854775808" };
+        for (size_t i = 0; i < sizeof(ints) / sizeof(ints[0]); i++) {
+            format_int64(ints[i], buf, sizeof(buf));
+            if (strcmp(buf, texts[i]) != 0) {
+                fprintf(stderr, "FAIL: format_int64 %s gave %s\n", texts[i], buf);
+                fails++;
+            }
+        }
+    }
+
+    {
+        SymTab t;
+        symtab_init(&t);
+        char name[32];
+        bool ids_ok = true;
+        for (int i = 0; i < 5000 && ids_ok; i++) {
+            snprintf(name, sizeof(name), "v%d", i);
+            int id = -1;
+            ids_ok = symtab_set_var(&t, name, strlen(name), (double)i, &id).ok && id == i;
+        }
+        for (int i = 0; i < 5000 && ids_ok; i++) {
+            snprintf(name, sizeof(name), "V%d", i);
+            const Symbol* s = symtab_get(&t, symtab_find(&t, name, strlen(name)));
+            ids_ok = s != NULL && s->value == (double)i;
+        }
+        int id = -1;
+        ids_ok = ids_ok && symtab_set_var(&t, "v42", 3, -1.0, &id).ok && id == 42 && t.count == 5000 &&
+                 symtab_find(&t, "v5000", 5) < 0 && symtab_find(&t, "v4", 1) < 0;
+        if (!ids_ok) {
+            fprintf(stderr, "FAIL: symbol table lookups\n");
+            fails++;
+        }
+        symtab_free(&t);
+
+        symtab_init(&t);
+        expect_ok(symtab_set_var(&t, "x", 1, 3.0, &id), "define x");
+        expect_symbols(&t, "x*2 + X", 9.0);
+        static const char* const ab[] = { "a", "b" };
+        static const char* const n[] = { "n" };
+        expect_ok(define_func(&t, "f", ab, 2, "a^2 + b"), "define f");
+        expect_symbols(&t, "f(x, 1) + f(2, x)", 17.0);
+        expect_ok(define_func(&t, "g", n, 1, "f(n, x) * n"), "define g");
+        expect_symbols(&t, "g(2)", 14.0);
+        expect_ok(symtab_set_var(&t, "x", 1, 0.0, &id), "redefine x");
+        expect_symbols(&t, "g(2)", 8.0);
+        expect_ok(define_func(&t, "f", ab, 2, "a - b"), "redefine f");
+        expect_symbols(&t, "g(5)", 25.0);
+        expect_ok(define_func(&t, "r", n, 1, "r(n - 1) + 1"), "define r");
+        expect_symbols_err(&t, "r(1)", "error: recursion too deep");
+        expect_symbols_err(&t, "f(1)", "error: wrong number of function args");
+        expect_symbols_err(&t, "y + 1", "error: unknown variable");
+        expect_symbols_err(&t, "x(1)", "error: unknown function");
+        bool added = true;
+        expect_err(symtab_declare_func(&t, "x", 1, 0, &id, &added), "error: name is already a variable", "x is a var");
+        expect_err(symtab_set_var(&t, "F", 1, 0.0, &id), "error: name is already a function", "f is a function");
+        expect_err(define_func(&t, "h", n, 1, "n + zz"), "error: unknown variable", "bad body");
+        if (symtab_find(&t, "h", 1) >= 0 || t.count != 4) {
+            fprintf(stderr, "FAIL: failed definition left a symbol\n");
+            fails++;
+        }
+        symtab_free(&t);
+    }
+
+    {
+        SymTab t;
+        symtab_init(&t);
+        EvalContext ctx;
+        eval_context_init(&ctx);
+        ctx.symbols = &t;
+        int id = -1;
+        expect_ok(symtab_set_var(&t, "a", 1, 1.0, &id), "define a");
+        expect_ok(define_var(&t, "b", "a * 2", &ctx), "define b");
+        expect_ok(define_var(&t, "c", "b + 1", &ctx), "define c");
+        expect_ok(define_var(&t, "d", "c * c", &ctx), "define d");
+        expect_ok(define_var(&t, "v", "ans + 1", &ctx), "define v");
+        expect_ok(symtab_set_var(&t, "a", 1, 2.0, &id), "set a");
+        expect_ok(symtab_update(&t, &ctx), "update after a");
+        if (symbol_value(&t, "d") != 25.0 || symbol_value(&t, "v") != 1.0 || t.stats.recomputed != 3 ||
+            t.stats.full != 4 || t.dirty_count != 0) {
+            fprintf(stderr, "FAIL: downstream of a: d=%g recomputed=%zu full=%zu\n", symbol_value(&t, "d"),
+                    t.stats.recomputed, t.stats.full);
+            fails++;
+        }
+        ctx.ans = 4.0;
+        symtab_touch_env(&t, SYMTAB_DEP_ANS | SYMTAB_DEP_MEM);
+        expect_ok(symtab_update(&t, &ctx), "update after ans");
+        if (symbol_value(&t, "v") != 5.0 || t.stats.recomputed != 4) {
+            fprintf(stderr, "FAIL: ans dependents\n");
+            fails++;
+        }
+
+        /* reading itself: evaluated once, then a plain value */
+        expect_ok(define_var(&t, "b", "b + 10", &ctx), "increment b");
+        expect_ok(symtab_update(&t, &ctx), "update after b");
+        expect_ok(symtab_set_var(&t, "a", 1, 100.0, &id), "set a again");
+        expect_ok(symtab_update(&t, &ctx), "update after a again");
+        if (symbol_value(&t, "b") != 14.0 || symbol_value(&t, "d") != 225.0) {
+            fprintf(stderr, "FAIL: b = b + 10 gave %g\n", symbol_value(&t, "b"));
+            fails++;
+        }
+
+        expect_ok(define_var(&t, "r", "1 / a", &ctx), "define r");
+        expect_ok(symtab_set_var(&t, "a", 1, 0.0, &id), "zero a");
+        expect_ok(symtab_update(&t, &ctx), "update after zero");
+        expect_symbols_err(&t, "r + 1", "error: division by zero");
+        expect_ok(symtab_set_var(&t, "a", 1, 4.0, &id), "set a to 4");
+        expect_ok(symtab_update(&t, &ctx), "update after 4");
+        expect_symbols(&t, "r + 1", 1.25);
+
+        static const char* const p[] = { "p" };
+        expect_ok(define_func(&t, "f", p, 1, "p + a"), "define f");
+        expect_ok(define_var(&t, "q", "f(1)", &ctx), "define q");
+        expect_err(define_func(&t, "f", p, 1, "p + q"), "error: circular definition", "f reads q");
+        expect_ok(define_func(&t, "f", p, 1, "p * a"), "redefine f");
+        expect_ok(symtab_update(&t, &ctx), "update after f");
+        expect_symbols(&t, "q", 4.0);
+        symtab_free(&t);
+
+        /* a long chain: a change in the middle recomputes only what follows */
+        symtab_init(&t);
+        ctx.symbols = &t;
+        char name[32], formula[64];
+        expect_ok(symtab_set_var(&t, "n0", 2, 0.0, &id), "define n0");
+        for (int i = 1; i < 300; i++) {
+            snprintf(name, sizeof(name), "n%d", i);
+            snprintf(formula, sizeof(formula), "n%d + 1", i - 1);
+            expect_ok(define_var(&t, name, formula, &ctx), name);
+        }
+        expect_ok(symtab_set_var(&t, "n150", 4, 0.0, &id), "set n150");
+        expect_ok(symtab_update(&t, &ctx), "update chain");
+        if (symbol_value(&t, "n299") != 149.0 || t.stats.recomputed != 149 || t.stats.full != 298) {
+            fprintf(stderr, "FAIL: chain recomputed %zu of %zu\n", t.stats.recomputed, t.stats.full);
+            fails++;
+        }
+        symtab_free(&t);
+    }
+
+    {
+        Kernel k;
+        KernelTest t = { &k, { -1, -1 }, 0, 0, 0 };
+        kernel_init(&k);
+        if (pipe(t.fds) != 0 || fcntl(t.fds[0], F_SETFL, O_NONBLOCK) != 0) {
+            fprintf(stderr, "FAIL: kernel test pipe\n");
+            fails++;
+        } else {
+            KernelTaskId reader = kernel_add_wait_task(&k, kernel_test_reader, &t, "reader", t.fds[0], 0);
+            KernelTaskId writer = kernel_add_wait_task(&k, kernel_test_writer, &t, "writer", -1, 2);
+            kernel_run(&k);
+            /* the reader runs once at the start and then only for input;
+               between timeouts the kernel sleeps */
+            uint64_t reader_runs = kernel_task(&k, reader)->runs;
+            uint64_t writer_runs = kernel_task(&k, writer)->runs;
+            if (t.received != 3 || reader_runs > 4 || writer_runs < 3 || writer_runs > 4 || k.idle_ns < 3000000u) {
+                fprintf(stderr, "FAIL: kernel waits: %d received, %llu/%llu runs, %llu ns idle\n", t.received,
+                        (unsigned long long)reader_runs, (unsigned long long)writer_runs,
+                        (unsigned long long)k.idle_ns);
+                fails++;
+            }
+
+            /* a plain task keeps the kernel from sleeping */
+            kernel_free(&k);
+            kernel_init(&k);
+            t.written = 0;
+            t.received = 0;
+            kernel_add_task(&k, kernel_test_plain, &t, "plain");
+            kernel_add_wait_task(&k, kernel_test_reader, &t, "reader", t.fds[0], 0);
+            kernel_add_wait_task(&k, kernel_test_writer, &t, "writer", -1, 1);
+            kernel_run(&k);
+            if (t.received != 3 || k.idle_ns != 0 || (uint64_t)t.plain_runs != k.tick) {
+                fprintf(stderr, "FAIL: kernel with a plain task: %d received, %llu ns idle\n", t.received,
+                        (unsigned long long)k.idle_ns);
+                fails++;
+            }
+            close(t.fds[0]);
+            close(t.fds[1]);
+        }
+        kernel_free(&k);
+    }
+
+    {
+        /* every timer fires once, at its tick, across all levels and with
+           advances of any length; cancelled ones never do */
+        enum { WHEEL_TIMERS = 20000 };
+        TimerWheel w;
+        uint64_t start = 123457;
+        timer_wheel_init(&w, start);
+        WheelProbe* probes = calloc(WHEEL_TIMERS, sizeof(WheelProbe));
+        TimerId* ids = calloc(WHEEL_TIMERS, sizeof(TimerId));
+        if (probes == NULL || ids == NULL) {
+            fprintf(stderr, "FAIL: wheel test out of memory\n");
+            fails++;
+        } else {
+            for (size_t i = 0; i < WHEEL_TIMERS; i++) {
+                uint64_t delay = (uint64_t)1 + (i % 4 == 0 ? rng_below(64) : rng_below(300000));
+                if (i % 997 == 0) {
+                    delay = (uint64_t)1 << 37;   /* past the top level */
+                }
+                probes[i] = (WheelProbe){ &w, start + delay, 0, 0 };
+                ids[i] = timer_wheel_add(&w, probes[i].expires, 0, wheel_probe, &probes[i]);
+            }
+            size_t cancelled = 0;
+            for (size_t i = 0; i < WHEEL_TIMERS; i += 3) {
+                cancelled += timer_wheel_cancel(&w, ids[i]);
+            }
+            bool stale = timer_wheel_cancel(&w, ids[0]);
+            uint64_t now = start;
+            while (now < start + 310000) {
+                now += rng_below(4) == 0 ? rng_below(5000) : rng_below(3);
+                timer_wheel_advance(&w, now);
+            }
+            size_t bad = 0, late = 0;
+            for (size_t i = 0; i < WHEEL_TIMERS; i++) {
+                bool far = probes[i].expires > now;
+                int want = i % 3 == 0 || far ? 0 : 1;
+                bad += probes[i].fires != want || (want == 1 && probes[i].fired_at != probes[i].expires);
+                late += far && i % 3 != 0;
+            }
+            if (bad != 0 || stale || cancelled != (WHEEL_TIMERS + 2) / 3 || w.count != late) {
+                fprintf(stderr, "FAIL: timer wheel: %zu wrong, %zu cancelled, %zu pending\n", bad, cancelled, w.count);
+                fails++;
+            }
+
+            /* a periodic timer keeps its phase and skips periods it missed */
+            WheelProbe p = { &w, 0, 0, 0 };
+            TimerId id = timer_wheel_add(&w, now + 3, 7, wheel_probe, &p);
+            for (int i = 0; i < 100; i++) timer_wheel_advance(&w, ++now);
+            int ticks = p.fires;
+            timer_wheel_advance(&w, now + 1000);
+            if (ticks != 14 || p.fires != 15 || timer_wheel_next(&w) > now + 1007 ||
+                !timer_wheel_cancel(&w, id) || timer_wheel_cancel(&w, id)) {
+                fprintf(stderr, "FAIL: periodic timer fired %d then %d times\n", ticks, p.fires);
+                fails++;
+            }
+        }
+        free(probes);
+        free(ids);
+        timer_wheel_free(&w);
+
+        Kernel k;
+        KernelTest t = { &k, { -1, -1 }, 0, 0, 0 };
+        kernel_init(&k);
+        kernel_add_timer(&k, 1, 1, kernel_test_tick, &t);
+        TimerId never = kernel_add_timer(&k, 0, 0, kernel_test_tick, &t);
+        kernel_cancel_timer(&k, never);
+        kernel_run(&k);
+        if (t.plain_runs != 5 || k.idle_ns < 3000000u) {
+            fprintf(stderr, "FAIL: kernel timer ran %d times\n", t.plain_runs);
+            fails++;
+        }
+        kernel_free(&k);
+    }
+
+    {
+        /* every item comes out exactly once while three threads steal and
+           the deque grows from its minimum size */
+        static WsTest t;
+        static size_t items[WS_TEST_ITEMS];
+        pthread_t thieves[3];
+        size_t started = 0;
+        atomic_init(&t.done, false);
+        if (!ws_deque_init(&t.deque, 1).ok) {
+            fprintf(stderr, "FAIL: ws_deque_init\n");
+            fails++;
+        } else {
+            for (; started < 3; started++) {
+                if (pthread_create(&thieves[started], NULL, ws_test_thief, &t) != 0) {
+                    break;
+                }
+            }
+            for (size_t i = 0; i < WS_TEST_ITEMS; i++) {
+                items[i] = i;
+                if (!ws_deque_push(&t.deque, &items[i]).ok) {
+                    break;
+                }
+                if (i % 3 == 0) {
+                    size_t* item = ws_deque_take(&t.deque);
+                    if (item != NULL) {
+                        atomic_fetch_add(&t.seen[*item], 1);
+                    }
+                }
+            }
+            size_t* item;
+            while ((item = ws_deque_take(&t.deque)) != NULL) {
+                atomic_fetch_add(&t.seen[*item], 1);
+            }
+            atomic_store(&t.done, true);
+            for (size_t i = 0; i < started; i++) {
+                pthread_join(thieves[i], NULL);
+            }
+            size_t bad = 0;
+            for (size_t i = 0; i < WS_TEST_ITEMS; i++) {
+                bad += atomic_load(&t.seen[i]) != 1 ? 1u : 0u;
+            }
+            if (bad != 0) {
+                fprintf(stderr, "FAIL: ws_deque lost or duplicated %zu items\n", bad);
+                fails++;
+            }
+            ws_deque_free(&t.deque);
+        }
+    }
+
+    {
+        /* subtasks run inline without workers, and are stolen with them */
+        Kernel k;
+        kernel_init(&k);
+        KernelSum s = { &k, 0, 100000, 0 };
+        kernel_test_sum(&s);
+        if (s.sum != 4999950000u) {
+            fprintf(stderr, "FAIL: kernel inline subtasks sum to %llu\n", (unsigned long long)s.sum);
+            fails++;
+        }
+        kernel_free(&k);
+
+        kernel_init(&k);
+        kernel_enable_smp(&k, 4);
+        s.sum = 0;
+        KernelTaskId sum = kernel_add_task(&k, kernel_test_sum_task, &s, "sum");
+        kernel_run(&k);
+        KernelStats ks;
+        kernel_stats(&k, &ks);
+        if (s.sum != 4999950000u || kernel_task(&k, sum)->runs != 1 || ks.workers != 0) {
+            fprintf(stderr, "FAIL: kernel smp subtasks sum to %llu\n", (unsigned long long)s.sum);
+            fails++;
+        }
+        kernel_free(&k);
+
+        /* fd tasks on workers are re-armed after each run */
+        KernelTest t = { &k, { -1, -1 }, 0, 0, 0 };
+        kernel_init(&k);
+        kernel_enable_smp(&k, 2);
+        if (pipe(t.fds) != 0 || fcntl(t.fds[0], F_SETFL, O_NONBLOCK) != 0) {
+            fprintf(stderr, "FAIL: kernel test pipe\n");
+            fails++;
+        } else {
+            KernelTaskId reader = kernel_add_wait_task(&k, kernel_test_reader, &t, "reader", t.fds[0], 0);
+            KernelTaskId writer = kernel_add_wait_task(&k, kernel_test_writer, &t, "writer", -1, 2);
+            kernel_run(&k);
+            uint64_t reader_runs = kernel_task(&k, reader)->runs;
+            uint64_t writer_runs = kernel_task(&k, writer)->runs;
+            if (t.received != 3 || reader_runs > 4 || writer_runs < 3) {
+                fprintf(stderr, "FAIL: kernel smp waits: %d received, %llu/%llu runs\n", t.received,
+                        (unsigned long long)reader_runs, (unsigned long long)writer_runs);
+                fails++;
+            }
+            close(t.fds[0]);
+            close(t.fds[1]);
+        }
+        kernel_free(&k);
+    }
+
+    {
+        /* a coroutine resumes where it suspended; one never finished is
+           just freed */
+        int n = 0;
+        Coro* co = NULL;
+        if (!coro_create(&co, 0, coro_test_counter, &n).ok) {
+            fprintf(stderr, "FAIL: coro_create\n");
+            fails++;
+        } else {
+            for (int i = 0; i < 5; i++) {
+                coro_resume(co);
+            }
+            if (n != 5 || coro_done(co) || coro_current() != NULL) {
+                fprintf(stderr, "FAIL: coroutine counted %d\n", n);
+                fails++;
+            }
+            coro_free(co);
+        }
+
+        /* coroutine tasks resume only once what they wait for happened,
+           on kernel_run's thread and on workers */
+        for (size_t workers = 0; workers <= 2; workers += 2) {
+            Kernel k;
+            CoroTest t = { &k, { -1, -1 }, 0, 0, 0, 0, 0, 0 };
+            kernel_init(&k);
+            if (workers > 0) {
+                kernel_enable_smp(&k, workers);
+            }
+            if (pipe(t.fds) != 0 || fcntl(t.fds[0], F_SETFL, O_NONBLOCK) != 0) {
+                fprintf(stderr, "FAIL: coroutine test pipe\n");
+                fails++;
+                kernel_free(&k);
+                continue;
+            }
+            KernelTaskId producer = kernel_add_coroutine(&k, coro_test_producer, &t, "producer", 0);
+            KernelTaskId yielder = kernel_add_coroutine(&k, coro_test_yielder, &t, "yielder", 16384);
+            bool added = producer != 0 && yielder != 0 &&
+                         kernel_add_coroutine(&k, coro_test_consumer, &t, "consumer", 0) != 0;
+            if (added) {
+                kernel_run(&k);
+            }
+            /* the consumer: at most one wait per write; the others have
+               ended and are gone */
+            if (!added || t.received != 3 || t.timeouts != 0 || t.timeout_ns < 3000000u || t.waits > 3 ||
+                t.yields != 10 || kernel_task(&k, yielder) != NULL || kernel_task(&k, producer) != NULL) {
+                fprintf(stderr, "FAIL: coroutines (%zu workers): %d received, %d timeouts, %llu ns, %d waits, %d yields\n",
+                        workers, t.received, t.timeouts, (unsigned long long)t.timeout_ns, t.waits, t.yields);
+                fails++;
+            }
+            close(t.fds[0]);
+            close(t.fds[1]);
+            kernel_free(&k);
+        }
+    }
+
+    {
+        /* tasks come and go on one thread and on workers: ids of ended
+           tasks name nothing, and freed slots are reused */
+        for (size_t workers = 0; workers <= 2; workers += 2) {
+            Kernel k;
+            KernelChurn c = { &k, 0, 0, 0, 0 };
+            kernel_init(&k);
+            if (workers > 0) {
+                kernel_enable_smp(&k, workers);
+            }
+            KernelTaskId spawner = kernel_add_task(&k, churn_spawner, &c, "spawner");
+            kernel_run(&k);
+            KernelStats ks;
+            kernel_stats(&k, &ks);
+            if (atomic_load(&c.ran) != CHURN_TASKS || ks.tasks != 0 || kernel_task(&k, spawner) != NULL ||
+                kernel_task(&k, c.first) != NULL || kernel_remove_task(&k, c.first) ||
+                k.slot_count >= CHURN_TASKS / 2) {
+                fprintf(stderr, "FAIL: task churn (%zu workers): %d ran, %zu left, %u slots\n", workers,
+                        atomic_load(&c.ran), ks.tasks, k.slot_count);
+                fails++;
+            }
+            kernel_free(&k);
+
+            /* coroutine sessions, many alive at once, reuse spare stacks */
+            KernelChurn l = { &k, 0, 0, 0, 0 };
+            kernel_init(&k);
+            if (workers > 0) {
+                kernel_enable_smp(&k, workers);
+            }
+            kernel_add_coroutine(&k, churn_listener, &l, "listener", 0);
+            kernel_run(&k);
+            kernel_stats(&k, &ks);
+            if (atomic_load(&l.ran) != CHURN_SESSIONS || ks.tasks != 0 || kernel_task(&k, l.first) != NULL ||
+                k.spare_count == 0) {
+                fprintf(stderr, "FAIL: coroutine sessions (%zu workers): %d ran, %zu left\n", workers,
+                        atomic_load(&l.ran), ks.tasks);
+                fails++;
+            }
+            kernel_free(&k);
+        }
+
+        /* a ready high-priority task holds off lower classes until it
+           exits */
+        Kernel k;
+        KernelPrio t = { &k, 0, -1, false };
+        kernel_init(&k);
+        KernelTaskId low = kernel_add_task(&k, prio_low, &t, "low");
+        KernelTaskId high = kernel_add_task(&k, prio_high, &t, "high");
+        kernel_set_priority(&k, low, KERNEL_PRIO_LOW);
+        kernel_set_priority(&k, high, KERNEL_PRIO_HIGH);
+        kernel_run(&k);
+        KernelTaskInfo info[4];
+        size_t n = kernel_tasks(&k, info, 4);
+        if (t.high_before_low != 3 || kernel_task(&k, high) != NULL || n != 1 || info[0].id != low ||
+            info[0].priority != KERNEL_PRIO_LOW || info[0].runs != 1) {
+            fprintf(stderr, "FAIL: priorities: low ran after %d high runs, %zu tasks\n", t.high_before_low, n);
+            fails++;
+        }
+        kernel_free(&k);
+
+        /* removing a sleeping coroutine drops its timer and keeps its
+           stack */
+        kernel_init(&k);
+        KernelTaskId sleeper = kernel_add_coroutine(&k, prio_sleeper, &t, "sleeper", 0);
+        kernel_add_task(&k, prio_low, &t, "stop");
+        kernel_run(&k);
+        KernelStats ks;
+        kernel_stats(&k, &ks);
+        size_t pending = ks.timers_pending;
+        bool removed = kernel_remove_task(&k, sleeper);
+        kernel_stats(&k, &ks);
+        if (pending != 1 || !removed || ks.timers_pending != 0 || ks.tasks != 1 || k.spare_count != 1 ||
+            kernel_task(&k, sleeper) != NULL || t.woke) {
+            fprintf(stderr, "FAIL: removing a sleeper: %zu then %zu timers\n", pending, ks.timers_pending);
+            fails++;
+        }
+        kernel_free(&k);
+    }
+
+    arena_free(&test_arena);
     if (fails == 0) {
         printf("OK\n");
         return 0;